@@ -0,0 +1,161 @@
+// Compares branchy and cmov lowering of if/else assignments. Each program
+// steps a linear congruential generator once per block and picks a value on
+// whether the state is in the lower half of its range, a coin flip a branch
+// predictor cannot learn. The chosen value feeds the next state, so the
+// select sits on the program's critical path. Several programs with different seeds are run in
+// turn so no block repeats its outcome from one run to the next. A variant
+// whose condition is almost always true shows the cost of cmov when the
+// branch predicts well.
+//
+// Usage: cmov_bench [blocks] [runs]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../src/tokenization.hpp"
+#include "../src/parser.hpp"
+#include "../src/semanticAnalysis.hpp"
+#include "../src/rangeAnalysis.hpp"
+#include "../src/deadCodeElimination.hpp"
+#include "../src/frameLayout.hpp"
+#include "../src/loopOptimisation.hpp"
+#include "../src/inliner.hpp"
+#include "../src/profile.hpp"
+#include "../src/generator.hpp"
+#include "../src/assembler.hpp"
+#include "../src/linker.hpp"
+#include "../src/jit.hpp"
+#include "runtime.hpp"
+
+static std::string make_program(int seed, int blocks, const std::string &cond)
+{
+  std::string source = "let int s = " + std::to_string(seed) + ";\nlet int x = 0;\nlet int t = 0;\n";
+  // One step up front keeps the first condition from being folded.
+  source += "s = (s * 1103515245 + 12345) % 2147483648;\n";
+  for (int i = 0; i < blocks; i++)
+  {
+    source += "if (" + cond + ") { x = s + 3; } else { x = 7; }\n";
+    source += "s = (s * 1103515245 + 12345 + x) % 2147483648;\n";
+    source += "t = t + x;\n";
+  }
+  source += "exit t % 256;\n";
+  return source;
+}
+
+static ObjectModule assemble(std::string_view source)
+{
+  Assembler assembler;
+  assembler.assemble(source);
+  return assembler.finish();
+}
+
+static std::unique_ptr<Jit> compile(std::string source, bool cmov, size_t &selects)
+{
+  const uint64_t source_hash = BranchProfile::hash_source(source);
+  Tokeniser tokeniser(std::move(source));
+  Parser parser(tokeniser.tokenise());
+  NodeProg prog = parser.parse();
+  SemanticAnalyser semantics(prog);
+  semantics.analyse();
+  RangeAnalyser ranges(prog);
+  ranges.analyse();
+  DeadCodeEliminator dce(prog, ranges);
+  dce.run();
+  FrameLayout layout(prog);
+  layout.compute();
+  LoopOptimiser loops(prog, ranges);
+  loops.run();
+  Inliner inliner(prog);
+  inliner.run();
+  BranchProfile profile(prog, source_hash);
+
+  Generator::Options options;
+  options.cmov = cmov;
+  Generator generator(std::move(prog), ranges, layout, loops, inliner, profile, options);
+  Assembler assembler;
+  assembler.assemble(generator.gen_prog());
+  selects = generator.stats().selects;
+
+  Linker linker;
+  linker.add(assembler.finish());
+  linker.add(assemble(runtime::output_asm));
+  linker.add(assemble(runtime::print_asm));
+  linker.add(assemble(runtime::errors_asm));
+  linker.add(assemble(runtime::cpu_asm));
+  linker.add(assemble(Jit::trampoline_asm));
+  return std::make_unique<Jit>(linker);
+}
+
+// Runs every program `runs` times in total, returning seconds per block.
+static double time_runs(const std::vector<std::unique_ptr<Jit>> &jits, int blocks, int runs, int64_t &checksum)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < runs; r++)
+  {
+    checksum += jits[r % jits.size()]->run();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return seconds / (static_cast<double>(blocks) * runs);
+}
+
+int main(int argc, char **argv)
+{
+  int blocks = argc > 1 ? std::atoi(argv[1]) : 2000;
+  int runs = argc > 2 ? std::atoi(argv[2]) : 4000;
+  const int programs = 8;
+
+  struct Case
+  {
+    const char *name;
+    std::string cond;
+  };
+  const Case cases[] = {{"random", "s < 1073741824"}, {"predictable", "s < 2147483647"}};
+
+  std::cout << blocks << " if/else blocks x " << runs << " runs, ns/block\n";
+  std::cout << "condition      branches      cmov   speedup\n";
+  for (const Case &c : cases)
+  {
+    double per_block[2];
+    int64_t checksum[2] = {0, 0};
+    for (int mode = 0; mode < 2; mode++)
+    {
+      bool cmov = mode == 1;
+      size_t selects = 0;
+      std::vector<std::unique_ptr<Jit>> jits;
+      for (int p = 0; p < programs; p++)
+      {
+        jits.push_back(compile(make_program(12345 + p * 7919, blocks, c.cond), cmov, selects));
+      }
+      if (cmov && selects != static_cast<size_t>(blocks))
+      {
+        std::cerr << "expected " << blocks << " selects, got " << selects << "\n";
+        return EXIT_FAILURE;
+      }
+
+      // exit writes a newline to stdout on every run.
+      std::cout.flush();
+      int saved_stdout = dup(1);
+      int null_fd = open("/dev/null", O_WRONLY);
+      dup2(null_fd, 1);
+      close(null_fd);
+      per_block[mode] = time_runs(jits, blocks, runs, checksum[mode]);
+      dup2(saved_stdout, 1);
+      close(saved_stdout);
+    }
+
+    if (checksum[0] != checksum[1])
+    {
+      std::cerr << c.name << ": results differ: " << checksum[0] << " vs " << checksum[1] << "\n";
+      return EXIT_FAILURE;
+    }
+    std::printf("%-12s %10.2f %9.2f %8.2fx\n", c.name, per_block[0] * 1e9, per_block[1] * 1e9,
+                per_block[0] / per_block[1]);
+  }
+  return EXIT_SUCCESS;
+}
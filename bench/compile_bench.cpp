@@ -0,0 +1,182 @@
+// Measures the compiler's own throughput. For each program shape it
+// generates synthetic programs from 1 KB up to the largest size asked for,
+// quadrupling each time, and times tokenising, parsing, the analyses and
+// code generation separately. Throughput that falls as programs grow points
+// at a pass that scales worse than linearly; the last column compares each
+// size's total time per byte with the smallest program's.
+//
+// Small programs are compiled many times over so every size is timed on
+// about the same amount of source.
+//
+// Usage: compile_bench [largest size in MB, default 16] [shape, default all]
+// Shapes: mixed, consts, scopes, elifs, wide, comments. A 1024 MB run needs
+// tens of GB of memory for the tokens and the syntax tree.
+//
+// compile_bench --emit <shape> <size in KB> prints the program of that
+// shape and size instead, so the generator's output can be compiled and
+// run on its own.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../src/tokenization.hpp"
+#include "../src/parser.hpp"
+#include "../src/semanticAnalysis.hpp"
+#include "../src/rangeAnalysis.hpp"
+#include "../src/deadCodeElimination.hpp"
+#include "../src/frameLayout.hpp"
+#include "../src/loopOptimisation.hpp"
+#include "../src/inliner.hpp"
+#include "../src/profile.hpp"
+#include "../src/generator.hpp"
+#include "./syntheticProgram.hpp"
+
+struct PhaseTimes
+{
+  double tokenise = 0;
+  double parse = 0;
+  double analyse = 0;
+  double generate = 0;
+
+  double total() const
+  {
+    return tokenise + parse + analyse + generate;
+  }
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Compiles `source` to assembly once, adding each phase's time to `times`.
+// Returns the size of the assembly so the work cannot be optimised away.
+static size_t compile(const std::string &source, PhaseTimes &times)
+{
+  const uint64_t source_hash = BranchProfile::hash_source(source);
+  auto start = std::chrono::steady_clock::now();
+  Tokeniser tokeniser(source);
+  std::vector<Token> tokens = tokeniser.tokenise();
+  times.tokenise += seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  Parser parser(std::move(tokens));
+  NodeProg prog = parser.parse();
+  times.parse += seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  SemanticAnalyser semantics(prog);
+  semantics.analyse();
+  RangeAnalyser ranges(prog);
+  ranges.analyse();
+  DeadCodeEliminator dce(prog, ranges);
+  dce.run();
+  FrameLayout layout(prog);
+  layout.compute();
+  LoopOptimiser loops(prog, ranges);
+  loops.run();
+  Inliner inliner(prog);
+  inliner.run();
+  BranchProfile profile(prog, source_hash);
+  times.analyse += seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  Generator generator(std::move(prog), ranges, layout, loops, inliner, profile, Generator::Options{});
+  size_t asm_bytes = generator.gen_prog().size();
+  times.generate += seconds_since(start);
+  return asm_bytes;
+}
+
+static void run_shape(const SyntheticProgram::Shape &shape, size_t max_bytes)
+{
+  // Every size is compiled until at least this much source has gone through.
+  const size_t bytes_per_size = 16 * 1024 * 1024;
+
+  std::cout << "shape " << shape.name << ": MB/s of source per phase\n";
+  std::cout << "      size   tokenise      parse    analyse   generate      total   ns/byte  vs 1 KB\n";
+  double first_ns_per_byte = 0;
+  for (size_t bytes = 1024; bytes <= max_bytes; bytes *= 4)
+  {
+    std::string source = SyntheticProgram::generate(bytes, shape);
+    size_t runs = std::max<size_t>(1, bytes_per_size / source.size());
+    PhaseTimes times;
+    size_t asm_bytes = 0;
+    for (size_t r = 0; r < runs; r++)
+    {
+      asm_bytes += compile(source, times);
+    }
+    if (asm_bytes == 0)
+    {
+      std::cerr << "no assembly generated\n";
+      exit(EXIT_FAILURE);
+    }
+
+    const double total_bytes = static_cast<double>(source.size()) * runs;
+    const double ns_per_byte = times.total() / total_bytes * 1e9;
+    if (first_ns_per_byte == 0)
+      first_ns_per_byte = ns_per_byte;
+    char size[32];
+    if (bytes >= 1024 * 1024)
+      std::snprintf(size, sizeof(size), "%zu MB", bytes / (1024 * 1024));
+    else
+      std::snprintf(size, sizeof(size), "%zu KB", bytes / 1024);
+    std::printf("%10s %10.1f %10.1f %10.1f %10.1f %10.1f %9.1f %7.2fx\n", size, total_bytes / times.tokenise / 1e6,
+                total_bytes / times.parse / 1e6, total_bytes / times.analyse / 1e6, total_bytes / times.generate / 1e6,
+                total_bytes / times.total() / 1e6, ns_per_byte, ns_per_byte / first_ns_per_byte);
+    std::fflush(stdout);
+  }
+}
+
+static const SyntheticProgram::Shape *find_shape(const char *name)
+{
+  for (const SyntheticProgram::Shape &shape : SyntheticProgram::shapes)
+  {
+    if (std::strcmp(name, shape.name) == 0)
+      return &shape;
+  }
+  return nullptr;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && std::strcmp(argv[1], "--emit") == 0)
+  {
+    const SyntheticProgram::Shape *shape = argc == 4 ? find_shape(argv[2]) : nullptr;
+    size_t kb = argc == 4 ? std::strtoull(argv[3], nullptr, 10) : 0;
+    if (shape == nullptr || kb == 0)
+    {
+      std::cerr << "Usage: compile_bench --emit <shape> <size in KB>\n";
+      return EXIT_FAILURE;
+    }
+    std::cout << SyntheticProgram::generate(kb * 1024, *shape);
+    return EXIT_SUCCESS;
+  }
+
+  size_t max_mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 16;
+  const char *only = argc > 2 ? argv[2] : nullptr;
+  if (max_mb == 0)
+  {
+    std::cerr << "Usage: compile_bench [largest size in MB] [shape]\n";
+    return EXIT_FAILURE;
+  }
+
+  bool found = false;
+  for (const SyntheticProgram::Shape &shape : SyntheticProgram::shapes)
+  {
+    if (only != nullptr && std::strcmp(only, shape.name) != 0)
+      continue;
+    found = true;
+    run_shape(shape, max_mb * 1024 * 1024);
+  }
+  if (!found)
+  {
+    std::cerr << "unknown shape " << only << "\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,252 @@
+// Times print_int from print.asm against the divide-per-digit conversion it
+// replaced, which is kept here as div_print_int. Both are loaded with the
+// JIT and called directly; print_int only clobbers registers the C calling
+// convention lets a callee clobber. Values are drawn from the whole int64
+// range, grouped by length, and every value is first checked against
+// printf, along with the edge cases: zero, each power of ten and its
+// neighbours, INT64_MAX and INT64_MIN.
+//
+// Usage: print_bench [calls per group]
+
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../src/assembler.hpp"
+#include "../src/linker.hpp"
+#include "../src/jit.hpp"
+#include "runtime.hpp"
+
+// The conversion print_int used before, appending to a buffer of its own
+// that simply starts over when full, so only the formatting is timed.
+static constexpr std::string_view div_print_asm = R"asm(
+global div_print_int
+global _start
+
+section .bss
+div_buf resb 65536
+div_len resq 1
+
+section .text
+_start:
+    ret
+
+div_print_int:
+    push    rbp
+    mov     rbp, rsp
+    sub     rsp, 64
+    mov     rax, rdi
+    mov     r8, rsp
+    add     r8, 63
+    mov     rcx, 0
+    mov     byte [r8], 10
+    dec     r8
+    inc     rcx
+    cmp     rax, 0
+    jne     .not_zero
+    mov     byte [r8], '0'
+    dec     r8
+    inc     rcx
+    jmp     .write_out
+.not_zero:
+    mov     r9, 0
+    cmp     rax, 0
+    jge     .loop
+    neg     rax
+    mov     r9, 1
+.loop:
+    xor     rdx, rdx
+    mov     r10, 10
+    div     r10
+    add     dl, '0'
+    mov     [r8], dl
+    dec     r8
+    inc     rcx
+    test    rax, rax
+    jnz     .loop
+    cmp     r9, 0
+    je      .write_out
+    mov     byte [r8], '-'
+    inc     rcx
+    jmp     .append
+.write_out:
+    inc     r8
+.append:
+    mov     rax, [rel div_len]
+    cmp     rax, 65536 - 24
+    jbe     .copy
+    xor     rax, rax
+.copy:
+    lea     rdi, [rel div_buf]
+    add     rdi, rax
+    add     rax, rcx
+    mov     [rel div_len], rax
+.copy_loop:
+    mov     dl, [r8]
+    mov     [rdi], dl
+    inc     r8
+    inc     rdi
+    dec     rcx
+    jnz     .copy_loop
+    leave
+    ret
+)asm";
+
+using PrintFn = void (*)(int64_t);
+using FlushFn = void (*)();
+
+static ObjectModule assemble(std::string_view source)
+{
+  Assembler assembler;
+  assembler.assemble(source);
+  return assembler.finish();
+}
+
+static uint64_t state = 1;
+
+// splitmix64
+static uint64_t next()
+{
+  uint64_t z = (state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+// A value with `digits` digits and a random sign, or any int64 if
+// `digits` is 0.
+static int64_t random_value(int digits)
+{
+  if (digits == 0)
+    return static_cast<int64_t>(next());
+  uint64_t low = 1;
+  for (int i = 1; i < digits; i++)
+    low *= 10;
+  uint64_t span = digits == 19 ? static_cast<uint64_t>(INT64_MAX) - low + 1 : low * 9;
+  int64_t value = static_cast<int64_t>(low + next() % span);
+  return next() & 1 ? -value : value;
+}
+
+// Calls `print` on every value with stdout sent to a memory file, and
+// compares what it wrote with printf's output.
+static bool check(PrintFn print, FlushFn flush, const std::vector<int64_t> &values, const char *name)
+{
+  int out = memfd_create("print_bench", 0);
+  std::cout.flush();
+  int saved_stdout = dup(1);
+  dup2(out, 1);
+  for (int64_t value : values)
+  {
+    print(value);
+  }
+  flush();
+  dup2(saved_stdout, 1);
+  close(saved_stdout);
+
+  std::string expected;
+  char line[32];
+  for (int64_t value : values)
+  {
+    std::snprintf(line, sizeof(line), "%lld\n", static_cast<long long>(value));
+    expected += line;
+  }
+  std::string actual(lseek(out, 0, SEEK_END), '\0');
+  pread(out, actual.data(), actual.size(), 0);
+  close(out);
+  if (actual != expected)
+  {
+    size_t at = 0;
+    while (at < actual.size() && at < expected.size() && actual[at] == expected[at])
+      at++;
+    size_t line_start = expected.rfind('\n', at == 0 ? 0 : at - 1);
+    line_start = line_start == std::string::npos || at == 0 ? 0 : line_start + 1;
+    std::cerr << name << ": wrong output at byte " << at << ", expected line \""
+              << expected.substr(line_start, expected.find('\n', line_start) - line_start) << "\"\n";
+    return false;
+  }
+  return true;
+}
+
+static double ns_per_call(PrintFn print, const std::vector<int64_t> &values)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int64_t value : values)
+  {
+    print(value);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return seconds / values.size() * 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  size_t calls = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000000;
+
+  Linker linker;
+  linker.add(assemble(runtime::output_asm));
+  linker.add(assemble(runtime::print_asm));
+  linker.add(assemble(div_print_asm));
+  linker.add(assemble(Jit::trampoline_asm));
+  Jit jit(linker);
+  auto print_int = reinterpret_cast<PrintFn>(jit.symbol(linker, "print_int"));
+  auto flush_output = reinterpret_cast<FlushFn>(jit.symbol(linker, "flush_output"));
+  auto div_print_int = reinterpret_cast<PrintFn>(jit.symbol(linker, "div_print_int"));
+
+  std::vector<int64_t> edges = {0, INT64_MAX, INT64_MIN, INT64_MIN + 1, INT64_MAX - 1};
+  for (int64_t p = 1;; p *= 10)
+  {
+    for (int64_t v : {p - 1, p, p + 1})
+    {
+      edges.push_back(v);
+      edges.push_back(-v);
+    }
+    if (p > INT64_MAX / 10)
+      break;
+  }
+  for (int i = 0; i < 1000000; i++)
+  {
+    edges.push_back(random_value(static_cast<int>(next() % 20)));
+  }
+  if (!check(print_int, flush_output, edges, "print_int"))
+    return EXIT_FAILURE;
+
+  struct Group
+  {
+    const char *name;
+    int digits; // 0 for any int64, -1 for a random length
+  };
+  const Group groups[] = {{"1 digit", 1},   {"2 digits", 2},  {"5 digits", 5},       {"10 digits", 10},
+                          {"19 digits", 19}, {"any int64", 0}, {"random length", -1}};
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  std::cout.flush();
+  int saved_stdout = dup(1);
+  std::printf("%zu calls per group, ns/call\n", calls);
+  std::printf("group                div   reciprocal   speedup\n");
+  for (const Group &group : groups)
+  {
+    std::vector<int64_t> values(calls);
+    for (int64_t &value : values)
+    {
+      value = random_value(group.digits < 0 ? 1 + static_cast<int>(next() % 19) : group.digits);
+    }
+    std::fflush(stdout);
+    dup2(null_fd, 1);
+    double before = ns_per_call(div_print_int, values);
+    double after = ns_per_call(print_int, values);
+    flush_output();
+    dup2(saved_stdout, 1);
+    std::printf("%-15s %8.2f %12.2f %8.2fx\n", group.name, before, after, before / after);
+  }
+  close(saved_stdout);
+  close(null_fd);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,413 @@
+// Measures the code the generator emits rather than the compiler. Every
+// program in the suite (bench/programs) is compiled with mycompiler, then
+// its executable is run a number of times with stdout sent to /dev/null.
+// Each run counts user-space instructions, cycles and branch misses with
+// perf_event_open from exec to exit, and is timed over the same span, so
+// loading the program counts too. Where the kernel offers no hardware
+// counters, as in many VMs and containers or with perf_event_paranoid set
+// high, only wall time is measured. The median of the runs is reported.
+//
+// --save=<file> writes the results as a baseline, and --baseline=<file>
+// shows every figure's change against one, with the geometric mean of the
+// changes over the suite. Save a baseline before a code generation change
+// and compare after it.
+//
+// Usage: runtime_bench [--runs=N] [--save=<file>] [--baseline=<file>]
+//                      [--compiler=<path>] [program.txt ...] [-- compiler options]
+// Compiler options such as --no-simd are passed on to every compile.
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// The figures measured for each run, in report order. A figure that could
+// not be measured is negative.
+static constexpr size_t metric_count = 4;
+static constexpr const char *metric_names[metric_count] = {"wall-ms", "instructions", "cycles", "branch-misses"};
+using Sample = std::array<double, metric_count>;
+
+static constexpr uint64_t hardware_events[metric_count - 1] = {
+    PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_BRANCH_MISSES};
+
+// Set once opening a hardware counter fails, with the reason.
+static std::optional<std::string> counters_unavailable;
+
+// Opens a counter for `pid` that starts when it calls exec. Returns -1 if
+// the kernel refuses.
+static int open_counter(pid_t pid, uint64_t event)
+{
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = event;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+// A counter's value, scaled up if the kernel had to share the hardware
+// between counters for part of the run.
+static double read_counter(int fd)
+{
+  uint64_t values[3] = {};
+  if (read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0)
+    return -1;
+  return static_cast<double>(values[0]) * values[1] / values[2];
+}
+
+static bool wait_for(pid_t pid, int &status)
+{
+  pid_t waited;
+  do
+  {
+    waited = waitpid(pid, &status, 0);
+  } while (waited < 0 && errno == EINTR);
+  return waited == pid;
+}
+
+// Runs `path` once. The child waits on a pipe until its counters are open,
+// so they see all of the program and none of the benchmark.
+static std::optional<Sample> run_once(const std::string &path, int null_fd)
+{
+  int ready[2];
+  if (pipe2(ready, O_CLOEXEC) != 0)
+  {
+    std::cerr << "could not create a pipe: " << std::strerror(errno) << "\n";
+    exit(EXIT_FAILURE);
+  }
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    std::cerr << "could not fork: " << std::strerror(errno) << "\n";
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0)
+  {
+    char go;
+    close(ready[1]);
+    if (read(ready[0], &go, 1) != 1)
+      _exit(127);
+    dup2(null_fd, STDOUT_FILENO);
+    execl(path.c_str(), path.c_str(), nullptr);
+    _exit(127);
+  }
+  close(ready[0]);
+
+  Sample sample;
+  sample.fill(-1);
+  std::array<int, metric_count - 1> fds;
+  fds.fill(-1);
+  for (size_t i = 0; i < fds.size() && !counters_unavailable; i++)
+  {
+    fds[i] = open_counter(pid, hardware_events[i]);
+    if (fds[i] < 0)
+      counters_unavailable = std::string(metric_names[i + 1]) + ": " + std::strerror(errno);
+  }
+  auto start = std::chrono::steady_clock::now();
+  write(ready[1], "x", 1);
+  close(ready[1]);
+
+  int status;
+  bool waited = wait_for(pid, status);
+  sample[0] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  for (size_t i = 0; i < fds.size(); i++)
+  {
+    if (fds[i] < 0)
+      continue;
+    if (!counters_unavailable)
+      sample[i + 1] = read_counter(fds[i]);
+    close(fds[i]);
+  }
+  if (!waited || WIFSIGNALED(status))
+  {
+    std::cerr << path << " did not run to completion\n";
+    return std::nullopt;
+  }
+  return sample;
+}
+
+// The median of each figure over `runs` runs, after one run to warm up.
+static std::optional<Sample> measure(const std::string &path, int runs, int null_fd)
+{
+  if (access(path.c_str(), X_OK) != 0)
+  {
+    std::cerr << "no executable " << path << "\n";
+    return std::nullopt;
+  }
+  if (!run_once(path, null_fd))
+    return std::nullopt;
+  std::vector<Sample> samples;
+  for (int r = 0; r < runs; r++)
+  {
+    std::optional<Sample> sample = run_once(path, null_fd);
+    if (!sample)
+      return std::nullopt;
+    samples.push_back(sample.value());
+  }
+  Sample median;
+  for (size_t m = 0; m < metric_count; m++)
+  {
+    std::vector<double> values;
+    for (const Sample &sample : samples)
+      values.push_back(sample[m]);
+    std::sort(values.begin(), values.end());
+    median[m] = values[values.size() / 2];
+  }
+  return median;
+}
+
+// Compiles every program into `out_dir` with one batch run of the compiler.
+static bool compile(const std::string &compiler, const std::vector<std::string> &programs,
+                    const std::vector<std::string> &flags, const fs::path &out_dir)
+{
+  std::vector<std::string> args = {compiler, "--batch", "--out-dir=" + out_dir.string()};
+  args.insert(args.end(), flags.begin(), flags.end());
+  args.insert(args.end(), programs.begin(), programs.end());
+  std::vector<char *> argv;
+  for (std::string &arg : args)
+    argv.push_back(arg.data());
+  argv.push_back(nullptr);
+
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    execv(argv[0], argv.data());
+    std::cerr << "could not run " << compiler << ": " << std::strerror(errno) << "\n";
+    _exit(127);
+  }
+  int status;
+  return pid > 0 && wait_for(pid, status) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+using Results = std::map<std::string, Sample>;
+
+// One line per program: its name, then each figure, or - where it was not
+// measured.
+static bool save(const Results &results, const std::string &path)
+{
+  std::ofstream out(path);
+  out << "# runtime_bench baseline: program";
+  for (const char *name : metric_names)
+    out << " " << name;
+  out << "\n";
+  for (const auto &[name, sample] : results)
+  {
+    out << name;
+    for (double value : sample)
+    {
+      char text[32];
+      std::snprintf(text, sizeof(text), " %.3f", value);
+      out << (value < 0 ? " -" : text);
+    }
+    out << "\n";
+  }
+  return static_cast<bool>(out);
+}
+
+static std::optional<Results> load(const std::string &path)
+{
+  std::ifstream in(path);
+  if (!in)
+    return std::nullopt;
+  Results results;
+  std::string line;
+  while (std::getline(in, line))
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream fields(line);
+    std::string name;
+    fields >> name;
+    Sample sample;
+    for (double &value : sample)
+    {
+      std::string field;
+      fields >> field;
+      value = field.empty() || field == "-" ? -1 : std::strtod(field.c_str(), nullptr);
+    }
+    results[name] = sample;
+  }
+  return results;
+}
+
+static std::string format_value(double value, size_t metric)
+{
+  char text[32];
+  if (value < 0)
+    return "-";
+  if (metric == 0)
+    std::snprintf(text, sizeof(text), "%.2f", value);
+  else
+    std::snprintf(text, sizeof(text), "%.0f", value);
+  return text;
+}
+
+static std::string format_change(double ratio)
+{
+  char text[32];
+  std::snprintf(text, sizeof(text), "%+.1f%%", (ratio - 1) * 100);
+  return text;
+}
+
+static void report(const Results &results, const Results *baseline)
+{
+  const int width = baseline != nullptr ? 24 : 14;
+  std::printf("%-12s", "program");
+  for (const char *name : metric_names)
+    std::printf(" %*s", width, name);
+  std::printf("\n");
+
+  std::array<double, metric_count> log_sum{};
+  std::array<int, metric_count> compared{};
+  for (const auto &[name, sample] : results)
+  {
+    const Sample *before = nullptr;
+    if (baseline != nullptr)
+    {
+      auto it = baseline->find(name);
+      before = it == baseline->end() ? nullptr : &it->second;
+    }
+    std::printf("%-12s", name.c_str());
+    for (size_t m = 0; m < metric_count; m++)
+    {
+      std::string cell = format_value(sample[m], m);
+      if (before != nullptr && sample[m] > 0 && (*before)[m] > 0)
+      {
+        double ratio = sample[m] / (*before)[m];
+        cell += " (" + format_change(ratio) + ")";
+        log_sum[m] += std::log(ratio);
+        compared[m]++;
+      }
+      std::printf(" %*s", width, cell.c_str());
+    }
+    std::printf("\n");
+  }
+  if (baseline == nullptr)
+    return;
+  std::printf("%-12s", "geomean");
+  for (size_t m = 0; m < metric_count; m++)
+  {
+    std::string cell = compared[m] == 0 ? "-" : format_change(std::exp(log_sum[m] / compared[m]));
+    std::printf(" %*s", width, cell.c_str());
+  }
+  std::printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  int runs = 10;
+  std::string compiler = MYCOMPILER_PATH;
+  const char *save_path = nullptr;
+  const char *baseline_path = nullptr;
+  std::vector<std::string> programs;
+  std::vector<std::string> flags;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg.starts_with("--runs="))
+      runs = std::atoi(argv[i] + std::strlen("--runs="));
+    else if (arg.starts_with("--save="))
+      save_path = argv[i] + std::strlen("--save=");
+    else if (arg.starts_with("--baseline="))
+      baseline_path = argv[i] + std::strlen("--baseline=");
+    else if (arg.starts_with("--compiler="))
+      compiler = argv[i] + std::strlen("--compiler=");
+    else if (arg == "--")
+      flags.assign(argv + i + 1, argv + argc);
+    else
+      programs.push_back(arg);
+    if (arg == "--")
+      break;
+  }
+  if (runs < 1)
+  {
+    std::cerr << "Usage: runtime_bench [--runs=N] [--save=<file>] [--baseline=<file>] [--compiler=<path>] "
+                 "[program.txt ...] [-- compiler options]\n";
+    return EXIT_FAILURE;
+  }
+  if (programs.empty())
+  {
+    for (const fs::directory_entry &entry : fs::directory_iterator(BENCH_PROGRAMS_DIR))
+    {
+      if (entry.path().extension() == ".txt")
+        programs.push_back(entry.path().string());
+    }
+    std::sort(programs.begin(), programs.end());
+  }
+
+  std::optional<Results> baseline;
+  if (baseline_path != nullptr)
+  {
+    baseline = load(baseline_path);
+    if (!baseline)
+    {
+      std::cerr << "could not read baseline " << baseline_path << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::string dir_template = (fs::temp_directory_path() / "runtime_bench.XXXXXX").string();
+  if (mkdtemp(dir_template.data()) == nullptr)
+  {
+    std::cerr << "could not create a temporary directory: " << std::strerror(errno) << "\n";
+    return EXIT_FAILURE;
+  }
+  const fs::path out_dir = dir_template;
+  if (!compile(compiler, programs, flags, out_dir))
+  {
+    fs::remove_all(out_dir);
+    return EXIT_FAILURE;
+  }
+
+  int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  Results results;
+  bool ok = true;
+  for (const std::string &program : programs)
+  {
+    std::string name = fs::path(program).stem().string();
+    std::optional<Sample> sample = measure((out_dir / name).string(), runs, null_fd);
+    ok = ok && sample.has_value();
+    if (sample)
+      results[name] = sample.value();
+  }
+  close(null_fd);
+  fs::remove_all(out_dir);
+
+  std::printf("median of %d runs per program", runs);
+  if (counters_unavailable)
+    std::printf("; no hardware counters (%s), wall time only", counters_unavailable->c_str());
+  std::printf("\n");
+  report(results, baseline ? &baseline.value() : nullptr);
+
+  if (save_path != nullptr && !save(results, save_path))
+  {
+    std::cerr << "could not write baseline " << save_path << "\n";
+    return EXIT_FAILURE;
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// Builds valid source programs of a requested size for the compiler
+// benchmarks. A program is a run of independent units, each a block of
+// its own, so the number of names in scope stays the same however big the
+// program gets and any slowdown with size comes from the compiler. The
+// shape sets what a unit is made of. The same size, shape and seed always
+// give the same program.
+class SyntheticProgram
+{
+public:
+  struct Shape
+  {
+    const char *name;
+    int consts;      // const declarations per unit
+    int depth;       // nested block scopes per unit
+    int elifs;       // elif branches in each unit's if chain
+    int width;       // operands in each expression
+    int comments;    // comment lines per statement
+  };
+
+  static constexpr Shape shapes[] = {
+      {"mixed", 4, 3, 6, 6, 1},
+      {"consts", 48, 0, 0, 2, 0},
+      {"scopes", 1, 32, 0, 2, 0},
+      {"elifs", 1, 0, 64, 2, 0},
+      {"wide", 2, 0, 0, 96, 0},
+      {"comments", 1, 1, 1, 2, 8},
+  };
+
+  // Returns a program of at least `bytes` bytes, and at most one unit more.
+  static std::string generate(size_t bytes, const Shape &shape, uint64_t seed = 1)
+  {
+    SyntheticProgram program(shape, seed);
+    program.out.reserve(bytes + 4096);
+    program.out += "let int acc = 0;\n";
+    while (program.out.size() < bytes)
+    {
+      program.unit();
+    }
+    program.out += "exit acc % 256;\n";
+    return std::move(program.out);
+  }
+
+private:
+  SyntheticProgram(const Shape &shape, uint64_t seed) : shape(shape), state(seed) {}
+
+  // splitmix64, so the programs do not depend on the standard library's
+  // distributions.
+  uint64_t next()
+  {
+    uint64_t z = (state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+  int below(int n)
+  {
+    return static_cast<int>(next() % static_cast<uint64_t>(n));
+  }
+
+  void comment()
+  {
+    static const char *const lines[] = {
+        "// running total of this unit, folded into acc at the end\n",
+        "/* the constants below are small so no product overflows */\n",
+        "// TODO: check the edge cases of the chain again\n",
+        "/* each unit is a block, so its names go out of scope with it */\n",
+    };
+    for (int i = 0; i < shape.comments; i++)
+    {
+      indent();
+      out += lines[below(4)];
+    }
+  }
+
+  void indent()
+  {
+    out.append(2 * level, ' ');
+  }
+
+  void statement(const std::string &text)
+  {
+    comment();
+    indent();
+    out += text;
+    out += '\n';
+  }
+
+  // An operand: a literal or one of the names in `names`, which are the
+  // unit's constants and the enclosing blocks' variables.
+  std::string operand(int names)
+  {
+    if (names == 0 || below(3) == 0)
+      return std::to_string(1 + below(99));
+    int i = below(names);
+    return i < const_count ? "c" + std::to_string(i) : "d" + std::to_string(i - const_count);
+  }
+
+  // Sums and differences of small products, and the odd division by a
+  // non-zero literal. Every value stays far from overflowing.
+  std::string expression(int names)
+  {
+    std::string expr = operand(names);
+    for (int i = 1; i < shape.width; i++)
+    {
+      switch (below(6))
+      {
+      case 0:
+        expr += " * " + std::to_string(1 + below(9));
+        break;
+      case 1:
+        expr = "(" + expr + ") / " + std::to_string(1 + below(9));
+        break;
+      case 2:
+        expr += " - " + operand(names);
+        break;
+      default:
+        expr += " + " + operand(names);
+        break;
+      }
+    }
+    return "(" + expr + ") % 1000";
+  }
+
+  void unit()
+  {
+    statement("{");
+    level++;
+    const_count = 0;
+    for (int i = 0; i < shape.consts; i++)
+    {
+      statement("const int c" + std::to_string(i) + " = " + expression(const_count) + ";");
+      const_count++;
+    }
+    statement("let int d0 = " + expression(const_count) + ";");
+    for (int d = 1; d <= shape.depth; d++)
+    {
+      statement("{");
+      level++;
+      statement("let int d" + std::to_string(d) + " = " + expression(const_count + d) + ";");
+    }
+    std::string v = "d" + std::to_string(shape.depth);
+    if (shape.elifs > 0)
+    {
+      // Equality tests against distinct constants, the shape a switch
+      // takes in this language.
+      statement("if (" + v + " == 0) {");
+      level++;
+      statement("acc = acc + 1;");
+      level--;
+      for (int i = 1; i <= shape.elifs; i++)
+      {
+        statement("} elif (" + v + " == " + std::to_string(i * 7) + ") {");
+        level++;
+        statement("acc = acc + " + expression(const_count + shape.depth + 1) + ";");
+        level--;
+      }
+      statement("} else {");
+      level++;
+      statement("acc = acc - 1;");
+      level--;
+      statement("}");
+    }
+    statement("acc = (acc + " + v + ") % 100000;");
+    for (int d = shape.depth; d >= 0; d--)
+    {
+      level--;
+      statement("}");
+    }
+  }
+
+  const Shape &shape;
+  uint64_t state;
+  std::string out;
+  int level = 0;
+  int const_count = 0;
+};
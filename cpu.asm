@@ -0,0 +1,46 @@
+; ============================================
+; cpu.asm - CPU feature detection
+; cpu_init sets cpu_avx2 to 1 if the CPU and the OS support AVX2;
+; vectorised loops test it to pick their AVX2 or SSE2 body
+; ============================================
+global cpu_init
+global cpu_avx2
+
+section .data
+cpu_avx2 db 0
+
+section .text
+
+; -------------------------------
+; cpu_init: detects AVX2
+; clobbers: RAX, RCX, RDX
+cpu_init:
+    push rbx
+    mov eax, 0
+    cpuid
+    cmp eax, 7
+    jb .done                   ; no structured extended feature leaf
+
+    mov eax, 1
+    cpuid
+    mov eax, ecx
+    and eax, 0x18000000        ; OSXSAVE (bit 27) and AVX (bit 28)
+    cmp eax, 0x18000000
+    jne .done
+
+    mov ecx, 0
+    xgetbv                     ; XCR0: the OS saves XMM and YMM state
+    and eax, 6
+    cmp eax, 6
+    jne .done
+
+    mov eax, 7
+    mov ecx, 0
+    cpuid
+    test ebx, 0x20             ; AVX2 (bit 5)
+    jz .done
+
+    mov byte [rel cpu_avx2], 1
+.done:
+    pop rbx
+    ret
@@ -1,34 +1,50 @@
 ; ============================================
 ; errors.asm - runtime error handlers
-; Calls print_string from print.asm
+; Calls print_string from output.asm and flushes the output the program
+; printed before it. The handlers only run once, on the way out, so they
+; live in .text.cold away from the program's code.
 ; ============================================
 global overflow_error
 global divzero_error
+global bounds_error
 
-extern print_string        ; already defined in print.asm
+extern print_string        ; already defined in output.asm
+extern flush_output        ; already defined in output.asm
+extern exit_program        ; already defined in exit.asm
 
 section .data
 overflow_msg db "Runtime Error: Integer Overflow", 10, 0
 divzero_msg  db "Runtime Error: Divide by Zero", 10, 0
+bounds_msg   db "Runtime Error: Index Out of Bounds", 10, 0
 
-section .text
+section .text.cold progbits alloc exec nowrite align=16
 
 ; -------------------------------
 ; overflow_error: prints overflow error and exits
-; clobbers: RAX, RDI
+; does not return
 overflow_error:
     mov rdi, overflow_msg
     call print_string
-    mov rax, 60      ; sys_exit
+    call flush_output
     mov rdi, 1       ; exit code 1
-    syscall
+    jmp exit_program
 
 ; -------------------------------
 ; divzero_error: prints divide by zero error and exits
-; clobbers: RAX, RDI
+; does not return
 divzero_error:
     mov rdi, divzero_msg
     call print_string
-    mov rax, 60      ; sys_exit
-    mov rdi, 2       ; exit code 1
-    syscall
+    call flush_output
+    mov rdi, 2       ; exit code 2
+    jmp exit_program
+
+; -------------------------------
+; bounds_error: prints index out of bounds error and exits
+; does not return
+bounds_error:
+    mov rdi, bounds_msg
+    call print_string
+    call flush_output
+    mov rdi, 3       ; exit code 3
+    jmp exit_program
@@ -0,0 +1,15 @@
+; ============================================
+; exit.asm - program termination
+; Every exit, including the error handlers, goes through exit_program so
+; the JIT (--run) can replace it and get control back.
+; ============================================
+global exit_program
+
+section .text
+
+; -------------------------------
+; exit_program: terminates the process
+; arg: RDI = exit code
+exit_program:
+    mov rax, 60      ; sys_exit
+    syscall
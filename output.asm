@@ -0,0 +1,163 @@
+; ============================================
+; output.asm - buffered output
+; Output is collected in out_buf and written to stdout when the buffer
+; fills up, so a print costs a copy rather than a system call. Every exit
+; calls finish_output, and every error handler flush_output, before
+; leaving, so nothing buffered is lost. print_int in print.asm and the
+; prints the generator writes in place append to out_buf directly, so
+; out_buf and out_len are global too.
+; ============================================
+global print_string
+global print_char
+global print_bytes
+global flush_output
+global finish_output
+global out_buf
+global out_len
+
+OUT_SIZE equ 65536                 ; output_buffer_size in generator.hpp
+
+section .bss
+out_buf resb 65536
+out_len resq 1
+
+section .text
+; -------------------------------
+; print_string: prints null-terminated string + newline
+; arg: RDI = pointer to string
+; clobbers: RAX, RCX, RDX, RSI, RDI, R11
+; ============================================
+print_string:
+    mov     rsi, rdi        ; rsi points to string
+    xor     rdx, rdx        ; counter for length
+.len_loop:
+    cmp     byte [rsi + rdx], 0
+    je      .len_done
+    inc     rdx
+    jmp     .len_loop
+.len_done:
+    call    buffer_bytes
+    jmp     put_newline
+; -------------------------------
+; print_bytes: prints RSI bytes at RDI as they are; the generator passes
+; string literals with their newline and their length known up front
+; arg: RDI = pointer, RSI = length
+; clobbers: RAX, RCX, RDX, RSI, RDI, R11
+; ============================================
+print_bytes:
+    mov     rdx, rsi
+    mov     rsi, rdi
+    jmp     buffer_bytes
+; -------------------------------
+; print_char: prints single character + newline
+; arg: RDI = character (in lower 8 bits)
+; clobbers: RAX, RCX, RDX, RSI, RDI, R11
+; ============================================
+print_char:
+    mov     rax, [rel out_len]
+    cmp     rax, OUT_SIZE - 2
+    jbe     .store
+    push    rdi
+    call    flush_output
+    pop     rdi
+    xor     rax, rax
+.store:
+    lea     rsi, [rel out_buf]
+    mov     [rsi + rax], dil     ; character
+    mov     byte [rsi + rax + 1], 10 ; newline
+    add     rax, 2
+    mov     [rel out_len], rax
+    ret
+; -------------------------------
+; finish_output: prints the newline every exit ends with and writes out
+; the buffer; the program exits straight after
+; clobbers: RAX, RCX, RDX, RSI, RDI, R11
+; ============================================
+finish_output:
+    call    put_newline
+    jmp     flush_output
+; -------------------------------
+; put_newline: appends a newline to the buffer
+; clobbers: RAX, RCX, RDX, RSI, RDI, R11
+put_newline:
+    mov     rax, [rel out_len]
+    cmp     rax, OUT_SIZE
+    jb      .store
+    call    flush_output
+    xor     rax, rax
+.store:
+    lea     rsi, [rel out_buf]
+    mov     byte [rsi + rax], 10
+    inc     rax
+    mov     [rel out_len], rax
+    ret
+; -------------------------------
+; flush_output: writes the buffered output to stdout and empties the buffer
+; clobbers: RAX, RCX, RDX, RSI, RDI, R11
+; ============================================
+flush_output:
+    lea     rsi, [rel out_buf]
+    mov     rdx, [rel out_len]
+    mov     qword [rel out_len], 0
+    jmp     write_all
+; -------------------------------
+; buffer_bytes: appends RDX bytes at RSI to the buffer, flushing it first
+; if they do not fit; more than a whole buffer is written straight out
+; clobbers: RAX, RCX, RDX, RSI, RDI, R11
+buffer_bytes:
+    mov     rax, [rel out_len]
+    lea     rcx, [rax + rdx]
+    cmp     rcx, OUT_SIZE
+    jbe     .copy
+    push    rsi
+    push    rdx
+    call    flush_output
+    pop     rdx
+    pop     rsi
+    xor     rax, rax
+    cmp     rdx, OUT_SIZE
+    ja      write_all
+.copy:
+    lea     rdi, [rel out_buf]
+    add     rdi, rax            ; end of the buffered output
+    add     rax, rdx
+    mov     [rel out_len], rax
+.copy_words:
+    cmp     rdx, 8
+    jb      .copy_bytes
+    mov     rcx, [rsi]
+    mov     [rdi], rcx
+    add     rsi, 8
+    add     rdi, 8
+    sub     rdx, 8
+    jmp     .copy_words
+.copy_bytes:
+    test    rdx, rdx
+    jz      .copied
+    mov     cl, [rsi]
+    mov     [rdi], cl
+    inc     rsi
+    inc     rdi
+    dec     rdx
+    jmp     .copy_bytes
+.copied:
+    ret
+; -------------------------------
+; write_all: write(1, RSI, RDX), resumed after partial writes and signals;
+; output that cannot be written is dropped
+; clobbers: RAX, RCX, RDX, RSI, RDI, R11
+write_all:
+    test    rdx, rdx
+    jz      .done
+    mov     rax, 1              ; sys_write
+    mov     rdi, 1              ; fd = stdout
+    syscall
+    cmp     rax, -4             ; -EINTR
+    je      write_all
+    test    rax, rax
+    jle     .done
+    add     rsi, rax
+    sub     rdx, rax
+    jmp     write_all
+.done:
+    ret
@@ -1,119 +1,103 @@
 ; ============================================
-; print_int: prints signed integer + newline
-; arg: RDI = integer
-; clobbers: RAX, RBX, RCX, RDX, RSI, R8, R9
+; print.asm - integer printing
+; Appends to the output buffer in output.asm. It is a module of its own so
+; programs that never print an integer do not link it or its table.
+; Generated functions call it under the System V convention they use
+; themselves, so it keeps to the caller-saved registers and leaves RBX,
+; RBP and R12-R15 alone.
 ; ============================================
 global print_int
-global print_string
-global print_char
+
+extern out_buf             ; already defined in output.asm
+extern out_len             ; already defined in output.asm
+extern flush_output        ; already defined in output.asm
+
+OUT_SIZE equ 65536                 ; as in output.asm
+
+section .rodata
+digit_pairs:
+    db "00010203040506070809"
+    db "10111213141516171819"
+    db "20212223242526272829"
+    db "30313233343536373839"
+    db "40414243444546474849"
+    db "50515253545556575859"
+    db "60616263646566676869"
+    db "70717273747576777879"
+    db "80818283848586878889"
+    db "90919293949596979899"
+
 section .text
 ; -------------------------------
+; print_int: prints signed integer + newline
+; Digits are produced two at a time from digit_pairs, dividing by 100
+; with a multiply by its reciprocal rather than a div per digit.
+; arg: RDI = integer
+; clobbers: RAX, RCX, RDX, RSI, RDI, R8, R9, R10, R11
+; ============================================
 print_int:
-    push    rbp
-    mov     rbp, rsp
-    sub     rsp, 64             ; scratch buffer on stack
-    mov     rax, rdi            ; copy input integer to rax
-    mov     r8, rsp             ; buffer base
-    add     r8, 63              ; point to end of buffer
-    mov     rcx, 0              ; digit count
-    
-    ; append newline first (since we're building backwards)
-    mov     byte [r8], 10
-    dec     r8
-    inc     rcx
-    
-    ; handle zero
-    cmp     rax, 0
-    jne     .not_zero
-    mov     byte [r8], '0'
-    dec     r8 
-    inc     rcx
-    jmp     .write_out
-.not_zero:
-    ; handle negative
-    mov     r9, 0
-    cmp     rax, 0
-    jge     .convert
-    neg     rax
-    mov     r9, 1
+    mov     rax, [rel out_len]
+    cmp     rax, OUT_SIZE - 24  ; room for 21 bytes copied 8 at a time
+    jbe     .room
+    push    rdi
+    call    flush_output
+    pop     rdi
+.room:
+    sub     rsp, 32             ; scratch buffer, filled from the end
+    lea     r8, [rsp + 31]
+    mov     byte [r8], 10       ; newline
+    mov     r9, rdi             ; keep the sign
+    mov     rax, rdi
+    test    rax, rax
+    jns     .convert
+    neg     rax                 ; INT64_MIN stays 2^63, right when unsigned
 .convert:
-.loop:
-    xor     rdx, rdx
-    mov     rbx, 10
-    div     rbx                 ; quotient in rax, remainder in rdx
-    add     dl, '0'
-    mov     [r8], dl
+    lea     r10, [rel digit_pairs]
+.pairs:
+    cmp     rax, 100
+    jb      .last
+    mov     rcx, rax
+    shr     rax, 2
+    mov     rdx, 0x28F5C28F5C28F5C3
+    mul     rdx
+    shr     rdx, 2              ; rdx = n / 100
+    imul    rax, rdx, 100
+    sub     rcx, rax            ; rcx = n % 100
+    movzx   eax, word [r10 + rcx*2]
+    sub     r8, 2
+    mov     [r8], ax
+    mov     rax, rdx
+    jmp     .pairs
+.last:
+    cmp     rax, 10
+    jb      .one_digit
+    movzx   eax, word [r10 + rax*2]
+    sub     r8, 2
+    mov     [r8], ax
+    jmp     .sign
+.one_digit:
+    add     al, '0'
+    dec     r8
+    mov     [r8], al
+.sign:
+    test    r9, r9
+    jns     .append
     dec     r8
-    inc     rcx
-    test    rax, rax
-    jnz     .loop
-    ; prepend minus if needed
-    cmp     r9, 0
-    je      .write_out
     mov     byte [r8], '-'
-    inc     rcx
-    jmp     .done_minus
-.write_out:
-    inc     r8                  ; adjust pointer back
-.done_minus:
-    ; write(1, r8, rcx)
-    mov     rax, 1              ; sys_write
-    mov     rdi, 1              ; fd = stdout
-    mov     rsi, r8             ; buf
-    mov     rdx, rcx            ; len
-    syscall
-    leave
+.append:
+    lea     rcx, [rsp + 32]
+    sub     rcx, r8             ; length
+    mov     rax, [rel out_len]
+    lea     rdi, [rel out_buf]
+    add     rdi, rax
+    add     rax, rcx
+    mov     [rel out_len], rax
+    ; at most 21 bytes; copying 24 only writes past them into free buffer
+    mov     rdx, [r8]
+    mov     [rdi], rdx
+    mov     rdx, [r8 + 8]
+    mov     [rdi + 8], rdx
+    mov     rdx, [r8 + 16]
+    mov     [rdi + 16], rdx
+    add     rsp, 32
     ret
-; -------------------------------
-; print_string: prints null-terminated string + newline
-; arg: RDI = pointer to string
-; clobbers: RAX, RCX, RDX, RSI
-; ============================================
-print_string:
-    push    rbp
-    mov     rbp, rsp
-    mov     rsi, rdi        ; rsi points to string
-    xor     rcx, rcx        ; counter for length
-.len_loop:
-    cmp     byte [rsi + rcx], 0
-    je      .len_done
-    inc     rcx
-    jmp     .len_loop
-.len_done:
-    ; first write the string
-    mov     rax, 1          ; sys_write
-    mov     rdi, 1          ; stdout
-    mov     rdx, rcx        ; length
-    syscall
-    ; then write newline
-    sub     rsp, 1
-    mov     byte [rsp], 10  ; newline character
-    mov     rax, 1          ; sys_write
-    mov     rdi, 1          ; stdout
-    lea     rsi, [rsp]      ; buffer with newline
-    mov     rdx, 1          ; length = 1
-    syscall
-    add     rsp, 1
-    leave
-    ret
-; -------------------------------
-; print_char: prints single character + newline
-; arg: RDI = character (in lower 8 bits)
-; clobbers: RAX, RDX, RSI
-; ============================================
-print_char:
-    push    rbp
-    mov     rbp, rsp
-    ; store character and newline on stack
-    sub     rsp, 2           ; 2-byte buffer (char + newline)
-    mov     byte [rsp], dil  ; move lower 8 bits of RDI to buffer
-    mov     byte [rsp+1], 10 ; append newline
-    ; write(1, rsp, 2)
-    mov     rax, 1           ; sys_write
-    mov     rdi, 1           ; fd = stdout
-    lea     rsi, [rsp]       ; buffer
-    mov     rdx, 2           ; length = 2 (char + newline)
-    syscall
-    add     rsp, 2
-    leave
-    ret
\ No newline at end of file
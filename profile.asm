@@ -0,0 +1,42 @@
+; ============================================
+; profile.asm - branch profile dump for --instrument builds
+; The instrumented program defines profile_header: the magic, the source
+; hash and the branch site count, followed by two counters per site
+; ============================================
+global profile_exit
+
+extern profile_header
+extern exit_program        ; already defined in exit.asm
+
+section .data
+profile_path db "out.prof", 0
+
+section .text
+
+; -------------------------------
+; profile_exit: writes the profile to out.prof and exits; a profile that
+; cannot be written is skipped rather than failing the program
+; arg: RDI = exit code
+profile_exit:
+    push rdi
+    mov rax, 2                 ; sys_open
+    mov rdi, profile_path
+    mov rsi, 0x241             ; O_WRONLY | O_CREAT | O_TRUNC
+    mov rdx, 420               ; 0644
+    syscall
+    test rax, rax
+    js .done
+    mov r8, rax                ; fd
+    mov rdx, [rel profile_header + 16]
+    shl rdx, 4                 ; 16 bytes of counters per site
+    add rdx, 24                ; and the header
+    mov rax, 1                 ; sys_write
+    mov rdi, r8
+    mov rsi, profile_header
+    syscall
+    mov rax, 3                 ; sys_close
+    mov rdi, r8
+    syscall
+.done:
+    pop rdi
+    jmp exit_program
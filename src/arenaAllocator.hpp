@@ -1,29 +1,82 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "./diagnostics.hpp"
 class ArenaAllocator{
   public:
+    // The arena grows by another block of `bytes` whenever one fills up, and
+    // nodes never move, so pointers into it stay valid.
     inline explicit ArenaAllocator(size_t bytes):m_size(bytes){
-      m_buffer = static_cast<std::byte*>(malloc(m_size));
-      m_offset = m_buffer;
+      grow(m_size);
     }
 
+    // Constructs a value-initialised T in the arena. Objects that own memory
+    // of their own, such as the strings in tokens, are destroyed with the
+    // arena.
     template<typename T>
     inline T* alloc(){
-      void* offset = m_offset;
-      m_offset += sizeof(T);
-      return static_cast<T*>(offset);
+      if(!fits(sizeof(T), alignof(T))){
+        grow(std::max(m_size, sizeof(T) + alignof(T)));
+      }
+      std::byte* offset = align(m_offset, alignof(T));
+      m_offset = offset + sizeof(T);
+      m_count++;
+      T* object = new (offset) T();
+      if constexpr(!std::is_trivially_destructible_v<T>){
+        m_destructors.emplace_back(object, [](void* p){ static_cast<T*>(p)->~T(); });
+      }
+      return object;
     }
 
     inline ArenaAllocator(const ArenaAllocator& other) = delete;
-   
+
     inline ArenaAllocator& operator=(const ArenaAllocator& other) = delete;
 
     inline ~ArenaAllocator(){
-      free(m_buffer);
+      for(auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it){
+        it->second(it->first);
+      }
+      for(std::byte* block : m_blocks){
+        free(block);
+      }
+    }
+
+    // Number of objects allocated so far.
+    inline size_t count() const{
+      return m_count;
     }
-    
+
   private:
+    static inline std::byte* align(std::byte* p, size_t alignment){
+      uintptr_t address = reinterpret_cast<uintptr_t>(p);
+      return p + ((alignment - address % alignment) % alignment);
+    }
+
+    inline bool fits(size_t bytes, size_t alignment) const{
+      std::byte* start = align(m_offset, alignment);
+      return start <= m_end && static_cast<size_t>(m_end - start) >= bytes;
+    }
+
+    inline void grow(size_t bytes){
+      std::byte* block = static_cast<std::byte*>(malloc(bytes));
+      if(block == nullptr){
+        diagnostics() << "Error: out of memory for the syntax tree" << std::endl;
+        throw CompileError();
+      }
+      m_blocks.push_back(block);
+      m_offset = block;
+      m_end = block + bytes;
+    }
+
     size_t m_size;
-    std::byte* m_buffer;
+    std::vector<std::byte*> m_blocks;
     std::byte* m_offset;
+    std::byte* m_end;
+    size_t m_count = 0;
+    std::vector<std::pair<void*, void(*)(void*)>> m_destructors;
 };
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Append-only text buffer for generated assembly. Text is copied into
+// fixed-size chunks, so appending never moves what was already written and
+// only allocates once per chunk. Integers are formatted in place, and the
+// finished buffer is handed to the kernel with writev without first being
+// joined into one string.
+class AsmBuffer
+{
+public:
+  static constexpr size_t chunk_size = 64 * 1024;
+
+  AsmBuffer() = default;
+  AsmBuffer(const AsmBuffer &other) = delete;
+  AsmBuffer &operator=(const AsmBuffer &other) = delete;
+
+  AsmBuffer &operator<<(std::string_view text)
+  {
+    while (!text.empty())
+    {
+      if (cursor == limit)
+      {
+        grow();
+      }
+      size_t n = std::min(text.size(), static_cast<size_t>(limit - cursor));
+      std::memcpy(cursor, text.data(), n);
+      cursor += n;
+      text.remove_prefix(n);
+    }
+    return *this;
+  }
+
+  AsmBuffer &operator<<(const char *text)
+  {
+    return *this << std::string_view(text);
+  }
+
+  AsmBuffer &operator<<(const std::string &text)
+  {
+    return *this << std::string_view(text);
+  }
+
+  AsmBuffer &operator<<(char c)
+  {
+    if (cursor == limit)
+    {
+      grow();
+    }
+    *cursor++ = c;
+    return *this;
+  }
+
+  template <typename Int>
+    requires(std::is_integral_v<Int> && !std::is_same_v<Int, char> && !std::is_same_v<Int, bool>)
+  AsmBuffer &operator<<(Int value)
+  {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    using Unsigned = std::make_unsigned_t<Int>;
+    Unsigned magnitude = static_cast<Unsigned>(value);
+    bool negative = false;
+    if constexpr (std::is_signed_v<Int>)
+    {
+      if (value < 0)
+      {
+        negative = true;
+        magnitude = Unsigned(0) - magnitude;
+      }
+    }
+    do
+    {
+      *--p = static_cast<char>('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude != 0);
+    if (negative)
+    {
+      *--p = '-';
+    }
+    return *this << std::string_view(p, end - p);
+  }
+
+  // Appends the text of `other`.
+  void append(const AsmBuffer &other)
+  {
+    for (size_t i = 0; i < other.chunks.size(); i++)
+    {
+      *this << std::string_view(other.chunks[i].get(), other.chunk_length(i));
+    }
+  }
+
+  void swap(AsmBuffer &other) noexcept
+  {
+    chunks.swap(other.chunks);
+    std::swap(cursor, other.cursor);
+    std::swap(limit, other.limit);
+  }
+
+  size_t size() const
+  {
+    size_t total = 0;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+      total += chunk_length(i);
+    }
+    return total;
+  }
+
+  std::string str() const
+  {
+    std::string text;
+    text.reserve(size());
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+      text.append(chunks[i].get(), chunk_length(i));
+    }
+    return text;
+  }
+
+  // Calls `f` with every line of the buffer, without the newline. Lines are
+  // viewed in place unless they straddle two chunks.
+  template <typename F>
+  void for_each_line(F f) const
+  {
+    std::string carry;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+      std::string_view text(chunks[i].get(), chunk_length(i));
+      size_t start = 0;
+      size_t end;
+      while ((end = text.find('\n', start)) != std::string_view::npos)
+      {
+        if (carry.empty())
+        {
+          f(text.substr(start, end - start));
+        }
+        else
+        {
+          carry.append(text.substr(start, end - start));
+          f(std::string_view(carry));
+          carry.clear();
+        }
+        start = end + 1;
+      }
+      carry.append(text.substr(start));
+    }
+    if (!carry.empty())
+    {
+      f(std::string_view(carry));
+    }
+  }
+
+  // Writes the whole buffer to `fd`. Returns false and leaves errno set if
+  // the kernel reports an error.
+  bool write_to(int fd) const
+  {
+    std::vector<iovec> iov;
+    iov.reserve(chunks.size());
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+      iov.push_back({chunks[i].get(), chunk_length(i)});
+    }
+
+    size_t next = 0;
+    while (next < iov.size())
+    {
+      int count = static_cast<int>(std::min<size_t>(iov.size() - next, IOV_MAX));
+      ssize_t written = writev(fd, iov.data() + next, count);
+      if (written < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      // Skip fully written entries and trim a partially written one.
+      size_t remaining = static_cast<size_t>(written);
+      while (next < iov.size() && remaining >= iov[next].iov_len)
+      {
+        remaining -= iov[next].iov_len;
+        next++;
+      }
+      if (remaining > 0)
+      {
+        iov[next].iov_base = static_cast<char *>(iov[next].iov_base) + remaining;
+        iov[next].iov_len -= remaining;
+      }
+    }
+    return true;
+  }
+
+private:
+  void grow()
+  {
+    chunks.push_back(std::unique_ptr<char[]>(new char[chunk_size]));
+    cursor = chunks.back().get();
+    limit = cursor + chunk_size;
+  }
+
+  size_t chunk_length(size_t i) const
+  {
+    return i + 1 == chunks.size() ? static_cast<size_t>(cursor - chunks[i].get()) : chunk_size;
+  }
+
+  std::vector<std::unique_ptr<char[]>> chunks;
+  char *cursor = nullptr;
+  char *limit = nullptr;
+};
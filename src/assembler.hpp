@@ -0,0 +1,1759 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "./asmBuffer.hpp"
+#include "./diagnostics.hpp"
+
+enum class RelocType
+{
+  Abs64,  // 64-bit absolute address
+  Abs32S, // 32-bit absolute address, sign-extended
+  PC32,   // 32-bit displacement from the end of the field (addend applied)
+};
+
+struct ObjSection
+{
+  std::string name;
+  std::vector<uint8_t> data; // empty for nobits sections
+  uint64_t size = 0;         // in-memory size
+  uint64_t align = 1;
+  bool write = false;
+  bool exec = false;
+  bool nobits = false;
+};
+
+struct ObjSymbol
+{
+  std::string name;
+  int section = -1; // -1 while undefined
+  uint64_t offset = 0;
+  bool global = false;
+};
+
+struct ObjReloc
+{
+  int section;
+  uint64_t offset;
+  RelocType type;
+  uint32_t symbol;
+  int64_t addend;
+};
+
+// Assembled form of one source file: sections, symbols and the relocations
+// left for the linker.
+struct ObjectModule
+{
+  std::vector<ObjSection> sections;
+  std::vector<ObjSymbol> symbols;
+  std::vector<ObjReloc> relocs;
+
+  std::optional<uint32_t> find_symbol(std::string_view name) const
+  {
+    for (uint32_t i = 0; i < symbols.size(); i++)
+    {
+      if (symbols[i].name == name)
+        return i;
+    }
+    return std::nullopt;
+  }
+
+  bool defines(std::string_view name) const
+  {
+    for (const ObjSymbol &symbol : symbols)
+    {
+      if (symbol.global && symbol.section >= 0 && symbol.name == name)
+        return true;
+    }
+    return false;
+  }
+
+  // Names the relocations refer to that this module leaves undefined.
+  std::vector<std::string> references() const
+  {
+    std::vector<std::string> names;
+    std::vector<bool> seen(symbols.size(), false);
+    for (const ObjReloc &reloc : relocs)
+    {
+      if (symbols[reloc.symbol].section < 0 && !seen[reloc.symbol])
+      {
+        seen[reloc.symbol] = true;
+        names.push_back(symbols[reloc.symbol].name);
+      }
+    }
+    return names;
+  }
+};
+
+// In-process assembler for the subset of NASM syntax produced by the
+// Generator and used by the runtime (output.asm, print.asm, errors.asm,
+// exit.asm, cpu.asm). It encodes x86-64 instructions, including the SSE2 and AVX2
+// ones vectorised loops use, directly to machine code, relaxes jumps to
+// their short form when the target is in range, and resolves branches
+// within a section itself. Everything else is left as relocations in the
+// resulting ObjectModule.
+class Assembler
+{
+public:
+  Assembler()
+  {
+    switch_section(".text");
+  }
+
+  void assemble(std::string_view source)
+  {
+    size_t start = 0;
+    while (start < source.size())
+    {
+      size_t end = source.find('\n', start);
+      if (end == std::string_view::npos)
+        end = source.size();
+      assemble_line(source.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+
+  void assemble(const AsmBuffer &buffer)
+  {
+    buffer.for_each_line([this](std::string_view line)
+                         { assemble_line(line); });
+  }
+
+  // Number of instructions assembled so far.
+  size_t instructions() const
+  {
+    return instruction_count;
+  }
+
+  ObjectModule finish()
+  {
+    ObjectModule module;
+    std::vector<std::vector<size_t>> prefixes(sections.size());
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+      prefixes[i] = relax(sections[i]);
+    }
+
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+      SectionState &sec = sections[i];
+      ObjSection out;
+      out.name = sec.name;
+      out.align = sec.align;
+      out.write = sec.write;
+      out.exec = sec.exec;
+      out.nobits = sec.nobits;
+      if (sec.nobits)
+      {
+        out.size = sec.bss_size;
+      }
+      else
+      {
+        out.data = layout(sec, prefixes[i]);
+        out.size = out.data.size();
+      }
+      module.sections.push_back(std::move(out));
+    }
+
+    for (const SymbolState &sym : symbols)
+    {
+      ObjSymbol out;
+      out.name = sym.name;
+      out.global = sym.global;
+      if (sym.defined)
+      {
+        out.section = sym.section;
+        out.offset = sym.pos + prefixes[sym.section][sym.frag];
+      }
+      module.symbols.push_back(std::move(out));
+    }
+
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+      for (const Fixup &fixup : sections[i].fixups)
+      {
+        uint64_t offset = fixup.pos + prefixes[i][fixup.frag];
+        const ObjSymbol &target = module.symbols[fixup.symbol];
+        if (fixup.type == RelocType::PC32 && target.section == static_cast<int>(i))
+        {
+          int64_t disp = static_cast<int64_t>(target.offset) + fixup.addend - static_cast<int64_t>(offset);
+          if (disp < INT32_MIN || disp > INT32_MAX)
+            fail("displacement out of range");
+          write_le(module.sections[i].data, offset, static_cast<uint64_t>(disp), 4);
+          continue;
+        }
+        module.relocs.push_back({static_cast<int>(i), offset, fixup.type, fixup.symbol, fixup.addend});
+      }
+    }
+    return module;
+  }
+
+private:
+  enum class OperandKind
+  {
+    None,
+    Reg,
+    Imm,
+    Mem,
+  };
+
+  struct Reg
+  {
+    uint8_t num;
+    uint8_t size;       // 1, 2, 4 or 8 bytes; 16 for xmm, 32 for ymm
+    bool needs_rex;     // spl, bpl, sil, dil
+    bool high_byte;     // ah, ch, dh, bh
+  };
+
+  // A constant optionally relative to a symbol.
+  struct Expr
+  {
+    int64_t value = 0;
+    std::optional<uint32_t> symbol;
+  };
+
+  struct Mem
+  {
+    int base = -1;
+    int index = -1;
+    uint8_t scale = 1;
+    bool rip = false;
+    Expr disp;
+  };
+
+  struct Operand
+  {
+    OperandKind kind = OperandKind::None;
+    uint8_t size = 0; // explicit or register size, 0 if unknown
+    Reg reg{};
+    Expr imm;
+    Mem mem;
+  };
+
+  struct Fixup
+  {
+    size_t pos;
+    size_t frag;
+    RelocType type;
+    uint32_t symbol;
+    int64_t addend;
+  };
+
+  // A piece of code whose size is only known after layout: a relaxable
+  // jump, or padding up to an alignment boundary.
+  struct Fragment
+  {
+    size_t pos;
+    bool is_align;
+    uint8_t cond;     // condition code, 0xff for jmp
+    uint32_t target;  // branch target symbol
+    size_t alignment; // for align fragments
+    bool is_long = false;
+    size_t size = 0;
+  };
+
+  struct SectionState
+  {
+    std::string name;
+    std::vector<uint8_t> bytes; // code with every fragment removed
+    std::vector<Fragment> frags;
+    std::vector<Fixup> fixups;
+    uint64_t bss_size = 0;
+    uint64_t align = 1;
+    bool write = false;
+    bool exec = false;
+    bool nobits = false;
+  };
+
+  struct SymbolState
+  {
+    std::string name;
+    bool defined = false;
+    bool global = false;
+    int section = -1;
+    size_t pos = 0;
+    size_t frag = 0;
+  };
+
+  struct StringHash
+  {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const
+    {
+      return std::hash<std::string_view>{}(s);
+    }
+  };
+
+  // ---------------------------------------------------------------------
+  // Layout
+
+  // Decides the size of every fragment and returns, for each fragment
+  // index, the number of bytes added by the fragments before it.
+  std::vector<size_t> relax(SectionState &sec)
+  {
+    for (Fragment &frag : sec.frags)
+    {
+      if (!frag.is_align)
+      {
+        // Branches leaving the section are always encoded with a rel32.
+        const SymbolState &target = symbols[frag.target];
+        frag.is_long = !target.defined || target.section != current_index(sec);
+      }
+    }
+
+    std::vector<size_t> prefix(sec.frags.size() + 1, 0);
+    bool changed = true;
+    while (changed)
+    {
+      changed = false;
+      size_t added = 0;
+      for (size_t i = 0; i < sec.frags.size(); i++)
+      {
+        Fragment &frag = sec.frags[i];
+        prefix[i] = added;
+        size_t start = frag.pos + added;
+        if (frag.is_align)
+        {
+          frag.size = (frag.alignment - start % frag.alignment) % frag.alignment;
+        }
+        else
+        {
+          frag.size = branch_size(frag);
+        }
+        added += frag.size;
+      }
+      prefix[sec.frags.size()] = added;
+
+      for (size_t i = 0; i < sec.frags.size(); i++)
+      {
+        Fragment &frag = sec.frags[i];
+        if (frag.is_align || frag.is_long)
+          continue;
+        int64_t end = static_cast<int64_t>(frag.pos + prefix[i] + frag.size);
+        const SymbolState &target = symbols[frag.target];
+        int64_t disp = static_cast<int64_t>(target.pos + prefix[target.frag]) - end;
+        if (disp < INT8_MIN || disp > INT8_MAX)
+        {
+          frag.is_long = true;
+          changed = true;
+        }
+      }
+    }
+    return prefix;
+  }
+
+  static size_t branch_size(const Fragment &frag)
+  {
+    if (!frag.is_long)
+      return 2;
+    return frag.cond == 0xff ? 5 : 6;
+  }
+
+  std::vector<uint8_t> layout(SectionState &sec, const std::vector<size_t> &prefix)
+  {
+    std::vector<uint8_t> out;
+    out.reserve(sec.bytes.size() + prefix.back());
+    size_t copied = 0;
+    int sec_index = current_index(sec);
+    for (size_t i = 0; i < sec.frags.size(); i++)
+    {
+      const Fragment &frag = sec.frags[i];
+      out.insert(out.end(), sec.bytes.begin() + copied, sec.bytes.begin() + frag.pos);
+      copied = frag.pos;
+      if (frag.is_align)
+      {
+        uint8_t fill = sec.exec ? 0x90 : 0x00;
+        out.insert(out.end(), frag.size, fill);
+        continue;
+      }
+      const SymbolState &target = symbols[frag.target];
+      int64_t end = static_cast<int64_t>(out.size() + frag.size);
+      int64_t disp = 0;
+      bool local = target.defined && target.section == sec_index;
+      if (local)
+      {
+        disp = static_cast<int64_t>(target.pos + prefix[target.frag]) - end;
+      }
+      if (!frag.is_long)
+      {
+        out.push_back(frag.cond == 0xff ? 0xEB : static_cast<uint8_t>(0x70 | frag.cond));
+        out.push_back(static_cast<uint8_t>(disp));
+        continue;
+      }
+      if (frag.cond == 0xff)
+      {
+        out.push_back(0xE9);
+      }
+      else
+      {
+        out.push_back(0x0F);
+        out.push_back(static_cast<uint8_t>(0x80 | frag.cond));
+      }
+      if (!local)
+      {
+        // Record the rel32 against the final layout; finish() keeps it as a
+        // relocation since the target lives elsewhere.
+        sec.fixups.push_back({out.size() - prefix[i + 1], i + 1, RelocType::PC32, frag.target, -4});
+      }
+      size_t at = out.size();
+      out.resize(at + 4);
+      write_le(out, at, static_cast<uint64_t>(disp), 4);
+    }
+    out.insert(out.end(), sec.bytes.begin() + copied, sec.bytes.end());
+    return out;
+  }
+
+  // Same type as SymbolState::section.
+  int current_index(const SectionState &sec) const
+  {
+    return static_cast<int>(&sec - sections.data());
+  }
+
+  static void write_le(std::vector<uint8_t> &out, size_t at, uint64_t value, int bytes)
+  {
+    for (int i = 0; i < bytes; i++)
+    {
+      out[at + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+  }
+
+  // ---------------------------------------------------------------------
+  // Parsing
+
+  [[noreturn]] void fail(const std::string &message) const
+  {
+    diagnostics() << "Assembler error on line " << line_no << ": " << message << "\n";
+    throw CompileError();
+  }
+
+  static std::string_view trim(std::string_view s)
+  {
+    while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front())))
+      s.remove_prefix(1);
+    while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back())))
+      s.remove_suffix(1);
+    return s;
+  }
+
+  static bool is_ident_char(char c)
+  {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '$' || c == '@';
+  }
+
+  static std::string lower(std::string_view s)
+  {
+    std::string out(s);
+    for (char &c : out)
+      c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return out;
+  }
+
+  static bool iequals(std::string_view a, std::string_view b)
+  {
+    if (a.size() != b.size())
+      return false;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+      if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+        return false;
+    }
+    return true;
+  }
+
+  // Removes a trailing comment, ignoring ';' inside quotes.
+  static std::string_view strip_comment(std::string_view line)
+  {
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); i++)
+    {
+      char c = line[i];
+      if (quote)
+      {
+        if (c == quote)
+          quote = 0;
+      }
+      else if (c == '"' || c == '\'' || c == '`')
+      {
+        quote = c;
+      }
+      else if (c == ';')
+      {
+        return line.substr(0, i);
+      }
+    }
+    return line;
+  }
+
+  // Splits operands on commas outside quotes and brackets.
+  static size_t split_operands(std::string_view text, std::string_view *out, size_t max)
+  {
+    size_t count = 0;
+    char quote = 0;
+    int depth = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= text.size(); i++)
+    {
+      char c = i < text.size() ? text[i] : ',';
+      if (quote)
+      {
+        if (c == quote)
+          quote = 0;
+        continue;
+      }
+      if (c == '"' || c == '\'' || c == '`')
+        quote = c;
+      else if (c == '[')
+        depth++;
+      else if (c == ']')
+        depth--;
+      else if (c == ',' && depth == 0)
+      {
+        if (count == max)
+          return max + 1;
+        out[count++] = trim(text.substr(start, i - start));
+        start = i + 1;
+      }
+    }
+    if (count == 1 && out[0].empty())
+      return 0;
+    return count;
+  }
+
+  void assemble_line(std::string_view line)
+  {
+    line_no++;
+    line = trim(strip_comment(line));
+    if (line.empty())
+      return;
+
+    // Label definition, possibly followed by an instruction.
+    size_t word_end = 0;
+    while (word_end < line.size() && is_ident_char(line[word_end]))
+      word_end++;
+    if (word_end > 0 && word_end < line.size() && line[word_end] == ':')
+    {
+      define_label(line.substr(0, word_end));
+      line = trim(line.substr(word_end + 1));
+      if (line.empty())
+        return;
+      word_end = 0;
+      while (word_end < line.size() && is_ident_char(line[word_end]))
+        word_end++;
+    }
+
+    std::string_view word = line.substr(0, word_end);
+    std::string_view rest = trim(line.substr(word_end));
+
+    // `name equ value`
+    if (size_t sp = rest.find_first_of(" \t"); sp != std::string_view::npos && iequals(rest.substr(0, sp), "equ"))
+    {
+      Expr value = parse_expr(trim(rest.substr(sp)));
+      if (value.symbol)
+        fail("equ requires a constant");
+      constants[std::string(word)] = value.value;
+      return;
+    }
+
+    // Data labels may omit the colon: `msg db "text", 0`, `buf resb 64`.
+    if (size_t sp = rest.find_first_of(" \t"); sp != std::string_view::npos)
+    {
+      std::string next = lower(rest.substr(0, sp));
+      bool data_directive = next.size() == 2 && next[0] == 'd' && std::strchr("bwdq", next[1]);
+      bool reserve_directive = next.size() == 4 && next.starts_with("res") && std::strchr("bwdq", next[3]);
+      if (data_directive || reserve_directive)
+      {
+        define_label(word);
+        directive(next, trim(rest.substr(sp)));
+        return;
+      }
+    }
+
+    std::string mnemonic = lower(word);
+    if (directive(mnemonic, rest))
+      return;
+    instruction(mnemonic, rest);
+    instruction_count++;
+  }
+
+  bool directive(const std::string &name, std::string_view rest)
+  {
+    if (name == "global")
+    {
+      for_each_name(rest, [this](std::string_view sym)
+                    { symbols[intern(sym)].global = true; });
+      return true;
+    }
+    if (name == "extern")
+    {
+      for_each_name(rest, [this](std::string_view sym)
+                    { intern(sym); });
+      return true;
+    }
+    if (name == "section" || name == "segment")
+    {
+      size_t end = rest.find_first_of(" \t");
+      switch_section(rest.substr(0, end));
+      return true;
+    }
+    if (name == "default" || name == "bits")
+    {
+      if (name == "default")
+        default_rel = iequals(rest, "rel");
+      return true;
+    }
+    if (name == "align")
+    {
+      std::string_view operands[2];
+      if (split_operands(rest, operands, 2) < 1)
+        fail("align requires a boundary");
+      int64_t alignment = parse_expr(operands[0]).value;
+      if (alignment <= 0 || (alignment & (alignment - 1)) != 0)
+        fail("alignment must be a power of two");
+      SectionState &sec = sections[section];
+      sec.align = std::max<uint64_t>(sec.align, alignment);
+      if (sec.nobits)
+      {
+        sec.bss_size = (sec.bss_size + alignment - 1) / alignment * alignment;
+        return true;
+      }
+      Fragment frag{};
+      frag.pos = sec.bytes.size();
+      frag.is_align = true;
+      frag.alignment = static_cast<size_t>(alignment);
+      sec.frags.push_back(frag);
+      return true;
+    }
+    if (name == "db" || name == "dw" || name == "dd" || name == "dq")
+    {
+      int width = name == "db" ? 1 : name == "dw" ? 2
+                                 : name == "dd"   ? 4
+                                                  : 8;
+      data(rest, width);
+      return true;
+    }
+    if (name == "resb" || name == "resw" || name == "resd" || name == "resq")
+    {
+      int width = name == "resb" ? 1 : name == "resw" ? 2
+                                   : name == "resd"   ? 4
+                                                      : 8;
+      int64_t count = parse_expr(rest).value;
+      SectionState &sec = sections[section];
+      if (sec.nobits)
+        sec.bss_size += count * width;
+      else
+        sec.bytes.insert(sec.bytes.end(), count * width, 0);
+      return true;
+    }
+    return false;
+  }
+
+  template <typename F>
+  void for_each_name(std::string_view rest, F f)
+  {
+    std::string_view names[16];
+    size_t n = split_operands(rest, names, 16);
+    for (size_t i = 0; i < n && i < 16; i++)
+    {
+      std::string_view sym = names[i];
+      size_t colon = sym.find(':');
+      f(trim(sym.substr(0, colon)));
+    }
+  }
+
+  void switch_section(std::string_view name)
+  {
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+      if (sections[i].name == name)
+      {
+        section = i;
+        return;
+      }
+    }
+    SectionState sec;
+    sec.name = std::string(name);
+    sec.exec = name.starts_with(".text");
+    sec.write = name.starts_with(".data") || name.starts_with(".bss");
+    sec.nobits = name.starts_with(".bss");
+    sections.push_back(std::move(sec));
+    section = sections.size() - 1;
+  }
+
+  std::string qualify(std::string_view name) const
+  {
+    if (name.starts_with("..@") || !name.starts_with("."))
+      return std::string(name);
+    return last_global + std::string(name);
+  }
+
+  void define_label(std::string_view name)
+  {
+    if (!name.starts_with("."))
+      last_global = std::string(name);
+    SymbolState &sym = symbols[intern(name)];
+    if (sym.defined)
+      fail("symbol '" + sym.name + "' redefined");
+    SectionState &sec = sections[section];
+    sym.defined = true;
+    sym.section = static_cast<int>(section);
+    sym.pos = sec.nobits ? sec.bss_size : sec.bytes.size();
+    sym.frag = sec.frags.size();
+  }
+
+  uint32_t intern(std::string_view raw)
+  {
+    std::string name = qualify(raw);
+    auto it = symbol_index.find(name);
+    if (it != symbol_index.end())
+      return it->second;
+    uint32_t id = static_cast<uint32_t>(symbols.size());
+    symbols.push_back({name});
+    symbol_index.emplace(std::move(name), id);
+    return id;
+  }
+
+  void data(std::string_view rest, int width)
+  {
+    std::string_view items[256];
+    size_t n = split_operands(rest, items, 256);
+    if (n > 256)
+      fail("too many data items on one line");
+    SectionState &sec = sections[section];
+    for (size_t i = 0; i < n; i++)
+    {
+      std::string_view item = items[i];
+      if (!item.empty() && (item.front() == '"' || item.front() == '`' || (item.front() == '\'' && item.size() > 3)))
+      {
+        std::string text = parse_string(item);
+        for (char c : text)
+        {
+          sec.bytes.push_back(static_cast<uint8_t>(c));
+          for (int pad = 1; pad < width; pad++)
+            sec.bytes.push_back(0);
+        }
+        continue;
+      }
+      Expr value = parse_expr(item);
+      if (value.symbol)
+      {
+        if (width != 8 && width != 4)
+          fail("symbol reference in data must be 4 or 8 bytes");
+        sec.fixups.push_back({sec.bytes.size(), sec.frags.size(), width == 8 ? RelocType::Abs64 : RelocType::Abs32S, *value.symbol, value.value});
+        value.value = 0;
+      }
+      for (int b = 0; b < width; b++)
+        sec.bytes.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value.value) >> (8 * b)));
+    }
+  }
+
+  std::string parse_string(std::string_view item) const
+  {
+    char quote = item.front();
+    if (item.size() < 2 || item.back() != quote)
+      fail("unterminated string");
+    std::string out;
+    for (size_t i = 1; i + 1 < item.size(); i++)
+    {
+      char c = item[i];
+      if (quote == '`' && c == '\\' && i + 2 < item.size())
+      {
+        char e = item[++i];
+        switch (e)
+        {
+        case 'n':
+          c = '\n';
+          break;
+        case 't':
+          c = '\t';
+          break;
+        case '0':
+          c = '\0';
+          break;
+        default:
+          c = e;
+        }
+      }
+      out.push_back(c);
+    }
+    return out;
+  }
+
+  // Parses `a + b - c` where each term is a number, a character constant or
+  // a symbol. At most one symbol may appear, with a positive sign.
+  Expr parse_expr(std::string_view text)
+  {
+    Expr expr;
+    text = trim(text);
+    if (text.empty())
+      fail("expected expression");
+    size_t i = 0;
+    bool negative = false;
+    while (i < text.size())
+    {
+      while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i])))
+        i++;
+      if (i < text.size() && (text[i] == '+' || text[i] == '-'))
+      {
+        negative = text[i] == '-';
+        i++;
+        while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i])))
+          i++;
+      }
+      size_t start = i;
+      int64_t term;
+      if (i < text.size() && text[i] == '\'')
+      {
+        size_t close = text.find('\'', i + 1);
+        if (close == std::string_view::npos || close != i + 2)
+          fail("bad character constant");
+        term = static_cast<unsigned char>(text[i + 1]);
+        i = close + 1;
+      }
+      else
+      {
+        while (i < text.size() && is_ident_char(text[i]))
+          i++;
+        std::string_view word = text.substr(start, i - start);
+        if (word.empty())
+          fail("bad expression '" + std::string(text) + "'");
+        if (std::isdigit(static_cast<unsigned char>(word.front())))
+        {
+          term = parse_number(word);
+        }
+        else if (auto it = constants.find(std::string(word)); it != constants.end())
+        {
+          term = it->second;
+        }
+        else
+        {
+          if (expr.symbol || negative)
+            fail("unsupported symbol arithmetic");
+          expr.symbol = intern(word);
+          term = 0;
+        }
+      }
+      expr.value += negative ? -term : term;
+      negative = false;
+      while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i])))
+        i++;
+      if (i < text.size() && text[i] != '+' && text[i] != '-')
+        fail("bad expression '" + std::string(text) + "'");
+    }
+    return expr;
+  }
+
+  int64_t parse_number(std::string_view word) const
+  {
+    uint64_t value = 0;
+    int base = 10;
+    if (word.size() > 2 && word[0] == '0' && (word[1] == 'x' || word[1] == 'X'))
+    {
+      base = 16;
+      word.remove_prefix(2);
+    }
+    else if (word.size() > 1 && (word.back() == 'h' || word.back() == 'H'))
+    {
+      base = 16;
+      word.remove_suffix(1);
+    }
+    for (char c : word)
+    {
+      if (c == '_')
+        continue;
+      int digit;
+      if (c >= '0' && c <= '9')
+        digit = c - '0';
+      else if (base == 16 && std::isxdigit(static_cast<unsigned char>(c)))
+        digit = std::tolower(static_cast<unsigned char>(c)) - 'a' + 10;
+      else
+        fail("bad number '" + std::string(word) + "'");
+      value = value * base + digit;
+    }
+    return static_cast<int64_t>(value);
+  }
+
+  static std::optional<Reg> parse_reg(std::string_view name)
+  {
+    static const std::unordered_map<std::string, Reg> regs = []
+    {
+      std::unordered_map<std::string, Reg> table;
+      const char *r64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi"};
+      const char *r32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+      const char *r16[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+      const char *r8[] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil"};
+      const char *high[] = {"ah", "ch", "dh", "bh"};
+      for (uint8_t i = 0; i < 8; i++)
+      {
+        table[r64[i]] = {i, 8, false, false};
+        table[r32[i]] = {i, 4, false, false};
+        table[r16[i]] = {i, 2, false, false};
+        table[r8[i]] = {i, 1, i >= 4, false};
+      }
+      for (uint8_t i = 0; i < 4; i++)
+      {
+        table[high[i]] = {static_cast<uint8_t>(i + 4), 1, false, true};
+      }
+      for (uint8_t i = 8; i < 16; i++)
+      {
+        std::string base = "r" + std::to_string(i);
+        table[base] = {i, 8, false, false};
+        table[base + "d"] = {i, 4, false, false};
+        table[base + "w"] = {i, 2, false, false};
+        table[base + "b"] = {i, 1, false, false};
+      }
+      for (uint8_t i = 0; i < 16; i++)
+      {
+        table["xmm" + std::to_string(i)] = {i, 16, false, false};
+        table["ymm" + std::to_string(i)] = {i, 32, false, false};
+      }
+      return table;
+    }();
+    auto it = regs.find(lower(name));
+    if (it == regs.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  Operand parse_operand(std::string_view text)
+  {
+    Operand op;
+    text = trim(text);
+    // Size and distance keywords.
+    while (true)
+    {
+      size_t sp = text.find_first_of(" \t[");
+      std::string_view word = text.substr(0, sp);
+      uint8_t size = 0;
+      if (iequals(word, "byte"))
+        size = 1;
+      else if (iequals(word, "word"))
+        size = 2;
+      else if (iequals(word, "dword"))
+        size = 4;
+      else if (iequals(word, "qword"))
+        size = 8;
+      else if (iequals(word, "short") || iequals(word, "near") || iequals(word, "strict"))
+        size = 0xff;
+      if (size == 0 || sp == std::string_view::npos)
+        break;
+      if (size != 0xff)
+        op.size = size;
+      text = trim(text.substr(sp));
+    }
+
+    if (!text.empty() && text.front() == '[')
+    {
+      if (text.back() != ']')
+        fail("expected ']'");
+      op.kind = OperandKind::Mem;
+      op.mem = parse_mem(trim(text.substr(1, text.size() - 2)));
+      return op;
+    }
+    if (auto reg = parse_reg(text))
+    {
+      op.kind = OperandKind::Reg;
+      op.reg = *reg;
+      op.size = reg->size;
+      return op;
+    }
+    op.kind = OperandKind::Imm;
+    op.imm = parse_expr(text);
+    return op;
+  }
+
+  Mem parse_mem(std::string_view text)
+  {
+    Mem mem;
+    bool rel = default_rel;
+    if (text.size() > 4 && iequals(text.substr(0, 3), "rel") && std::isspace(static_cast<unsigned char>(text[3])))
+    {
+      rel = true;
+      text = trim(text.substr(4));
+    }
+    else if (text.size() > 4 && iequals(text.substr(0, 3), "abs") && std::isspace(static_cast<unsigned char>(text[3])))
+    {
+      rel = false;
+      text = trim(text.substr(4));
+    }
+
+    // Split on + and - at the top level, pulling registers out of the sum.
+    std::string constant;
+    size_t i = 0;
+    while (i < text.size())
+    {
+      char sign = '+';
+      while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i])))
+        i++;
+      if (i < text.size() && (text[i] == '+' || text[i] == '-'))
+      {
+        sign = text[i++];
+      }
+      size_t start = i;
+      while (i < text.size() && text[i] != '+' && text[i] != '-')
+      {
+        if (text[i] == '\'')
+        {
+          size_t close = text.find('\'', i + 1);
+          i = close == std::string_view::npos ? text.size() : close + 1;
+          continue;
+        }
+        i++;
+      }
+      std::string_view term = trim(text.substr(start, i - start));
+      size_t star = term.find('*');
+      std::string_view reg_part = trim(term.substr(0, star));
+      if (auto reg = parse_reg(reg_part))
+      {
+        if (reg->size != 8 || sign == '-')
+          fail("bad address register");
+        if (star != std::string_view::npos)
+        {
+          if (mem.index != -1)
+            fail("two index registers");
+          mem.index = reg->num;
+          mem.scale = static_cast<uint8_t>(parse_number(trim(term.substr(star + 1))));
+        }
+        else if (mem.base == -1)
+        {
+          mem.base = reg->num;
+        }
+        else if (mem.index == -1)
+        {
+          mem.index = reg->num;
+        }
+        else
+        {
+          fail("too many registers in address");
+        }
+        continue;
+      }
+      constant.push_back(sign);
+      constant.append(term);
+    }
+    if (!constant.empty())
+      mem.disp = parse_expr(constant);
+    if (mem.index == 4)
+    {
+      if (mem.scale != 1 || mem.base == 4)
+        fail("rsp cannot be an index register");
+      std::swap(mem.base, mem.index);
+    }
+    if (mem.scale != 1 && mem.scale != 2 && mem.scale != 4 && mem.scale != 8)
+      fail("bad scale");
+    mem.rip = rel && mem.base == -1 && mem.index == -1 && mem.disp.symbol.has_value();
+    return mem;
+  }
+
+  // ---------------------------------------------------------------------
+  // Encoding
+
+  void emit(uint8_t byte)
+  {
+    sections[section].bytes.push_back(byte);
+  }
+
+  void emit_imm(int64_t value, int bytes)
+  {
+    for (int i = 0; i < bytes; i++)
+      emit(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+  }
+
+  void emit_fixup(const Expr &expr, RelocType type, int bytes, int64_t extra_addend = 0)
+  {
+    SectionState &sec = sections[section];
+    if (expr.symbol)
+    {
+      sec.fixups.push_back({sec.bytes.size(), sec.frags.size(), type, *expr.symbol, expr.value + extra_addend});
+      emit_imm(0, bytes);
+      return;
+    }
+    emit_imm(expr.value, bytes);
+  }
+
+  static bool fits8(int64_t v)
+  {
+    return v >= INT8_MIN && v <= INT8_MAX;
+  }
+
+  static bool fits32(int64_t v)
+  {
+    return v >= INT32_MIN && v <= INT32_MAX;
+  }
+
+  // Emits [prefixes] [REX] opcode ModRM [SIB] [disp] for an instruction
+  // whose ModRM.reg field is `reg` and whose r/m operand is `rm`.
+  // `imm_bytes` is the size of any immediate that follows, which matters
+  // for RIP-relative displacements.
+  void emit_modrm(std::initializer_list<uint8_t> opcode, uint8_t reg, const Operand &rm, uint8_t size,
+                  bool reg_needs_rex = false, bool reg_high = false, int imm_bytes = 0, bool default64 = false)
+  {
+    if (size == 2)
+      emit(0x66);
+
+    uint8_t rex = 0;
+    if (size == 8 && !default64)
+      rex |= 0x08;
+    if (reg & 8)
+      rex |= 0x04;
+    bool needs_rex = reg_needs_rex;
+    bool high = reg_high;
+    if (rm.kind == OperandKind::Reg)
+    {
+      if (rm.reg.num & 8)
+        rex |= 0x01;
+      needs_rex = needs_rex || rm.reg.needs_rex;
+      high = high || rm.reg.high_byte;
+    }
+    else
+    {
+      if (rm.mem.base >= 0 && (rm.mem.base & 8))
+        rex |= 0x01;
+      if (rm.mem.index >= 0 && (rm.mem.index & 8))
+        rex |= 0x02;
+    }
+    if (rex || needs_rex)
+    {
+      if (high)
+        fail("ah/bh/ch/dh cannot be used with a REX prefix");
+      emit(static_cast<uint8_t>(0x40 | rex));
+    }
+    for (uint8_t byte : opcode)
+      emit(byte);
+    emit_rm(reg, rm, imm_bytes);
+  }
+
+  // Emits ModRM [SIB] [disp] for ModRM.reg `reg` and r/m operand `rm`.
+  void emit_rm(uint8_t reg, const Operand &rm, int imm_bytes)
+  {
+    uint8_t reg_bits = static_cast<uint8_t>((reg & 7) << 3);
+    if (rm.kind == OperandKind::Reg)
+    {
+      emit(static_cast<uint8_t>(0xC0 | reg_bits | (rm.reg.num & 7)));
+      return;
+    }
+
+    const Mem &mem = rm.mem;
+    if (mem.rip)
+    {
+      emit(static_cast<uint8_t>(0x05 | reg_bits));
+      emit_fixup(mem.disp, RelocType::PC32, 4, -4 - imm_bytes);
+      return;
+    }
+
+    uint8_t scale_bits = mem.scale == 1 ? 0 : mem.scale == 2 ? 1
+                                          : mem.scale == 4   ? 2
+                                                             : 3;
+    if (mem.base == -1)
+    {
+      // [disp32] or [index*scale + disp32]
+      emit(static_cast<uint8_t>(0x04 | reg_bits));
+      uint8_t index = mem.index == -1 ? 4 : static_cast<uint8_t>(mem.index & 7);
+      emit(static_cast<uint8_t>((scale_bits << 6) | (index << 3) | 5));
+      emit_fixup(mem.disp, RelocType::Abs32S, 4);
+      return;
+    }
+
+    uint8_t mod;
+    if (mem.disp.symbol || !fits8(mem.disp.value))
+      mod = 0x80;
+    else if (mem.disp.value != 0 || (mem.base & 7) == 5)
+      mod = 0x40;
+    else
+      mod = 0x00;
+    if (!mem.disp.symbol && !fits32(mem.disp.value))
+      fail("displacement out of range");
+
+    bool sib = mem.index != -1 || (mem.base & 7) == 4;
+    if (sib)
+    {
+      emit(static_cast<uint8_t>(mod | reg_bits | 4));
+      uint8_t index = mem.index == -1 ? 4 : static_cast<uint8_t>(mem.index & 7);
+      emit(static_cast<uint8_t>((scale_bits << 6) | (index << 3) | (mem.base & 7)));
+    }
+    else
+    {
+      emit(static_cast<uint8_t>(mod | reg_bits | (mem.base & 7)));
+    }
+    if (mod == 0x40)
+      emit_imm(mem.disp.value, 1);
+    else if (mod == 0x80)
+      emit_fixup(mem.disp, RelocType::Abs32S, 4);
+  }
+
+  void emit_modrm_reg(std::initializer_list<uint8_t> opcode, const Reg &reg, const Operand &rm, uint8_t size, int imm_bytes = 0)
+  {
+    emit_modrm(opcode, reg.num, rm, size, reg.needs_rex, reg.high_byte, imm_bytes);
+  }
+
+  // Emits a VEX-encoded instruction. `pp` selects the implied prefix (0
+  // none, 1 66, 2 F3, 3 F2), `map` the opcode map (1 0F, 2 0F38) and
+  // `vvvv` the extra source register. The two-byte C5 form is used when
+  // nothing needs the fields only the three-byte form has.
+  void emit_vex(uint8_t pp, uint8_t map, bool w, bool l, uint8_t vvvv, uint8_t opcode, uint8_t reg, const Operand &rm)
+  {
+    bool r = reg & 8;
+    bool x = rm.kind == OperandKind::Mem && rm.mem.index >= 0 && (rm.mem.index & 8);
+    bool b = rm.kind == OperandKind::Reg ? (rm.reg.num & 8) != 0 : rm.mem.base >= 0 && (rm.mem.base & 8);
+    uint8_t tail = static_cast<uint8_t>((~vvvv & 0xF) << 3 | (l ? 4 : 0) | pp);
+    if (map == 1 && !w && !x && !b)
+    {
+      emit(0xC5);
+      emit(static_cast<uint8_t>((r ? 0 : 0x80) | tail));
+    }
+    else
+    {
+      emit(0xC4);
+      emit(static_cast<uint8_t>((r ? 0 : 0x80) | (x ? 0 : 0x40) | (b ? 0 : 0x20) | map));
+      emit(static_cast<uint8_t>((w ? 0x80 : 0) | tail));
+    }
+    emit(opcode);
+    emit_rm(reg, rm, 0);
+  }
+
+  static std::optional<uint8_t> condition_code(std::string_view cc)
+  {
+    static const std::unordered_map<std::string_view, uint8_t> codes = {
+        {"o", 0x0}, {"no", 0x1}, {"b", 0x2}, {"c", 0x2}, {"nae", 0x2}, {"ae", 0x3}, {"nb", 0x3}, {"nc", 0x3}, {"e", 0x4}, {"z", 0x4}, {"ne", 0x5}, {"nz", 0x5}, {"be", 0x6}, {"na", 0x6}, {"a", 0x7}, {"nbe", 0x7}, {"s", 0x8}, {"ns", 0x9}, {"p", 0xA}, {"pe", 0xA}, {"np", 0xB}, {"po", 0xB}, {"l", 0xC}, {"nge", 0xC}, {"ge", 0xD}, {"nl", 0xD}, {"le", 0xE}, {"ng", 0xE}, {"g", 0xF}, {"nle", 0xF}};
+    auto it = codes.find(cc);
+    if (it == codes.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  uint8_t operand_size(const Operand &a, const Operand &b)
+  {
+    uint8_t size = a.size ? a.size : b.size;
+    if (a.size && b.size && a.size != b.size && b.kind != OperandKind::Imm)
+      fail("operand size mismatch");
+    if (size == 0)
+      fail("operation size not specified");
+    return size;
+  }
+
+  void instruction(const std::string &mnemonic, std::string_view rest)
+  {
+    if (sections[section].nobits)
+      fail("instruction in a nobits section");
+    std::string_view texts[3];
+    size_t count = split_operands(rest, texts, 3);
+    if (count > 3)
+      fail("too many operands");
+    Operand ops[3];
+    for (size_t i = 0; i < count; i++)
+      ops[i] = parse_operand(texts[i]);
+
+    auto expect = [&](size_t n)
+    {
+      if (count != n)
+        fail("'" + mnemonic + "' expects " + std::to_string(n) + " operand(s)");
+    };
+
+    // Instructions without operands.
+    static const std::unordered_map<std::string_view, std::vector<uint8_t>> plain = {
+        {"cqo", {0x48, 0x99}},
+        {"cdq", {0x99}},
+        {"leave", {0xC9}},
+        {"ret", {0xC3}},
+        {"syscall", {0x0F, 0x05}},
+        {"nop", {0x90}},
+        {"ud2", {0x0F, 0x0B}},
+        {"int3", {0xCC}},
+        {"hlt", {0xF4}},
+        {"cpuid", {0x0F, 0xA2}},
+        {"xgetbv", {0x0F, 0x01, 0xD0}},
+        {"stosq", {0x48, 0xAB}},
+        {"vzeroupper", {0xC5, 0xF8, 0x77}},
+    };
+    if (auto it = plain.find(mnemonic); it != plain.end())
+    {
+      expect(0);
+      for (uint8_t byte : it->second)
+        emit(byte);
+      return;
+    }
+    if (mnemonic == "rep")
+    {
+      if (!iequals(rest, "stosq"))
+        fail("rep is only supported with stosq");
+      emit(0xF3);
+      emit(0x48);
+      emit(0xAB);
+      return;
+    }
+    if (encode_vector(mnemonic, ops, count))
+      return;
+    for (size_t i = 0; i < count; i++)
+    {
+      if (ops[i].kind == OperandKind::Reg && ops[i].size >= 16)
+        fail("'" + mnemonic + "' does not take vector registers");
+    }
+
+    static const std::unordered_map<std::string_view, uint8_t> alu = {
+        {"add", 0}, {"or", 1}, {"adc", 2}, {"sbb", 3}, {"and", 4}, {"sub", 5}, {"xor", 6}, {"cmp", 7}};
+    if (auto it = alu.find(mnemonic); it != alu.end())
+    {
+      expect(2);
+      encode_alu(it->second, ops[0], ops[1]);
+      return;
+    }
+
+    if (mnemonic == "mov")
+    {
+      expect(2);
+      encode_mov(ops[0], ops[1]);
+      return;
+    }
+    if (mnemonic == "movzx" || mnemonic == "movsx")
+    {
+      expect(2);
+      if (ops[0].kind != OperandKind::Reg || ops[0].size < 2)
+        fail(mnemonic + " needs a register destination");
+      uint8_t src_size = ops[1].size;
+      if (src_size != 1 && src_size != 2)
+        fail(mnemonic + " needs a byte or word source");
+      uint8_t op = static_cast<uint8_t>((mnemonic == "movzx" ? 0xB6 : 0xBE) + (src_size == 2 ? 1 : 0));
+      emit_modrm({0x0F, op}, ops[0].reg.num, ops[1], ops[0].size, ops[1].kind == OperandKind::Reg && ops[1].reg.needs_rex);
+      return;
+    }
+    if (mnemonic == "movsxd")
+    {
+      expect(2);
+      emit_modrm_reg({0x63}, ops[0].reg, ops[1], 8);
+      return;
+    }
+    if (mnemonic == "lea")
+    {
+      expect(2);
+      if (ops[0].kind != OperandKind::Reg || ops[1].kind != OperandKind::Mem)
+        fail("lea needs a register and an address");
+      emit_modrm_reg({0x8D}, ops[0].reg, ops[1], ops[0].size);
+      return;
+    }
+    if (mnemonic == "push" || mnemonic == "pop")
+    {
+      expect(1);
+      encode_push_pop(mnemonic == "push", ops[0]);
+      return;
+    }
+    if (mnemonic == "test")
+    {
+      expect(2);
+      uint8_t size = operand_size(ops[0], ops[1]);
+      if (ops[1].kind == OperandKind::Imm)
+      {
+        int bytes = size == 1 ? 1 : size == 2 ? 2
+                                              : 4;
+        emit_modrm({static_cast<uint8_t>(size == 1 ? 0xF6 : 0xF7)}, 0, ops[0], size, false, false, bytes);
+        emit_fixup(ops[1].imm, RelocType::Abs32S, bytes);
+        return;
+      }
+      if (ops[1].kind != OperandKind::Reg)
+        std::swap(ops[0], ops[1]);
+      emit_modrm_reg({static_cast<uint8_t>(size == 1 ? 0x84 : 0x85)}, ops[1].reg, ops[0], size);
+      return;
+    }
+    static const std::unordered_map<std::string_view, std::pair<uint8_t, uint8_t>> unary = {
+        {"inc", {0xFE, 0}}, {"dec", {0xFE, 1}}, {"not", {0xF6, 2}}, {"neg", {0xF6, 3}}, {"mul", {0xF6, 4}}, {"div", {0xF6, 6}}, {"idiv", {0xF6, 7}}};
+    if (auto it = unary.find(mnemonic); it != unary.end())
+    {
+      expect(1);
+      uint8_t size = ops[0].size;
+      if (size == 0)
+        fail("operation size not specified");
+      uint8_t opcode = static_cast<uint8_t>(it->second.first + (size == 1 ? 0 : 1));
+      emit_modrm({opcode}, it->second.second, ops[0], size);
+      return;
+    }
+    if (mnemonic == "imul")
+    {
+      encode_imul(ops, count);
+      return;
+    }
+    static const std::unordered_map<std::string_view, uint8_t> shifts = {
+        {"rol", 0}, {"ror", 1}, {"shl", 4}, {"sal", 4}, {"shr", 5}, {"sar", 7}};
+    if (auto it = shifts.find(mnemonic); it != shifts.end())
+    {
+      expect(2);
+      uint8_t size = ops[0].size;
+      if (size == 0)
+        fail("operation size not specified");
+      uint8_t wide = size == 1 ? 0 : 1;
+      if (ops[1].kind == OperandKind::Reg && ops[1].reg.num == 1 && ops[1].size == 1)
+      {
+        emit_modrm({static_cast<uint8_t>(0xD2 + wide)}, it->second, ops[0], size);
+        return;
+      }
+      if (ops[1].kind != OperandKind::Imm || ops[1].imm.symbol)
+        fail("shift count must be cl or a constant");
+      if (ops[1].imm.value == 1)
+      {
+        emit_modrm({static_cast<uint8_t>(0xD0 + wide)}, it->second, ops[0], size);
+        return;
+      }
+      emit_modrm({static_cast<uint8_t>(0xC0 + wide)}, it->second, ops[0], size, false, false, 1);
+      emit_imm(ops[1].imm.value, 1);
+      return;
+    }
+    if (mnemonic == "xchg")
+    {
+      expect(2);
+      uint8_t size = operand_size(ops[0], ops[1]);
+      if (ops[1].kind != OperandKind::Reg)
+        std::swap(ops[0], ops[1]);
+      emit_modrm_reg({static_cast<uint8_t>(size == 1 ? 0x86 : 0x87)}, ops[1].reg, ops[0], size);
+      return;
+    }
+    if (mnemonic == "call" || mnemonic == "jmp")
+    {
+      expect(1);
+      bool is_call = mnemonic == "call";
+      if (ops[0].kind == OperandKind::Imm)
+      {
+        if (is_call)
+        {
+          emit(0xE8);
+          emit_fixup(ops[0].imm, RelocType::PC32, 4, -4);
+          return;
+        }
+        branch(0xff, ops[0].imm);
+        return;
+      }
+      emit_modrm({0xFF}, is_call ? 2 : 4, ops[0], 8, false, false, 0, true);
+      return;
+    }
+    if (mnemonic.size() > 1 && mnemonic[0] == 'j')
+    {
+      if (auto cc = condition_code(std::string_view(mnemonic).substr(1)))
+      {
+        expect(1);
+        if (ops[0].kind != OperandKind::Imm)
+          fail("conditional jump needs a label");
+        branch(*cc, ops[0].imm);
+        return;
+      }
+    }
+    if (mnemonic.starts_with("set"))
+    {
+      if (auto cc = condition_code(std::string_view(mnemonic).substr(3)))
+      {
+        expect(1);
+        if (ops[0].size != 1)
+          fail("setcc needs a byte operand");
+        emit_modrm({0x0F, static_cast<uint8_t>(0x90 | *cc)}, 0, ops[0], 1);
+        return;
+      }
+    }
+    if (mnemonic.starts_with("cmov"))
+    {
+      if (auto cc = condition_code(std::string_view(mnemonic).substr(4)))
+      {
+        expect(2);
+        if (ops[0].kind != OperandKind::Reg || ops[0].size == 1)
+          fail("cmov needs a register destination");
+        emit_modrm_reg({0x0F, static_cast<uint8_t>(0x40 | *cc)}, ops[0].reg, ops[1], ops[0].size);
+        return;
+      }
+    }
+    fail("unknown instruction '" + mnemonic + "'");
+  }
+
+  // The SSE2 and AVX2 instructions emitted for vectorised loops. Returns
+  // false if `mnemonic` is not one of them.
+  bool encode_vector(const std::string &mnemonic, Operand *ops, size_t count)
+  {
+    auto is_vec = [](const Operand &op, uint8_t size)
+    { return op.kind == OperandKind::Reg && op.size == size; };
+    auto is_gp32 = [](const Operand &op)
+    { return op.kind == OperandKind::Reg && op.size == 4; };
+
+    // Legacy SSE: mandatory prefix, then REX, then 0F opcode. `store` is
+    // the opcode of the `mem, xmm` form, if there is one.
+    struct Sse
+    {
+      uint8_t prefix;
+      uint8_t load;
+      uint8_t store;
+    };
+    static const std::unordered_map<std::string_view, Sse> sse = {
+        {"movdqu", {0xF3, 0x6F, 0x7F}},
+        {"movdqa", {0x66, 0x6F, 0x7F}},
+        {"movq", {0xF3, 0x7E, 0x00}},
+        {"paddq", {0x66, 0xD4, 0x00}},
+        {"psubq", {0x66, 0xFB, 0x00}},
+        {"pxor", {0x66, 0xEF, 0x00}},
+        {"pand", {0x66, 0xDB, 0x00}},
+        {"por", {0x66, 0xEB, 0x00}},
+        {"punpcklqdq", {0x66, 0x6C, 0x00}},
+        {"movmskpd", {0x66, 0x50, 0x00}},
+    };
+    if (auto it = sse.find(mnemonic); it != sse.end())
+    {
+      if (count != 2)
+        fail("'" + mnemonic + "' expects 2 operand(s)");
+      const Sse &enc = it->second;
+      if (ops[0].kind == OperandKind::Mem && enc.store != 0 && is_vec(ops[1], 16))
+      {
+        emit(enc.prefix);
+        emit_modrm({0x0F, enc.store}, ops[1].reg.num, ops[0], 4);
+        return true;
+      }
+      bool dst_ok = mnemonic == "movmskpd" ? is_gp32(ops[0]) : is_vec(ops[0], 16);
+      bool src_ok = mnemonic == "movmskpd" ? is_vec(ops[1], 16) : is_vec(ops[1], 16) || ops[1].kind == OperandKind::Mem;
+      if (!dst_ok || !src_ok)
+        fail("bad operands for '" + mnemonic + "'");
+      emit(enc.prefix);
+      emit_modrm({0x0F, enc.load}, ops[0].reg.num, ops[1], 4);
+      return true;
+    }
+
+    // VEX: `nds` instructions take a second source in VEX.vvvv.
+    struct Vex
+    {
+      uint8_t pp;
+      uint8_t map;
+      uint8_t load;
+      uint8_t store;
+      bool nds;
+    };
+    static const std::unordered_map<std::string_view, Vex> vex = {
+        {"vmovdqu", {2, 1, 0x6F, 0x7F, false}},
+        {"vmovdqa", {1, 1, 0x6F, 0x7F, false}},
+        {"vpaddq", {1, 1, 0xD4, 0x00, true}},
+        {"vpsubq", {1, 1, 0xFB, 0x00, true}},
+        {"vpxor", {1, 1, 0xEF, 0x00, true}},
+        {"vpand", {1, 1, 0xDB, 0x00, true}},
+        {"vpor", {1, 1, 0xEB, 0x00, true}},
+        {"vpbroadcastq", {1, 2, 0x59, 0x00, false}},
+        {"vmovmskpd", {1, 1, 0x50, 0x00, false}},
+    };
+    auto it = vex.find(mnemonic);
+    if (it == vex.end())
+      return false;
+    const Vex &enc = it->second;
+    if (enc.nds)
+    {
+      if (count != 3)
+        fail("'" + mnemonic + "' expects 3 operand(s)");
+      uint8_t size = ops[0].size;
+      if ((size != 16 && size != 32) || !is_vec(ops[0], size) || !is_vec(ops[1], size) ||
+          !(is_vec(ops[2], size) || ops[2].kind == OperandKind::Mem))
+        fail("bad operands for '" + mnemonic + "'");
+      emit_vex(enc.pp, enc.map, false, size == 32, ops[1].reg.num, enc.load, ops[0].reg.num, ops[2]);
+      return true;
+    }
+    if (count != 2)
+      fail("'" + mnemonic + "' expects 2 operand(s)");
+    if (ops[0].kind == OperandKind::Mem && enc.store != 0 && (is_vec(ops[1], 16) || is_vec(ops[1], 32)))
+    {
+      emit_vex(enc.pp, enc.map, false, ops[1].size == 32, 0, enc.store, ops[1].reg.num, ops[0]);
+      return true;
+    }
+    if (mnemonic == "vmovmskpd")
+    {
+      if (!is_gp32(ops[0]) || !(is_vec(ops[1], 16) || is_vec(ops[1], 32)))
+        fail("bad operands for 'vmovmskpd'");
+      emit_vex(enc.pp, enc.map, false, ops[1].size == 32, 0, enc.load, ops[0].reg.num, ops[1]);
+      return true;
+    }
+    bool dst_ok = is_vec(ops[0], 16) || is_vec(ops[0], 32);
+    bool src_ok = mnemonic == "vpbroadcastq" ? is_vec(ops[1], 16) || ops[1].kind == OperandKind::Mem
+                                             : is_vec(ops[1], ops[0].size) || ops[1].kind == OperandKind::Mem;
+    if (!dst_ok || !src_ok)
+      fail("bad operands for '" + mnemonic + "'");
+    emit_vex(enc.pp, enc.map, false, ops[0].size == 32, 0, enc.load, ops[0].reg.num, ops[1]);
+    return true;
+  }
+
+  void branch(uint8_t cond, const Expr &target)
+  {
+    if (!target.symbol || target.value != 0)
+      fail("jump target must be a label");
+    SectionState &sec = sections[section];
+    Fragment frag{};
+    frag.pos = sec.bytes.size();
+    frag.is_align = false;
+    frag.cond = cond;
+    frag.target = *target.symbol;
+    sec.frags.push_back(frag);
+  }
+
+  void encode_alu(uint8_t ext, Operand dst, Operand src)
+  {
+    uint8_t size = operand_size(dst, src);
+    uint8_t base = static_cast<uint8_t>(ext << 3);
+    uint8_t wide = size == 1 ? 0 : 1;
+    if (src.kind == OperandKind::Imm)
+    {
+      if (dst.kind == OperandKind::Imm)
+        fail("bad operands");
+      if (size != 1 && !src.imm.symbol && fits8(src.imm.value))
+      {
+        emit_modrm({0x83}, ext, dst, size, false, false, 1);
+        emit_imm(src.imm.value, 1);
+        return;
+      }
+      int bytes = size == 1 ? 1 : size == 2 ? 2
+                                            : 4;
+      if (size == 8 && !src.imm.symbol && !fits32(src.imm.value))
+        fail("immediate does not fit in 32 bits");
+      emit_modrm({static_cast<uint8_t>(size == 1 ? 0x80 : 0x81)}, ext, dst, size, false, false, bytes);
+      emit_fixup(src.imm, RelocType::Abs32S, bytes);
+      return;
+    }
+    if (src.kind == OperandKind::Reg)
+    {
+      emit_modrm_reg({static_cast<uint8_t>(base + wide)}, src.reg, dst, size);
+      return;
+    }
+    if (dst.kind != OperandKind::Reg)
+      fail("bad operands");
+    emit_modrm_reg({static_cast<uint8_t>(base + 2 + wide)}, dst.reg, src, size);
+  }
+
+  void encode_mov(Operand dst, Operand src)
+  {
+    uint8_t size = operand_size(dst, src);
+    if (src.kind == OperandKind::Imm)
+    {
+      if (dst.kind == OperandKind::Reg)
+      {
+        uint8_t rex_b = dst.reg.num & 8 ? 0x01 : 0x00;
+        int64_t v = src.imm.value;
+        if (size == 8 && (src.imm.symbol || (!fits32(v) && (v < 0 || v > UINT32_MAX))))
+        {
+          // mov r64, imm64
+          emit(static_cast<uint8_t>(0x48 | rex_b));
+          emit(static_cast<uint8_t>(0xB8 + (dst.reg.num & 7)));
+          emit_fixup(src.imm, RelocType::Abs64, 8);
+          return;
+        }
+        if (size == 8 && v < 0)
+        {
+          // mov r/m64, imm32 (sign-extended)
+          emit_modrm({0xC7}, 0, dst, 8, false, false, 4);
+          emit_imm(v, 4);
+          return;
+        }
+        if (size == 1)
+        {
+          if (rex_b || dst.reg.needs_rex)
+          {
+            if (dst.reg.high_byte)
+              fail("ah/bh/ch/dh cannot be used with a REX prefix");
+            emit(static_cast<uint8_t>(0x40 | rex_b));
+          }
+          emit(static_cast<uint8_t>(0xB0 + (dst.reg.num & 7)));
+          emit_imm(v, 1);
+          return;
+        }
+        // mov r32, imm32 zero-extends, which also covers 64-bit values
+        // in [0, 2^32).
+        if (size == 2)
+          emit(0x66);
+        if (rex_b)
+          emit(static_cast<uint8_t>(0x40 | rex_b));
+        emit(static_cast<uint8_t>(0xB8 + (dst.reg.num & 7)));
+        emit_fixup(src.imm, RelocType::Abs32S, size == 2 ? 2 : 4);
+        return;
+      }
+      if (dst.kind != OperandKind::Mem)
+        fail("bad operands");
+      int bytes = size == 1 ? 1 : size == 2 ? 2
+                                            : 4;
+      if (size == 8 && !src.imm.symbol && !fits32(src.imm.value))
+        fail("immediate does not fit in 32 bits");
+      emit_modrm({static_cast<uint8_t>(size == 1 ? 0xC6 : 0xC7)}, 0, dst, size, false, false, bytes);
+      emit_fixup(src.imm, RelocType::Abs32S, bytes);
+      return;
+    }
+    uint8_t wide = size == 1 ? 0 : 1;
+    if (src.kind == OperandKind::Reg)
+    {
+      emit_modrm_reg({static_cast<uint8_t>(0x88 + wide)}, src.reg, dst, size);
+      return;
+    }
+    if (dst.kind != OperandKind::Reg)
+      fail("bad operands");
+    emit_modrm_reg({static_cast<uint8_t>(0x8A + wide)}, dst.reg, src, size);
+  }
+
+  void encode_push_pop(bool push, const Operand &op)
+  {
+    if (op.kind == OperandKind::Reg)
+    {
+      if (op.size != 8)
+        fail("push/pop needs a 64-bit register");
+      if (op.reg.num & 8)
+        emit(0x41);
+      emit(static_cast<uint8_t>((push ? 0x50 : 0x58) + (op.reg.num & 7)));
+      return;
+    }
+    if (op.kind == OperandKind::Mem)
+    {
+      if (op.size != 0 && op.size != 8)
+        fail("push/pop needs a qword operand");
+      emit_modrm({static_cast<uint8_t>(push ? 0xFF : 0x8F)}, push ? 6 : 0, op, 8, false, false, 0, true);
+      return;
+    }
+    if (!push)
+      fail("cannot pop into an immediate");
+    if (!op.imm.symbol && fits8(op.imm.value))
+    {
+      emit(0x6A);
+      emit_imm(op.imm.value, 1);
+      return;
+    }
+    emit(0x68);
+    emit_fixup(op.imm, RelocType::Abs32S, 4);
+  }
+
+  void encode_imul(Operand *ops, size_t count)
+  {
+    if (count == 1)
+    {
+      uint8_t size = ops[0].size;
+      if (size == 0)
+        fail("operation size not specified");
+      emit_modrm({static_cast<uint8_t>(size == 1 ? 0xF6 : 0xF7)}, 5, ops[0], size);
+      return;
+    }
+    if (ops[0].kind != OperandKind::Reg || ops[0].size == 1)
+      fail("imul needs a register destination");
+    if (count == 2 && ops[1].kind != OperandKind::Imm)
+    {
+      emit_modrm_reg({0x0F, 0xAF}, ops[0].reg, ops[1], ops[0].size);
+      return;
+    }
+    const Operand &src = count == 2 ? ops[0] : ops[1];
+    const Operand &imm = count == 2 ? ops[1] : ops[2];
+    if (imm.kind != OperandKind::Imm || imm.imm.symbol)
+      fail("bad imul operands");
+    if (fits8(imm.imm.value))
+    {
+      emit_modrm_reg({0x6B}, ops[0].reg, src, ops[0].size, 1);
+      emit_imm(imm.imm.value, 1);
+      return;
+    }
+    if (!fits32(imm.imm.value))
+      fail("immediate does not fit in 32 bits");
+    emit_modrm_reg({0x69}, ops[0].reg, src, ops[0].size, 4);
+    emit_imm(imm.imm.value, 4);
+  }
+
+  std::vector<SectionState> sections;
+  size_t section = 0;
+  std::vector<SymbolState> symbols;
+  std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>> symbol_index;
+  std::unordered_map<std::string, int64_t> constants;
+  std::string last_global;
+  bool default_rel = false;
+  size_t line_no = 0;
+  size_t instruction_count = 0;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include "./diagnostics.hpp"
+#include "./workStealingPool.hpp"
+
+// Compiles many programs in one run of the compiler. The programs are
+// compiled in process by a work-stealing pool of threads, each job with
+// its own syntax tree arena, assembly buffer and diagnostics stream; a
+// compile error fails that job alone, and what it wrote to its stream is
+// shown with its failure in the report.
+class BatchCompiler
+{
+public:
+  // Compiles the program at `input_path` to an executable at
+  // `output_path`, writing any errors to diagnostics(), and returns its
+  // exit status.
+  using Compile = std::function<int(const char *input_path, const char *output_path)>;
+
+  // At most `workers` jobs run at a time, and no more workers are started
+  // than there are jobs.
+  BatchCompiler(size_t workers, Compile compile)
+      : max_workers(workers), compile(std::move(compile)) {}
+
+  void add(std::string input_path)
+  {
+    Job job;
+    job.input = std::move(input_path);
+    jobs.push_back(std::move(job));
+  }
+
+  // Adds the inputs listed in a manifest, one path per line. Blank lines
+  // and lines starting with '#' are skipped.
+  void add_manifest(const char *manifest_path)
+  {
+    std::ifstream manifest(manifest_path);
+    if (!manifest)
+    {
+      std::cerr << "Error: could not open manifest " << manifest_path << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (line.empty() || line[0] == '#')
+        continue;
+      add(line);
+    }
+  }
+
+  size_t size() const
+  {
+    return jobs.size();
+  }
+
+  // Gives every job its executable: the input path without its extension,
+  // or that name inside `out_dir` if one is given.
+  void assign_outputs(const char *out_dir)
+  {
+    if (out_dir != nullptr && mkdir(out_dir, 0755) != 0 && errno != EEXIST)
+    {
+      std::cerr << "Error: could not create " << out_dir << ": " << std::strerror(errno) << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::unordered_map<std::string, const Job *> owners;
+    for (Job &job : jobs)
+    {
+      std::string name = job.input;
+      size_t base = name.rfind('/') == std::string::npos ? 0 : name.rfind('/') + 1;
+      size_t dot = name.rfind('.');
+      if (dot != std::string::npos && dot > base)
+        name.erase(dot);
+      if (out_dir != nullptr)
+        name = std::string(out_dir) + "/" + name.substr(base);
+      if (name == job.input)
+        name += ".out";
+      auto [owner, inserted] = owners.try_emplace(name, &job);
+      if (!inserted)
+      {
+        std::cerr << "Error: " << owner->second->input << " and " << job.input
+                  << " would both be compiled to " << name << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      job.output = std::move(name);
+    }
+  }
+
+  // Compiles every job and prints the report. Returns EXIT_SUCCESS if all
+  // of them compiled.
+  int run()
+  {
+    auto start = std::chrono::steady_clock::now();
+    WorkStealingPool pool(std::min(max_workers, jobs.size()));
+    pool.run(jobs.size(), [this](size_t i)
+             { run_job(jobs[i]); });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0;
+    uint64_t bytes = 0;
+    for (const Job &job : jobs)
+    {
+      bytes += job.bytes;
+      if (job.status == 0)
+        continue;
+      failed++;
+      std::string message = job.diagnostics.substr(0, job.diagnostics.find('\n'));
+      std::cout << "failed: " << job.input << " (exit " << job.status << ")";
+      if (!message.empty())
+        std::cout << ": " << message;
+      std::cout << "\n";
+    }
+    char rates[128];
+    std::snprintf(rates, sizeof(rates), "%.3f s on %zu workers (%.1f programs/s, %.2f MB/s of source",
+                  seconds, pool.workers(), jobs.size() / seconds, bytes / seconds / 1e6);
+    std::cout << "compiled " << jobs.size() - failed << " of " << jobs.size() << " programs in " << rates
+              << ", " << pool.steals() << " jobs stolen)\n";
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+private:
+  struct Job
+  {
+    std::string input;
+    std::string output;
+    int status = 0;
+    std::string diagnostics;
+    uint64_t bytes = 0;
+  };
+
+  void run_job(Job &job)
+  {
+    struct stat st;
+    if (stat(job.input.c_str(), &st) == 0)
+      job.bytes = st.st_size;
+
+    std::ostringstream errors;
+    diagnostics_stream() = &errors;
+    job.status = compile(job.input.c_str(), job.output.c_str());
+    diagnostics_stream() = &std::cerr;
+    job.diagnostics = errors.str();
+  }
+
+  std::vector<Job> jobs;
+  size_t max_workers;
+  Compile compile;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+// Fixed-capacity queue between two pipeline stages running on different
+// threads. The producer blocks while the queue is full, so a fast stage
+// can only run a bounded distance ahead of a slow one, and closes the
+// queue when it is done; the consumer blocks while it is empty and sees
+// nothing once it is closed and drained. A consumer that stops early
+// cancels the queue, which drops what is queued and every later push, so
+// the producer is never left waiting for room.
+template <typename T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+  BoundedQueue(const BoundedQueue &other) = delete;
+  BoundedQueue &operator=(const BoundedQueue &other) = delete;
+
+  // Returns false, dropping `item`, once the queue has been cancelled.
+  bool push(T item)
+  {
+    std::unique_lock lock(mutex);
+    not_full.wait(lock, [this]
+                  { return items.size() < capacity || cancelled; });
+    if (cancelled)
+      return false;
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  void close()
+  {
+    std::lock_guard lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+  void cancel()
+  {
+    std::lock_guard lock(mutex);
+    cancelled = true;
+    items.clear();
+    not_full.notify_all();
+  }
+
+  std::optional<T> pop()
+  {
+    std::unique_lock lock(mutex);
+    not_empty.wait(lock, [this]
+                   { return !items.empty() || closed; });
+    if (items.empty())
+      return std::nullopt;
+    T item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return item;
+  }
+
+private:
+  const size_t capacity;
+  std::deque<T> items;
+  bool closed = false;
+  bool cancelled = false;
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
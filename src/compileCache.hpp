@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./diagnostics.hpp"
+
+// On-disk cache of compiled executables, so an unchanged program compiles
+// to a copy of its last executable without being lexed, parsed or
+// assembled again. An entry is found by a hash of its key: the identity
+// of the compiler binary, the options that affect code generation, any
+// profile and the source text. The entry also stores the key itself and
+// is only used if that matches in full, so a hash collision costs a
+// recompile and nothing more.
+//
+// Entries are written to a temporary file and renamed into place, so
+// compilers sharing the cache never see half an entry. Reading an entry
+// touches its modification time, and once the cache outgrows its limit
+// the least recently used entries are removed.
+class CompileCache
+{
+public:
+  static constexpr size_t default_max_bytes = 256 * 1024 * 1024;
+
+  CompileCache(std::string directory, size_t max_bytes) : dir(std::move(directory)), max_size(max_bytes)
+  {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+      diagnostics() << "Error: could not create cache " << dir << ": " << std::strerror(errno) << std::endl;
+      throw CompileError();
+    }
+  }
+
+  // Starts a key with what identifies the running compiler. Any rebuild
+  // of the compiler replaces its binary, which invalidates every entry.
+  static std::string new_key()
+  {
+    std::string key = "mycompiler cache 1\n";
+    struct stat st;
+    if (stat("/proc/self/exe", &st) == 0)
+    {
+      key += std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":" +
+             std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+    }
+    key += "\n";
+    return key;
+  }
+
+  // Appends a length-prefixed field, so no two sequences of fields run
+  // together into the same key.
+  static void add_field(std::string &key, std::string_view field)
+  {
+    key += std::to_string(field.size());
+    key += ':';
+    key += field;
+  }
+
+  // Copies the executable cached for `key` to `output_path`. Returns false
+  // if there is none.
+  bool fetch(const std::string &key, const char *output_path) const
+  {
+    std::string path = entry_path(key);
+    std::string entry;
+    if (!read_file(path, entry) || entry.size() < key.size() || entry.compare(0, key.size(), key) != 0)
+      return false;
+    if (!write_atomically(output_path, std::string_view(entry).substr(key.size()), 0755))
+      return false;
+    // Mark the entry as recently used.
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return true;
+  }
+
+  // Caches the executable at `output_path` under `key`. Failing to store
+  // an entry is not an error; the next compile just misses.
+  void store(const std::string &key, const char *output_path) const
+  {
+    std::string executable;
+    if (!read_file(output_path, executable))
+      return;
+    if (write_atomically(entry_path(key), key + executable, 0644))
+    {
+      evict();
+    }
+  }
+
+private:
+  std::string entry_path(const std::string &key) const
+  {
+    uint64_t h = 0xcbf29ce484222325;
+    for (char c : key)
+    {
+      h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+    }
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(h));
+    return dir + "/" + name;
+  }
+
+  // Removes the least recently used finished entries until the cache fits.
+  void evict() const
+  {
+    struct Entry
+    {
+      std::string path;
+      size_t size;
+      struct timespec used;
+    };
+    std::vector<Entry> entries;
+    size_t total = 0;
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr)
+      return;
+    while (struct dirent *ent = readdir(d))
+    {
+      // Temporary files are entries another compiler is still writing;
+      // they are neither counted nor removed.
+      if (ent->d_name[0] == '.' || std::strstr(ent->d_name, ".tmp") != nullptr)
+        continue;
+      std::string path = dir + "/" + ent->d_name;
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        continue;
+      entries.push_back({path, static_cast<size_t>(st.st_size), st.st_mtim});
+      total += st.st_size;
+    }
+    closedir(d);
+    if (total <= max_size)
+      return;
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+              { return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec; });
+    for (const Entry &entry : entries)
+    {
+      if (total <= max_size)
+        break;
+      // Another compiler may have removed it already.
+      unlink(entry.path.c_str());
+      total -= entry.size;
+    }
+  }
+
+  static bool read_file(const std::string &path, std::string &contents)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok)
+    {
+      contents.resize(st.st_size);
+      size_t done = 0;
+      while (ok && done < contents.size())
+      {
+        ssize_t n = read(fd, contents.data() + done, contents.size() - done);
+        if (n < 0 && errno == EINTR)
+          continue;
+        ok = n > 0;
+        done += ok ? static_cast<size_t>(n) : 0;
+      }
+    }
+    close(fd);
+    return ok;
+  }
+
+  // Writes `data` next to `path` and renames it into place. The temporary
+  // file is named after the thread, as the jobs of a batch share a process.
+  static bool write_atomically(const std::string &path, std::string_view data, mode_t mode)
+  {
+    std::string tmp = path + ".tmp" + std::to_string(gettid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0)
+      return false;
+    bool ok = true;
+    while (ok && !data.empty())
+    {
+      ssize_t n = write(fd, data.data(), data.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      ok = n > 0;
+      data.remove_prefix(ok ? static_cast<size_t>(n) : 0);
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+      unlink(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  std::string dir;
+  size_t max_size;
+};
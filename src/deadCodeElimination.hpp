@@ -0,0 +1,636 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <variant>
+#include "./parser.hpp"
+#include "./rangeAnalysis.hpp"
+
+// Prunes the AST before code generation: statements that follow an `exit`
+// or `return` on every path, if/elif arms and loops whose condition is constant, and
+// let/const definitions that are never read and whose initialiser (and
+// every assignment) can neither fail at runtime nor fail to type-check. An
+// array that is never read goes with all of its element stores, as long as
+// each store is provably in bounds.
+class DeadCodeEliminator
+{
+public:
+  struct Stats
+  {
+    size_t unreachable_stmts = 0;
+    size_t folded_branches = 0;
+    size_t unused_defs = 0;
+  };
+
+  DeadCodeEliminator(NodeProg &program, const RangeAnalyser &range_analyser)
+      : prog(program), ranges(range_analyser) {}
+
+  void run()
+  {
+    prune_stmts(prog.stmts);
+    for (NodeFunc *func : prog.funcs)
+    {
+      prune_stmts(func->body->stmts);
+    }
+    while (find_unused_defs())
+    {
+      remove_stmts(prog.stmts);
+      for (NodeFunc *func : prog.funcs)
+      {
+        remove_stmts(func->body->stmts);
+      }
+    }
+  }
+
+  const Stats &stats() const
+  {
+    return dce_stats;
+  }
+
+private:
+  struct Decl
+  {
+    NodeStmt *stmt;
+    DataType dtype;
+    bool mut;
+    size_t reads = 0;
+    bool removable = true;
+    std::vector<NodeStmt *> assigns;
+  };
+
+  // Removes unreachable statements from `stmts` and folds constant
+  // conditions. Returns true if control can never reach the end of the list.
+  bool prune_stmts(std::vector<NodeStmt *> &stmts)
+  {
+    for (size_t i = 0; i < stmts.size(); i++)
+    {
+      if (prune_stmt(stmts[i]))
+      {
+        dce_stats.unreachable_stmts += stmts.size() - i - 1;
+        stmts.resize(i + 1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns true if the statement never completes normally.
+  bool prune_stmt(NodeStmt *stmt)
+  {
+    if (std::holds_alternative<NodeStmtExit *>(stmt->stmt) || std::holds_alternative<NodeStmtReturn *>(stmt->stmt))
+    {
+      return true;
+    }
+    if (auto *stmt_scope = std::get_if<NodeStmtScope *>(&stmt->stmt))
+    {
+      return prune_stmts((*stmt_scope)->stmts);
+    }
+    if (auto *stmt_if = std::get_if<NodeStmtIf *>(&stmt->stmt))
+    {
+      return prune_if(stmt, *stmt_if);
+    }
+    if (auto *stmt_while = std::get_if<NodeStmtWhile *>(&stmt->stmt))
+    {
+      return prune_loop(stmt, (*stmt_while)->expr, (*stmt_while)->scope, nullptr);
+    }
+    if (auto *stmt_for = std::get_if<NodeStmtFor *>(&stmt->stmt))
+    {
+      return prune_loop(stmt, (*stmt_for)->cond, (*stmt_for)->scope, (*stmt_for)->init);
+    }
+    return false;
+  }
+
+  // A loop whose condition is never true is replaced by its initialiser, if
+  // any. A loop whose condition is never false can only be left by exit or
+  // return.
+  bool prune_loop(NodeStmt *stmt, const NodeExpr *cond_expr, NodeStmtScope *scope, NodeStmt *init)
+  {
+    Range cond = ranges.range_of(cond_expr).value_or(Range::full());
+    if (cond == Range::constant(0) && is_pure(cond_expr))
+    {
+      dce_stats.folded_branches++;
+      scope->stmts.clear();
+      if (init != nullptr)
+      {
+        scope->stmts.push_back(init);
+      }
+      stmt->stmt = scope;
+      return false;
+    }
+    prune_stmts(scope->stmts);
+    return !cond.contains(0);
+  }
+
+  bool prune_if(NodeStmt *stmt, NodeStmtIf *stmt_if)
+  {
+    Range cond = ranges.range_of(stmt_if->expr).value_or(Range::full());
+    bool pure = is_pure(stmt_if->expr);
+
+    if (cond == Range::constant(0) && pure)
+    {
+      // The arm is never taken: hoist the continuation into its place.
+      dce_stats.folded_branches++;
+      if (!stmt_if->cont.has_value())
+      {
+        stmt->stmt = empty_scope(stmt_if->scope);
+        return false;
+      }
+      if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&stmt_if->cont.value()->clause))
+      {
+        stmt_if->expr = (*stmt_elif)->expr;
+        stmt_if->scope = (*stmt_elif)->scope;
+        stmt_if->cont = (*stmt_elif)->cont;
+        return prune_if(stmt, stmt_if);
+      }
+      stmt->stmt = std::get<NodeStmtElse *>(stmt_if->cont.value()->clause)->scope;
+      return prune_stmt(stmt);
+    }
+    if (!cond.contains(0))
+    {
+      // The arm is always taken: the continuation is dead.
+      if (stmt_if->cont.has_value())
+      {
+        dce_stats.folded_branches++;
+        stmt_if->cont = std::nullopt;
+      }
+      if (pure)
+      {
+        stmt->stmt = stmt_if->scope;
+      }
+      return prune_stmts(stmt_if->scope->stmts);
+    }
+
+    bool terminates = prune_stmts(stmt_if->scope->stmts);
+    return prune_cont(stmt_if->cont) && terminates;
+  }
+
+  // Prunes an elif/else chain. Returns true if every remaining arm of the
+  // chain terminates (a chain without a final else never does).
+  bool prune_cont(std::optional<NodeStmtIfCont *> &cont)
+  {
+    if (!cont.has_value())
+    {
+      return false;
+    }
+    if (auto *stmt_else = std::get_if<NodeStmtElse *>(&cont.value()->clause))
+    {
+      return prune_stmts((*stmt_else)->scope->stmts);
+    }
+    NodeStmtElif *stmt_elif = std::get<NodeStmtElif *>(cont.value()->clause);
+    Range cond = ranges.range_of(stmt_elif->expr).value_or(Range::full());
+    if (cond == Range::constant(0) && is_pure(stmt_elif->expr))
+    {
+      dce_stats.folded_branches++;
+      cont = stmt_elif->cont;
+      return prune_cont(cont);
+    }
+    if (!cond.contains(0) && stmt_elif->cont.has_value())
+    {
+      dce_stats.folded_branches++;
+      stmt_elif->cont = std::nullopt;
+    }
+    bool terminates = prune_stmts(stmt_elif->scope->stmts);
+    return prune_cont(stmt_elif->cont) && terminates;
+  }
+
+  NodeStmtScope *empty_scope(NodeStmtScope *scope)
+  {
+    scope->stmts.clear();
+    return scope;
+  }
+
+  // An expression is pure if none of its runtime checks can fire.
+  bool is_pure(const NodeExpr *expr) const
+  {
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      return is_pure(*term);
+    }
+    const NodeBinExpr *bin_expr = std::get<NodeBinExpr *>(expr->var);
+    return std::visit(
+        [this](const auto *op)
+        {
+          using Op = std::remove_cv_t<std::remove_pointer_t<decltype(op)>>;
+          if constexpr (std::is_same_v<Op, NodeBinExprAdd> || std::is_same_v<Op, NodeBinExprSub> || std::is_same_v<Op, NodeBinExprMul>)
+          {
+            if (!ranges.no_overflow(op))
+              return false;
+          }
+          if constexpr (std::is_same_v<Op, NodeBinExprDiv> || std::is_same_v<Op, NodeBinExprMod>)
+          {
+            if (!ranges.nonzero_divisor(op))
+              return false;
+          }
+          return is_pure(op->lhs) && is_pure(op->rhs);
+        },
+        bin_expr->op);
+  }
+
+  bool is_pure(const NodeTerm *term) const
+  {
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return is_pure((*term_paren)->expr);
+    }
+    if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      return is_pure((*term_unary)->operand);
+    }
+    if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      return ranges.in_bounds(*term_index) && is_pure((*term_index)->index);
+    }
+    return !std::holds_alternative<NodeTermCall *>(term->val);
+  }
+
+  // Type of an expression under the generator's typing rules, or nothing if
+  // the generator would reject it.
+  std::optional<DataType> infer(const NodeExpr *expr) const
+  {
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      return infer(*term);
+    }
+    const NodeBinExpr *bin_expr = std::get<NodeBinExpr *>(expr->var);
+    return std::visit(
+        [this](const auto *op) -> std::optional<DataType>
+        {
+          using Op = std::remove_cv_t<std::remove_pointer_t<decltype(op)>>;
+          std::optional<DataType> lhs = infer(op->lhs);
+          std::optional<DataType> rhs = infer(op->rhs);
+          if (!lhs.has_value() || !rhs.has_value())
+            return std::nullopt;
+          if constexpr (std::is_same_v<Op, NodeBinExprEq> || std::is_same_v<Op, NodeBinExprNeq>)
+          {
+            return lhs == rhs ? std::optional(DataType::Bool) : std::nullopt;
+          }
+          else if constexpr (std::is_same_v<Op, NodeBinExprAnd>)
+          {
+            bool ok = (lhs == DataType::Int || lhs == DataType::Bool) && (rhs == DataType::Int || rhs == DataType::Bool);
+            return ok ? std::optional(DataType::Bool) : std::nullopt;
+          }
+          else
+          {
+            if (lhs != DataType::Int || rhs != DataType::Int)
+              return std::nullopt;
+            if constexpr (std::is_same_v<Op, NodeBinExprLt> || std::is_same_v<Op, NodeBinExprGt> || std::is_same_v<Op, NodeBinExprLte> || std::is_same_v<Op, NodeBinExprGte> || std::is_same_v<Op, NodeBinExprOr>)
+              return DataType::Bool;
+            return DataType::Int;
+          }
+        },
+        bin_expr->op);
+  }
+
+  std::optional<DataType> infer(const NodeTerm *term) const
+  {
+    if (auto *term_lit = std::get_if<NodeTermLit *>(&term->val))
+    {
+      switch ((*term_lit)->token.type)
+      {
+      case TokenType::int_lit:
+        return DataType::Int;
+      case TokenType::char_lit:
+        return DataType::Char;
+      case TokenType::bool_lit:
+        return DataType::Bool;
+      default:
+        return std::nullopt;
+      }
+    }
+    if (auto *term_ident = std::get_if<NodeTermIdent *>(&term->val))
+    {
+      // An array is only a value when indexed.
+      const Decl *decl = lookup((*term_ident)->ident.val.value());
+      if (decl != nullptr && decl->dtype != DataType::IntArray)
+      {
+        return decl->dtype;
+      }
+      return std::nullopt;
+    }
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return infer((*term_paren)->expr);
+    }
+    if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      const Decl *decl = lookup((*term_index)->ident.val.value());
+      bool ok = decl != nullptr && decl->dtype == DataType::IntArray && infer((*term_index)->index) == DataType::Int;
+      return ok ? std::optional(DataType::Int) : std::nullopt;
+    }
+    if (std::holds_alternative<NodeTermCall *>(term->val))
+    {
+      // Impure anyway, so the type is never needed.
+      return std::nullopt;
+    }
+    const NodeTermUnary *term_unary = std::get<NodeTermUnary *>(term->val);
+    std::optional<DataType> operand = infer(term_unary->operand);
+    if (term_unary->op == UnaryOp::Negate)
+    {
+      return operand == DataType::Int ? operand : std::nullopt;
+    }
+    bool ok = operand == DataType::Int || operand == DataType::Bool;
+    return ok ? std::optional(DataType::Bool) : std::nullopt;
+  }
+
+  // Resolves every read against the live definitions and collects the ones
+  // that can be dropped. Returns true if any were found.
+  bool find_unused_defs()
+  {
+    decls.clear();
+    scopes.clear();
+    dead.clear();
+    visit_stmts(prog.stmts);
+    for (const NodeFunc *func : prog.funcs)
+    {
+      scopes.push_back({});
+      for (const NodeParam &param : func->params)
+      {
+        declare(param.ident.val.value(), Decl{nullptr, param.dtype, true, 0, false, {}});
+      }
+      visit_stmts(func->body->stmts);
+      scopes.pop_back();
+    }
+    for (Decl &decl : decls)
+    {
+      if (decl.reads != 0 || !decl.removable)
+        continue;
+      dce_stats.unused_defs++;
+      dead.insert(decl.stmt);
+      dead.insert(decl.assigns.begin(), decl.assigns.end());
+    }
+    return !dead.empty();
+  }
+
+  void visit_stmts(const std::vector<NodeStmt *> &stmts)
+  {
+    scopes.push_back({});
+    for (NodeStmt *stmt : stmts)
+    {
+      visit_stmt(stmt);
+    }
+    scopes.pop_back();
+  }
+
+  void visit_stmt(NodeStmt *stmt)
+  {
+    struct StmtVisitor
+    {
+      DeadCodeEliminator *dce;
+      NodeStmt *stmt;
+      void operator()(const NodeStmtExit *stmt_exit) const
+      {
+        dce->visit_expr(stmt_exit->expr);
+      }
+      void operator()(const NodeStmtPrint *stmt_print) const
+      {
+        dce->visit_expr(stmt_print->expr);
+      }
+      void operator()(const NodeStmtReturn *stmt_return) const
+      {
+        dce->visit_expr(stmt_return->expr);
+      }
+      void operator()(const NodeStmtCall *stmt_call) const
+      {
+        dce->visit_call(stmt_call->call);
+      }
+      void operator()(const NodeStmtIf *stmt_if) const
+      {
+        dce->visit_expr(stmt_if->expr);
+        dce->visit_stmts(stmt_if->scope->stmts);
+        std::optional<NodeStmtIfCont *> cont = stmt_if->cont;
+        while (cont.has_value())
+        {
+          if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+          {
+            dce->visit_expr((*stmt_elif)->expr);
+            dce->visit_stmts((*stmt_elif)->scope->stmts);
+            cont = (*stmt_elif)->cont;
+          }
+          else
+          {
+            dce->visit_stmts(std::get<NodeStmtElse *>(cont.value()->clause)->scope->stmts);
+            cont = std::nullopt;
+          }
+        }
+      }
+      void operator()(const NodeStmtConst *stmt_const) const
+      {
+        dce->visit_expr(stmt_const->expr);
+        bool ok = dce->is_pure(stmt_const->expr) && dce->infer(stmt_const->expr) == stmt_const->dtype;
+        dce->declare(stmt_const->ident.val.value(), Decl{stmt, stmt_const->dtype, false, 0, ok, {}});
+      }
+      void operator()(const NodeStmtLet *stmt_let) const
+      {
+        bool ok = true;
+        if (stmt_let->expr.has_value())
+        {
+          dce->visit_expr(stmt_let->expr.value());
+          ok = dce->is_pure(stmt_let->expr.value()) && dce->infer(stmt_let->expr.value()) == stmt_let->dtype;
+        }
+        dce->declare(stmt_let->ident.val.value(), Decl{stmt, stmt_let->dtype, true, 0, ok, {}});
+      }
+      void operator()(const NodeStmtAssign *stmt_assign) const
+      {
+        dce->visit_expr(stmt_assign->expr);
+        if (Decl *decl = dce->lookup(stmt_assign->ident.val.value()))
+        {
+          decl->assigns.push_back(stmt);
+          if (!decl->mut || !dce->is_pure(stmt_assign->expr) || dce->infer(stmt_assign->expr) != decl->dtype)
+          {
+            decl->removable = false;
+          }
+        }
+      }
+      void operator()(const NodeStmtAssignIndex *stmt_assign_index) const
+      {
+        dce->visit_expr(stmt_assign_index->index);
+        dce->visit_expr(stmt_assign_index->expr);
+        if (Decl *decl = dce->lookup(stmt_assign_index->ident.val.value()))
+        {
+          decl->assigns.push_back(stmt);
+          bool ok = decl->dtype == DataType::IntArray && dce->ranges.in_bounds(stmt_assign_index) &&
+                    dce->is_pure(stmt_assign_index->index) && dce->is_pure(stmt_assign_index->expr) &&
+                    dce->infer(stmt_assign_index->index) == DataType::Int &&
+                    dce->infer(stmt_assign_index->expr) == DataType::Int;
+          if (!ok)
+          {
+            decl->removable = false;
+          }
+        }
+      }
+      void operator()(const NodeStmtScope *stmt_scope) const
+      {
+        dce->visit_stmts(stmt_scope->stmts);
+      }
+      void operator()(const NodeStmtWhile *stmt_while) const
+      {
+        dce->visit_expr(stmt_while->expr);
+        dce->visit_stmts(stmt_while->scope->stmts);
+      }
+      void operator()(const NodeStmtFor *stmt_for) const
+      {
+        // The initialiser and step cannot be removed from the loop, so
+        // neither can the variables they define or assign.
+        dce->scopes.push_back({});
+        dce->visit_stmt(stmt_for->init);
+        dce->keep_target(stmt_for->init);
+        dce->visit_expr(stmt_for->cond);
+        dce->visit_stmts(stmt_for->scope->stmts);
+        dce->visit_stmt(stmt_for->step);
+        dce->keep_target(stmt_for->step);
+        dce->scopes.pop_back();
+      }
+    };
+    StmtVisitor visitor{this, stmt};
+    std::visit(visitor, stmt->stmt);
+  }
+
+  // Marks the variable defined or assigned by `stmt` as not removable.
+  void keep_target(const NodeStmt *stmt)
+  {
+    std::string name;
+    if (auto *stmt_let = std::get_if<NodeStmtLet *>(&stmt->stmt))
+      name = (*stmt_let)->ident.val.value();
+    else if (auto *stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->stmt))
+      name = (*stmt_assign)->ident.val.value();
+    if (Decl *decl = lookup(name))
+    {
+      decl->removable = false;
+    }
+  }
+
+  void visit_expr(const NodeExpr *expr)
+  {
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      visit_term(*term);
+      return;
+    }
+    std::visit(
+        [this](const auto *op)
+        {
+          visit_expr(op->lhs);
+          visit_expr(op->rhs);
+        },
+        std::get<NodeBinExpr *>(expr->var)->op);
+  }
+
+  void visit_term(const NodeTerm *term)
+  {
+    if (auto *term_ident = std::get_if<NodeTermIdent *>(&term->val))
+    {
+      if (Decl *decl = lookup((*term_ident)->ident.val.value()))
+      {
+        decl->reads++;
+      }
+    }
+    else if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      visit_expr((*term_paren)->expr);
+    }
+    else if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      visit_term((*term_unary)->operand);
+    }
+    else if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      visit_expr((*term_index)->index);
+      if (Decl *decl = lookup((*term_index)->ident.val.value()))
+      {
+        decl->reads++;
+      }
+    }
+    else if (auto *term_call = std::get_if<NodeTermCall *>(&term->val))
+    {
+      visit_call(*term_call);
+    }
+  }
+
+  void visit_call(const NodeTermCall *call)
+  {
+    for (const NodeExpr *arg : call->args)
+    {
+      visit_expr(arg);
+    }
+  }
+
+  void declare(const std::string &name, Decl decl)
+  {
+    auto &scope = scopes.back();
+    auto it = scope.find(name);
+    if (it != scope.end())
+    {
+      // Redeclaration is reported by the generator; keep both definitions.
+      decls[it->second].removable = false;
+      decl.removable = false;
+    }
+    decls.push_back(std::move(decl));
+    scope[name] = decls.size() - 1;
+  }
+
+  Decl *lookup(const std::string &name)
+  {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+    {
+      auto found = it->find(name);
+      if (found != it->end())
+      {
+        return &decls[found->second];
+      }
+    }
+    return nullptr;
+  }
+
+  const Decl *lookup(const std::string &name) const
+  {
+    return const_cast<DeadCodeEliminator *>(this)->lookup(name);
+  }
+
+  void remove_stmts(std::vector<NodeStmt *> &stmts)
+  {
+    std::erase_if(stmts, [this](NodeStmt *stmt)
+                  { return dead.contains(stmt); });
+    for (NodeStmt *stmt : stmts)
+    {
+      if (auto *stmt_scope = std::get_if<NodeStmtScope *>(&stmt->stmt))
+      {
+        remove_stmts((*stmt_scope)->stmts);
+      }
+      else if (auto *stmt_while = std::get_if<NodeStmtWhile *>(&stmt->stmt))
+      {
+        remove_stmts((*stmt_while)->scope->stmts);
+      }
+      else if (auto *stmt_for = std::get_if<NodeStmtFor *>(&stmt->stmt))
+      {
+        remove_stmts((*stmt_for)->scope->stmts);
+      }
+      else if (auto *stmt_if = std::get_if<NodeStmtIf *>(&stmt->stmt))
+      {
+        remove_stmts((*stmt_if)->scope->stmts);
+        std::optional<NodeStmtIfCont *> cont = (*stmt_if)->cont;
+        while (cont.has_value())
+        {
+          if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+          {
+            remove_stmts((*stmt_elif)->scope->stmts);
+            cont = (*stmt_elif)->cont;
+          }
+          else
+          {
+            remove_stmts(std::get<NodeStmtElse *>(cont.value()->clause)->scope->stmts);
+            cont = std::nullopt;
+          }
+        }
+      }
+    }
+  }
+
+  NodeProg &prog;
+  const RangeAnalyser &ranges;
+  Stats dce_stats;
+  std::vector<Decl> decls;
+  std::vector<std::unordered_map<std::string, size_t>> scopes;
+  std::unordered_set<const NodeStmt *> dead;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <iostream>
+#include <ostream>
+
+// Thrown once a compile error has been written to diagnostics(). It
+// unwinds to compile() in main.cpp, which fails that one compile: a single
+// compile exits with status 1, and a batch reports the job as failed and
+// carries on with the others. It is not a std::exception, so the passes
+// that catch those from std::stoll cannot swallow it.
+struct CompileError
+{
+};
+
+// Where the thread running a compile writes its errors: std::cerr, unless
+// the thread was given a stream of its own, as every batch job is.
+inline std::ostream *&diagnostics_stream()
+{
+  thread_local std::ostream *stream = &std::cerr;
+  return stream;
+}
+
+inline std::ostream &diagnostics()
+{
+  return *diagnostics_stream();
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "./assembler.hpp"
+#include "./linker.hpp"
+
+// Serialises assembled modules as ELF64 files for x86-64.
+class ElfWriter
+{
+public:
+  // Writes `module` as a relocatable object that ld can link, in the same
+  // shape NASM's -felf64 output has: one section per assembler section, a
+  // .rela section for each section with relocations, and a symbol table
+  // listing local symbols before global and undefined ones.
+  static bool write_object(const ObjectModule &module, const char *path)
+  {
+    std::vector<uint8_t> image(sizeof(Elf64_Ehdr), 0);
+    std::vector<Elf64_Shdr> headers(1, Elf64_Shdr{});
+    std::string shstrtab(1, '\0');
+
+    auto add_name = [](std::string &table, const std::string &name)
+    {
+      uint32_t offset = static_cast<uint32_t>(table.size());
+      table.append(name);
+      table.push_back('\0');
+      return offset;
+    };
+
+    auto append = [&image](const void *data, size_t size, size_t align)
+    {
+      size_t offset = (image.size() + align - 1) / align * align;
+      image.resize(offset);
+      const uint8_t *bytes = static_cast<const uint8_t *>(data);
+      image.insert(image.end(), bytes, bytes + size);
+      return offset;
+    };
+
+    for (const ObjSection &section : module.sections)
+    {
+      Elf64_Shdr header{};
+      header.sh_name = add_name(shstrtab, section.name);
+      header.sh_type = section.nobits ? SHT_NOBITS : SHT_PROGBITS;
+      header.sh_flags = SHF_ALLOC | (section.write ? SHF_WRITE : 0) | (section.exec ? SHF_EXECINSTR : 0);
+      header.sh_addralign = section.align;
+      header.sh_size = section.size;
+      header.sh_offset = section.nobits ? image.size() : append(section.data.data(), section.data.size(), section.align);
+      headers.push_back(header);
+    }
+
+    // Symbol table: null symbol, locals, then globals and undefined symbols.
+    std::vector<Elf64_Sym> symtab(1, Elf64_Sym{});
+    std::string strtab(1, '\0');
+    std::vector<uint32_t> elf_index(module.symbols.size());
+    uint32_t first_global = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+      if (pass == 1)
+        first_global = static_cast<uint32_t>(symtab.size());
+      for (size_t i = 0; i < module.symbols.size(); i++)
+      {
+        const ObjSymbol &symbol = module.symbols[i];
+        bool global = symbol.global || symbol.section < 0;
+        if (global != (pass == 1))
+          continue;
+        Elf64_Sym sym{};
+        sym.st_name = add_name(strtab, symbol.name);
+        sym.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+        sym.st_shndx = symbol.section < 0 ? SHN_UNDEF : static_cast<uint16_t>(symbol.section + 1);
+        sym.st_value = symbol.section < 0 ? 0 : symbol.offset;
+        elf_index[i] = static_cast<uint32_t>(symtab.size());
+        symtab.push_back(sym);
+      }
+    }
+
+    size_t symtab_index = headers.size() + count_rela_sections(module);
+    for (size_t s = 0; s < module.sections.size(); s++)
+    {
+      std::vector<Elf64_Rela> relas;
+      for (const ObjReloc &reloc : module.relocs)
+      {
+        if (reloc.section != static_cast<int>(s))
+          continue;
+        Elf64_Rela rela{};
+        rela.r_offset = reloc.offset;
+        rela.r_info = ELF64_R_INFO(elf_index[reloc.symbol], elf_type(reloc.type));
+        rela.r_addend = reloc.addend;
+        relas.push_back(rela);
+      }
+      if (relas.empty())
+        continue;
+      Elf64_Shdr header{};
+      header.sh_name = add_name(shstrtab, ".rela" + module.sections[s].name);
+      header.sh_type = SHT_RELA;
+      header.sh_flags = SHF_INFO_LINK;
+      header.sh_link = static_cast<uint32_t>(symtab_index);
+      header.sh_info = static_cast<uint32_t>(s + 1);
+      header.sh_addralign = 8;
+      header.sh_entsize = sizeof(Elf64_Rela);
+      header.sh_size = relas.size() * sizeof(Elf64_Rela);
+      header.sh_offset = append(relas.data(), header.sh_size, 8);
+      headers.push_back(header);
+    }
+
+    Elf64_Shdr symtab_header{};
+    symtab_header.sh_name = add_name(shstrtab, ".symtab");
+    symtab_header.sh_type = SHT_SYMTAB;
+    symtab_header.sh_link = static_cast<uint32_t>(symtab_index + 1);
+    symtab_header.sh_info = first_global;
+    symtab_header.sh_addralign = 8;
+    symtab_header.sh_entsize = sizeof(Elf64_Sym);
+    symtab_header.sh_size = symtab.size() * sizeof(Elf64_Sym);
+    symtab_header.sh_offset = append(symtab.data(), symtab_header.sh_size, 8);
+    headers.push_back(symtab_header);
+
+    Elf64_Shdr strtab_header{};
+    strtab_header.sh_name = add_name(shstrtab, ".strtab");
+    strtab_header.sh_type = SHT_STRTAB;
+    strtab_header.sh_addralign = 1;
+    strtab_header.sh_size = strtab.size();
+    strtab_header.sh_offset = append(strtab.data(), strtab.size(), 1);
+    headers.push_back(strtab_header);
+
+    Elf64_Shdr shstrtab_header{};
+    shstrtab_header.sh_name = add_name(shstrtab, ".shstrtab");
+    shstrtab_header.sh_type = SHT_STRTAB;
+    shstrtab_header.sh_addralign = 1;
+    shstrtab_header.sh_size = shstrtab.size();
+    shstrtab_header.sh_offset = append(shstrtab.data(), shstrtab.size(), 1);
+    headers.push_back(shstrtab_header);
+
+    Elf64_Ehdr ehdr = file_header(ET_REL);
+    ehdr.e_shoff = append(headers.data(), headers.size() * sizeof(Elf64_Shdr), 8);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = static_cast<uint16_t>(headers.size());
+    ehdr.e_shstrndx = static_cast<uint16_t>(headers.size() - 1);
+    std::memcpy(image.data(), &ehdr, sizeof(ehdr));
+
+    return write_file(path, image, 0644);
+  }
+
+  // Space reserved in front of the first segment of an executable for the
+  // file header and program headers: one PT_LOAD per segment plus
+  // PT_GNU_STACK.
+  static constexpr uint64_t executable_header_size = sizeof(Elf64_Ehdr) + 4 * sizeof(Elf64_Phdr);
+
+  // Writes a static executable from segments linked for address `base`
+  // with a header of `executable_header_size` bytes. File offsets equal
+  // offsets from the base, so each segment maps straight from the file.
+  static bool write_executable(const std::vector<Segment> &segments, uint64_t base, uint64_t entry, const char *path)
+  {
+    size_t file_size = executable_header_size;
+    for (const Segment &seg : segments)
+    {
+      file_size = std::max<size_t>(file_size, seg.offset + seg.data.size());
+    }
+    std::vector<uint8_t> image(file_size, 0);
+
+    std::vector<Elf64_Phdr> phdrs;
+    for (const Segment &seg : segments)
+    {
+      Elf64_Phdr phdr{};
+      phdr.p_type = PT_LOAD;
+      phdr.p_flags = PF_R | (seg.write ? PF_W : 0) | (seg.exec ? PF_X : 0);
+      phdr.p_offset = seg.offset;
+      phdr.p_vaddr = base + seg.offset;
+      phdr.p_paddr = phdr.p_vaddr;
+      phdr.p_filesz = seg.data.size();
+      phdr.p_memsz = seg.mem_size;
+      phdr.p_align = Linker::page_size;
+      phdrs.push_back(phdr);
+      std::memcpy(image.data() + seg.offset, seg.data.data(), seg.data.size());
+    }
+    Elf64_Phdr stack{};
+    stack.p_type = PT_GNU_STACK;
+    stack.p_flags = PF_R | PF_W;
+    stack.p_align = 16;
+    phdrs.push_back(stack);
+
+    Elf64_Ehdr ehdr = file_header(ET_EXEC);
+    ehdr.e_entry = entry;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = static_cast<uint16_t>(phdrs.size());
+    // The first segment leaves its first executable_header_size bytes free
+    // for these.
+    std::memcpy(image.data(), &ehdr, sizeof(ehdr));
+    std::memcpy(image.data() + sizeof(ehdr), phdrs.data(), phdrs.size() * sizeof(Elf64_Phdr));
+
+    return write_file(path, image, 0755);
+  }
+
+private:
+  static size_t count_rela_sections(const ObjectModule &module)
+  {
+    std::vector<bool> has_relocs(module.sections.size(), false);
+    for (const ObjReloc &reloc : module.relocs)
+    {
+      has_relocs[reloc.section] = true;
+    }
+    size_t count = 0;
+    for (bool has : has_relocs)
+    {
+      count += has ? 1 : 0;
+    }
+    return count;
+  }
+
+  static uint32_t elf_type(RelocType type)
+  {
+    switch (type)
+    {
+    case RelocType::Abs64:
+      return R_X86_64_64;
+    case RelocType::Abs32S:
+      return R_X86_64_32S;
+    case RelocType::PC32:
+      return R_X86_64_PC32;
+    }
+    return R_X86_64_NONE;
+  }
+
+  static Elf64_Ehdr file_header(uint16_t type)
+  {
+    Elf64_Ehdr ehdr{};
+    std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = type;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    return ehdr;
+  }
+
+  // Returns false and leaves errno set on failure.
+  static bool write_file(const char *path, const std::vector<uint8_t> &image, mode_t mode)
+  {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0)
+      return false;
+    size_t done = 0;
+    while (done < image.size())
+    {
+      ssize_t written = write(fd, image.data() + done, image.size() - done);
+      if (written < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return false;
+      }
+      done += static_cast<size_t>(written);
+    }
+    return close(fd) == 0;
+  }
+};
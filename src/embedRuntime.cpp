@@ -0,0 +1,115 @@
+// Assembles the runtime with the built-in assembler when the compiler is
+// built, and writes the object modules out as a header the compiler
+// embeds, so no compile has to assemble them again.
+//
+// Usage: embed_runtime <runtimeObjects.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include "./assembler.hpp"
+#include "./jit.hpp"
+#include "runtime.hpp"
+
+static std::string quote(std::string_view text)
+{
+  std::string quoted = "\"";
+  for (char c : text)
+  {
+    if (c == '"' || c == '\\')
+      quoted.push_back('\\');
+    quoted.push_back(c);
+  }
+  return quoted + "\"";
+}
+
+// Writes `name`_object(), which returns the module assembled from `source`.
+static void embed(std::ostream &out, const char *name, std::string_view source)
+{
+  Assembler assembler;
+  assembler.assemble(source);
+  ObjectModule module = assembler.finish();
+
+  out << "\ninline ObjectModule " << name << "_object()\n{\n";
+  for (size_t i = 0; i < module.sections.size(); i++)
+  {
+    const std::vector<uint8_t> &data = module.sections[i].data;
+    if (data.empty())
+      continue;
+    out << "  static constexpr uint8_t section" << i << "[] = {";
+    for (size_t j = 0; j < data.size(); j++)
+    {
+      char byte[16];
+      std::snprintf(byte, sizeof(byte), "%s0x%02x", j % 16 == 0 ? "\n      " : " ", data[j]);
+      out << byte << (j + 1 < data.size() ? "," : "");
+    }
+    out << "};\n";
+  }
+  out << "  ObjectModule module;\n";
+  for (size_t i = 0; i < module.sections.size(); i++)
+  {
+    const ObjSection &section = module.sections[i];
+    std::string data = section.data.empty() ? "{}"
+                                            : "{std::begin(section" + std::to_string(i) + "), std::end(section" +
+                                                  std::to_string(i) + ")}";
+    out << "  module.sections.push_back({" << quote(section.name) << ", " << data << ", " << section.size << ", "
+        << section.align << ", " << section.write << ", " << section.exec << ", " << section.nobits << "});\n";
+  }
+  for (const ObjSymbol &symbol : module.symbols)
+  {
+    out << "  module.symbols.push_back({" << quote(symbol.name) << ", " << symbol.section << ", " << symbol.offset
+        << ", " << symbol.global << "});\n";
+  }
+  for (const ObjReloc &reloc : module.relocs)
+  {
+    out << "  module.relocs.push_back({" << reloc.section << ", " << reloc.offset << ", static_cast<RelocType>("
+        << static_cast<int>(reloc.type) << "), " << reloc.symbol << ", " << reloc.addend << "});\n";
+  }
+  out << "  return module;\n}\n";
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    std::cerr << "Usage: embed_runtime <runtimeObjects.hpp>\n";
+    return EXIT_FAILURE;
+  }
+  // The header is only written once every module has assembled, so a
+  // failed build leaves no half of one behind.
+  std::ostringstream text;
+  text << std::boolalpha << "#pragma once\n\n"
+       << "#include <cstdint>\n#include <iterator>\n#include \"assembler.hpp\"\n\n"
+       << "// Generated by embed_runtime from the runtime sources; do not edit.\n"
+       << "namespace runtime\n{";
+  try
+  {
+    embed(text, "output", runtime::output_asm);
+    embed(text, "print", runtime::print_asm);
+    embed(text, "errors", runtime::errors_asm);
+    embed(text, "exit", runtime::exit_asm);
+    embed(text, "cpu", runtime::cpu_asm);
+    embed(text, "profile", runtime::profile_asm);
+    embed(text, "trampoline", Jit::trampoline_asm);
+  }
+  catch (const CompileError &)
+  {
+    return EXIT_FAILURE;
+  }
+  text << "}\n";
+
+  std::ofstream out(argv[1]);
+  out << text.str();
+  out.close();
+  if (!out)
+  {
+    std::cerr << "Error: could not write " << argv[1] << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
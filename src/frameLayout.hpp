@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <variant>
+#include "./parser.hpp"
+
+// Assigns every let/const definition of the program an 8-byte slot in the
+// stack frame of `_start`, and every parameter and definition of a function
+// one in that function's frame. Slot k lives at [rbp - 8 * (k + 1)], so the
+// generator can load and store variables in place instead of tracking them
+// relative to the moving stack pointer.
+//
+// Slots are shared between variables whose live ranges do not overlap. Each
+// statement gets a position in program order; a variable is live from its
+// definition to its last read or assignment, which never extends past the
+// end of its scope. A variable defined outside a loop and used inside it
+// stays live until the end of the loop, since the next iteration may read
+// it again. Colouring those intervals with a linear scan lets sibling
+// scopes, and dead variables within one scope, reuse the same slots.
+//
+// An int[N] array takes N consecutive slots starting at slot_of(decl), with
+// element 0 in the lowest address, so element j lives at
+// [rbp - 8 * (slot + N) + 8 * j]. Arrays always get a fresh block; once an
+// array is dead its slots are handed out to scalars one at a time.
+class FrameLayout
+{
+public:
+  explicit FrameLayout(const NodeProg &program) : prog(program) {}
+
+  void compute()
+  {
+    visit_stmts(prog.stmts);
+    main_slots = assign_slots();
+    for (const NodeFunc *func : prog.funcs)
+    {
+      // Parameters are defined on entry, ahead of the body.
+      scopes.push_back({});
+      for (const NodeParam &param : func->params)
+      {
+        define(param.ident.val.value(), &param);
+      }
+      visit_stmts(func->body->stmts);
+      scopes.pop_back();
+      func_slots[func] = assign_slots();
+    }
+  }
+
+  // Slot of a let/const statement or a function parameter.
+  size_t slot_of(const void *decl) const
+  {
+    return slots.at(decl);
+  }
+
+  // Number of slots the frame of `_start` needs.
+  size_t frame_slots() const
+  {
+    return main_slots;
+  }
+
+  size_t frame_slots(const NodeFunc *func) const
+  {
+    return func_slots.at(func);
+  }
+
+  // Number of variables sharing the slots of every frame.
+  size_t variables() const
+  {
+    return variable_count;
+  }
+
+private:
+  struct Interval
+  {
+    const void *decl;
+    size_t start;
+    size_t end;
+    size_t size;
+  };
+
+  struct Loop
+  {
+    size_t start;
+    std::vector<size_t> outer_uses; // intervals used inside the loop
+  };
+
+  void visit_stmts(const std::vector<NodeStmt *> &stmts)
+  {
+    scopes.push_back({});
+    for (const NodeStmt *stmt : stmts)
+    {
+      visit_stmt(stmt);
+    }
+    scopes.pop_back();
+  }
+
+  void visit_stmt(const NodeStmt *stmt)
+  {
+    struct StmtVisitor
+    {
+      FrameLayout *fl;
+      void operator()(const NodeStmtConst *stmt_const) const
+      {
+        fl->visit_expr(stmt_const->expr);
+        fl->define(stmt_const->ident.val.value(), stmt_const);
+      }
+      void operator()(const NodeStmtLet *stmt_let) const
+      {
+        if (stmt_let->expr.has_value())
+        {
+          fl->visit_expr(stmt_let->expr.value());
+        }
+        fl->define(stmt_let->ident.val.value(), stmt_let,
+                   stmt_let->dtype == DataType::IntArray ? stmt_let->length : 1);
+      }
+      void operator()(const NodeStmtAssign *stmt_assign) const
+      {
+        fl->visit_expr(stmt_assign->expr);
+        fl->use(stmt_assign->ident.val.value());
+      }
+      void operator()(const NodeStmtAssignIndex *stmt_assign_index) const
+      {
+        fl->visit_expr(stmt_assign_index->index);
+        fl->visit_expr(stmt_assign_index->expr);
+        fl->use(stmt_assign_index->ident.val.value());
+      }
+      void operator()(const NodeStmtExit *stmt_exit) const
+      {
+        fl->visit_expr(stmt_exit->expr);
+      }
+      void operator()(const NodeStmtPrint *stmt_print) const
+      {
+        fl->visit_expr(stmt_print->expr);
+      }
+      void operator()(const NodeStmtReturn *stmt_return) const
+      {
+        fl->visit_expr(stmt_return->expr);
+      }
+      void operator()(const NodeStmtCall *stmt_call) const
+      {
+        fl->visit_call(stmt_call->call);
+      }
+      void operator()(const NodeStmtScope *stmt_scope) const
+      {
+        fl->visit_stmts(stmt_scope->stmts);
+      }
+      void operator()(const NodeStmtWhile *stmt_while) const
+      {
+        fl->enter_loop();
+        fl->visit_expr(stmt_while->expr);
+        fl->visit_stmts(stmt_while->scope->stmts);
+        fl->exit_loop();
+      }
+      void operator()(const NodeStmtFor *stmt_for) const
+      {
+        fl->scopes.push_back({});
+        fl->visit_stmt(stmt_for->init);
+        fl->enter_loop();
+        fl->visit_expr(stmt_for->cond);
+        fl->visit_stmts(stmt_for->scope->stmts);
+        fl->visit_stmt(stmt_for->step);
+        fl->exit_loop();
+        fl->scopes.pop_back();
+      }
+      void operator()(const NodeStmtIf *stmt_if) const
+      {
+        fl->visit_expr(stmt_if->expr);
+        fl->visit_stmts(stmt_if->scope->stmts);
+        std::optional<NodeStmtIfCont *> cont = stmt_if->cont;
+        while (cont.has_value())
+        {
+          if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+          {
+            fl->position++;
+            fl->visit_expr((*stmt_elif)->expr);
+            fl->visit_stmts((*stmt_elif)->scope->stmts);
+            cont = (*stmt_elif)->cont;
+          }
+          else
+          {
+            fl->visit_stmts(std::get<NodeStmtElse *>(cont.value()->clause)->scope->stmts);
+            cont = std::nullopt;
+          }
+        }
+      }
+    };
+    position++;
+    StmtVisitor visitor{this};
+    std::visit(visitor, stmt->stmt);
+  }
+
+  void visit_expr(const NodeExpr *expr)
+  {
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      visit_term(*term);
+      return;
+    }
+    std::visit(
+        [this](const auto *op)
+        {
+          visit_expr(op->lhs);
+          visit_expr(op->rhs);
+        },
+        std::get<NodeBinExpr *>(expr->var)->op);
+  }
+
+  void visit_term(const NodeTerm *term)
+  {
+    if (auto *term_ident = std::get_if<NodeTermIdent *>(&term->val))
+    {
+      use((*term_ident)->ident.val.value());
+    }
+    else if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      visit_expr((*term_paren)->expr);
+    }
+    else if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      visit_term((*term_unary)->operand);
+    }
+    else if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      visit_expr((*term_index)->index);
+      use((*term_index)->ident.val.value());
+    }
+    else if (auto *term_call = std::get_if<NodeTermCall *>(&term->val))
+    {
+      visit_call(*term_call);
+    }
+  }
+
+  void visit_call(const NodeTermCall *call)
+  {
+    for (const NodeExpr *arg : call->args)
+    {
+      visit_expr(arg);
+    }
+  }
+
+  void define(const std::string &name, const void *decl, size_t size = 1)
+  {
+    intervals.push_back({decl, position, position, size});
+    scopes.back()[name] = intervals.size() - 1;
+  }
+
+  void use(const std::string &name)
+  {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+    {
+      auto found = it->find(name);
+      if (found != it->end())
+      {
+        intervals[found->second].end = position;
+        for (Loop &loop : loops)
+        {
+          if (intervals[found->second].start <= loop.start)
+          {
+            loop.outer_uses.push_back(found->second);
+          }
+        }
+        return;
+      }
+    }
+  }
+
+  // Loops are entered at the position of the loop statement, or of a for
+  // loop's initialiser, so everything defined there or earlier is outside.
+  void enter_loop()
+  {
+    loops.push_back({position, {}});
+  }
+
+  void exit_loop()
+  {
+    for (size_t index : loops.back().outer_uses)
+    {
+      intervals[index].end = std::max(intervals[index].end, position);
+    }
+    loops.pop_back();
+  }
+
+  // Linear scan over intervals ordered by start position. A slot is
+  // released once its variable's last use lies at or before the start of
+  // the next definition, since the new value is stored after its
+  // initialiser has been evaluated. Returns the frame's slot count and
+  // starts the next frame afresh.
+  size_t assign_slots()
+  {
+    size_t slot_count = 0;
+    using Active = std::tuple<size_t, size_t, size_t>; // (end, slot, size)
+    std::priority_queue<Active, std::vector<Active>, std::greater<>> active;
+    std::priority_queue<size_t, std::vector<size_t>, std::greater<>> free_slots;
+
+    for (const Interval &interval : intervals)
+    {
+      while (!active.empty() && std::get<0>(active.top()) <= interval.start)
+      {
+        auto [end, slot, size] = active.top();
+        for (size_t k = 0; k < size; k++)
+        {
+          free_slots.push(slot + k);
+        }
+        active.pop();
+      }
+      size_t slot;
+      if (interval.size > 1 || free_slots.empty())
+      {
+        slot = slot_count;
+        slot_count += interval.size;
+      }
+      else
+      {
+        slot = free_slots.top();
+        free_slots.pop();
+      }
+      slots[interval.decl] = slot;
+      active.push({interval.end, slot, interval.size});
+    }
+    variable_count += intervals.size();
+    intervals.clear();
+    position = 0;
+    return slot_count;
+  }
+
+  const NodeProg &prog;
+  std::vector<Interval> intervals;
+  std::vector<std::unordered_map<std::string, size_t>> scopes;
+  std::vector<Loop> loops;
+  std::unordered_map<const void *, size_t> slots;
+  std::unordered_map<const NodeFunc *, size_t> func_slots;
+  size_t position = 0;
+  size_t main_slots = 0;
+  size_t variable_count = 0;
+};
@@ -1,12 +1,76 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <type_traits>
 #include <vector>
-#include <sstream>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include "./asmBuffer.hpp"
+#include "./rangeAnalysis.hpp"
+#include "./frameLayout.hpp"
+#include "./loopOptimisation.hpp"
+#include "./inliner.hpp"
+#include "./profile.hpp"
+#include "./diagnostics.hpp"
 
 class Generator
 {
 
 public:
-  explicit Generator(NodeProg program) : prog(std::move(program)) {}
+  struct Stats
+  {
+    size_t overflow_checks = 0;
+    size_t overflow_checks_elided = 0;
+    size_t divzero_checks = 0;
+    size_t divzero_checks_elided = 0;
+    size_t bounds_checks = 0;
+    size_t bounds_checks_elided = 0;
+    size_t peak_stack_depth = 0; // bytes below the entry rsp, frame included
+    size_t selects = 0;          // if chains lowered to cmov
+    size_t loops = 0;            // loops emitted with a branch back
+    size_t unrolled_loops = 0;
+    size_t vector_loops = 0; // loops given an SSE2/AVX2 body
+    size_t functions = 0;    // functions emitted out of line
+    size_t calls = 0;        // call instructions emitted
+    size_t inlined_calls = 0;
+    size_t cold_blocks = 0;     // arms and loop bodies moved to .text.cold
+    size_t biased_branches = 0; // if chains the profile keeps off cmov
+    size_t jump_tables = 0;     // elif chains dispatched through a table
+    size_t search_trees = 0;    // elif chains dispatched by binary search
+    size_t strings = 0;         // distinct texts in the .rodata string pool
+    size_t merged_prints = 0;   // constant prints folded into the print before
+    size_t inlined_prints = 0;  // prints stored into the output buffer in place
+  };
+
+  struct Options
+  {
+    bool cmov = true; // lower simple if/else assignments to cmov
+    bool simd = true; // emit the vector bodies the loop optimiser planned
+    bool inline_calls = true; // expand the calls the inliner picked
+    bool instrument = false;  // count branches and write them to out.prof on exit
+    bool switches = true;     // dispatch long elif chains on constants by table or search
+  };
+
+  struct Label
+  {
+    int id;
+    friend AsmBuffer &operator<<(AsmBuffer &out, Label label)
+    {
+      return out << "label" << label.id;
+    }
+  };
+
+  explicit Generator(NodeProg program, const RangeAnalyser &range_analyser, const FrameLayout &frame_layout,
+                     const LoopOptimiser &loop_optimiser, const Inliner &call_inliner,
+                     const BranchProfile &branch_profile, Options opts)
+      : prog(std::move(program)), ranges(range_analyser), layout(frame_layout), loops(loop_optimiser),
+        inliner(call_inliner), profile(branch_profile), options(opts) {}
+  explicit Generator(NodeProg program, const RangeAnalyser &range_analyser, const FrameLayout &frame_layout,
+                     const LoopOptimiser &loop_optimiser, const Inliner &call_inliner,
+                     const BranchProfile &branch_profile)
+      : Generator(std::move(program), range_analyser, frame_layout, loop_optimiser, call_inliner, branch_profile,
+                  Options{}) {}
   DataType gen_lit(const NodeTermLit *term_lit)
   {
     const Token &tok = term_lit->token;
@@ -28,13 +92,13 @@ public:
       }
       catch (const std::out_of_range &)
       {
-        std::cerr << "Integer literal out of bounds\n";
-        exit(EXIT_FAILURE);
+        diagnostics() << "Integer literal out of bounds\n";
+        throw CompileError();
       }
       catch (const std::invalid_argument &)
       {
-        std::cerr << "Invalid integer literal\n";
-        exit(EXIT_FAILURE);
+        diagnostics() << "Invalid integer literal\n";
+        throw CompileError();
       }
       output << "    mov rax, " << value << "\n";
       push("rax");
@@ -49,7 +113,7 @@ public:
     }
     case TokenType::bool_lit:
     {
-      std::string value = tok.val.value();
+      const std::string &value = tok.val.value();
 
       if (value == "true")
       {
@@ -63,15 +127,15 @@ public:
       }
       else
       {
-        std::cerr << "Unknown boolean literal: " << value << "\n";
-        exit(EXIT_FAILURE);
+        diagnostics() << "Unknown boolean literal: " << value << "\n";
+        throw CompileError();
       }
 
       return DataType::Bool;
     }
     default:
-      std::cerr << "Unknown literal type\n";
-      exit(EXIT_FAILURE);
+      diagnostics() << "Unknown literal type\n";
+      throw CompileError();
     }
   }
   DataType gen_term(const NodeTerm *term)
@@ -87,19 +151,40 @@ public:
       {
         if (!gen->globals.contains(term_ident->ident.val.value()))
         {
-          std::cerr << "Variable " << term_ident->ident.val.value() << " not declared" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Variable " << term_ident->ident.val.value() << " not declared" << std::endl;
+          throw CompileError();
         }
         const auto &var = gen->globals.at(term_ident->ident.val.value());
-        std::stringstream offset;
-        offset << "QWORD [rsp + " << (gen->stack_size - var.stack_loc) * 8 << "]";
-        gen->push(offset.str());
+        if (var.dtype == DataType::IntArray)
+        {
+          diagnostics() << "Error: Array '" << term_ident->ident.val.value() << "' must be indexed" << std::endl;
+          throw CompileError();
+        }
+        gen->push(gen->var_operand(var));
         return var.dtype;
       }
+      DataType operator()(const NodeTermIndex *term_index) const
+      {
+        const Var &var = gen->array_var(term_index->ident.val.value());
+        if (auto index = gen->constant_index(term_index, term_index->index))
+        {
+          gen->push(gen->element_operand(var, index.value()));
+          return DataType::Int;
+        }
+        gen->gen_index(term_index->index);
+        gen->pop("rax");
+        gen->bounds_check(term_index, "rax", var);
+        gen->push(gen->element_operand(var, "rax"));
+        return DataType::Int;
+      }
       DataType operator()(const NodeTermParen *term_paren) const
       {
         return gen->gen_expr(term_paren->expr);
       }
+      DataType operator()(const NodeTermCall *term_call) const
+      {
+        return gen->gen_call(term_call);
+      }
       DataType operator()(const NodeTermUnary *term_unary) const
       {
         switch (term_unary->op)
@@ -109,8 +194,8 @@ public:
           DataType dtype = gen->gen_term(term_unary->operand);
           if (dtype != DataType::Int)
           {
-            std::cerr << "Cannot use '-' on non integers\n";
-            exit(EXIT_FAILURE);
+            diagnostics() << "Cannot use '-' on non integers\n";
+            throw CompileError();
           }
           gen->pop("rax");
           gen->output << "    neg rax\n";
@@ -122,8 +207,8 @@ public:
           DataType dtype = gen->gen_term(term_unary->operand);
           if (dtype != DataType::Int && dtype != DataType::Bool)
           {
-            std::cerr << "Cannot use '!' on non-integers or non-booleans\n";
-            exit(EXIT_FAILURE);
+            diagnostics() << "Cannot use '!' on non-integers or non-booleans\n";
+            throw CompileError();
           }
 
           gen->pop("rax");
@@ -139,8 +224,8 @@ public:
         }
 
         default:
-          std::cerr << "Unknown unary operator\n";
-          exit(EXIT_FAILURE);
+          diagnostics() << "Unknown unary operator\n";
+          throw CompileError();
         }
       }
     };
@@ -160,14 +245,14 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Addition operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Addition operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
 
         gen->pop("rax");
         gen->pop("rbx");
         gen->output << "    add rax, rbx\n";
-        gen->output << "    jo overflow_error\n";
+        gen->overflow_check(add);
         gen->push("rax");
         return DataType::Int;
       }
@@ -178,14 +263,14 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Multiplication operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Multiplication operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
 
         gen->pop("rax");
         gen->pop("rbx");
         gen->output << "    imul rbx\n";
-        gen->output << "    jo overflow_error\n";
+        gen->overflow_check(mul);
         gen->push("rax");
         return DataType::Int;
       }
@@ -197,14 +282,14 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Subtraction operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Subtraction operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
 
         gen->pop("rax");
         gen->pop("rbx");
         gen->output << "    sub rax, rbx\n";
-        gen->output << "    jo overflow_error\n";
+        gen->overflow_check(sub);
         gen->push("rax");
         return DataType::Int;
       }
@@ -216,13 +301,12 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Division operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Division operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax");
         gen->pop("rbx");
-        gen->output << "    cmp rbx, 0\n";
-        gen->output << "    je divzero_error\n"; // check division by zero
+        gen->divzero_check(div);
         gen->output << "    cqo\n";              // sign-extend RAX -> RDX:RAX
         gen->output << "    idiv rbx\n";         // RAX/RBX -> quotient in RAX, remainder in RDX
         gen->push("rax");
@@ -236,13 +320,12 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Modulo operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Modulo operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax");
         gen->pop("rbx");
-        gen->output << "    cmp rbx, 0\n";
-        gen->output << "    je divzero_error\n"; // check division by zero
+        gen->divzero_check(mod);
         gen->output << "    cqo\n";
         gen->output << "    idiv rbx\n";
         gen->push("rdx");
@@ -256,8 +339,8 @@ public:
 
         if (lhs_type != rhs_type)
         {
-          std::cerr << "Error: Equality comparison requires both operands to be of the same type" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Equality comparison requires both operands to be of the same type" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax");
         gen->pop("rbx");
@@ -275,8 +358,8 @@ public:
 
         if (lhs_type != rhs_type)
         {
-          std::cerr << "Error: Non Equality comparison requires both operands to be of the same type" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Non Equality comparison requires both operands to be of the same type" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax"); // lhs
         gen->pop("rbx"); // rhs
@@ -294,8 +377,8 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Less Then operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Less Then operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax"); // lhs
         gen->pop("rbx"); // rhs
@@ -313,8 +396,8 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Greater Then operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Greater Then operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax"); // lhs
         gen->pop("rbx"); // rhs
@@ -332,8 +415,8 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Less Then Equal to operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Less Then Equal to operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax"); // lhs
         gen->pop("rbx"); // rhs
@@ -351,8 +434,8 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Greater Then Equal to operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Greater Then Equal to operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax"); // lhs
         gen->pop("rbx"); // rhs
@@ -369,8 +452,8 @@ public:
 
         if ((lhs_type != DataType::Int && lhs_type != DataType::Bool) || (rhs_type != DataType::Int && rhs_type != DataType::Bool))
         {
-          std::cerr << "Error: Greater Then Equal to operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Greater Then Equal to operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
 
         gen->pop("rax"); // lhs
@@ -397,8 +480,8 @@ public:
 
         if (lhs_type != DataType::Int || rhs_type != DataType::Int)
         {
-          std::cerr << "Error: Greater Then Equal to operator requires both operands to be integers" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Greater Then Equal to operator requires both operands to be integers" << std::endl;
+          throw CompileError();
         }
         gen->pop("rax"); // lhs
         gen->pop("rbx"); // rhs
@@ -423,6 +506,12 @@ public:
 
   DataType gen_expr(const NodeExpr *expr)
   {
+    // Hoisted and strength-reduced expressions are already on the stack.
+    if (auto value = loop_values.find(expr); value != loop_values.end())
+    {
+      push(stack_operand(value->second.index));
+      return value->second.dtype;
+    }
     struct ExprVisistor
     {
       Generator *gen;
@@ -442,58 +531,449 @@ public:
   void gen_scope(const NodeStmtScope *stmt_scope)
   {
     enter_scope();
+    // An exit inside the scope pops its status without returning, so
+    // resynchronise the tracked depth for code after the scope.
+    const size_t entry_stack_size = stack_size;
 
-    for (const NodeStmt *stmt_s : stmt_scope->stmts)
-    {
-      gen_stmt(stmt_s);
-    }
+    gen_stmts(stmt_scope->stmts);
+    stack_size = entry_stack_size;
     exit_scope();
   }
 
   void gen_exit()
   {
-    output << "    mov rax, 1\n";
-    output << "    mov rdi, 1\n";
-    output << "    lea rsi, [rsp-1]\n";
-    output << "    mov byte [rsp-1], 10\n";
-    output << "    mov rdx, 1\n";
-    output << "    syscall\n";
-    output << "    mov rax, 60\n";
+    output << "    call " << runtime("finish_output") << "\n";
     pop("rdi");
-    output << "    syscall\n";
+    output << "    jmp " << runtime(options.instrument ? "profile_exit" : "exit_program") << "\n";
     is_terminated = true;
   }
 
-  void gen_if_cont(const NodeStmtIfCont *stmt_if_cont, const std::string &end_label)
+  // Emits one arm of an if/elif chain and the rest of the chain after it.
+  // An arm normally falls through from its test and jumps over the rest.
+  // When the profile shows the arm rarely runs, it moves to .text.cold and
+  // the rest falls through instead; when it shows the rest rarely runs,
+  // the rest moves there and the arm falls through to the end. Afterwards
+  // is_terminated tells whether every path through the chain terminated.
+  void gen_if_arm(const NodeExpr *cond, const NodeStmtScope *scope, std::optional<NodeStmtIfCont *> cont,
+                  Label end_label)
   {
-    struct StmtIfContVisitor
+    gen_expr(cond);
+    pop("rax");
+    count_branch(cond, false);
+    output << "    test rax, rax\n";
+    const Label label = create_label();
+    if (is_rare(cond, true))
     {
-      Generator *gen;
-      const std::string &end_label;
+      output << "    jnz " << label << "\n";
+      gen_cold([&]
+               {
+                 output << label << ":\n";
+                 count_branch(cond, true);
+                 gen_scope(scope);
+                 if (!is_terminated)
+                 {
+                   output << "    jmp " << end_label << "\n";
+                 } });
+      const bool arm_terminated = is_terminated;
+      is_terminated = false;
+      gen_if_rest(cont, end_label);
+      is_terminated = arm_terminated && is_terminated;
+      return;
+    }
+
+    output << "    jz " << label << "\n";
+    count_branch(cond, true);
+    gen_scope(scope);
+    const bool arm_terminated = is_terminated;
+    is_terminated = false;
+    if (!cont.has_value())
+    {
+      output << label << ":\n";
+      return;
+    }
+    if (is_rare(cond, false))
+    {
+      gen_cold([&]
+               {
+                 output << label << ":\n";
+                 gen_if_rest(cont, end_label);
+                 if (!is_terminated)
+                 {
+                   output << "    jmp " << end_label << "\n";
+                 } });
+    }
+    else
+    {
+      output << "    jmp " << end_label << "\n";
+      output << label << ":\n";
+      gen_if_rest(cont, end_label);
+    }
+    is_terminated = arm_terminated && is_terminated;
+  }
+
+  // Emits the elif or else that follows an arm, if any.
+  void gen_if_rest(std::optional<NodeStmtIfCont *> cont, Label end_label)
+  {
+    if (!cont.has_value())
+    {
+      is_terminated = false;
+      return;
+    }
+    if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+    {
+      gen_if_arm((*stmt_elif)->expr, (*stmt_elif)->scope, (*stmt_elif)->cont, end_label);
+      return;
+    }
+    gen_scope(std::get<NodeStmtElse *>(cont.value()->clause)->scope);
+  }
+
+  // Counts an evaluation of the branch on `cond`, or one where it held, in
+  // instrumented builds.
+  void count_branch(const NodeExpr *cond, bool taken)
+  {
+    if (!options.instrument)
+      return;
+    output << "    inc QWORD [rel profile_counts + " << profile.site_of(cond).value() * 16 + (taken ? 8 : 0) << "]\n";
+  }
+
+  // Emits what `f` generates as a block in .text.cold. The block must not
+  // be fallen into or out of: it starts at a label and ends in a jump or a
+  // terminating statement.
+  template <typename F>
+  void gen_cold(F f)
+  {
+    AsmBuffer block;
+    output.swap(block);
+    f();
+    output.swap(block);
+    cold_output.append(block);
+    gen_stats.cold_blocks++;
+  }
+
+  // Lowers an if/elif chain that compares one side-effect-free expression
+  // against distinct int or char constants in every arm, like a switch.
+  // The expression is evaluated once and dispatched through a
+  // bounds-checked jump table in .rodata if the constants are dense, or a
+  // balanced binary search over them otherwise; the arms follow in source
+  // order. Returns false without emitting anything if the chain does not
+  // qualify.
+  bool gen_switch(const NodeStmtIf *stmt_if)
+  {
+    const NodeExpr *subject = nullptr;
+    TokenType kind;
+    std::vector<SwitchCase> cases;
+    const NodeStmtScope *otherwise = nullptr;
+    if (!switch_cases(stmt_if, subject, kind, cases, otherwise))
+    {
+      return false;
+    }
+    const DataType dtype = gen_expr(subject);
+    if (dtype != (kind == TokenType::char_lit ? DataType::Char : DataType::Int))
+    {
+      diagnostics() << "Error: Equality comparison requires both operands to be of the same type" << std::endl;
+      throw CompileError();
+    }
+    pop("rax");
+
+    const Label end_label = create_label();
+    const Label default_label = otherwise != nullptr ? create_label() : end_label;
+    for (SwitchCase &c : cases)
+    {
+      c.label = create_label();
+    }
+    std::vector<SwitchCase> sorted = cases;
+    std::sort(sorted.begin(), sorted.end(), [](const SwitchCase &a, const SwitchCase &b)
+              { return a.value < b.value; });
+    const uint64_t span = static_cast<uint64_t>(sorted.back().value) - static_cast<uint64_t>(sorted.front().value) + 1;
+    if (span <= max_jump_table_entries && span <= sorted.size() * jump_table_density)
+    {
+      gen_jump_table(sorted, span, default_label);
+    }
+    else
+    {
+      gen_search(sorted, 0, sorted.size(), default_label);
+      gen_stats.search_trees++;
+    }
 
-      void operator()(const NodeStmtElif *stmt_elif) const
+    // The chain only terminates if every arm, including an else, does.
+    bool terminated = otherwise != nullptr;
+    for (const SwitchCase &c : cases)
+    {
+      output << c.label << ":\n";
+      gen_scope(c.scope);
+      terminated = terminated && is_terminated;
+      if (!is_terminated)
       {
-        gen->gen_expr(stmt_elif->expr);
-        gen->pop("rax");
-        std::string label = gen->create_label();
-        gen->output << "    test rax, rax\n";
-        gen->output << "    jz " << label << "\n";
-        gen->gen_scope(stmt_elif->scope);
-        gen->output << "    jmp " << end_label << "\n";
-        if (stmt_elif->cont.has_value())
+        output << "    jmp " << end_label << "\n";
+      }
+      is_terminated = false;
+    }
+    if (otherwise != nullptr)
+    {
+      output << default_label << ":\n";
+      gen_scope(otherwise);
+      terminated = terminated && is_terminated;
+    }
+    output << end_label << ":\n";
+    is_terminated = terminated;
+    return true;
+  }
+
+  // Lowers an if/elif/else chain whose arms only assign side-effect-free
+  // expressions to mutable variables into straight-line code. Every
+  // condition and assigned value is evaluated and each variable's result is
+  // picked with cmov, innermost arm first, so the first arm whose condition
+  // holds wins as before. Returns false without emitting anything if the
+  // chain does not qualify.
+  bool gen_select(const NodeStmtIf *stmt_if)
+  {
+    std::vector<SelectArm> arms;
+    if (!select_arms(stmt_if, arms))
+    {
+      return false;
+    }
+    if (is_biased(arms))
+    {
+      gen_stats.biased_branches++;
+      return false;
+    }
+
+    std::vector<std::string> vars;
+    for (const SelectArm &arm : arms)
+    {
+      for (const NodeStmt *stmt : arm.scope->stmts)
+      {
+        const std::string &name = std::get<NodeStmtAssign *>(stmt->stmt)->ident.val.value();
+        if (std::find(vars.begin(), vars.end(), name) == vars.end())
         {
-          gen->output << label << ":\n";
-          gen->gen_if_cont(stmt_elif->cont.value(), end_label);
+          vars.push_back(name);
         }
       }
+    }
 
-      void operator()(const NodeStmtElse *stmt_else) const
+    const size_t conds_base = stack_size;
+    size_t cond_count = 0;
+    for (const SelectArm &arm : arms)
+    {
+      if (arm.cond != nullptr)
       {
-        gen->gen_scope(stmt_else->scope);
+        gen_expr(arm.cond);
+        cond_count++;
       }
-    };
-    StmtIfContVisitor visitor{this, end_label};
-    std::visit(visitor, stmt_if_cont->clause);
+    }
+
+    for (const std::string &name : vars)
+    {
+      const Var &var = globals.at(name);
+      // Value when no condition holds: the else arm's, or the current one.
+      const NodeExpr *fallback = arms.back().cond == nullptr ? assigned_value(arms.back(), name) : nullptr;
+      if (fallback != nullptr)
+      {
+        check_assign_type(name, var, gen_expr(fallback));
+      }
+      else
+      {
+        push(var_operand(var));
+      }
+      // An arm that is taken but leaves the variable alone keeps its
+      // current value, which matters once a later arm may have replaced it.
+      bool is_current = fallback == nullptr;
+      for (size_t i = cond_count; i-- > 0;)
+      {
+        const NodeExpr *value = assigned_value(arms[i], name);
+        if (value == nullptr && is_current)
+        {
+          continue;
+        }
+        if (value != nullptr)
+        {
+          check_assign_type(name, var, gen_expr(value));
+          pop("rbx");
+        }
+        pop("rax");
+        output << "    cmp QWORD [rsp + " << (stack_size - conds_base - 1 - i) * 8 << "], 0\n";
+        if (value != nullptr)
+        {
+          output << "    cmovne rax, rbx\n";
+        }
+        else
+        {
+          output << "    cmovne rax, " << var_operand(var) << "\n";
+        }
+        push("rax");
+        is_current = false;
+      }
+    }
+
+    // Store only once every value is computed, since later values read the
+    // variables' old contents.
+    for (size_t i = vars.size(); i-- > 0;)
+    {
+      pop("rax");
+      output << "    mov " << var_operand(globals.at(vars[i])) << ", rax\n";
+    }
+    output << "    add rsp, " << cond_count * 8 << "\n";
+    stack_size -= cond_count;
+    gen_stats.selects++;
+    return true;
+  }
+
+  // Emits a loop. Values the loop plan hoists or strength-reduces are
+  // pushed first and stay on the stack until the loop ends. A loop that is
+  // not unrolled is rotated so its condition is tested at the bottom, and
+  // its body, which is only ever entered by a jump, starts on a 16-byte
+  // boundary.
+  void gen_loop(const void *loop, const NodeExpr *cond, const NodeStmtScope *scope, const NodeStmt *step)
+  {
+    const LoopOptimiser::LoopPlan *plan = loops.plan_for(loop);
+    const size_t values_base = stack_size;
+    if (plan != nullptr)
+    {
+      for (const NodeExpr *expr : plan->hoisted)
+      {
+        DataType dtype = gen_expr(expr);
+        loop_values[expr] = {stack_size - 1, dtype};
+      }
+      for (const LoopOptimiser::Reduction &reduction : plan->reductions)
+      {
+        DataType dtype = gen_expr(reduction.expr);
+        loop_values[reduction.expr] = {stack_size - 1, dtype};
+        induction_updates[reduction.update].push_back({stack_size - 1, reduction.delta});
+      }
+    }
+
+    if (plan != nullptr && plan->trips.has_value())
+    {
+      for (size_t trip = 0; trip < plan->trips.value() && !is_terminated; trip++)
+      {
+        gen_scope(scope);
+        if (!is_terminated)
+        {
+          gen_stmt(step);
+        }
+      }
+      gen_stats.unrolled_loops++;
+    }
+    else
+    {
+      const Label body_label = create_label();
+      const Label cond_label = create_label();
+      auto gen_body = [&]
+      {
+        output << body_label << ":\n";
+        count_branch(cond, true);
+        gen_scope(scope);
+        if (step != nullptr && !is_terminated)
+        {
+          gen_stmt(step);
+        }
+      };
+      if (is_rare(cond, true))
+      {
+        // The profile shows the body rarely runs: test first, and keep
+        // the body in .text.cold.
+        gen_cold([&]
+                 {
+                   gen_body();
+                   if (!is_terminated)
+                   {
+                     output << "    jmp " << cond_label << "\n";
+                   } });
+      }
+      else
+      {
+        output << "    jmp " << cond_label << "\n";
+        output << "    align 16\n";
+        gen_body();
+      }
+      is_terminated = false;
+      output << cond_label << ":\n";
+      gen_expr(cond);
+      pop("rax");
+      count_branch(cond, false);
+      output << "    test rax, rax\n";
+      output << "    jnz " << body_label << "\n";
+      gen_stats.loops++;
+    }
+
+    if (plan != nullptr)
+    {
+      for (const NodeExpr *expr : plan->hoisted)
+      {
+        loop_values.erase(expr);
+      }
+      for (const LoopOptimiser::Reduction &reduction : plan->reductions)
+      {
+        loop_values.erase(reduction.expr);
+        induction_updates.erase(reduction.update);
+      }
+      if (stack_size > values_base && !is_terminated)
+      {
+        output << "    add rsp, " << (stack_size - values_base) * 8 << "\n";
+      }
+      stack_size = values_base;
+    }
+  }
+
+  // Emits the vector form of a for loop ahead of its scalar loop. The
+  // invariants are pushed, then cpu_avx2 picks a body that broadcasts them
+  // and runs four (AVX2) or two (SSE2) iterations per round, with the
+  // index in rcx, for as many whole rounds as fit. Lanes that overflow set
+  // their sign bit in xmm15, which is tested once after the last round: a
+  // store loop fails like the scalar code would, while a sum loop, which
+  // writes nothing until it has checked its totals, leaves the scalar loop
+  // to redo every iteration and fail or succeed by itself. On success the
+  // index and the sums are stored, and the scalar loop finishes the rest.
+  void gen_vector_loop(const LoopOptimiser::VectorLoop &vector)
+  {
+    const size_t values_base = stack_size;
+    for (const NodeExpr *expr : vector.invariants)
+    {
+      gen_expr(expr);
+    }
+    const Label sse_label = create_label();
+    const Label done_label = create_label();
+    output << "    cmp byte [rel " << runtime("cpu_avx2") << "], 0\n";
+    output << "    je " << sse_label << "\n";
+    gen_vector_body(vector, values_base, true, done_label);
+    output << "    jmp " << done_label << "\n";
+    output << sse_label << ":\n";
+    gen_vector_body(vector, values_base, false, done_label);
+    output << done_label << ":\n";
+    if (stack_size > values_base)
+    {
+      output << "    add rsp, " << (stack_size - values_base) * 8 << "\n";
+    }
+    stack_size = values_base;
+    gen_stats.vector_loops++;
+  }
+
+  // Generates a list of statements up to the first that ends the program.
+  // A run of prints of constants becomes one print of all their text.
+  void gen_stmts(const std::vector<NodeStmt *> &stmts)
+  {
+    size_t i = 0;
+    while (i < stmts.size() && !is_terminated)
+    {
+      std::string text;
+      size_t run = 0;
+      for (; i + run < stmts.size(); run++)
+      {
+        auto *stmt_print = std::get_if<NodeStmtPrint *>(&stmts[i + run]->stmt);
+        std::optional<std::string> line = stmt_print != nullptr ? constant_text((*stmt_print)->expr) : std::nullopt;
+        if (!line.has_value())
+          break;
+        text += line.value();
+      }
+      if (run > 0)
+      {
+        gen_print_text(text);
+        gen_stats.merged_prints += run - 1;
+        i += run;
+        continue;
+      }
+      gen_stmt(stmts[i++]);
+    }
   }
 
   void gen_stmt(const NodeStmt *stmt)
@@ -508,23 +988,28 @@ public:
       }
       void operator()(const NodeStmtPrint *stmt_print) const
       {
+        if (std::optional<std::string> text = constant_text(stmt_print->expr))
+        {
+          gen->gen_print_text(text.value());
+          return;
+        }
         DataType dtpye = gen->gen_expr(stmt_print->expr);
         gen->pop("rdi");
         switch (dtpye)
         {
         case DataType::Int:
         {
-          gen->output << "    call print_int\n";
+          gen->output << "    call " << gen->runtime("print_int") << "\n";
           break;
         }
         case DataType::Bool:
         {
-          gen->output << "    call print_int\n";
+          gen->output << "    call " << gen->runtime("print_int") << "\n";
           break;
         }
         case DataType::Char:
         {
-          gen->output << "    call print_char\n";
+          gen->gen_print_char();
           break;
         }
 
@@ -532,141 +1017,283 @@ public:
           break;
         }
       }
-      void operator()(const NodeStmtIf *stmt_if) const
+      void operator()(const NodeStmtReturn *stmt_return) const
       {
-        gen->gen_expr(stmt_if->expr);
+        DataType type = gen->gen_expr(stmt_return->expr);
+        gen->check_return_type(gen->current_func, type);
         gen->pop("rax");
-        std::string label = gen->create_label();
-        gen->output << "    test rax, rax\n";
-        gen->output << "    jz " << label << "\n";
-        gen->gen_scope(stmt_if->scope);
-        if (stmt_if->cont.has_value())
-        {
-          const std::string end_label = gen->create_label();
-          gen->output << "    jmp " << end_label << "\n";
-          gen->output << label << ":\n";
-          gen->gen_if_cont(stmt_if->cont.value(), end_label);
-          gen->output << end_label << ":\n";
+        gen->gen_return();
+      }
+      void operator()(const NodeStmtCall *stmt_call) const
+      {
+        gen->gen_call(stmt_call->call);
+        gen->pop("rax"); // the result is unused
+      }
+      void operator()(const NodeStmtIf *stmt_if) const
+      {
+        // Instrumented builds keep every branch so that each is counted.
+        if (gen->options.cmov && !gen->options.instrument && gen->gen_select(stmt_if))
+        {
+          return;
         }
-        else
+        if (gen->options.switches && !gen->options.instrument && gen->gen_switch(stmt_if))
         {
-          gen->output << label << ":\n";
+          return;
         }
+        const Label end_label = gen->create_label();
+        gen->gen_if_arm(stmt_if->expr, stmt_if->scope, stmt_if->cont, end_label);
+        gen->output << end_label << ":\n";
       }
       void operator()(const NodeStmtConst *stmt_const) const
       {
         if (gen->is_declared(stmt_const->ident.val.value()))
         {
-          std::cerr << "Variable " << stmt_const->ident.val.value() << " already declared" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Variable " << stmt_const->ident.val.value() << " already declared" << std::endl;
+          throw CompileError();
         }
         DataType expr_type = gen->gen_expr(stmt_const->expr);
-        if (expr_type != stmt_const->dtype)
-        {
-          std::cerr << "Error: Type mismatch for variable '" << stmt_const->ident.val.value()
-                    << "'. Expected " << gen->type_to_string(stmt_const->dtype)
-                    << " but got " << gen->type_to_string(expr_type) << std::endl;
-          exit(EXIT_FAILURE);
-        }
-        gen->declare_var(stmt_const->ident.val.value(), Var(gen->stack_size, stmt_const->dtype));
+        gen->check_init_type(stmt_const->ident.val.value(), stmt_const->dtype, expr_type);
+        const auto var = Var(gen->layout.slot_of(stmt_const), stmt_const->dtype);
+        gen->pop("rax");
+        gen->output << "    mov " << gen->var_operand(var) << ", rax\n";
+        gen->declare_var(stmt_const->ident.val.value(), var);
       }
       void operator()(const NodeStmtLet *stmt_let) const
       {
         if (gen->is_declared(stmt_let->ident.val.value()))
         {
-          std::cerr << "Variable " << stmt_let->ident.val.value() << " already declared" << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Variable " << stmt_let->ident.val.value() << " already declared" << std::endl;
+          throw CompileError();
         }
-        if (!stmt_let->expr.has_value())
+        auto var = Var(gen->layout.slot_of(stmt_let), stmt_let->dtype, true);
+        if (stmt_let->dtype == DataType::IntArray)
         {
-          gen->output << "mov rax, 0\n";
-          gen->push("rax");
+          var.length = stmt_let->length;
+          gen->zero_array(var);
+        }
+        else if (!stmt_let->expr.has_value())
+        {
+          gen->output << "    mov " << gen->var_operand(var) << ", 0\n";
         }
         else
         {
           DataType expr_type = gen->gen_expr(stmt_let->expr.value());
-          if (expr_type != stmt_let->dtype)
-          {
-            std::cerr << "Error: Type mismatch for variable '" << stmt_let->ident.val.value()
-                      << "'. Expected " << gen->type_to_string(stmt_let->dtype)
-                      << " but got " << gen->type_to_string(expr_type) << std::endl;
-            exit(EXIT_FAILURE);
-          }
+          gen->check_init_type(stmt_let->ident.val.value(), stmt_let->dtype, expr_type);
+          gen->pop("rax");
+          gen->output << "    mov " << gen->var_operand(var) << ", rax\n";
         }
-        gen->declare_var(stmt_let->ident.val.value(), Var(gen->stack_size, stmt_let->dtype, true));
+        gen->declare_var(stmt_let->ident.val.value(), var);
       }
       void operator()(const NodeStmtAssign *stmt_assign)
       {
         if (!stmt_assign->ident.val.has_value())
         {
-          std::cerr << "Error: Assignment statement missing identifier." << std::endl;
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Assignment statement missing identifier." << std::endl;
+          throw CompileError();
         }
         if (!gen->globals.contains(stmt_assign->ident.val.value()))
         {
-          std::cerr << "You need to declare the variable first";
-          exit(EXIT_FAILURE);
+          diagnostics() << "You need to declare the variable first";
+          throw CompileError();
         }
         auto &existing_var = gen->globals.at(stmt_assign->ident.val.value());
+        if (existing_var.dtype == DataType::IntArray)
+        {
+          diagnostics() << "Error: Cannot assign to array '" << stmt_assign->ident.val.value()
+                    << "'; assign to its elements instead\n";
+          throw CompileError();
+        }
         if (!existing_var.mut)
         {
-          std::cerr << "Error: Cannot assign to immutable variable '"
+          diagnostics() << "Error: Cannot assign to immutable variable '"
                     << stmt_assign->ident.val.value() << "'\n";
-          exit(EXIT_FAILURE);
+          throw CompileError();
         }
         DataType type = gen->gen_expr(stmt_assign->expr);
-        if (type != existing_var.dtype)
+        gen->check_assign_type(stmt_assign->ident.val.value(), existing_var, type);
+        gen->pop("rax");
+        gen->output << "    mov " << gen->var_operand(existing_var) << ", rax\n";
+      }
+      // The index is evaluated and checked before the value.
+      void operator()(const NodeStmtAssignIndex *stmt_assign_index) const
+      {
+        const Var &var = gen->array_var(stmt_assign_index->ident.val.value());
+        auto index = gen->constant_index(stmt_assign_index, stmt_assign_index->index);
+        if (!index.has_value())
+        {
+          gen->gen_index(stmt_assign_index->index);
+          gen->bounds_check(stmt_assign_index, "QWORD [rsp]", var);
+        }
+        DataType type = gen->gen_expr(stmt_assign_index->expr);
+        if (type != DataType::Int)
         {
-          std::cerr << "Error: Type mismatch in assignment to '"
-                    << stmt_assign->ident.val.value() << "'. Expected "
-                    << gen->type_to_string(existing_var.dtype)
-                    << ", got " << gen->type_to_string(type) << "\n";
-          exit(EXIT_FAILURE);
+          diagnostics() << "Error: Type mismatch in assignment to '" << stmt_assign_index->ident.val.value()
+                    << "'. Expected int, got " << gen->type_to_string(type) << "\n";
+          throw CompileError();
         }
-        const auto new_var = Var(gen->stack_size, type, true);
-        gen->update_var(stmt_assign->ident.val.value(), existing_var, new_var);
+        gen->pop("rax");
+        if (index.has_value())
+        {
+          gen->output << "    mov " << gen->element_operand(var, index.value()) << ", rax\n";
+          return;
+        }
+        gen->pop("rbx");
+        gen->output << "    mov " << gen->element_operand(var, "rbx") << ", rax\n";
       }
       void operator()(const NodeStmtScope *stmt_scope) const
       {
         gen->gen_scope(stmt_scope);
       }
+      void operator()(const NodeStmtWhile *stmt_while) const
+      {
+        gen->gen_loop(stmt_while, stmt_while->expr, stmt_while->scope, nullptr);
+      }
+      void operator()(const NodeStmtFor *stmt_for) const
+      {
+        gen->enter_scope();
+        gen->gen_stmt(stmt_for->init);
+        const LoopOptimiser::LoopPlan *plan = gen->loops.plan_for(stmt_for);
+        if (plan != nullptr && plan->vector.has_value() && gen->options.simd)
+        {
+          gen->gen_vector_loop(plan->vector.value());
+        }
+        gen->gen_loop(stmt_for, stmt_for->cond, stmt_for->scope, stmt_for->step);
+        gen->exit_scope();
+      }
     };
     StmtVisitor visitor{this};
     std::visit(visitor, stmt->stmt);
+
+    // Step the derived induction variables that follow this statement.
+    if (auto updates = induction_updates.find(stmt); updates != induction_updates.end())
+    {
+      for (const auto &[index, delta] : updates->second)
+      {
+        if (delta >= INT32_MIN && delta <= INT32_MAX)
+        {
+          output << "    add " << stack_operand(index) << ", " << delta << "\n";
+        }
+        else
+        {
+          output << "    mov rax, " << delta << "\n";
+          output << "    add " << stack_operand(index) << ", rax\n";
+        }
+      }
+    }
   }
 
-  std::string gen_prog()
+  const AsmBuffer &gen_prog()
   {
 
-    output << "extern print_int\n"
-           << "extern print_string\n"
-           << "extern print_char\n"
-           << "extern overflow_error\n"
-           << "extern divzero_error\n"
-           << "global _start\n"
-           << "_start:\n";
+    const bool vector_loops = options.simd && loops.stats().vectorised > 0;
+    output << "_start:\n";
+
+    for (const NodeFunc *func : prog.funcs)
+    {
+      if (!funcs.try_emplace(func->ident.val.value(), func).second)
+      {
+        diagnostics() << "Error: Function '" << func->ident.val.value() << "' already defined" << std::endl;
+        throw CompileError();
+      }
+    }
+
+    output << "    mov rbp, rsp\n";
+    frame_slots = layout.frame_slots();
+    if (frame_slots > 0)
+    {
+      output << "    sub rsp, " << frame_slots * 8 << "\n";
+    }
+    if (vector_loops)
+    {
+      output << "    call " << runtime("cpu_init") << "\n";
+    }
+    gen_stats.peak_stack_depth = frame_slots * 8;
+
+    gen_stmts(prog.stmts);
+
+    // Falling off the end of the program exits with status 0.
+    if (!is_terminated)
+    {
+      output << "    mov rax, 0\n";
+      push("rax");
+      gen_exit();
+    }
+
+    // Functions are emitted once something calls them out of line.
+    globals.clear();
+    scopes.clear();
+    for (size_t i = 0; i < pending_funcs.size(); i++)
+    {
+      gen_func(pending_funcs[i]);
+    }
+
+    if (cold_output.size() > 0)
+    {
+      output << "section .text.cold progbits alloc exec nowrite align=16\n";
+      output.append(cold_output);
+    }
+    if (gen_stats.jump_tables > 0 || !strings.empty())
+    {
+      output << "section .rodata\n";
+      output.append(rodata_output);
+      gen_string_pool();
+    }
+    if (options.instrument)
+    {
+      // Read by profile_exit in profile.asm, in BranchProfile's format.
+      output << "section .data\n"
+             << "align 8\n"
+             << "profile_header:\n"
+             << "    dq " << BranchProfile::magic << ", " << static_cast<int64_t>(profile.source_hash())
+             << ", " << profile.sites() << "\n"
+             << "profile_counts:\n";
+      for (size_t i = 0; i < profile.sites(); i++)
+      {
+        output << "    dq 0, 0\n";
+      }
+    }
 
-    for (const NodeStmt *stmt : prog.stmts)
+    // Only the runtime routines the code refers to are declared, so only
+    // the runtime modules defining them are linked, and that is known once
+    // the code is generated.
+    AsmBuffer code;
+    output.swap(code);
+    for (std::string_view name : runtime_refs)
+    {
+      output << "extern " << name << "\n";
+    }
+    if (options.instrument)
     {
-      if (is_terminated)
-        return output.str();
-      gen_stmt(stmt);
+      output << "global profile_header\n";
     }
+    output << "global _start\n";
+    output.append(code);
+    return output;
+  }
 
-    gen_exit();
+  // The runtime routines and data the generated code refers to, in order
+  // of first use.
+  const std::vector<std::string_view> &runtime_symbols() const
+  {
+    return runtime_refs;
+  }
 
-    return output.str();
+  const Stats &stats() const
+  {
+    return gen_stats;
   }
 
 private:
   struct Var
   {
-    size_t stack_loc;
+    size_t slot;
     DataType dtype;
     bool mut;
-    Var() : stack_loc(0), dtype(DataType::Int), mut(false) {}
-    Var(size_t stack_loc, DataType dtype, bool mut = false)
-        : stack_loc(stack_loc), dtype(dtype), mut(mut) {}
+    size_t length = 0;     // elements, for arrays
+    bool on_stack = false; // slot is a value stack index, in an inlined call
+    Var() : slot(0), dtype(DataType::Int), mut(false) {}
+    Var(size_t slot, DataType dtype, bool mut = false)
+        : slot(slot), dtype(dtype), mut(mut) {}
   };
 
   struct ScopeEntry
@@ -675,56 +1302,1312 @@ private:
     std::optional<Var> old_binding; // empty if no shadowing
   };
 
-  void push(const std::string &reg)
-  {
-    output << "    push " << reg << "\n";
-    stack_size++;
-  }
-  void pop(const std::string &reg)
-  {
-    output << "    pop " << reg << "\n";
-    stack_size--;
-  }
-  std::string create_label()
+  // One arm of an if/elif/else chain considered for cmov lowering; `cond`
+  // is null for the else arm.
+  struct SelectArm
   {
-    std::stringstream ss;
-    ss << "label" << label_count++;
-    return ss.str();
-  }
+    const NodeExpr *cond;
+    const NodeStmtScope *scope;
+  };
 
-  void enter_scope()
+  // One arm of an if/elif chain lowered by gen_switch.
+  struct SwitchCase
   {
-    scopes.push_back({});
-  }
+    int64_t value;
+    const NodeStmtScope *scope;
+    Label label;
+  };
 
-  void exit_scope()
+  static constexpr size_t min_switch_cases = 4;
+  static constexpr size_t max_jump_table_entries = 4096;
+  static constexpr size_t jump_table_density = 2; // entries per case, at most
+  static constexpr size_t max_linear_search = 3;
+
+  // Collects the arms of `stmt_if` if it can be lowered by gen_switch: at
+  // least min_switch_cases arms, each testing `subject == constant` (or
+  // `constant == subject`) for the same speculatable subject and distinct
+  // constants of one kind, optionally followed by an else.
+  bool switch_cases(const NodeStmtIf *stmt_if, const NodeExpr *&subject, TokenType &kind,
+                    std::vector<SwitchCase> &cases, const NodeStmtScope *&otherwise) const
   {
-    for (auto &entry : scopes.back())
+    std::unordered_set<int64_t> values;
+    auto add_case = [&](const NodeExpr *cond, const NodeStmtScope *scope)
     {
-      if (entry.old_binding.has_value())
+      auto *bin_expr = std::get_if<NodeBinExpr *>(&cond->var);
+      if (bin_expr == nullptr || !std::holds_alternative<NodeBinExprEq *>((*bin_expr)->op))
+        return false;
+      const NodeBinExprEq *eq = std::get<NodeBinExprEq *>((*bin_expr)->op);
+      TokenType case_kind;
+      const NodeExpr *other = eq->lhs;
+      std::optional<int64_t> value = case_value(eq->rhs, case_kind);
+      if (!value.has_value())
       {
-        // Restore the old value (either from shadowing or from assignment)
-        globals[entry.name] = entry.old_binding.value();
+        other = eq->rhs;
+        value = case_value(eq->lhs, case_kind);
+      }
+      if (!value.has_value() || !values.insert(value.value()).second)
+        return false;
+      if (subject == nullptr)
+      {
+        if (!ranges.is_speculatable(other))
+          return false;
+        subject = other;
+        kind = case_kind;
+      }
+      else if (case_kind != kind || !same_expr(subject, other))
+      {
+        return false;
+      }
+      cases.push_back({value.value(), scope, {}});
+      return true;
+    };
+
+    if (!add_case(stmt_if->expr, stmt_if->scope))
+      return false;
+    std::optional<NodeStmtIfCont *> cont = stmt_if->cont;
+    while (cont.has_value())
+    {
+      if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+      {
+        if (!add_case((*stmt_elif)->expr, (*stmt_elif)->scope))
+          return false;
+        cont = (*stmt_elif)->cont;
       }
       else
       {
-        // Variable was new, remove it
-        globals.erase(entry.name);
+        otherwise = std::get<NodeStmtElse *>(cont.value()->clause)->scope;
+        cont = std::nullopt;
       }
     }
-    scopes.pop_back();
+    return cases.size() >= min_switch_cases;
+  }
+
+  // Value of an int or char literal, possibly negated or parenthesised.
+  static std::optional<int64_t> case_value(const NodeExpr *expr, TokenType &kind)
+  {
+    auto *term = std::get_if<NodeTerm *>(&expr->var);
+    if (term == nullptr)
+      return std::nullopt;
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&(*term)->val))
+      return case_value((*term_paren)->expr, kind);
+    bool negate = false;
+    const NodeTerm *operand = *term;
+    if (auto *term_unary = std::get_if<NodeTermUnary *>(&operand->val))
+    {
+      if ((*term_unary)->op != UnaryOp::Negate)
+        return std::nullopt;
+      negate = true;
+      operand = (*term_unary)->operand;
+    }
+    auto *term_lit = std::get_if<NodeTermLit *>(&operand->val);
+    if (term_lit == nullptr)
+      return std::nullopt;
+    const Token &tok = (*term_lit)->token;
+    int64_t value;
+    if (tok.type == TokenType::char_lit && !negate)
+    {
+      value = tok.val.value()[0];
+    }
+    else if (tok.type == TokenType::int_lit)
+    {
+      try
+      {
+        size_t idx;
+        value = std::stoll(tok.val.value(), &idx, 10);
+        if (idx != tok.val.value().size())
+          return std::nullopt;
+      }
+      catch (const std::exception &)
+      {
+        // Reported when the chain is generated as written.
+        return std::nullopt;
+      }
+    }
+    else
+    {
+      return std::nullopt;
+    }
+    kind = tok.type;
+    return negate ? -value : value;
+  }
+
+  // What printing `expr` writes, newline included, if it is a literal.
+  static std::optional<std::string> constant_text(const NodeExpr *expr)
+  {
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      if (auto *term_lit = std::get_if<NodeTermLit *>(&(*term)->val))
+      {
+        const Token &tok = (*term_lit)->token;
+        if (tok.type == TokenType::str_lit)
+          return tok.val.value() + "\n";
+        if (tok.type == TokenType::bool_lit)
+          return tok.val.value() == "true" ? "1\n" : "0\n";
+      }
+    }
+    TokenType kind;
+    std::optional<int64_t> value = case_value(expr, kind);
+    if (!value.has_value())
+      return std::nullopt;
+    if (kind == TokenType::char_lit)
+      return std::string(1, static_cast<char>(value.value())) + "\n";
+    return std::to_string(value.value()) + "\n";
+  }
+
+  // Prints `text` from the string pool, which holds each distinct text once.
+  // A text of up to 8 bytes is stored into the output buffer straight from
+  // an immediate instead.
+  void gen_print_text(const std::string &text)
+  {
+    if (text.size() <= 8)
+    {
+      uint64_t bytes = 0;
+      std::memcpy(&bytes, text.data(), text.size());
+      gen_buffer_store(8, [&]
+                       {
+                         output << "    mov rcx, " << static_cast<int64_t>(bytes) << "\n";
+                         output << "    mov [rsi + rax], rcx\n";
+                       });
+      output << "    add rax, " << text.size() << "\n";
+      output << "    mov [rel out_len], rax\n";
+      return;
+    }
+    auto [it, inserted] = string_ids.try_emplace(text, strings.size());
+    if (inserted)
+    {
+      strings.push_back(&it->first);
+    }
+    output << "    lea rdi, [rel string" << it->second << "]\n";
+    output << "    mov rsi, " << text.size() << "\n";
+    output << "    call " << runtime("print_bytes") << "\n";
+  }
+
+  // Prints the character in rdi, as print_char would.
+  void gen_print_char()
+  {
+    gen_buffer_store(2, [&]
+                     {
+                       output << "    mov [rsi + rax], dil\n";
+                       output << "    mov byte [rsi + rax + 1], 10\n";
+                     });
+    output << "    add rax, 2\n";
+    output << "    mov [rel out_len], rax\n";
+  }
+
+  // Emits what `store` generates to write up to `bytes` bytes at rsi + rax,
+  // the end of output.asm's output buffer, in place of calling a print
+  // routine. The call would cost more than the store itself. A full buffer
+  // is flushed by a block in .text.cold, which keeps rdi.
+  template <typename F>
+  void gen_buffer_store(size_t bytes, F store)
+  {
+    const Label room = create_label();
+    const Label full = create_label();
+    output << "    mov rax, [rel " << runtime("out_len") << "]\n";
+    output << "    cmp rax, " << output_buffer_size - bytes << "\n";
+    output << "    ja " << full << "\n";
+    output << room << ":\n";
+    output << "    lea rsi, [rel " << runtime("out_buf") << "]\n";
+    store();
+    cold_output << full << ":\n"
+                << "    push rdi\n"
+                << "    call " << runtime("flush_output") << "\n"
+                << "    pop rdi\n"
+                << "    xor rax, rax\n"
+                << "    jmp " << room << "\n";
+    gen_stats.inlined_prints++;
+  }
+
+  // The texts are written as numbers so no character needs quoting.
+  void gen_string_pool()
+  {
+    for (size_t id = 0; id < strings.size(); id++)
+    {
+      const std::string &text = *strings[id];
+      output << "string" << id << ":\n";
+      for (size_t i = 0; i < text.size(); i += 16)
+      {
+        output << "    db ";
+        for (size_t j = i; j < std::min(text.size(), i + 16); j++)
+        {
+          output << (j == i ? "" : ", ") << static_cast<int>(static_cast<unsigned char>(text[j]));
+        }
+        output << "\n";
+      }
+    }
+    gen_stats.strings = strings.size();
+  }
+
+  static bool same_expr(const NodeExpr *a, const NodeExpr *b)
+  {
+    if (a->var.index() != b->var.index())
+      return false;
+    if (auto *term = std::get_if<NodeTerm *>(&a->var))
+      return same_term(*term, std::get<NodeTerm *>(b->var));
+    const NodeBinExpr *lhs = std::get<NodeBinExpr *>(a->var);
+    const NodeBinExpr *rhs = std::get<NodeBinExpr *>(b->var);
+    if (lhs->op.index() != rhs->op.index())
+      return false;
+    return std::visit([rhs](const auto *op)
+                      {
+                        using Op = std::remove_const_t<std::remove_pointer_t<decltype(op)>>;
+                        const Op *other = std::get<Op *>(rhs->op);
+                        return same_expr(op->lhs, other->lhs) && same_expr(op->rhs, other->rhs); },
+                      lhs->op);
   }
 
-  void update_var(const std::string &name, Var &old_var, Var new_var)
+  static bool same_term(const NodeTerm *a, const NodeTerm *b)
   {
-    // Save the current state before modifying
-    if (!scopes.empty())
+    if (a->val.index() != b->val.index())
+      return false;
+    if (auto *lit = std::get_if<NodeTermLit *>(&a->val))
+    {
+      const Token &other = std::get<NodeTermLit *>(b->val)->token;
+      return (*lit)->token.type == other.type && (*lit)->token.val == other.val;
+    }
+    if (auto *ident = std::get_if<NodeTermIdent *>(&a->val))
+      return (*ident)->ident.val == std::get<NodeTermIdent *>(b->val)->ident.val;
+    if (auto *paren = std::get_if<NodeTermParen *>(&a->val))
+      return same_expr((*paren)->expr, std::get<NodeTermParen *>(b->val)->expr);
+    if (auto *unary = std::get_if<NodeTermUnary *>(&a->val))
+    {
+      const NodeTermUnary *other = std::get<NodeTermUnary *>(b->val);
+      return (*unary)->op == other->op && same_term((*unary)->operand, other->operand);
+    }
+    if (auto *index = std::get_if<NodeTermIndex *>(&a->val))
     {
-      scopes.back().push_back({name, old_var});
+      const NodeTermIndex *other = std::get<NodeTermIndex *>(b->val);
+      return (*index)->ident.val == other->ident.val && same_expr((*index)->index, other->index);
     }
+    return false;
+  }
 
-    // Now update the variable
-    old_var = new_var;
+  // Dispatches rax through a table of `span` arm addresses starting at the
+  // smallest case; values outside it, or on a hole, go to `default_label`.
+  void gen_jump_table(const std::vector<SwitchCase> &sorted, uint64_t span, Label default_label)
+  {
+    const int64_t low = sorted.front().value;
+    if (low >= INT32_MIN && low <= INT32_MAX)
+    {
+      if (low != 0)
+      {
+        output << "    sub rax, " << low << "\n";
+      }
+    }
+    else
+    {
+      output << "    mov rbx, " << low << "\n";
+      output << "    sub rax, rbx\n";
+    }
+    // Unsigned, so values below the smallest case wrap around and fail too.
+    output << "    cmp rax, " << span - 1 << "\n";
+    output << "    ja " << default_label << "\n";
+    const Label table = create_label();
+    output << "    lea rbx, [rel " << table << "]\n";
+    output << "    jmp QWORD [rbx + rax*8]\n";
+
+    rodata_output << "align 8\n"
+                  << table << ":\n";
+    size_t next = 0;
+    for (uint64_t offset = 0; offset < span; offset++)
+    {
+      if (static_cast<uint64_t>(sorted[next].value) - static_cast<uint64_t>(low) == offset)
+      {
+        rodata_output << "    dq " << sorted[next++].label << "\n";
+      }
+      else
+      {
+        rodata_output << "    dq " << default_label << "\n";
+      }
+    }
+    gen_stats.jump_tables++;
+  }
+
+  // Dispatches rax among sorted[lo, hi) by comparing with the middle case
+  // and recursing into the half that can still match, down to a few
+  // compares in a row.
+  void gen_search(const std::vector<SwitchCase> &sorted, size_t lo, size_t hi, Label default_label)
+  {
+    if (hi - lo <= max_linear_search)
+    {
+      for (size_t i = lo; i < hi; i++)
+      {
+        compare_case(sorted[i].value);
+        output << "    je " << sorted[i].label << "\n";
+      }
+      output << "    jmp " << default_label << "\n";
+      return;
+    }
+    const size_t mid = lo + (hi - lo) / 2;
+    const Label lower = create_label();
+    compare_case(sorted[mid].value);
+    output << "    je " << sorted[mid].label << "\n";
+    output << "    jl " << lower << "\n";
+    gen_search(sorted, mid + 1, hi, default_label);
+    output << lower << ":\n";
+    gen_search(sorted, lo, mid, default_label);
+  }
+
+  void compare_case(int64_t value)
+  {
+    if (value >= INT32_MIN && value <= INT32_MAX)
+    {
+      output << "    cmp rax, " << value << "\n";
+    }
+    else
+    {
+      output << "    mov rbx, " << value << "\n";
+      output << "    cmp rax, rbx\n";
+    }
+  }
+
+  static constexpr size_t max_inline_zero_stores = 8;
+  static constexpr size_t max_select_arms = 4;
+  static constexpr size_t max_select_assignments = 6;
+  // A branch is rare if it goes one way at most once in rare_share
+  // evaluations, and biased if at most once in biased_share.
+  static constexpr uint64_t rare_share = 20;
+  static constexpr uint64_t biased_share = 10;
+
+  // Collects the arms of `stmt_if` if it can be lowered by gen_select: a
+  // short chain whose arms only assign, at most once per variable, to
+  // mutable variables, where everything evaluated speculatively cannot
+  // trap and no value reads a variable assigned earlier in its own arm.
+  bool select_arms(const NodeStmtIf *stmt_if, std::vector<SelectArm> &arms) const
+  {
+    arms.push_back({stmt_if->expr, stmt_if->scope});
+    std::optional<NodeStmtIfCont *> cont = stmt_if->cont;
+    while (cont.has_value())
+    {
+      if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+      {
+        arms.push_back({(*stmt_elif)->expr, (*stmt_elif)->scope});
+        cont = (*stmt_elif)->cont;
+      }
+      else
+      {
+        arms.push_back({nullptr, std::get<NodeStmtElse *>(cont.value()->clause)->scope});
+        cont = std::nullopt;
+      }
+    }
+    if (arms.size() > max_select_arms)
+    {
+      return false;
+    }
+
+    size_t assignments = 0;
+    for (size_t i = 0; i < arms.size(); i++)
+    {
+      // The first condition is evaluated either way.
+      if (i > 0 && arms[i].cond != nullptr && !ranges.is_speculatable(arms[i].cond))
+      {
+        return false;
+      }
+      std::vector<std::string> assigned;
+      for (const NodeStmt *stmt : arms[i].scope->stmts)
+      {
+        auto *assign = std::get_if<NodeStmtAssign *>(&stmt->stmt);
+        if (assign == nullptr)
+        {
+          return false;
+        }
+        const std::string &name = (*assign)->ident.val.value();
+        auto var = globals.find(name);
+        if (var == globals.end() || !var->second.mut || var->second.dtype == DataType::IntArray)
+        {
+          return false;
+        }
+        if (std::find(assigned.begin(), assigned.end(), name) != assigned.end() ||
+            !ranges.is_speculatable((*assign)->expr) || reads_any((*assign)->expr, assigned))
+        {
+          return false;
+        }
+        assigned.push_back(name);
+        assignments++;
+      }
+    }
+    return assignments > 0 && assignments <= max_select_assignments;
+  }
+
+  // True if the profile shows `cond` rarely (or, for `held` false, rarely
+  // not) holding where it was evaluated.
+  bool is_rare(const NodeExpr *cond, bool held) const
+  {
+    auto counts = profile.counts_of(cond);
+    if (!counts.has_value() || counts->executed == 0)
+      return false;
+    const uint64_t hits = held ? counts->taken : counts->executed - counts->taken;
+    return hits * rare_share <= counts->executed;
+  }
+
+  // True if the profile shows every condition of a chain biased enough for
+  // the branches to predict well, which beats evaluating every arm.
+  bool is_biased(const std::vector<SelectArm> &arms) const
+  {
+    bool seen = false;
+    for (const SelectArm &arm : arms)
+    {
+      if (arm.cond == nullptr)
+        continue;
+      auto counts = profile.counts_of(arm.cond);
+      if (!counts.has_value())
+        return false;
+      if (counts->executed == 0)
+        continue;
+      const uint64_t minority = std::min(counts->taken, counts->executed - counts->taken);
+      if (minority * biased_share > counts->executed)
+        return false;
+      seen = true;
+    }
+    return seen;
+  }
+
+  static const NodeExpr *assigned_value(const SelectArm &arm, const std::string &name)
+  {
+    for (const NodeStmt *stmt : arm.scope->stmts)
+    {
+      const NodeStmtAssign *assign = std::get<NodeStmtAssign *>(stmt->stmt);
+      if (assign->ident.val.value() == name)
+      {
+        return assign->expr;
+      }
+    }
+    return nullptr;
+  }
+
+  static bool reads_any(const NodeExpr *expr, const std::vector<std::string> &names)
+  {
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      return reads_any(*term, names);
+    }
+    return std::visit([&names](const auto *op)
+                      { return reads_any(op->lhs, names) || reads_any(op->rhs, names); },
+                      std::get<NodeBinExpr *>(expr->var)->op);
+  }
+
+  static bool reads_any(const NodeTerm *term, const std::vector<std::string> &names)
+  {
+    if (auto *term_ident = std::get_if<NodeTermIdent *>(&term->val))
+    {
+      return std::find(names.begin(), names.end(), (*term_ident)->ident.val.value()) != names.end();
+    }
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return reads_any((*term_paren)->expr, names);
+    }
+    if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      return reads_any((*term_unary)->operand, names);
+    }
+    if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      return reads_any((*term_index)->index, names);
+    }
+    return false;
+  }
+
+  void check_init_type(const std::string &name, DataType expected, DataType type) const
+  {
+    if (type != expected)
+    {
+      diagnostics() << "Error: Type mismatch for variable '" << name
+                << "'. Expected " << type_to_string(expected)
+                << " but got " << type_to_string(type) << std::endl;
+      throw CompileError();
+    }
+  }
+
+  void check_assign_type(const std::string &name, const Var &var, DataType type) const
+  {
+    if (type != var.dtype)
+    {
+      diagnostics() << "Error: Type mismatch in assignment to '"
+                << name << "'. Expected "
+                << type_to_string(var.dtype)
+                << ", got " << type_to_string(type) << "\n";
+      throw CompileError();
+    }
+  }
+
+  // Memory operand of a variable: its slot in the current frame, or its
+  // place on the value stack for the parameters and locals of an inlined
+  // call.
+  struct VarOperand
+  {
+    bool on_stack;
+    size_t offset;
+    friend AsmBuffer &operator<<(AsmBuffer &out, VarOperand operand)
+    {
+      return out << (operand.on_stack ? "QWORD [rsp + " : "QWORD [rbp - ") << operand.offset << "]";
+    }
+  };
+
+  VarOperand var_operand(const Var &var) const
+  {
+    if (var.on_stack)
+    {
+      return {true, (stack_size - 1 - var.slot) * 8};
+    }
+    return {false, (var.slot + 1) * 8};
+  }
+
+  // Integer arguments go in these registers, in order, and the rest on the
+  // stack, as in the System V AMD64 ABI.
+  static constexpr std::array<std::string_view, 6> arg_registers = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+  static std::string func_label(const NodeFunc *func)
+  {
+    return "fn_" + func->ident.val.value();
+  }
+
+  const NodeFunc *lookup_func(const NodeTermCall *call) const
+  {
+    const std::string &name = call->ident.val.value();
+    auto func = funcs.find(name);
+    if (func == funcs.end())
+    {
+      diagnostics() << "Error: Function '" << name << "' not declared" << std::endl;
+      throw CompileError();
+    }
+    if (func->second->params.size() != call->args.size())
+    {
+      diagnostics() << "Error: Function '" << name << "' expects " << func->second->params.size()
+                << " arguments but got " << call->args.size() << std::endl;
+      throw CompileError();
+    }
+    return func->second;
+  }
+
+  void check_return_type(const NodeFunc *func, DataType type) const
+  {
+    if (type != func->ret)
+    {
+      diagnostics() << "Error: Function '" << func->ident.val.value() << "' returns "
+                << type_to_string(func->ret) << " but got " << type_to_string(type) << std::endl;
+      throw CompileError();
+    }
+  }
+
+  // Pushes the arguments of `call` left to right.
+  void gen_args(const NodeTermCall *call, const NodeFunc *func)
+  {
+    for (size_t k = 0; k < call->args.size(); k++)
+    {
+      DataType type = gen_expr(call->args[k]);
+      if (type != func->params[k].dtype)
+      {
+        diagnostics() << "Error: Type mismatch for argument " << k + 1 << " of '" << func->ident.val.value()
+                  << "'. Expected " << type_to_string(func->params[k].dtype)
+                  << " but got " << type_to_string(type) << std::endl;
+        throw CompileError();
+      }
+    }
+  }
+
+  // Calls `call` and pushes its result. Every frame starts 16-byte aligned
+  // at rbp, so the padding that aligns rsp at the call is known here.
+  DataType gen_call(const NodeTermCall *call)
+  {
+    const NodeFunc *func = lookup_func(call);
+    if (options.inline_calls && inliner.should_inline(call))
+    {
+      return gen_inline_call(call, func);
+    }
+    const size_t base = stack_size;
+    gen_args(call, func);
+    const size_t count = call->args.size();
+    const size_t in_registers = std::min(count, arg_registers.size());
+    if ((frame_slots + stack_size + count - in_registers) % 2 != 0)
+    {
+      output << "    sub rsp, 8\n";
+      stack_size++;
+    }
+    for (size_t k = count; k > in_registers; k--)
+    {
+      push(stack_operand(base + k - 1));
+    }
+    for (size_t k = 0; k < in_registers; k++)
+    {
+      output << "    mov " << arg_registers[k] << ", " << stack_operand(base + k) << "\n";
+    }
+    output << "    call " << func_label(func) << "\n";
+    if (stack_size > base)
+    {
+      output << "    add rsp, " << (stack_size - base) * 8 << "\n";
+    }
+    stack_size = base;
+    push("rax");
+
+    if (emitted_funcs.insert(func).second)
+    {
+      pending_funcs.push_back(func);
+    }
+    gen_stats.calls++;
+    return func->ret;
+  }
+
+  // Expands a call the inliner picked in place. Its arguments and locals
+  // stay on the value stack where they were computed and are addressed
+  // relative to rsp; the return value replaces them.
+  DataType gen_inline_call(const NodeTermCall *call, const NodeFunc *func)
+  {
+    const size_t base = stack_size;
+    gen_args(call, func);
+    auto caller_globals = std::exchange(globals, {});
+    auto caller_scopes = std::exchange(scopes, {});
+    const NodeFunc *caller = std::exchange(current_func, func);
+    enter_scope();
+    for (size_t k = 0; k < func->params.size(); k++)
+    {
+      declare_param(func->params[k], Var(base + k, func->params[k].dtype, true), true);
+    }
+    for (const NodeStmt *stmt : func->body->stmts)
+    {
+      if (auto *stmt_let = std::get_if<NodeStmtLet *>(&stmt->stmt))
+      {
+        gen_inline_local((*stmt_let)->ident, (*stmt_let)->dtype, (*stmt_let)->expr, true);
+      }
+      else if (auto *stmt_const = std::get_if<NodeStmtConst *>(&stmt->stmt))
+      {
+        gen_inline_local((*stmt_const)->ident, (*stmt_const)->dtype, (*stmt_const)->expr, false);
+      }
+      else if (auto *stmt_return = std::get_if<NodeStmtReturn *>(&stmt->stmt))
+      {
+        check_return_type(func, gen_expr((*stmt_return)->expr));
+      }
+      else
+      {
+        gen_stmt(stmt);
+      }
+    }
+    pop("rax");
+    if (stack_size > base)
+    {
+      output << "    add rsp, " << (stack_size - base) * 8 << "\n";
+    }
+    stack_size = base;
+    push("rax");
+    exit_scope();
+    globals = std::move(caller_globals);
+    scopes = std::move(caller_scopes);
+    current_func = caller;
+    gen_stats.inlined_calls++;
+    return func->ret;
+  }
+
+  void gen_inline_local(const Token &ident, DataType dtype, std::optional<NodeExpr *> expr, bool mut)
+  {
+    const std::string &name = ident.val.value();
+    if (is_declared(name))
+    {
+      diagnostics() << "Variable " << name << " already declared" << std::endl;
+      throw CompileError();
+    }
+    if (expr.has_value())
+    {
+      check_init_type(name, dtype, gen_expr(expr.value()));
+    }
+    else
+    {
+      output << "    mov rax, 0\n";
+      push("rax");
+    }
+    Var var(stack_size - 1, dtype, mut);
+    var.on_stack = true;
+    declare_var(name, var);
+  }
+
+  void declare_param(const NodeParam &param, Var var, bool on_stack)
+  {
+    const std::string &name = param.ident.val.value();
+    if (is_declared(name))
+    {
+      diagnostics() << "Error: Parameter '" << name << "' already declared" << std::endl;
+      throw CompileError();
+    }
+    var.on_stack = on_stack;
+    declare_var(name, var);
+  }
+
+  // Emits `func` out of line. On entry the parameters are copied from
+  // their registers, or from above the return address, to their slots.
+  // rbx is saved below the frame, the only callee-saved register the
+  // generated code uses besides rbp.
+  void gen_func(const NodeFunc *func)
+  {
+    output << func_label(func) << ":\n";
+    output << "    push rbp\n";
+    output << "    mov rbp, rsp\n";
+    frame_slots = layout.frame_slots(func);
+    if (frame_slots > 0)
+    {
+      output << "    sub rsp, " << frame_slots * 8 << "\n";
+    }
+    stack_size = 0;
+    push("rbx");
+    current_func = func;
+    is_terminated = false;
+    enter_scope();
+    for (size_t k = 0; k < func->params.size(); k++)
+    {
+      const NodeParam &param = func->params[k];
+      const Var var(layout.slot_of(&param), param.dtype, true);
+      if (k < arg_registers.size())
+      {
+        output << "    mov " << var_operand(var) << ", " << arg_registers[k] << "\n";
+      }
+      else
+      {
+        output << "    mov rax, QWORD [rbp + " << 16 + (k - arg_registers.size()) * 8 << "]\n";
+        output << "    mov " << var_operand(var) << ", rax\n";
+      }
+      declare_param(param, var, false);
+    }
+    gen_scope(func->body);
+    // Falling off the end of a function returns 0.
+    if (!is_terminated)
+    {
+      output << "    mov rax, 0\n";
+      gen_return();
+    }
+    exit_scope();
+    gen_stats.functions++;
+  }
+
+  // Returns rax from the current function.
+  void gen_return()
+  {
+    output << "    mov rbx, QWORD [rbp - " << (frame_slots + 1) * 8 << "]\n";
+    output << "    leave\n";
+    output << "    ret\n";
+    is_terminated = true;
+  }
+
+  // Memory operand of an array element: `index`, a register scaled by 8,
+  // plus `offset` elements. Element 0 lies `base` bytes below rbp.
+  struct ElementOperand
+  {
+    size_t base;
+    const char *index;
+    int64_t offset;
+    bool sized; // vector loads and stores take the address alone
+    friend AsmBuffer &operator<<(AsmBuffer &out, ElementOperand operand)
+    {
+      if (operand.sized)
+        out << "QWORD ";
+      out << "[rbp";
+      if (operand.index != nullptr)
+        out << " + " << operand.index << "*8";
+      return out << " - " << static_cast<int64_t>(operand.base) - operand.offset * 8 << "]";
+    }
+  };
+
+  ElementOperand element_operand(const Var &var, int64_t index, bool sized = true) const
+  {
+    return {(var.slot + var.length) * 8, nullptr, index, sized};
+  }
+
+  ElementOperand element_operand(const Var &var, const char *index, bool sized = true) const
+  {
+    return {(var.slot + var.length) * 8, index, 0, sized};
+  }
+
+  const Var &array_var(const std::string &name) const
+  {
+    auto var = globals.find(name);
+    if (var == globals.end())
+    {
+      diagnostics() << "Variable " << name << " not declared" << std::endl;
+      throw CompileError();
+    }
+    if (var->second.dtype != DataType::IntArray)
+    {
+      diagnostics() << "Error: '" << name << "' is not an array" << std::endl;
+      throw CompileError();
+    }
+    return var->second;
+  }
+
+  // The index of an access, if it is a literal or an int variable whose
+  // value range analysis pinned down, and is known to be in bounds. Such
+  // accesses address the element directly.
+  std::optional<int64_t> constant_index(const void *access, const NodeExpr *index)
+  {
+    auto *term = std::get_if<NodeTerm *>(&index->var);
+    if (term == nullptr || !ranges.in_bounds(access))
+    {
+      return std::nullopt;
+    }
+    bool simple = false;
+    if (auto *term_lit = std::get_if<NodeTermLit *>(&(*term)->val))
+    {
+      simple = (*term_lit)->token.type == TokenType::int_lit;
+    }
+    else if (auto *term_ident = std::get_if<NodeTermIdent *>(&(*term)->val))
+    {
+      auto var = globals.find((*term_ident)->ident.val.value());
+      simple = var != globals.end() && var->second.dtype == DataType::Int;
+    }
+    std::optional<Range> range = ranges.range_of(index);
+    if (!simple || !range.has_value() || !range->is_constant())
+    {
+      return std::nullopt;
+    }
+    gen_stats.bounds_checks_elided++;
+    return range->lo;
+  }
+
+  // Pushes an array index, which must be an int.
+  void gen_index(const NodeExpr *index)
+  {
+    if (gen_expr(index) != DataType::Int)
+    {
+      diagnostics() << "Error: Array index must be an integer" << std::endl;
+      throw CompileError();
+    }
+  }
+
+  // Emits the bounds check on `index` unless range analysis proved the
+  // access in bounds. An unsigned compare also catches negative indices.
+  template <typename Operand>
+  void bounds_check(const void *access, const Operand &index, const Var &var)
+  {
+    if (ranges.in_bounds(access))
+    {
+      gen_stats.bounds_checks_elided++;
+      return;
+    }
+    gen_stats.bounds_checks++;
+    output << "    cmp " << index << ", " << var.length << "\n";
+    output << "    jae " << runtime("bounds_error") << "\n";
+  }
+
+  // Arrays start out zeroed. Short ones are cleared with a store per
+  // element, longer ones with rep stosq.
+  void zero_array(const Var &var)
+  {
+    if (var.length <= max_inline_zero_stores)
+    {
+      for (size_t i = 0; i < var.length; i++)
+      {
+        output << "    mov " << element_operand(var, static_cast<int64_t>(i)) << ", 0\n";
+      }
+      return;
+    }
+    output << "    lea rdi, " << element_operand(var, int64_t{0}, false) << "\n";
+    output << "    mov rcx, " << var.length << "\n";
+    output << "    xor eax, eax\n";
+    output << "    rep stosq\n";
+  }
+
+  // Memory operand of the value pushed when the stack held `index` values.
+  struct StackOperand
+  {
+    size_t offset;
+    friend AsmBuffer &operator<<(AsmBuffer &out, StackOperand operand)
+    {
+      return out << "QWORD [rsp + " << operand.offset << "]";
+    }
+  };
+
+  StackOperand stack_operand(size_t index) const
+  {
+    return {(stack_size - 1 - index) * 8};
+  }
+
+  // A value kept on the stack for the duration of a loop.
+  struct LoopValue
+  {
+    size_t index;
+    DataType dtype;
+  };
+
+  // Register use while emitting one body of a vectorised loop: invariants
+  // and sums keep their registers, temporaries come from `free`.
+  struct VectorState
+  {
+    bool avx;
+    int width;
+    std::unordered_map<const NodeExpr *, int> invariants;
+    std::vector<int> free;
+    int first_temp;
+
+    std::string reg(int num) const
+    {
+      return (avx ? "ymm" : "xmm") + std::to_string(num);
+    }
+    int alloc()
+    {
+      int num = free.back();
+      free.pop_back();
+      return num;
+    }
+    void release(int num)
+    {
+      if (num >= first_temp)
+        free.push_back(num);
+    }
+  };
+
+  static constexpr int check_regs[] = {13, 14};
+  static constexpr int mask_reg = 15;
+
+  void gen_vector_body(const LoopOptimiser::VectorLoop &vector, size_t values_base, bool avx, Label done_label)
+  {
+    VectorState vs{avx, avx ? 4 : 2, {}, {}, 0};
+    const int64_t vector_end = vector.start + (vector.end - vector.start) / vs.width * vs.width;
+    int next = 0;
+    for (size_t i = 0; i < vector.invariants.size(); i++)
+    {
+      const int num = next++;
+      vs.invariants[vector.invariants[i]] = num;
+      if (avx)
+      {
+        output << "    vpbroadcastq " << vs.reg(num) << ", " << stack_operand(values_base + i) << "\n";
+      }
+      else
+      {
+        output << "    movq " << vs.reg(num) << ", " << stack_operand(values_base + i) << "\n";
+        output << "    punpcklqdq " << vs.reg(num) << ", " << vs.reg(num) << "\n";
+      }
+    }
+    std::vector<int> sums;
+    if (vector.sums)
+    {
+      for (size_t i = 0; i < vector.stmts.size(); i++)
+      {
+        sums.push_back(next++);
+        vector_zero(vs, sums.back());
+      }
+    }
+    vs.first_temp = next;
+    for (int num = static_cast<int>(LoopOptimiser::vector_registers); num-- > next;)
+    {
+      vs.free.push_back(num);
+    }
+    bool checks = false;
+    for (const LoopOptimiser::VectorStmt &vstmt : vector.stmts)
+    {
+      checks = checks || vstmt.check_sums || has_lane_checks(vstmt.value, vs);
+    }
+    if (checks)
+    {
+      vector_zero(vs, mask_reg);
+    }
+
+    const Label body_label = create_label();
+    output << "    mov rcx, " << vector.start << "\n";
+    output << "    align 16\n";
+    output << body_label << ":\n";
+    for (size_t i = 0; i < vector.stmts.size(); i++)
+    {
+      const LoopOptimiser::VectorStmt &vstmt = vector.stmts[i];
+      const int value = gen_vector_expr(vstmt.value, vs);
+      if (!vector.sums)
+      {
+        const Var &var = array_var(vstmt.target);
+        output << "    " << (avx ? "vmovdqu " : "movdqu ") << element_operand(var, "rcx", false) << ", "
+               << vs.reg(value) << "\n";
+      }
+      else if (!vstmt.check_sums)
+      {
+        vector_op(vs, "paddq", sums[i], sums[i], value);
+      }
+      else
+      {
+        // The sum is rebuilt in a check register, so its old value can
+        // serve as scratch for the overflow test.
+        vector_op(vs, "paddq", check_regs[1], sums[i], value);
+        vector_op(vs, "pxor", check_regs[0], check_regs[1], sums[i]);
+        vector_op(vs, "pxor", sums[i], check_regs[1], value);
+        vector_op(vs, "pand", check_regs[0], check_regs[0], sums[i]);
+        vector_op(vs, "por", mask_reg, mask_reg, check_regs[0]);
+        vector_move(vs, sums[i], check_regs[1]);
+      }
+      vs.release(value);
+    }
+    output << "    add rcx, " << vs.width << "\n";
+    output << "    cmp rcx, " << vector_end << "\n";
+    output << "    jne " << body_label << "\n";
+
+    if (checks)
+    {
+      output << "    " << (avx ? "vmovmskpd" : "movmskpd") << " eax, " << vs.reg(mask_reg) << "\n";
+    }
+    const Var &index = globals.at(vector.index);
+    if (!vector.sums)
+    {
+      if (avx)
+      {
+        output << "    vzeroupper\n";
+      }
+      if (checks)
+      {
+        output << "    test eax, eax\n";
+        output << "    jnz " << runtime("overflow_error") << "\n";
+      }
+      output << "    mov " << var_operand(index) << ", " << vector_end << "\n";
+      return;
+    }
+
+    // Sum the lanes of every total and add it to its variable, bailing out
+    // to the scalar loop on any overflow before anything is stored.
+    const Label fail_label = create_label();
+    const size_t lane_bytes = static_cast<size_t>(vs.width) * 8;
+    const size_t spill_bytes = lane_bytes * sums.size();
+    output << "    sub rsp, " << spill_bytes << "\n";
+    for (size_t i = 0; i < sums.size(); i++)
+    {
+      output << "    " << (avx ? "vmovdqu" : "movdqu") << " [rsp + " << i * lane_bytes << "], " << vs.reg(sums[i])
+             << "\n";
+    }
+    if (avx)
+    {
+      output << "    vzeroupper\n";
+    }
+    if (checks)
+    {
+      output << "    test eax, eax\n";
+      output << "    jnz " << fail_label << "\n";
+    }
+    for (size_t i = 0; i < sums.size(); i++)
+    {
+      const LoopOptimiser::VectorStmt &vstmt = vector.stmts[i];
+      const size_t at = i * lane_bytes;
+      output << "    mov rax, QWORD [rsp + " << at << "]\n";
+      for (int lane = 1; lane < vs.width; lane++)
+      {
+        output << "    add rax, QWORD [rsp + " << at + lane * 8 << "]\n";
+        output << "    jo " << fail_label << "\n";
+      }
+      output << "    mov rbx, " << var_operand(globals.at(vstmt.target)) << "\n";
+      output << "    " << (vstmt.subtract ? "sub" : "add") << " rbx, rax\n";
+      output << "    jo " << fail_label << "\n";
+      output << "    mov QWORD [rsp + " << at << "], rbx\n";
+    }
+    for (size_t i = 0; i < sums.size(); i++)
+    {
+      output << "    mov rax, QWORD [rsp + " << i * lane_bytes << "]\n";
+      output << "    mov " << var_operand(globals.at(vector.stmts[i].target)) << ", rax\n";
+    }
+    output << "    mov " << var_operand(index) << ", " << vector_end << "\n";
+    output << "    add rsp, " << spill_bytes << "\n";
+    output << "    jmp " << done_label << "\n";
+    output << fail_label << ":\n";
+    output << "    add rsp, " << spill_bytes << "\n";
+  }
+
+  // Evaluates `expr` in every lane and returns the register holding it.
+  int gen_vector_expr(const NodeExpr *expr, VectorState &vs)
+  {
+    if (auto invariant = vs.invariants.find(expr); invariant != vs.invariants.end())
+    {
+      return invariant->second;
+    }
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      return gen_vector_term(*term, vs);
+    }
+    const NodeBinExpr *bin_expr = std::get<NodeBinExpr *>(expr->var);
+    if (auto *add = std::get_if<NodeBinExprAdd *>(&bin_expr->op))
+    {
+      const int lhs = gen_vector_expr((*add)->lhs, vs);
+      const int rhs = gen_vector_expr((*add)->rhs, vs);
+      const int sum = vs.alloc();
+      vector_op(vs, "paddq", sum, lhs, rhs);
+      // Overflow if the result's sign differs from both operands'.
+      if (!ranges.no_overflow(*add))
+      {
+        lane_check(vs, sum, lhs, sum, rhs);
+      }
+      vs.release(lhs);
+      vs.release(rhs);
+      return sum;
+    }
+    const NodeBinExprSub *sub = std::get<NodeBinExprSub *>(bin_expr->op);
+    const int lhs = gen_vector_expr(sub->lhs, vs);
+    const int rhs = gen_vector_expr(sub->rhs, vs);
+    const int diff = vs.alloc();
+    vector_op(vs, "psubq", diff, lhs, rhs);
+    // Overflow if the operands' signs differ and the result's differs from lhs.
+    if (!ranges.no_overflow(sub))
+    {
+      lane_check(vs, lhs, rhs, lhs, diff);
+    }
+    vs.release(lhs);
+    vs.release(rhs);
+    return diff;
+  }
+
+  int gen_vector_term(const NodeTerm *term, VectorState &vs)
+  {
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return gen_vector_expr((*term_paren)->expr, vs);
+    }
+    if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      // Wraps like the scalar neg.
+      const int operand = gen_vector_term((*term_unary)->operand, vs);
+      const int negated = vs.alloc();
+      vector_zero(vs, negated);
+      vector_op(vs, "psubq", negated, negated, operand);
+      vs.release(operand);
+      return negated;
+    }
+    const NodeTermIndex *term_index = std::get<NodeTermIndex *>(term->val);
+    const Var &var = array_var(term_index->ident.val.value());
+    const int element = vs.alloc();
+    output << "    " << (vs.avx ? "vmovdqu " : "movdqu ") << vs.reg(element) << ", "
+           << element_operand(var, "rcx", false) << "\n";
+    gen_stats.bounds_checks_elided++;
+    return element;
+  }
+
+  bool has_lane_checks(const NodeExpr *expr, const VectorState &vs) const
+  {
+    if (vs.invariants.contains(expr))
+    {
+      return false;
+    }
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      return has_lane_checks(*term, vs);
+    }
+    return std::visit(
+        [&](const auto *op)
+        { return !ranges.no_overflow(op) || has_lane_checks(op->lhs, vs) || has_lane_checks(op->rhs, vs); },
+        std::get<NodeBinExpr *>(expr->var)->op);
+  }
+
+  bool has_lane_checks(const NodeTerm *term, const VectorState &vs) const
+  {
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return has_lane_checks((*term_paren)->expr, vs);
+    }
+    if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      return has_lane_checks((*term_unary)->operand, vs);
+    }
+    return false;
+  }
+
+  // `dst = a op b` for an SSE2 mnemonic, in the three-operand AVX2 form or
+  // as a copy and a two-operand SSE2 instruction.
+  void vector_op(const VectorState &vs, const char *op, int dst, int a, int b)
+  {
+    if (vs.avx)
+    {
+      output << "    v" << op << " " << vs.reg(dst) << ", " << vs.reg(a) << ", " << vs.reg(b) << "\n";
+      return;
+    }
+    if (dst == b && dst != a)
+    {
+      // Only reached for the commutative operations.
+      std::swap(a, b);
+    }
+    if (dst != a)
+    {
+      vector_move(vs, dst, a);
+    }
+    output << "    " << op << " " << vs.reg(dst) << ", " << vs.reg(b) << "\n";
+  }
+
+  void vector_move(const VectorState &vs, int dst, int src)
+  {
+    output << "    " << (vs.avx ? "vmovdqa " : "movdqa ") << vs.reg(dst) << ", " << vs.reg(src) << "\n";
+  }
+
+  void vector_zero(const VectorState &vs, int dst)
+  {
+    vector_op(vs, "pxor", dst, dst, dst);
+  }
+
+  // ORs the sign bits of (a1 ^ b1) & (a2 ^ b2) into the overflow mask.
+  void lane_check(const VectorState &vs, int a1, int b1, int a2, int b2)
+  {
+    vector_op(vs, "pxor", check_regs[0], a1, b1);
+    vector_op(vs, "pxor", check_regs[1], a2, b2);
+    vector_op(vs, "pand", check_regs[0], check_regs[0], check_regs[1]);
+    vector_op(vs, "por", mask_reg, mask_reg, check_regs[0]);
+  }
+
+  template <typename Operand>
+  void push(const Operand &reg)
+  {
+    output << "    push " << reg << "\n";
+    stack_size++;
+    gen_stats.peak_stack_depth = std::max(gen_stats.peak_stack_depth, (frame_slots + stack_size) * 8);
+  }
+  void pop(std::string_view reg)
+  {
+    output << "    pop " << reg << "\n";
+    stack_size--;
+  }
+  // Emits the overflow check after an add/sub/imul unless range analysis
+  // proved the operation cannot overflow.
+  void overflow_check(const void *op)
+  {
+    if (ranges.no_overflow(op))
+    {
+      gen_stats.overflow_checks_elided++;
+      return;
+    }
+    gen_stats.overflow_checks++;
+    output << "    jo " << runtime("overflow_error") << "\n";
+  }
+
+  // Emits the zero-divisor check on rbx unless range analysis proved it nonzero.
+  void divzero_check(const void *op)
+  {
+    if (ranges.nonzero_divisor(op))
+    {
+      gen_stats.divzero_checks_elided++;
+      return;
+    }
+    gen_stats.divzero_checks++;
+    output << "    cmp rbx, 0\n";
+    output << "    je " << runtime("divzero_error") << "\n"; // check division by zero
+  }
+
+  Label create_label()
+  {
+    return {label_count++};
+  }
+
+  // Returns `name`, recording that the code refers to it.
+  std::string_view runtime(std::string_view name)
+  {
+    if (std::find(runtime_refs.begin(), runtime_refs.end(), name) == runtime_refs.end())
+    {
+      runtime_refs.push_back(name);
+    }
+    return name;
+  }
+
+  void enter_scope()
+  {
+    scopes.push_back({});
+  }
+
+  void exit_scope()
+  {
+    for (auto &entry : scopes.back())
+    {
+      if (entry.old_binding.has_value())
+      {
+        // Restore the shadowed binding
+        globals[entry.name] = entry.old_binding.value();
+      }
+      else
+      {
+        // Variable was new, remove it
+        globals.erase(entry.name);
+      }
+    }
+    scopes.pop_back();
   }
 
   void declare_var(const std::string &name, Var var)
@@ -766,16 +2649,42 @@ private:
       return "int";
     case DataType::Char:
       return "char";
+    case DataType::Bool:
+      return "bool";
+    case DataType::IntArray:
+      return "int[]";
     default:
       return "unknown";
     }
   }
 
+  // OUT_SIZE in output.asm, for prints written into its buffer in place.
+  static constexpr size_t output_buffer_size = 65536;
+
   bool is_terminated = false;
-  std::stringstream output;
+  AsmBuffer output;
+  AsmBuffer cold_output;   // blocks for .text.cold, emitted after everything else
+  AsmBuffer rodata_output; // jump tables
+  std::unordered_map<std::string, size_t> string_ids;
+  std::vector<const std::string *> strings; // the pool, in order of first use
+  std::vector<std::string_view> runtime_refs;
   const NodeProg prog;
+  const RangeAnalyser &ranges;
+  const FrameLayout &layout;
+  const LoopOptimiser &loops;
+  const Inliner &inliner;
+  const BranchProfile &profile;
+  const Options options;
+  Stats gen_stats;
   size_t stack_size = 0;
+  size_t frame_slots = 0; // of the function being generated
+  const NodeFunc *current_func = nullptr;
+  std::unordered_map<std::string, const NodeFunc *> funcs;
+  std::vector<const NodeFunc *> pending_funcs; // called out of line, emitted after `_start`
+  std::unordered_set<const NodeFunc *> emitted_funcs;
   int label_count = 0;
   std::unordered_map<std::string, Var> globals{};
+  std::unordered_map<const NodeExpr *, LoopValue> loop_values;
+  std::unordered_map<const NodeStmt *, std::vector<std::pair<size_t, int64_t>>> induction_updates;
   std::vector<std::vector<ScopeEntry>> scopes;
 };
\ No newline at end of file
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <variant>
+#include "./parser.hpp"
+
+// Decides which calls the generator expands in place rather than calling.
+// Only straight-line functions qualify: a body of scalar let/const
+// definitions, assignments and prints that ends in its only return. The
+// generator keeps the arguments and locals of an expanded call on the
+// value stack, so no frame is set up. A qualifying function that is not
+// recursive is inlined
+//
+// - at every call, if its body costs no more than the call sequence would,
+// - at calls inside loops, which are assumed hot, up to a larger cost, and
+// - at its only call in the program, up to a larger cost still, since the
+//   out-of-line copy is then never emitted.
+//
+// The cost of a body is the number of its statements, operators and
+// operands, which tracks the number of instructions it compiles to.
+class Inliner
+{
+public:
+  struct Stats
+  {
+    size_t call_sites = 0;
+    size_t inlined_sites = 0;
+  };
+
+  static constexpr size_t max_small_cost = 10;
+  static constexpr size_t max_hot_cost = 40;
+  static constexpr size_t max_single_call_cost = 200;
+  static constexpr size_t call_cost = 6;
+
+  explicit Inliner(const NodeProg &program) : prog(program) {}
+
+  void run()
+  {
+    for (const NodeFunc *func : prog.funcs)
+    {
+      // A duplicate definition is reported by the generator.
+      funcs.try_emplace(func->ident.val.value(), func);
+    }
+    visit_stmts(prog.stmts);
+    for (const NodeFunc *func : prog.funcs)
+    {
+      caller = func;
+      visit_stmts(func->body->stmts);
+    }
+    caller = nullptr;
+
+    std::unordered_map<const NodeFunc *, size_t> site_counts;
+    for (const Site &site : sites)
+    {
+      site_counts[site.callee]++;
+    }
+    for (const Site &site : sites)
+    {
+      std::optional<size_t> cost = body_cost(site.callee);
+      if (!cost.has_value() || is_recursive(site.callee))
+        continue;
+      bool inline_site = cost.value() <= max_small_cost ||
+                         (site.loop_depth > 0 && cost.value() <= max_hot_cost) ||
+                         (site_counts[site.callee] == 1 && cost.value() <= max_single_call_cost);
+      if (inline_site)
+      {
+        inlined.insert(site.call);
+        inline_stats.inlined_sites++;
+      }
+    }
+    inline_stats.call_sites = sites.size();
+  }
+
+  bool should_inline(const NodeTermCall *call) const
+  {
+    return inlined.contains(call);
+  }
+
+  const Stats &stats() const
+  {
+    return inline_stats;
+  }
+
+private:
+  struct Site
+  {
+    const NodeTermCall *call;
+    const NodeFunc *callee;
+    size_t loop_depth;
+  };
+
+  // Cost of a function that can be inlined, or nothing if it cannot.
+  std::optional<size_t> body_cost(const NodeFunc *func) const
+  {
+    const std::vector<NodeStmt *> &stmts = func->body->stmts;
+    if (stmts.empty() || !std::holds_alternative<NodeStmtReturn *>(stmts.back()->stmt))
+    {
+      return std::nullopt;
+    }
+    size_t cost = expr_cost(std::get<NodeStmtReturn *>(stmts.back()->stmt)->expr);
+    for (size_t i = 0; i + 1 < stmts.size(); i++)
+    {
+      const NodeStmt *stmt = stmts[i];
+      if (auto *stmt_let = std::get_if<NodeStmtLet *>(&stmt->stmt))
+      {
+        if ((*stmt_let)->dtype == DataType::IntArray)
+          return std::nullopt;
+        cost += 1 + ((*stmt_let)->expr.has_value() ? expr_cost((*stmt_let)->expr.value()) : 0);
+      }
+      else if (auto *stmt_const = std::get_if<NodeStmtConst *>(&stmt->stmt))
+        cost += 1 + expr_cost((*stmt_const)->expr);
+      else if (auto *stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->stmt))
+        cost += 1 + expr_cost((*stmt_assign)->expr);
+      else if (auto *stmt_print = std::get_if<NodeStmtPrint *>(&stmt->stmt))
+        cost += call_cost + expr_cost((*stmt_print)->expr);
+      else
+        return std::nullopt;
+    }
+    return cost;
+  }
+
+  static size_t expr_cost(const NodeExpr *expr)
+  {
+    if (auto *bin_expr = std::get_if<NodeBinExpr *>(&expr->var))
+    {
+      return std::visit([](const auto *op)
+                        { return 1 + expr_cost(op->lhs) + expr_cost(op->rhs); },
+                        (*bin_expr)->op);
+    }
+    return term_cost(std::get<NodeTerm *>(expr->var));
+  }
+
+  static size_t term_cost(const NodeTerm *term)
+  {
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return expr_cost((*term_paren)->expr);
+    }
+    if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      return 1 + term_cost((*term_unary)->operand);
+    }
+    if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      return 2 + expr_cost((*term_index)->index);
+    }
+    if (auto *term_call = std::get_if<NodeTermCall *>(&term->val))
+    {
+      size_t cost = call_cost;
+      for (const NodeExpr *arg : (*term_call)->args)
+      {
+        cost += expr_cost(arg);
+      }
+      return cost;
+    }
+    return 1;
+  }
+
+  // True if `func` can call itself, directly or through other functions.
+  bool is_recursive(const NodeFunc *func) const
+  {
+    std::unordered_set<const NodeFunc *> seen;
+    std::vector<const NodeFunc *> work{func};
+    while (!work.empty())
+    {
+      const NodeFunc *next = work.back();
+      work.pop_back();
+      auto callees = calls.find(next);
+      if (callees == calls.end())
+        continue;
+      for (const NodeFunc *callee : callees->second)
+      {
+        if (callee == func)
+          return true;
+        if (seen.insert(callee).second)
+          work.push_back(callee);
+      }
+    }
+    return false;
+  }
+
+  void visit_stmts(const std::vector<NodeStmt *> &stmts)
+  {
+    for (const NodeStmt *stmt : stmts)
+    {
+      visit_stmt(stmt);
+    }
+  }
+
+  void visit_stmt(const NodeStmt *stmt)
+  {
+    struct StmtVisitor
+    {
+      Inliner *inl;
+      void operator()(const NodeStmtExit *stmt_exit) const
+      {
+        inl->visit_expr(stmt_exit->expr);
+      }
+      void operator()(const NodeStmtPrint *stmt_print) const
+      {
+        inl->visit_expr(stmt_print->expr);
+      }
+      void operator()(const NodeStmtReturn *stmt_return) const
+      {
+        inl->visit_expr(stmt_return->expr);
+      }
+      void operator()(const NodeStmtCall *stmt_call) const
+      {
+        inl->visit_call(stmt_call->call);
+      }
+      void operator()(const NodeStmtConst *stmt_const) const
+      {
+        inl->visit_expr(stmt_const->expr);
+      }
+      void operator()(const NodeStmtLet *stmt_let) const
+      {
+        if (stmt_let->expr.has_value())
+        {
+          inl->visit_expr(stmt_let->expr.value());
+        }
+      }
+      void operator()(const NodeStmtAssign *stmt_assign) const
+      {
+        inl->visit_expr(stmt_assign->expr);
+      }
+      void operator()(const NodeStmtAssignIndex *stmt_assign_index) const
+      {
+        inl->visit_expr(stmt_assign_index->index);
+        inl->visit_expr(stmt_assign_index->expr);
+      }
+      void operator()(const NodeStmtScope *stmt_scope) const
+      {
+        inl->visit_stmts(stmt_scope->stmts);
+      }
+      void operator()(const NodeStmtWhile *stmt_while) const
+      {
+        inl->loop_depth++;
+        inl->visit_expr(stmt_while->expr);
+        inl->visit_stmts(stmt_while->scope->stmts);
+        inl->loop_depth--;
+      }
+      void operator()(const NodeStmtFor *stmt_for) const
+      {
+        inl->visit_stmt(stmt_for->init);
+        inl->loop_depth++;
+        inl->visit_expr(stmt_for->cond);
+        inl->visit_stmts(stmt_for->scope->stmts);
+        inl->visit_stmt(stmt_for->step);
+        inl->loop_depth--;
+      }
+      void operator()(const NodeStmtIf *stmt_if) const
+      {
+        inl->visit_expr(stmt_if->expr);
+        inl->visit_stmts(stmt_if->scope->stmts);
+        std::optional<NodeStmtIfCont *> cont = stmt_if->cont;
+        while (cont.has_value())
+        {
+          if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+          {
+            inl->visit_expr((*stmt_elif)->expr);
+            inl->visit_stmts((*stmt_elif)->scope->stmts);
+            cont = (*stmt_elif)->cont;
+          }
+          else
+          {
+            inl->visit_stmts(std::get<NodeStmtElse *>(cont.value()->clause)->scope->stmts);
+            cont = std::nullopt;
+          }
+        }
+      }
+    };
+    StmtVisitor visitor{this};
+    std::visit(visitor, stmt->stmt);
+  }
+
+  void visit_expr(const NodeExpr *expr)
+  {
+    if (auto *bin_expr = std::get_if<NodeBinExpr *>(&expr->var))
+    {
+      std::visit([this](const auto *op)
+                 {
+                   visit_expr(op->lhs);
+                   visit_expr(op->rhs); },
+                 (*bin_expr)->op);
+      return;
+    }
+    visit_term(std::get<NodeTerm *>(expr->var));
+  }
+
+  void visit_term(const NodeTerm *term)
+  {
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      visit_expr((*term_paren)->expr);
+    }
+    else if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      visit_term((*term_unary)->operand);
+    }
+    else if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      visit_expr((*term_index)->index);
+    }
+    else if (auto *term_call = std::get_if<NodeTermCall *>(&term->val))
+    {
+      visit_call(*term_call);
+    }
+  }
+
+  void visit_call(const NodeTermCall *call)
+  {
+    for (const NodeExpr *arg : call->args)
+    {
+      visit_expr(arg);
+    }
+    auto callee = funcs.find(call->ident.val.value());
+    if (callee == funcs.end() || callee->second->params.size() != call->args.size())
+    {
+      // Reported by the generator.
+      return;
+    }
+    sites.push_back({call, callee->second, loop_depth});
+    calls[caller].insert(callee->second);
+  }
+
+  const NodeProg &prog;
+  Stats inline_stats;
+  std::unordered_map<std::string, const NodeFunc *> funcs;
+  std::unordered_map<const NodeFunc *, std::unordered_set<const NodeFunc *>> calls; // caller -> callees
+  std::vector<Site> sites;
+  std::unordered_set<const NodeTermCall *> inlined;
+  const NodeFunc *caller = nullptr; // null in the program body
+  size_t loop_depth = 0;
+};
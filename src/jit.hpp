@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <vector>
+#include <sys/mman.h>
+#include "./linker.hpp"
+#include "./diagnostics.hpp"
+
+// Runs a linked program inside the compiler process. The image is copied
+// into fresh anonymous pages, each segment gets its final protection, and
+// control jumps to `_start` through a trampoline. Linking trampoline_asm in
+// place of exit.asm turns every exit of the program, including the runtime
+// error handlers, into a return from that trampoline. A Jit owns the
+// mapped image until it is destroyed, so a program can be loaded once and
+// timed over many runs without relinking.
+class Jit
+{
+public:
+  // jit_enter(entry) saves the host's callee-saved registers and stack
+  // pointer, then jumps to the program. exit_program(code) restores them and
+  // returns `code` from jit_enter.
+  static constexpr std::string_view trampoline_asm = R"asm(
+global jit_enter
+global exit_program
+
+section .data
+saved_rsp dq 0
+
+section .text
+jit_enter:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rel saved_rsp], rsp
+    sub rsp, 8 ; _start expects rsp 16-byte aligned, as in a new process
+    jmp rdi
+
+exit_program:
+    mov rsp, [rel saved_rsp]
+    mov rax, rdi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+)asm";
+
+  // Loads the program linked by `linker`, which must include
+  // trampoline_asm.
+  explicit Jit(Linker &linker)
+  {
+    linker.layout(0);
+    size = (linker.image_size() + Linker::page_size - 1) / Linker::page_size * Linker::page_size;
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+      diagnostics() << "Error: could not map memory for the program: " << std::strerror(errno) << std::endl;
+      throw CompileError();
+    }
+
+    base = static_cast<uint8_t *>(memory);
+    try
+    {
+      load(linker);
+    }
+    catch (const CompileError &)
+    {
+      munmap(base, size);
+      throw;
+    }
+  }
+
+  Jit(const Jit &other) = delete;
+  Jit &operator=(const Jit &other) = delete;
+
+  ~Jit()
+  {
+    munmap(base, size);
+  }
+
+  // Runs the program from _start and returns its exit code. The program
+  // may be run again; its writable data keeps whatever the last run left.
+  int64_t run() const
+  {
+    return enter(entry);
+  }
+
+  // Address of the global `name` in the loaded program, for calling a
+  // runtime routine directly. `linker` must be the one it was loaded from.
+  void *symbol(const Linker &linker, std::string_view name) const
+  {
+    return base + linker.symbol_offset(name);
+  }
+
+private:
+  // Copies the linked segments into the mapping and finds the entry points.
+  void load(Linker &linker)
+  {
+    std::vector<Segment> segments = linker.relocate(reinterpret_cast<uint64_t>(base));
+    for (const Segment &seg : segments)
+    {
+      std::memcpy(base + seg.offset, seg.data.data(), seg.data.size());
+      size_t length = (seg.mem_size + Linker::page_size - 1) / Linker::page_size * Linker::page_size;
+      int prot = PROT_READ | (seg.write ? PROT_WRITE : 0) | (seg.exec ? PROT_EXEC : 0);
+      if (length > 0 && mprotect(base + seg.offset, length, prot) != 0)
+      {
+        diagnostics() << "Error: could not protect program memory: " << std::strerror(errno) << std::endl;
+        throw CompileError();
+      }
+    }
+    enter = reinterpret_cast<Enter>(base + linker.symbol_offset("jit_enter"));
+    entry = reinterpret_cast<uint64_t>(base + linker.symbol_offset("_start"));
+  }
+
+  using Enter = int64_t (*)(uint64_t entry);
+
+  uint8_t *base = nullptr;
+  size_t size = 0;
+  Enter enter = nullptr;
+  uint64_t entry = 0;
+};
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "./assembler.hpp"
+#include "./diagnostics.hpp"
+
+// One loadable piece of a linked image, `offset` bytes from the image base.
+// `data` holds the initialised part; the rest up to `mem_size` is zeroed.
+struct Segment
+{
+  uint64_t offset;
+  std::vector<uint8_t> data;
+  uint64_t mem_size;
+  bool write;
+  bool exec;
+};
+
+// Static linker for assembled modules. Sections are grouped into an
+// executable, a read-only and a writable segment, each starting on its own
+// page, global symbols are resolved across modules and relocations are
+// applied for a chosen load address. Used both to write executables and to
+// load programs into memory.
+class Linker
+{
+public:
+  static constexpr uint64_t page_size = 0x1000;
+
+  void add(ObjectModule module)
+  {
+    modules.push_back(std::move(module));
+  }
+
+  // Adds a module that is only linked if the program needs it, like a
+  // member of a static library: if it defines a symbol a linked module
+  // refers to and leaves undefined.
+  void add_library(ObjectModule module)
+  {
+    library.push_back(std::move(module));
+  }
+
+  // Which of `members` a program referring to `names` needs, following the
+  // references of every member taken in turn.
+  static std::vector<bool> needed(std::vector<std::string> names, const std::vector<ObjectModule> &members)
+  {
+    std::vector<bool> taken(members.size(), false);
+    while (!names.empty())
+    {
+      std::string name = std::move(names.back());
+      names.pop_back();
+      for (size_t i = 0; i < members.size(); i++)
+      {
+        if (!taken[i] && members[i].defines(name))
+        {
+          taken[i] = true;
+          std::vector<std::string> more = members[i].references();
+          names.insert(names.end(), more.begin(), more.end());
+          break;
+        }
+      }
+    }
+    return taken;
+  }
+
+  // Assigns every section an offset from the image base, leaving
+  // `header_size` bytes free at the start of the first segment, and resolves
+  // every symbol reference.
+  void layout(uint64_t header_size)
+  {
+    link_library();
+    segments.clear();
+    section_offsets.assign(modules.size(), {});
+    for (size_t m = 0; m < modules.size(); m++)
+    {
+      section_offsets[m].assign(modules[m].sections.size(), 0);
+    }
+
+    uint64_t cursor = header_size;
+    for (int kind = 0; kind < 3; kind++)
+    {
+      SegmentLayout seg{};
+      seg.offset = kind == 0 ? 0 : align_up(cursor, page_size);
+      seg.write = kind == 2;
+      seg.exec = kind == 0;
+      cursor = kind == 0 ? header_size : seg.offset;
+      uint64_t file_end = cursor;
+      bool used = false;
+      // Writable segments place nobits sections after everything else so
+      // they need no space in the file, and the executable segment places
+      // .text.cold after the rest of the code so hot code stays packed.
+      for (int late = 0; late < 2; late++)
+      {
+        for (size_t m = 0; m < modules.size(); m++)
+        {
+          for (size_t s = 0; s < modules[m].sections.size(); s++)
+          {
+            const ObjSection &section = modules[m].sections[s];
+            if (segment_kind(section) != kind || is_late(section) != (late == 1) || section.size == 0)
+              continue;
+            cursor = align_up(cursor, section.align);
+            section_offsets[m][s] = cursor;
+            cursor += section.size;
+            if (!section.nobits)
+              file_end = cursor;
+            used = true;
+          }
+        }
+      }
+      if (!used && kind != 0)
+        continue;
+      seg.file_size = file_end - seg.offset;
+      seg.mem_size = cursor - seg.offset;
+      segments.push_back(seg);
+    }
+    total_size = cursor;
+    resolve_symbols();
+  }
+
+  uint64_t image_size() const
+  {
+    return total_size;
+  }
+
+  // Offset of a global symbol from the image base.
+  uint64_t symbol_offset(std::string_view name) const
+  {
+    auto it = globals.find(std::string(name));
+    if (it == globals.end())
+    {
+      diagnostics() << "Link error: undefined symbol '" << name << "'\n";
+      throw CompileError();
+    }
+    return it->second;
+  }
+
+  // Copies the sections into their segments and applies relocations as if
+  // the image were loaded at `base`.
+  std::vector<Segment> relocate(uint64_t base) const
+  {
+    std::vector<Segment> out;
+    for (const SegmentLayout &seg : segments)
+    {
+      out.push_back({seg.offset, std::vector<uint8_t>(seg.file_size, 0), seg.mem_size, seg.write, seg.exec});
+    }
+
+    for (size_t m = 0; m < modules.size(); m++)
+    {
+      const ObjectModule &module = modules[m];
+      for (size_t s = 0; s < module.sections.size(); s++)
+      {
+        const ObjSection &section = module.sections[s];
+        if (section.nobits || section.data.empty())
+          continue;
+        Segment &seg = segment_at(out, section_offsets[m][s]);
+        std::memcpy(seg.data.data() + (section_offsets[m][s] - seg.offset), section.data.data(), section.data.size());
+      }
+
+      for (const ObjReloc &reloc : module.relocs)
+      {
+        uint64_t place = section_offsets[m][reloc.section] + reloc.offset;
+        Segment &seg = segment_at(out, place);
+        uint8_t *field = seg.data.data() + (place - seg.offset);
+        if (symbol_addrs[m][reloc.symbol] == undefined)
+          symbol_offset(module.symbols[reloc.symbol].name);
+        uint64_t target = base + symbol_addrs[m][reloc.symbol] + reloc.addend;
+        switch (reloc.type)
+        {
+        case RelocType::Abs64:
+          std::memcpy(field, &target, 8);
+          break;
+        case RelocType::Abs32S:
+        {
+          int64_t value = static_cast<int64_t>(target);
+          if (value < INT32_MIN || value > INT32_MAX)
+            out_of_range(m, reloc);
+          int32_t narrow = static_cast<int32_t>(value);
+          std::memcpy(field, &narrow, 4);
+          break;
+        }
+        case RelocType::PC32:
+        {
+          int64_t value = static_cast<int64_t>(target - (base + place));
+          if (value < INT32_MIN || value > INT32_MAX)
+            out_of_range(m, reloc);
+          int32_t narrow = static_cast<int32_t>(value);
+          std::memcpy(field, &narrow, 4);
+          break;
+        }
+        }
+      }
+    }
+    return out;
+  }
+
+private:
+  static constexpr uint64_t undefined = UINT64_MAX;
+
+  struct SegmentLayout
+  {
+    uint64_t offset;
+    uint64_t file_size;
+    uint64_t mem_size;
+    bool write;
+    bool exec;
+  };
+
+  static uint64_t align_up(uint64_t value, uint64_t align)
+  {
+    return (value + align - 1) / align * align;
+  }
+
+  // 0: code, 1: read-only data, 2: writable data
+  static int segment_kind(const ObjSection &section)
+  {
+    if (section.exec)
+      return 0;
+    return section.write ? 2 : 1;
+  }
+
+  static bool is_late(const ObjSection &section)
+  {
+    return section.nobits || section.name == ".text.cold";
+  }
+
+  static Segment &segment_at(std::vector<Segment> &segs, uint64_t offset)
+  {
+    for (size_t i = segs.size(); i-- > 0;)
+    {
+      if (segs[i].offset <= offset)
+        return segs[i];
+    }
+    return segs.front();
+  }
+
+  // Moves the library members the linked modules need in with them, in
+  // the order they were added.
+  void link_library()
+  {
+    std::vector<std::string> names;
+    for (const ObjectModule &module : modules)
+    {
+      for (std::string &name : module.references())
+      {
+        bool defined = false;
+        for (const ObjectModule &other : modules)
+          defined = defined || other.defines(name);
+        if (!defined)
+          names.push_back(std::move(name));
+      }
+    }
+    std::vector<bool> taken = needed(std::move(names), library);
+    for (size_t i = 0; i < library.size(); i++)
+    {
+      if (taken[i])
+        modules.push_back(std::move(library[i]));
+    }
+    library.clear();
+  }
+
+  void resolve_symbols()
+  {
+    globals.clear();
+    for (size_t m = 0; m < modules.size(); m++)
+    {
+      for (const ObjSymbol &symbol : modules[m].symbols)
+      {
+        if (!symbol.global || symbol.section < 0)
+          continue;
+        uint64_t offset = section_offsets[m][symbol.section] + symbol.offset;
+        if (!globals.emplace(symbol.name, offset).second)
+        {
+          diagnostics() << "Link error: symbol '" << symbol.name << "' defined more than once\n";
+          throw CompileError();
+        }
+      }
+    }
+
+    symbol_addrs.assign(modules.size(), {});
+    for (size_t m = 0; m < modules.size(); m++)
+    {
+      for (const ObjSymbol &symbol : modules[m].symbols)
+      {
+        if (symbol.section >= 0)
+        {
+          symbol_addrs[m].push_back(section_offsets[m][symbol.section] + symbol.offset);
+          continue;
+        }
+        // Declared but undefined symbols are only an error once referenced.
+        auto it = globals.find(symbol.name);
+        symbol_addrs[m].push_back(it == globals.end() ? undefined : it->second);
+      }
+    }
+  }
+
+  [[noreturn]] void out_of_range(size_t m, const ObjReloc &reloc) const
+  {
+    diagnostics() << "Link error: relocation against '" << modules[m].symbols[reloc.symbol].name
+              << "' does not fit in 32 bits\n";
+    throw CompileError();
+  }
+
+  std::vector<ObjectModule> modules;
+  std::vector<ObjectModule> library; // linked on demand by layout()
+  std::vector<std::vector<uint64_t>> section_offsets;
+  std::vector<std::vector<uint64_t>> symbol_addrs;
+  std::vector<SegmentLayout> segments;
+  std::unordered_map<std::string, uint64_t> globals;
+  uint64_t total_size = 0;
+};
@@ -0,0 +1,847 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <variant>
+#include "./parser.hpp"
+#include "./rangeAnalysis.hpp"
+
+// Plans the optimisation of every loop in the program; the generator
+// carries the plans out.
+//
+// - Loop-invariant expressions, whose variables are neither assigned nor
+//   declared anywhere in the loop, are evaluated once before the loop. Only
+//   expressions that cannot trap are hoisted, since the loop may not run.
+// - Basic induction variables, stepped by `i = i + c` or `i = i - c` once
+//   per iteration in the loop's own body or for step, make `i * k` a
+//   derived induction variable: it is evaluated before the loop and
+//   stepped by `c * k` alongside `i`, replacing each multiplication with a
+//   load. Only products proven not to overflow are reduced.
+// - Counted for loops with literal bounds, a small trip count and a small
+//   loop-free body are unrolled completely.
+// - Counted for loops stepping an index by one between constant bounds,
+//   whose body only stores element-wise sums and differences to arrays at
+//   that index, or only accumulates them into scalars, are vectorised: the
+//   generator runs two (SSE2) or four (AVX2) iterations at once in 64-bit
+//   lanes and leaves the remaining iterations to the scalar loop.
+class LoopOptimiser
+{
+public:
+  // `expr` (`i * k`) is kept up to date by adding `delta` after `update`,
+  // the statement stepping `i`.
+  struct Reduction
+  {
+    const NodeExpr *expr;
+    const NodeStmt *update;
+    int64_t delta;
+  };
+
+  // One statement of a vectorised loop: `target[i] = value`, or
+  // `target = target + value` / `target = target - value` for a sum.
+  struct VectorStmt
+  {
+    std::string target;
+    const NodeExpr *value;
+    bool subtract;
+    bool check_sums; // lane totals of a sum may overflow
+  };
+
+  // `for (let int index = start; index < end; index = index + 1)`. Every
+  // value is built from array elements at `index` and `invariants`, which
+  // are evaluated once before the loop and broadcast to every lane.
+  struct VectorLoop
+  {
+    std::string index;
+    int64_t start;
+    int64_t end;
+    bool sums; // the statements are sums, not stores
+    std::vector<VectorStmt> stmts;
+    std::vector<const NodeExpr *> invariants;
+  };
+
+  struct LoopPlan
+  {
+    std::vector<const NodeExpr *> hoisted;
+    std::vector<Reduction> reductions;
+    std::optional<size_t> trips; // set if the loop is unrolled completely
+    std::optional<VectorLoop> vector;
+  };
+
+  struct Stats
+  {
+    size_t hoisted = 0;
+    size_t reduced = 0;
+    size_t unrolled = 0;
+    size_t vectorised = 0;
+  };
+
+  static constexpr size_t max_unroll_trips = 8;
+  static constexpr size_t max_unrolled_stmts = 64;
+  static constexpr size_t max_loop_values = 8; // hoisted plus reduced, per loop
+  static constexpr size_t min_vector_trips = 8;
+  // xmm0-12 hold invariants, sums and temporaries; xmm13-15 are reserved
+  // for overflow checks.
+  static constexpr size_t vector_registers = 13;
+
+  LoopOptimiser(const NodeProg &program, const RangeAnalyser &range_analyser)
+      : prog(program), ranges(range_analyser) {}
+
+  void run()
+  {
+    visit_stmts(prog.stmts);
+    for (const NodeFunc *func : prog.funcs)
+    {
+      visit_stmts(func->body->stmts);
+    }
+  }
+
+  // Plan for a NodeStmtWhile or NodeStmtFor, or null if there is nothing to do.
+  const LoopPlan *plan_for(const void *loop) const
+  {
+    auto it = plans.find(loop);
+    return it == plans.end() ? nullptr : &it->second;
+  }
+
+  const Stats &stats() const
+  {
+    return loop_stats;
+  }
+
+private:
+  // What a loop's condition, body and step do to variables.
+  struct LoopFacts
+  {
+    std::unordered_map<std::string, size_t> assigned; // name -> assignments
+    std::unordered_set<std::string> declared;
+    size_t stmts = 0;
+    bool has_loop = false;
+  };
+
+  struct Induction
+  {
+    const NodeStmt *update;
+    int64_t step;
+  };
+
+  void visit_stmts(const std::vector<NodeStmt *> &stmts)
+  {
+    for (const NodeStmt *stmt : stmts)
+    {
+      visit_stmt(stmt);
+    }
+  }
+
+  void visit_stmt(const NodeStmt *stmt)
+  {
+    if (auto *stmt_scope = std::get_if<NodeStmtScope *>(&stmt->stmt))
+    {
+      visit_stmts((*stmt_scope)->stmts);
+    }
+    else if (auto *stmt_if = std::get_if<NodeStmtIf *>(&stmt->stmt))
+    {
+      visit_stmts((*stmt_if)->scope->stmts);
+      std::optional<NodeStmtIfCont *> cont = (*stmt_if)->cont;
+      while (cont.has_value())
+      {
+        if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+        {
+          visit_stmts((*stmt_elif)->scope->stmts);
+          cont = (*stmt_elif)->cont;
+        }
+        else
+        {
+          visit_stmts(std::get<NodeStmtElse *>(cont.value()->clause)->scope->stmts);
+          cont = std::nullopt;
+        }
+      }
+    }
+    else if (auto *stmt_while = std::get_if<NodeStmtWhile *>(&stmt->stmt))
+    {
+      plan_loop(*stmt_while, (*stmt_while)->expr, (*stmt_while)->scope, nullptr);
+      visit_stmts((*stmt_while)->scope->stmts);
+    }
+    else if (auto *stmt_for = std::get_if<NodeStmtFor *>(&stmt->stmt))
+    {
+      plan_loop(*stmt_for, (*stmt_for)->cond, (*stmt_for)->scope, (*stmt_for)->step);
+      if (auto trips = trip_count(*stmt_for))
+      {
+        plans[*stmt_for].trips = trips;
+        loop_stats.unrolled++;
+      }
+      else if (auto vector = vector_loop(*stmt_for))
+      {
+        plans[*stmt_for].vector = std::move(vector);
+        loop_stats.vectorised++;
+      }
+      visit_stmts((*stmt_for)->scope->stmts);
+    }
+  }
+
+  // Outer loops are planned first, so an expression hoisted or reduced by
+  // an outer loop is not claimed again by an inner one.
+  void plan_loop(const void *loop, const NodeExpr *cond, const NodeStmtScope *scope, const NodeStmt *step)
+  {
+    LoopFacts facts;
+    collect(scope->stmts, facts);
+    if (step != nullptr)
+    {
+      collect(step, facts);
+    }
+
+    std::unordered_map<std::string, Induction> inductions;
+    auto add_induction = [&](const NodeStmt *stmt)
+    {
+      auto *assign = std::get_if<NodeStmtAssign *>(&stmt->stmt);
+      if (assign == nullptr)
+        return;
+      const std::string &name = (*assign)->ident.val.value();
+      if (facts.assigned.at(name) != 1 || facts.declared.contains(name))
+        return;
+      if (auto step_value = induction_step(name, (*assign)->expr))
+      {
+        inductions[name] = {stmt, step_value.value()};
+      }
+    };
+    for (const NodeStmt *stmt : scope->stmts)
+    {
+      add_induction(stmt);
+    }
+    if (step != nullptr)
+    {
+      add_induction(step);
+    }
+
+    LoopPlan plan;
+    auto plan_expr = [&](const NodeExpr *expr)
+    { find_candidates(expr, facts, inductions, plan); };
+    plan_expr(cond);
+    for_each_expr(scope->stmts, plan_expr);
+    if (step != nullptr)
+    {
+      for_each_expr(step, plan_expr);
+    }
+    if (!plan.hoisted.empty() || !plan.reductions.empty())
+    {
+      plans[loop] = std::move(plan);
+    }
+  }
+
+  // Hoists or reduces the largest qualifying subexpressions of `expr`.
+  void find_candidates(const NodeExpr *expr, const LoopFacts &facts,
+                       const std::unordered_map<std::string, Induction> &inductions, LoopPlan &plan)
+  {
+    auto *bin_expr = std::get_if<NodeBinExpr *>(&expr->var);
+    if (bin_expr == nullptr)
+    {
+      if (auto *paren = std::get_if<NodeTermParen *>(&std::get<NodeTerm *>(expr->var)->val))
+      {
+        find_candidates((*paren)->expr, facts, inductions, plan);
+      }
+      else if (auto *unary = std::get_if<NodeTermUnary *>(&std::get<NodeTerm *>(expr->var)->val))
+      {
+        if (auto *paren = std::get_if<NodeTermParen *>(&(*unary)->operand->val))
+        {
+          find_candidates((*paren)->expr, facts, inductions, plan);
+        }
+      }
+      return;
+    }
+    bool room = plan.hoisted.size() + plan.reductions.size() < max_loop_values;
+    if (room && !claimed.contains(expr) && is_invariant(expr, facts) && ranges.is_speculatable(expr))
+    {
+      claimed.insert(expr);
+      plan.hoisted.push_back(expr);
+      loop_stats.hoisted++;
+      return;
+    }
+    if (auto *mul = std::get_if<NodeBinExprMul *>(&(*bin_expr)->op))
+    {
+      if (room && !claimed.contains(expr) && ranges.no_overflow(*mul))
+      {
+        std::optional<std::string> var = ident_name((*mul)->lhs);
+        std::optional<int64_t> factor = int_literal((*mul)->rhs);
+        if (!var.has_value() || !factor.has_value())
+        {
+          var = ident_name((*mul)->rhs);
+          factor = int_literal((*mul)->lhs);
+        }
+        auto induction = var.has_value() ? inductions.find(var.value()) : inductions.end();
+        int64_t delta;
+        if (factor.has_value() && induction != inductions.end() &&
+            !__builtin_mul_overflow(induction->second.step, factor.value(), &delta))
+        {
+          claimed.insert(expr);
+          plan.reductions.push_back({expr, induction->second.update, delta});
+          loop_stats.reduced++;
+          return;
+        }
+      }
+    }
+    std::visit([&](const auto *op)
+               {
+                 find_candidates(op->lhs, facts, inductions, plan);
+                 find_candidates(op->rhs, facts, inductions, plan); },
+               (*bin_expr)->op);
+  }
+
+  // `name + c`, `c + name` or `name - c` for a literal c gives the step.
+  static std::optional<int64_t> induction_step(const std::string &name, const NodeExpr *expr)
+  {
+    auto *bin_expr = std::get_if<NodeBinExpr *>(&expr->var);
+    if (bin_expr == nullptr)
+    {
+      return std::nullopt;
+    }
+    if (auto *add = std::get_if<NodeBinExprAdd *>(&(*bin_expr)->op))
+    {
+      if (ident_name((*add)->lhs) == name)
+        return int_literal((*add)->rhs);
+      if (ident_name((*add)->rhs) == name)
+        return int_literal((*add)->lhs);
+    }
+    if (auto *sub = std::get_if<NodeBinExprSub *>(&(*bin_expr)->op))
+    {
+      if (ident_name((*sub)->lhs) == name)
+      {
+        if (auto step = int_literal((*sub)->rhs))
+          return -step.value();
+      }
+    }
+    return std::nullopt;
+  }
+
+  // Trip count of `for (let int i = a; i < b; i = i + c)` and its mirror
+  // images with <=, > and >=, if the loop should be unrolled completely.
+  std::optional<size_t> trip_count(const NodeStmtFor *stmt_for) const
+  {
+    auto *init = std::get_if<NodeStmtLet *>(&stmt_for->init->stmt);
+    if (init == nullptr || (*init)->dtype != DataType::Int || !(*init)->expr.has_value())
+    {
+      return std::nullopt;
+    }
+    const std::string &name = (*init)->ident.val.value();
+    std::optional<int64_t> start = int_literal((*init)->expr.value());
+    auto *step = std::get_if<NodeStmtAssign *>(&stmt_for->step->stmt);
+    if (!start.has_value() || (*step)->ident.val.value() != name)
+    {
+      return std::nullopt;
+    }
+    std::optional<int64_t> stride = induction_step(name, (*step)->expr);
+
+    auto *cond = std::get_if<NodeBinExpr *>(&stmt_for->cond->var);
+    if (!stride.has_value() || stride.value() == 0 || cond == nullptr)
+    {
+      return std::nullopt;
+    }
+    std::optional<int64_t> bound;
+    bool upward;
+    bool inclusive;
+    std::visit(
+        [&](const auto *op)
+        {
+          using Op = std::remove_cvref_t<decltype(*op)>;
+          upward = std::is_same_v<Op, NodeBinExprLt> || std::is_same_v<Op, NodeBinExprLte>;
+          inclusive = std::is_same_v<Op, NodeBinExprLte> || std::is_same_v<Op, NodeBinExprGte>;
+          if constexpr (std::is_same_v<Op, NodeBinExprLt> || std::is_same_v<Op, NodeBinExprLte> ||
+                        std::is_same_v<Op, NodeBinExprGt> || std::is_same_v<Op, NodeBinExprGte>)
+          {
+            if (ident_name(op->lhs) == name)
+              bound = int_literal(op->rhs);
+          }
+        },
+        (*cond)->op);
+    if (!bound.has_value() || upward != (stride.value() > 0))
+    {
+      return std::nullopt;
+    }
+
+    LoopFacts facts;
+    collect(stmt_for->scope->stmts, facts);
+    if (facts.has_loop || facts.assigned.contains(name) || facts.declared.contains(name))
+    {
+      return std::nullopt;
+    }
+
+    __int128 distance = upward ? static_cast<__int128>(bound.value()) - start.value()
+                               : static_cast<__int128>(start.value()) - bound.value();
+    if (inclusive)
+      distance++;
+    __int128 stride_abs = stride.value() > 0 ? stride.value() : -static_cast<__int128>(stride.value());
+    __int128 trips = distance <= 0 ? 0 : (distance + stride_abs - 1) / stride_abs;
+    if (trips > static_cast<__int128>(max_unroll_trips) || trips * (facts.stmts + 1) > max_unrolled_stmts)
+    {
+      return std::nullopt;
+    }
+    return static_cast<size_t>(trips);
+  }
+
+  // Plans the vectorisation of a for loop, if its shape allows it. Every
+  // array access must be proven in bounds, which also keeps the index
+  // within an array's length.
+  std::optional<VectorLoop> vector_loop(const NodeStmtFor *stmt_for) const
+  {
+    auto *init = std::get_if<NodeStmtLet *>(&stmt_for->init->stmt);
+    if (init == nullptr || (*init)->dtype != DataType::Int || !(*init)->expr.has_value())
+    {
+      return std::nullopt;
+    }
+    VectorLoop vector;
+    vector.index = (*init)->ident.val.value();
+    auto *step = std::get_if<NodeStmtAssign *>(&stmt_for->step->stmt);
+    if ((*step)->ident.val.value() != vector.index || induction_step(vector.index, (*step)->expr) != 1)
+    {
+      return std::nullopt;
+    }
+
+    // `index < bound` or `index <= bound` for a bound known at compile time.
+    auto *cond = std::get_if<NodeBinExpr *>(&stmt_for->cond->var);
+    if (cond == nullptr)
+    {
+      return std::nullopt;
+    }
+    const NodeExpr *bound_expr = nullptr;
+    bool inclusive = false;
+    if (auto *lt = std::get_if<NodeBinExprLt *>(&(*cond)->op); lt && ident_name((*lt)->lhs) == vector.index)
+    {
+      bound_expr = (*lt)->rhs;
+    }
+    else if (auto *lte = std::get_if<NodeBinExprLte *>(&(*cond)->op); lte && ident_name((*lte)->lhs) == vector.index)
+    {
+      bound_expr = (*lte)->rhs;
+      inclusive = true;
+    }
+    if (bound_expr == nullptr || !ranges.is_speculatable(bound_expr))
+    {
+      return std::nullopt;
+    }
+    std::optional<Range> start = ranges.range_of((*init)->expr.value());
+    std::optional<Range> bound = ranges.range_of(bound_expr);
+    if (!start.has_value() || !bound.has_value() || !start->is_constant() || !bound->is_constant())
+    {
+      return std::nullopt;
+    }
+    vector.start = start->lo;
+    __int128 end = static_cast<__int128>(bound->lo) + (inclusive ? 1 : 0);
+    if (end - vector.start < static_cast<__int128>(min_vector_trips))
+    {
+      return std::nullopt;
+    }
+    vector.end = static_cast<int64_t>(end);
+
+    LoopFacts facts;
+    collect(stmt_for->scope->stmts, facts);
+    if (facts.has_loop || !facts.declared.empty() || facts.assigned.contains(vector.index))
+    {
+      return std::nullopt;
+    }
+    facts.assigned[vector.index]++;
+
+    // Reads of each variable anywhere in the loop, to find sums whose
+    // variable is read by nothing but its own update.
+    std::unordered_map<std::string, size_t> reads;
+    auto count_reads = [&](const NodeExpr *expr)
+    { for_each_ident(expr, [&](const std::string &name)
+                     { reads[name]++; }); };
+    count_reads(stmt_for->cond);
+    for_each_expr(stmt_for->scope->stmts, count_reads);
+    for_each_expr(stmt_for->step, count_reads);
+
+    size_t temporaries = 0;
+    for (const NodeStmt *stmt : stmt_for->scope->stmts)
+    {
+      VectorStmt vstmt{};
+      const void *sum_op = nullptr;
+      bool sum;
+      if (auto *store = std::get_if<NodeStmtAssignIndex *>(&stmt->stmt))
+      {
+        if (ident_name((*store)->index) != vector.index || !ranges.in_bounds(*store))
+          return std::nullopt;
+        vstmt.target = (*store)->ident.val.value();
+        vstmt.value = (*store)->expr;
+        sum = false;
+      }
+      else if (auto *assign = std::get_if<NodeStmtAssign *>(&stmt->stmt))
+      {
+        vstmt.target = (*assign)->ident.val.value();
+        sum_op = sum_operand(vstmt.target, (*assign)->expr, vstmt);
+        if (sum_op == nullptr || facts.assigned.at(vstmt.target) != 1 || reads[vstmt.target] != 1)
+          return std::nullopt;
+        sum = true;
+      }
+      else
+      {
+        return std::nullopt;
+      }
+      if (!vector.stmts.empty() && vector.sums != sum)
+      {
+        return std::nullopt;
+      }
+      vector.sums = sum;
+
+      size_t need;
+      bool held;
+      size_t elements = 0;
+      if (!vector_value(vstmt.value, vector.index, facts, vector.invariants, need, held, elements) ||
+          (sum && elements == 0))
+      {
+        return std::nullopt;
+      }
+      temporaries = std::max(temporaries, need);
+      if (sum && !sum_is_safe(vstmt, sum_op, end - vector.start))
+      {
+        return std::nullopt;
+      }
+      vector.stmts.push_back(vstmt);
+    }
+    size_t sums = vector.sums ? vector.stmts.size() : 0;
+    if (vector.stmts.empty() || vector.invariants.size() + sums + temporaries > vector_registers)
+    {
+      return std::nullopt;
+    }
+    return vector;
+  }
+
+  // Splits `target + value`, `value + target` or `target - value`, and
+  // returns the operation, or null if `expr` is none of them.
+  static const void *sum_operand(const std::string &target, const NodeExpr *expr, VectorStmt &vstmt)
+  {
+    auto *bin_expr = std::get_if<NodeBinExpr *>(&expr->var);
+    if (bin_expr == nullptr)
+      return nullptr;
+    if (auto *add = std::get_if<NodeBinExprAdd *>(&(*bin_expr)->op))
+    {
+      if (ident_name((*add)->lhs) == target)
+        vstmt.value = (*add)->rhs;
+      else if (ident_name((*add)->rhs) == target)
+        vstmt.value = (*add)->lhs;
+      return vstmt.value != nullptr ? *add : nullptr;
+    }
+    if (auto *sub = std::get_if<NodeBinExprSub *>(&(*bin_expr)->op))
+    {
+      if (ident_name((*sub)->lhs) != target)
+        return nullptr;
+      vstmt.value = (*sub)->rhs;
+      vstmt.subtract = true;
+      return *sub;
+    }
+    return nullptr;
+  }
+
+  // A vectorised sum adds the values in a different order than the loop
+  // would, so it may only replace the loop if the loop cannot fail where
+  // the vector code succeeds: either the loop's own sum never overflows, or
+  // every value has the same sign and the partial sums move monotonically
+  // towards the total. Lane totals need no checks if they cannot exceed
+  // `trips` times the largest value.
+  bool sum_is_safe(VectorStmt &vstmt, const void *sum_op, __int128 trips) const
+  {
+    std::optional<Range> range = ranges.range_of(vstmt.value);
+    if (!range.has_value())
+    {
+      return false;
+    }
+    __int128 largest = std::max(-static_cast<__int128>(range->lo), static_cast<__int128>(range->hi));
+    vstmt.check_sums = largest * trips > std::numeric_limits<int64_t>::max();
+    return ranges.no_overflow(sum_op) || range->lo >= 0 || range->hi <= 0;
+  }
+
+  // Checks that `expr` can be evaluated lane by lane from array elements at
+  // `index`, invariants, +, - and negation, and collects the invariants.
+  // `need` is the number of registers its evaluation uses at once and
+  // `held` whether the result takes one of them rather than an invariant's.
+  bool vector_value(const NodeExpr *expr, const std::string &index, const LoopFacts &facts,
+                    std::vector<const NodeExpr *> &invariants, size_t &need, bool &held, size_t &elements) const
+  {
+    if (is_invariant(expr, facts) && ranges.is_speculatable(expr))
+    {
+      invariants.push_back(expr);
+      need = 0;
+      held = false;
+      return true;
+    }
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      return vector_term(*term, index, facts, invariants, need, held, elements);
+    }
+    const NodeExpr *lhs = nullptr;
+    const NodeExpr *rhs = nullptr;
+    if (auto *add = std::get_if<NodeBinExprAdd *>(&std::get<NodeBinExpr *>(expr->var)->op))
+    {
+      lhs = (*add)->lhs;
+      rhs = (*add)->rhs;
+    }
+    else if (auto *sub = std::get_if<NodeBinExprSub *>(&std::get<NodeBinExpr *>(expr->var)->op))
+    {
+      lhs = (*sub)->lhs;
+      rhs = (*sub)->rhs;
+    }
+    else
+    {
+      return false;
+    }
+    size_t lhs_need, rhs_need;
+    bool lhs_held, rhs_held;
+    if (!vector_value(lhs, index, facts, invariants, lhs_need, lhs_held, elements) ||
+        !vector_value(rhs, index, facts, invariants, rhs_need, rhs_held, elements))
+    {
+      return false;
+    }
+    need = std::max({lhs_need, lhs_held + rhs_need, lhs_held + rhs_held + size_t{1}});
+    held = true;
+    return true;
+  }
+
+  bool vector_term(const NodeTerm *term, const std::string &index, const LoopFacts &facts,
+                   std::vector<const NodeExpr *> &invariants, size_t &need, bool &held, size_t &elements) const
+  {
+    if (auto *paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return vector_value((*paren)->expr, index, facts, invariants, need, held, elements);
+    }
+    if (auto *unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      if ((*unary)->op != UnaryOp::Negate ||
+          !vector_term((*unary)->operand, index, facts, invariants, need, held, elements))
+        return false;
+      need = std::max(need, held + size_t{1});
+      held = true;
+      return true;
+    }
+    if (auto *element = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      if (ident_name((*element)->index) != index || !ranges.in_bounds(*element))
+        return false;
+      elements++;
+      need = 1;
+      held = true;
+      return true;
+    }
+    return false;
+  }
+
+  bool is_invariant(const NodeExpr *expr, const LoopFacts &facts) const
+  {
+    bool invariant = true;
+    for_each_ident(expr, [&](const std::string &name)
+                   { invariant = invariant && !facts.assigned.contains(name) && !facts.declared.contains(name); });
+    return invariant;
+  }
+
+  void collect(const std::vector<NodeStmt *> &stmts, LoopFacts &facts) const
+  {
+    for (const NodeStmt *stmt : stmts)
+    {
+      collect(stmt, facts);
+    }
+  }
+
+  void collect(const NodeStmt *stmt, LoopFacts &facts) const
+  {
+    facts.stmts++;
+    if (auto *stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->stmt))
+    {
+      facts.assigned[(*stmt_assign)->ident.val.value()]++;
+    }
+    else if (auto *stmt_assign_index = std::get_if<NodeStmtAssignIndex *>(&stmt->stmt))
+    {
+      facts.assigned[(*stmt_assign_index)->ident.val.value()]++;
+    }
+    else if (auto *stmt_let = std::get_if<NodeStmtLet *>(&stmt->stmt))
+    {
+      facts.declared.insert((*stmt_let)->ident.val.value());
+    }
+    else if (auto *stmt_const = std::get_if<NodeStmtConst *>(&stmt->stmt))
+    {
+      facts.declared.insert((*stmt_const)->ident.val.value());
+    }
+    else if (auto *stmt_scope = std::get_if<NodeStmtScope *>(&stmt->stmt))
+    {
+      collect((*stmt_scope)->stmts, facts);
+    }
+    else if (auto *stmt_if = std::get_if<NodeStmtIf *>(&stmt->stmt))
+    {
+      collect((*stmt_if)->scope->stmts, facts);
+      std::optional<NodeStmtIfCont *> cont = (*stmt_if)->cont;
+      while (cont.has_value())
+      {
+        if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+        {
+          collect((*stmt_elif)->scope->stmts, facts);
+          cont = (*stmt_elif)->cont;
+        }
+        else
+        {
+          collect(std::get<NodeStmtElse *>(cont.value()->clause)->scope->stmts, facts);
+          cont = std::nullopt;
+        }
+      }
+    }
+    else if (auto *stmt_while = std::get_if<NodeStmtWhile *>(&stmt->stmt))
+    {
+      facts.has_loop = true;
+      collect((*stmt_while)->scope->stmts, facts);
+    }
+    else if (auto *stmt_for = std::get_if<NodeStmtFor *>(&stmt->stmt))
+    {
+      facts.has_loop = true;
+      collect((*stmt_for)->init, facts);
+      collect((*stmt_for)->scope->stmts, facts);
+      collect((*stmt_for)->step, facts);
+    }
+  }
+
+  // Calls `f` on every expression evaluated directly by the statements,
+  // including those of nested statements.
+  template <typename F>
+  void for_each_expr(const std::vector<NodeStmt *> &stmts, F &f) const
+  {
+    for (const NodeStmt *stmt : stmts)
+    {
+      for_each_expr(stmt, f);
+    }
+  }
+
+  template <typename F>
+  void for_each_expr(const NodeStmt *stmt, F &f) const
+  {
+    if (auto *stmt_exit = std::get_if<NodeStmtExit *>(&stmt->stmt))
+      f((*stmt_exit)->expr);
+    else if (auto *stmt_print = std::get_if<NodeStmtPrint *>(&stmt->stmt))
+      f((*stmt_print)->expr);
+    else if (auto *stmt_return = std::get_if<NodeStmtReturn *>(&stmt->stmt))
+      f((*stmt_return)->expr);
+    else if (auto *stmt_call = std::get_if<NodeStmtCall *>(&stmt->stmt))
+    {
+      for (const NodeExpr *arg : (*stmt_call)->call->args)
+        f(arg);
+    }
+    else if (auto *stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->stmt))
+      f((*stmt_assign)->expr);
+    else if (auto *stmt_assign_index = std::get_if<NodeStmtAssignIndex *>(&stmt->stmt))
+    {
+      f((*stmt_assign_index)->index);
+      f((*stmt_assign_index)->expr);
+    }
+    else if (auto *stmt_const = std::get_if<NodeStmtConst *>(&stmt->stmt))
+      f((*stmt_const)->expr);
+    else if (auto *stmt_let = std::get_if<NodeStmtLet *>(&stmt->stmt))
+    {
+      if ((*stmt_let)->expr.has_value())
+        f((*stmt_let)->expr.value());
+    }
+    else if (auto *stmt_scope = std::get_if<NodeStmtScope *>(&stmt->stmt))
+      for_each_expr((*stmt_scope)->stmts, f);
+    else if (auto *stmt_if = std::get_if<NodeStmtIf *>(&stmt->stmt))
+    {
+      f((*stmt_if)->expr);
+      for_each_expr((*stmt_if)->scope->stmts, f);
+      std::optional<NodeStmtIfCont *> cont = (*stmt_if)->cont;
+      while (cont.has_value())
+      {
+        if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+        {
+          f((*stmt_elif)->expr);
+          for_each_expr((*stmt_elif)->scope->stmts, f);
+          cont = (*stmt_elif)->cont;
+        }
+        else
+        {
+          for_each_expr(std::get<NodeStmtElse *>(cont.value()->clause)->scope->stmts, f);
+          cont = std::nullopt;
+        }
+      }
+    }
+    else if (auto *stmt_while = std::get_if<NodeStmtWhile *>(&stmt->stmt))
+    {
+      f((*stmt_while)->expr);
+      for_each_expr((*stmt_while)->scope->stmts, f);
+    }
+    else if (auto *stmt_for = std::get_if<NodeStmtFor *>(&stmt->stmt))
+    {
+      for_each_expr((*stmt_for)->init, f);
+      f((*stmt_for)->cond);
+      for_each_expr((*stmt_for)->scope->stmts, f);
+      for_each_expr((*stmt_for)->step, f);
+    }
+  }
+
+  template <typename F>
+  static void for_each_ident(const NodeExpr *expr, F &&f)
+  {
+    if (auto *bin_expr = std::get_if<NodeBinExpr *>(&expr->var))
+    {
+      std::visit([&](const auto *op)
+                 {
+                   for_each_ident(op->lhs, f);
+                   for_each_ident(op->rhs, f); },
+                 (*bin_expr)->op);
+      return;
+    }
+    const NodeTerm *term = std::get<NodeTerm *>(expr->var);
+    while (auto *unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      term = (*unary)->operand;
+    }
+    if (auto *ident = std::get_if<NodeTermIdent *>(&term->val))
+    {
+      f((*ident)->ident.val.value());
+    }
+    else if (auto *paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      for_each_ident((*paren)->expr, f);
+    }
+    else if (auto *element = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      f((*element)->ident.val.value());
+      for_each_ident((*element)->index, f);
+    }
+    else if (auto *call = std::get_if<NodeTermCall *>(&term->val))
+    {
+      for (const NodeExpr *arg : (*call)->args)
+        for_each_ident(arg, f);
+    }
+  }
+
+  static std::optional<std::string> ident_name(const NodeExpr *expr)
+  {
+    auto *term = std::get_if<NodeTerm *>(&expr->var);
+    if (term == nullptr)
+      return std::nullopt;
+    auto *ident = std::get_if<NodeTermIdent *>(&(*term)->val);
+    if (ident == nullptr)
+      return std::nullopt;
+    return (*ident)->ident.val.value();
+  }
+
+  static std::optional<int64_t> int_literal(const NodeExpr *expr)
+  {
+    auto *term = std::get_if<NodeTerm *>(&expr->var);
+    if (term == nullptr)
+      return std::nullopt;
+    auto *lit = std::get_if<NodeTermLit *>(&(*term)->val);
+    if (lit == nullptr || (*lit)->token.type != TokenType::int_lit)
+      return std::nullopt;
+    try
+    {
+      size_t idx;
+      int64_t value = std::stoll((*lit)->token.val.value(), &idx, 10);
+      if (idx == (*lit)->token.val.value().size())
+        return value;
+    }
+    catch (const std::exception &)
+    {
+    }
+    return std::nullopt;
+  }
+
+  const NodeProg &prog;
+  const RangeAnalyser &ranges;
+  Stats loop_stats;
+  std::unordered_map<const void *, LoopPlan> plans;
+  std::unordered_set<const NodeExpr *> claimed;
+};
@@ -1,28 +1,155 @@
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
 #include "./tokenization.hpp"
 #include "./parser.hpp"
+#include "./semanticAnalysis.hpp"
+#include "./rangeAnalysis.hpp"
+#include "./deadCodeElimination.hpp"
+#include "./frameLayout.hpp"
+#include "./loopOptimisation.hpp"
+#include "./inliner.hpp"
+#include "./profile.hpp"
 #include "./generator.hpp"
+#include "./assembler.hpp"
+#include "./linker.hpp"
+#include "./elfWriter.hpp"
+#include "./jit.hpp"
+#include "./batch.hpp"
+#include "./toolchain.hpp"
+#include "./compileCache.hpp"
+#include "./passTimer.hpp"
+#include "runtimeObjects.hpp"
 
-int main(int argc, char **argv)
+// The runtime a program is linked against, assembled when the compiler
+// was built. A program run in process gets the JIT trampoline in place of
+// exit.asm. The modules come in link order: output, print, errors, exit,
+// cpu, then profile if instrumenting, then the trampoline. Of the others
+// only those the program needs are linked.
+static std::vector<ObjectModule> runtime_modules(bool jit, bool instrument)
+{
+    std::vector<ObjectModule> modules;
+    modules.push_back(runtime::output_object());
+    modules.push_back(runtime::print_object());
+    modules.push_back(runtime::errors_object());
+    if (!jit)
+    {
+        modules.push_back(runtime::exit_object());
+    }
+    modules.push_back(runtime::cpu_object());
+    if (instrument)
+    {
+        modules.push_back(runtime::profile_object());
+    }
+    if (jit)
+    {
+        modules.push_back(runtime::trampoline_object());
+    }
+    return modules;
+}
+
+// Names of the runtime modules, in link order, for the object files NASM
+// and ld see.
+static const char *const runtime_objects[] = {"output.o", "print.o", "errors.o", "exit.o", "cpu.o", "profile.o"};
+
+// Batches of tokens the lexer may run ahead of the parser.
+static constexpr size_t lexer_queue_depth = 16;
+
+// How to compile a program, from the command line.
+struct CompileOptions
 {
+    bool print_stats = false;
+    bool use_nasm = false;
+    bool use_ld = false;
+    bool emit_asm = false;
+    bool run = false;
+    const char *profile_path = nullptr;
+    const char *output_path = "out";
+    bool time_passes = false;
+    const char *time_passes_json = nullptr; // "-" for stdout
+    const char *cache_dir = nullptr;
+    size_t cache_max_bytes = CompileCache::default_max_bytes;
+    Generator::Options gen_options;
+};
 
-    if (argc != 2)
+// Cache key of a compile: everything the executable depends on besides
+// the compiler itself. Returns nothing if the profile cannot be read, in
+// which case the compile reports it.
+static std::optional<std::string> cache_key(const std::string &source, const CompileOptions &options)
+{
+    const Generator::Options &gen = options.gen_options;
+    std::string key = CompileCache::new_key();
+    // Every Generator option has to be part of the key.
+    std::string flags = {gen.cmov ? 'c' : '-', gen.simd ? 's' : '-', gen.inline_calls ? 'i' : '-',
+                         gen.instrument ? 'p' : '-', gen.switches ? 'j' : '-'};
+    CompileCache::add_field(key, flags);
+    std::string profile;
+    if (options.profile_path != nullptr)
     {
-        std::cout << "Wrong input format the input should be ./mycomiper <input file>";
-        return EXIT_FAILURE;
+        std::ifstream file(options.profile_path, std::ios::binary);
+        if (!file)
+            return std::nullopt;
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        profile = buffer.str();
     }
+    CompileCache::add_field(key, profile);
+    CompileCache::add_field(key, source);
+    return key;
+}
 
+// Prints the pass times --time-passes and --time-passes-json ask for.
+static bool report_passes(const PassTimer &timer, const CompileOptions &options)
+{
+    if (options.time_passes)
+    {
+        timer.report(std::cerr);
+    }
+    if (options.time_passes_json == nullptr)
+    {
+        return true;
+    }
+    if (std::strcmp(options.time_passes_json, "-") == 0)
+    {
+        timer.report_json(std::cout);
+        return true;
+    }
+    std::ofstream file(options.time_passes_json);
+    timer.report_json(file);
+    if (!file)
+    {
+        diagnostics() << "Error: could not write " << options.time_passes_json << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Compiles one program as the command line asks and returns the exit
+// status for main. Errors are written to diagnostics() and thrown as a
+// CompileError, which compile() below turns into a failed status.
+static int compile_program(const char *input_path, const CompileOptions &options)
+{
+    PassTimer timer;
+    PassTimer::Span span = PassTimer::now();
     std::string contents;
 
     {
-        std::ifstream file(argv[1]);
+        std::ifstream file(input_path);
         if (!file)
         {
-            std::cerr << "Error: could not open file " << argv[1] << std::endl;
+            diagnostics() << "Error: could not open file " << input_path << std::endl;
             return EXIT_FAILURE;
         }
 
@@ -30,28 +157,487 @@ int main(int argc, char **argv)
         buffer << file.rdbuf();
         contents = buffer.str();
     }
+    timer.end("read", span);
+    timer.counts.source_bytes = contents.size();
 
     // std::cout << "File contents:\n" << contents << std::endl;
 
+    // Only executables are cached, and --stats and --time-passes need a
+    // real compile.
+    std::optional<CompileCache> cache;
+    std::optional<std::string> key;
+    bool writes_executable = !options.run && !options.emit_asm && !options.use_nasm && !options.use_ld;
+    bool measures = options.print_stats || options.time_passes || options.time_passes_json != nullptr;
+    if (options.cache_dir != nullptr && writes_executable && !measures)
+    {
+        key = cache_key(contents, options);
+        if (key.has_value())
+        {
+            cache.emplace(options.cache_dir, options.cache_max_bytes);
+            if (cache->fetch(key.value(), options.output_path))
+            {
+                return EXIT_SUCCESS;
+            }
+        }
+    }
+
+    const uint64_t source_hash = BranchProfile::hash_source(contents);
     Tokeniser tokeniser(std::move(contents));
-    std::vector<Token> tokens = tokeniser.tokenise();
 
-    Parser parser(std::move(tokens));
+    // The lexer runs on its own thread and hands tokens to the parser in
+    // batches as it goes.
+    // An error on either side stops the other: the lexer closes the queue,
+    // the parser cancels it. Both write their errors to buffers of their
+    // own, and a lexer error wins, as it comes earlier in the source than
+    // any error the parser found in the tokens it was given.
+    TokenQueue token_queue(lexer_queue_depth);
+    std::ostringstream lexer_errors;
+    bool lexer_failed = false;
+    std::thread lexer([&]
+                      {
+                          diagnostics_stream() = &lexer_errors;
+                          PassTimer::Span lexer_span = PassTimer::now();
+                          try
+                          {
+                              tokeniser.tokenise(token_queue);
+                          }
+                          catch (const CompileError &)
+                          {
+                              lexer_failed = true;
+                              token_queue.close();
+                              return;
+                          }
+                          timer.end("tokenise", lexer_span); });
+    Parser parser(token_queue);
+
+    span = PassTimer::now();
+    std::ostringstream parser_errors;
+    std::ostream *errors = std::exchange(diagnostics_stream(), &parser_errors);
+    std::optional<NodeProg> parsed;
+    try
+    {
+        parsed = parser.parse();
+    }
+    catch (const CompileError &)
+    {
+        token_queue.cancel();
+    }
+    diagnostics_stream() = errors;
+    timer.end("parse", span);
+    lexer.join();
+    if (lexer_failed || !parsed.has_value())
+    {
+        diagnostics() << (lexer_failed ? lexer_errors : parser_errors).str();
+        throw CompileError();
+    }
+    NodeProg prog = std::move(parsed.value());
+    timer.counts.tokens = tokeniser.count();
+    timer.counts.ast_nodes = parser.nodes();
+
+    span = PassTimer::now();
+    SemanticAnalyser semantics(prog);
+    semantics.analyse();
+
+    RangeAnalyser ranges(prog);
+    ranges.analyse();
+
+    DeadCodeEliminator dce(prog, ranges);
+    dce.run();
+
+    FrameLayout layout(prog);
+    layout.compute();
 
-    NodeProg prog = parser.parse();
+    LoopOptimiser loops(prog, ranges);
+    loops.run();
 
-    Generator generator(std::move(prog));
-    std::string output = generator.gen_prog();
+    Inliner inliner(prog);
+    inliner.run();
+
+    BranchProfile profile(prog, source_hash);
+    if (options.profile_path != nullptr)
+    {
+        profile.load(options.profile_path);
+    }
+    timer.end("analyse", span);
+
+    span = PassTimer::now();
+    Generator generator(std::move(prog), ranges, layout, loops, inliner, profile, options.gen_options);
+    const AsmBuffer &output = generator.gen_prog();
+    timer.end("generate", span);
+    timer.counts.asm_bytes = output.size();
+
+    if (options.print_stats)
+    {
+        const Generator::Stats &stats = generator.stats();
+        std::cerr << "overflow checks: " << stats.overflow_checks << " emitted, "
+                  << stats.overflow_checks_elided << " eliminated\n";
+        std::cerr << "divide-by-zero checks: " << stats.divzero_checks << " emitted, "
+                  << stats.divzero_checks_elided << " eliminated\n";
+        std::cerr << "bounds checks: " << stats.bounds_checks << " emitted, "
+                  << stats.bounds_checks_elided << " eliminated\n";
+        const DeadCodeEliminator::Stats &dce_stats = dce.stats();
+        std::cerr << "dead code: " << dce_stats.unreachable_stmts << " unreachable statements, "
+                  << dce_stats.folded_branches << " constant branches, "
+                  << dce_stats.unused_defs << " unused definitions removed\n";
+        std::cerr << "frame: " << layout.frame_slots() << " slots for " << layout.variables()
+                  << " variables, peak stack depth " << stats.peak_stack_depth << " bytes\n";
+        std::cerr << "branchless selects: " << stats.selects << " if chains lowered to cmov\n";
+        std::cerr << "switches: " << stats.jump_tables << " elif chains dispatched through jump tables, "
+                  << stats.search_trees << " by binary search\n";
+        std::cerr << "strings: " << stats.strings << " in the .rodata pool, " << stats.merged_prints
+                  << " constant prints merged, " << stats.inlined_prints << " prints written in place\n";
+        const LoopOptimiser::Stats &loop_stats = loops.stats();
+        std::cerr << "loops: " << stats.loops << " emitted, " << stats.unrolled_loops << " unrolled, "
+                  << loop_stats.hoisted << " invariant expressions hoisted, "
+                  << loop_stats.reduced << " multiplications strength-reduced, "
+                  << stats.vector_loops << " vectorised\n";
+        const Inliner::Stats &inline_stats = inliner.stats();
+        std::cerr << "calls: " << stats.calls << " emitted, " << stats.inlined_calls << " inlined ("
+                  << inline_stats.inlined_sites << " of " << inline_stats.call_sites << " call sites), "
+                  << stats.functions << " functions emitted\n";
+        if (options.gen_options.instrument || options.profile_path != nullptr)
+        {
+            std::cerr << "profile: " << profile.sites() << " branch sites, " << stats.cold_blocks
+                      << " blocks moved to .text.cold, " << stats.biased_branches
+                      << " biased if chains kept as branches\n";
+        }
+    }
 
     // std::cout<<output<<std::endl;
 
+    if (options.run)
+    {
+        span = PassTimer::now();
+        Assembler assembler;
+        assembler.assemble(output);
+        ObjectModule program = assembler.finish();
+        timer.end("assemble", span);
+        timer.counts.instructions = assembler.instructions();
+
+        std::vector<ObjectModule> modules = runtime_modules(true, options.gen_options.instrument);
+        span = PassTimer::now();
+        Linker linker;
+        linker.add(std::move(program));
+        linker.add(std::move(modules.back()));
+        modules.pop_back();
+        for (ObjectModule &module : modules)
+        {
+            linker.add_library(std::move(module));
+        }
+
+        Jit jit(linker);
+        timer.end("link", span);
+        if (!report_passes(timer, options))
+        {
+            return EXIT_FAILURE;
+        }
+        std::cout.flush();
+        return static_cast<int>(jit.run() & 0xff);
+    }
+    else if (options.emit_asm)
+    {
+        span = PassTimer::now();
+        int fd = open("out.asm", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !output.write_to(fd))
+        {
+            diagnostics() << "Error: could not write out.asm: " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        timer.end("write", span);
+    }
+    else if (options.use_nasm)
+    {
+        // NASM assembles the program only; the runtime is linked from the
+        // objects assembled when the compiler was built, as with --ld, and
+        // the generator says which of them the program's references need.
+        std::vector<ObjectModule> modules = runtime_modules(false, options.gen_options.instrument);
+        const std::vector<std::string_view> &refs = generator.runtime_symbols();
+        std::vector<bool> needed = Linker::needed({refs.begin(), refs.end()}, modules);
+        span = PassTimer::now();
+        std::vector<Toolchain::MemFile> sources;
+        std::vector<Toolchain::MemFile> objects;
+        sources.emplace_back("out.asm");
+        objects.emplace_back("out.o");
+        if (!sources.back().write_text(output))
+        {
+            diagnostics() << "Error: could not write assembly for nasm: " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        bool written = true;
+        for (size_t i = 0; i < modules.size() && written; i++)
+        {
+            if (!needed[i])
+            {
+                continue;
+            }
+            objects.emplace_back(runtime_objects[i]);
+            written = ElfWriter::write_object(modules[i], objects.back().path().c_str());
+        }
+        if (!written)
+        {
+            diagnostics() << "Error: could not write object file: " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        timer.end("write", span);
+        span = PassTimer::now();
+        if (!Toolchain::nasm(sources, objects))
+        {
+            return EXIT_FAILURE;
+        }
+        timer.end("assemble", span);
+        span = PassTimer::now();
+        if (!Toolchain::ld(objects, options.output_path))
+        {
+            return EXIT_FAILURE;
+        }
+        timer.end("link", span);
+    }
+    else if (options.use_ld)
+    {
+        span = PassTimer::now();
+        Assembler assembler;
+        assembler.assemble(output);
+        ObjectModule program = assembler.finish();
+        timer.end("assemble", span);
+        timer.counts.instructions = assembler.instructions();
+
+        std::vector<ObjectModule> modules = runtime_modules(false, options.gen_options.instrument);
+        span = PassTimer::now();
+        std::vector<Toolchain::MemFile> objects;
+        objects.emplace_back("out.o");
+        bool written = ElfWriter::write_object(program, objects.back().path().c_str());
+        std::vector<bool> needed = Linker::needed(program.references(), modules);
+        for (size_t i = 0; i < modules.size() && written; i++)
+        {
+            if (!needed[i])
+            {
+                continue;
+            }
+            objects.emplace_back(runtime_objects[i]);
+            written = ElfWriter::write_object(modules[i], objects.back().path().c_str());
+        }
+        if (!written)
+        {
+            diagnostics() << "Error: could not write object file: " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        timer.end("write", span);
+        span = PassTimer::now();
+        if (!Toolchain::ld(objects, options.output_path))
+        {
+            return EXIT_FAILURE;
+        }
+        timer.end("link", span);
+    }
+    else
+    {
+        span = PassTimer::now();
+        Assembler assembler;
+        assembler.assemble(output);
+        ObjectModule program = assembler.finish();
+        timer.end("assemble", span);
+        timer.counts.instructions = assembler.instructions();
+
+        std::vector<ObjectModule> modules = runtime_modules(false, options.gen_options.instrument);
+        span = PassTimer::now();
+        Linker linker;
+        linker.add(std::move(program));
+        for (ObjectModule &module : modules)
+        {
+            linker.add_library(std::move(module));
+        }
+        linker.layout(ElfWriter::executable_header_size);
+
+        const uint64_t base = 0x400000;
+        std::vector<Segment> segments = linker.relocate(base);
+        uint64_t entry = base + linker.symbol_offset("_start");
+        timer.end("link", span);
+
+        span = PassTimer::now();
+        if (!ElfWriter::write_executable(segments, base, entry, options.output_path))
+        {
+            diagnostics() << "Error: could not write " << options.output_path << ": " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        timer.end("write", span);
+        if (cache.has_value())
+        {
+            cache->store(key.value(), options.output_path);
+        }
+    }
+    return report_passes(timer, options) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int compile(const char *input_path, const CompileOptions &options)
+{
+    try
+    {
+        return compile_program(input_path, options);
+    }
+    catch (const CompileError &)
+    {
+        return EXIT_FAILURE;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<const char *> input_paths;
+    CompileOptions options;
+    bool batch = false;
+    const char *manifest_path = nullptr;
+    const char *out_dir = nullptr;
+    const char *output_path = nullptr;
+    size_t jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--stats")
+        {
+            options.print_stats = true;
+        }
+        else if (arg == "--time-passes")
+        {
+            options.time_passes = true;
+        }
+        else if (arg.starts_with("--time-passes-json="))
+        {
+            options.time_passes_json = argv[i] + std::strlen("--time-passes-json=");
+        }
+        else if (arg == "--nasm")
+        {
+            options.use_nasm = true;
+        }
+        else if (arg == "--ld")
+        {
+            options.use_ld = true;
+        }
+        else if (arg == "--asm")
+        {
+            options.emit_asm = true;
+        }
+        else if (arg == "--no-cmov")
+        {
+            options.gen_options.cmov = false;
+        }
+        else if (arg == "--no-simd")
+        {
+            options.gen_options.simd = false;
+        }
+        else if (arg == "--no-switch")
+        {
+            options.gen_options.switches = false;
+        }
+        else if (arg == "--no-inline")
+        {
+            options.gen_options.inline_calls = false;
+        }
+        else if (arg == "--instrument")
+        {
+            options.gen_options.instrument = true;
+        }
+        else if (arg.starts_with("--profile="))
+        {
+            options.profile_path = argv[i] + std::strlen("--profile=");
+        }
+        else if (arg.starts_with("--output="))
+        {
+            output_path = argv[i] + std::strlen("--output=");
+        }
+        else if (arg == "--run")
+        {
+            options.run = true;
+        }
+        else if (arg.starts_with("--cache="))
+        {
+            options.cache_dir = argv[i] + std::strlen("--cache=");
+        }
+        else if (arg.starts_with("--cache-size="))
+        {
+            const char *text = argv[i] + std::strlen("--cache-size=");
+            char *end;
+            errno = 0;
+            unsigned long long megabytes = std::strtoull(text, &end, 10);
+            // strtoull would take leading spaces and a sign, and wrap a
+            // negative number round.
+            if (!std::isdigit(static_cast<unsigned char>(*text)) || *end != '\0' || errno == ERANGE ||
+                megabytes == 0 || megabytes > SIZE_MAX / (1024 * 1024))
+            {
+                std::cerr << "Error: invalid cache size " << text << ", expected a number of MB" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            options.cache_max_bytes = megabytes * 1024 * 1024;
+        }
+        else if (arg == "--batch")
+        {
+            batch = true;
+        }
+        else if (arg.starts_with("--manifest="))
+        {
+            batch = true;
+            manifest_path = argv[i] + std::strlen("--manifest=");
+        }
+        else if (arg.starts_with("--out-dir="))
+        {
+            out_dir = argv[i] + std::strlen("--out-dir=");
+        }
+        else if (arg.starts_with("--jobs="))
+        {
+            const char *text = argv[i] + std::strlen("--jobs=");
+            char *end;
+            errno = 0;
+            unsigned long long count = std::strtoull(text, &end, 10);
+            if (!std::isdigit(static_cast<unsigned char>(*text)) || *end != '\0' || errno == ERANGE ||
+                count == 0 || count > SIZE_MAX)
+            {
+                std::cerr << "Error: invalid job count " << text << ", expected a positive number" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            jobs = count;
+        }
+        else
+        {
+            input_paths.push_back(argv[i]);
+        }
+    }
+
+    // A batch only writes executables, and one profile cannot fit every
+    // program in it.
+    bool single_only = options.print_stats || options.time_passes || options.time_passes_json != nullptr || options.use_nasm || options.use_ld || options.emit_asm || options.run ||
+                       options.profile_path != nullptr || output_path != nullptr;
+    bool valid = !(options.gen_options.instrument && options.profile_path != nullptr) &&
+                 (batch ? !single_only && (manifest_path != nullptr || !input_paths.empty())
+                        : input_paths.size() == 1 && out_dir == nullptr);
+    if (!valid)
+    {
+        std::cout << "Wrong input format the input should be ./mycomiper [--stats] [--time-passes] [--time-passes-json=<file>] [--no-cmov] [--no-simd] [--no-switch] [--no-inline] [--instrument | --profile=<file>] [--output=<file>] [--nasm | --ld | --asm | --run] [--cache=<dir> [--cache-size=<MB>]] <input file>\n"
+                  << "or ./mycomiper --batch [--manifest=<file>] [--jobs=N] [--out-dir=<dir>] [--cache=<dir> [--cache-size=<MB>]] [--no-cmov] [--no-simd] [--no-switch] [--no-inline] [--instrument] <input files>";
+        return EXIT_FAILURE;
+    }
+
+    if (!batch)
+    {
+        if (output_path != nullptr)
+        {
+            options.output_path = output_path;
+        }
+        return compile(input_paths[0], options);
+    }
+
+    BatchCompiler batch_compiler(jobs, [&options](const char *input_path, const char *job_output_path)
+                                 {
+                                     CompileOptions job_options = options;
+                                     job_options.output_path = job_output_path;
+                                     return compile(input_path, job_options); });
+    if (manifest_path != nullptr)
+    {
+        batch_compiler.add_manifest(manifest_path);
+    }
+    for (const char *input_path : input_paths)
     {
-        std::fstream file("out.asm", std::ios::out);
-        file << output;
+        batch_compiler.add(input_path);
     }
-    system("nasm -felf64 print.asm -o print.o");
-    system("nasm -felf64 errors.asm -o errors.o");
-    system("nasm -felf64 out.asm -o out.o");
-    system("ld -o out out.o print.o errors.o");
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    batch_compiler.assign_outputs(out_dir);
+    return batch_compiler.run();
+}
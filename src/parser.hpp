@@ -4,13 +4,17 @@
 #include <iostream>
 #include <variant>
 #include <optional>
+#include <iterator>
 #include "./arenaAllocator.hpp"
+#include "./tokenization.hpp"
+#include "./diagnostics.hpp"
 
 enum class DataType
 {
   Int,
   Char,
   Bool,
+  IntArray,
 };
 
 enum class UnaryOp
@@ -113,9 +117,22 @@ struct NodeTermParen
 {
   NodeExpr *expr;
 };
+
+// ident[index], an element of an int array.
+struct NodeTermIndex
+{
+  Token ident;
+  NodeExpr *index;
+};
+// ident(args), a call of a function.
+struct NodeTermCall
+{
+  Token ident;
+  std::vector<NodeExpr *> args;
+};
 struct NodeTerm
 {
-  std::variant<NodeTermLit *, NodeTermIdent *, NodeTermParen *, NodeTermUnary *> val;
+  std::variant<NodeTermLit *, NodeTermIdent *, NodeTermParen *, NodeTermUnary *, NodeTermIndex *, NodeTermCall *> val;
 };
 
 struct NodeBinExpr
@@ -150,6 +167,15 @@ struct NodeStmtLet
   Token ident;
   DataType dtype;
   std::optional<NodeExpr *> expr;
+  size_t length; // element count if dtype is IntArray
+};
+
+// ident[index] = expr;
+struct NodeStmtAssignIndex
+{
+  Token ident;
+  NodeExpr *index;
+  NodeExpr *expr;
 };
 
 struct NodeStmt;
@@ -186,24 +212,131 @@ struct NodeStmtIf
   NodeStmtScope *scope;
   std::optional<NodeStmtIfCont *> cont;
 };
+struct NodeStmtWhile
+{
+  NodeExpr *expr;
+  NodeStmtScope *scope;
+};
+
+// for (init; cond; step) { ... }. `init` is a scalar let or an assignment and is
+// scoped to the loop; `step` is an assignment run after every iteration.
+struct NodeStmtFor
+{
+  NodeStmt *init;
+  NodeExpr *cond;
+  NodeStmt *step;
+  NodeStmtScope *scope;
+};
+
+struct NodeStmtReturn
+{
+  NodeExpr *expr;
+};
+
+// A call made for its effects; the result is dropped.
+struct NodeStmtCall
+{
+  NodeTermCall *call;
+};
+
 struct NodeStmt
 {
-  std::variant<NodeStmtExit *, NodeStmtConst *, NodeStmtScope *, NodeStmtPrint *, NodeStmtIf *, NodeStmtLet *, NodeStmtAssign *> stmt;
+  std::variant<NodeStmtExit *, NodeStmtConst *, NodeStmtScope *, NodeStmtPrint *, NodeStmtIf *, NodeStmtLet *, NodeStmtAssign *, NodeStmtWhile *, NodeStmtFor *, NodeStmtAssignIndex *, NodeStmtReturn *, NodeStmtCall *> stmt;
+};
+
+struct NodeParam
+{
+  Token ident;
+  DataType dtype;
+};
+
+// fn type ident(type param, ...) { ... }, defined at the top level.
+// Parameters are mutable, like let variables.
+struct NodeFunc
+{
+  Token ident;
+  DataType ret;
+  std::vector<NodeParam> params;
+  NodeStmtScope *body;
 };
 
 struct NodeProg
 {
   std::vector<NodeStmt *> stmts;
+  std::vector<NodeFunc *> funcs;
 };
 
 class Parser
 {
 public:
+  // Arrays live in the stack frame, so their size is capped well below the
+  // default stack limit.
+  static constexpr size_t max_array_length = 65536;
+
   explicit Parser(std::vector<Token> token_vec)
       : tokens(std::move(token_vec)), allocator(1024 * 1024 * 4) {}
 
+  // Reads tokens from a lexer running on another thread as it produces
+  // them, keeping only the current batch and the lookahead.
+  explicit Parser(TokenQueue &token_queue)
+      : queue(&token_queue), allocator(1024 * 1024 * 4) {}
+
+  // A string literal wrapped as an expression, if one comes next.
+  std::optional<NodeExpr *> parse_str_lit()
+  {
+    auto str_lit_token = try_consume(TokenType::str_lit);
+    if (!str_lit_token.has_value())
+    {
+      return std::nullopt;
+    }
+    auto *node_lit = allocator.alloc<NodeTermLit>();
+    node_lit->token = str_lit_token.value();
+    auto *node_term = allocator.alloc<NodeTerm>();
+    node_term->val = node_lit;
+    auto *node_expr = allocator.alloc<NodeExpr>();
+    node_expr->var = node_term;
+    return node_expr;
+  }
+
+  // A string literal in any number of parentheses, as in print("hi");
+  // the parentheses are dropped.
+  std::optional<NodeExpr *> parse_paren_str_lit()
+  {
+    int depth = 0;
+    while (peek(depth).has_value() && peek(depth)->type == TokenType::open_paren)
+    {
+      depth++;
+    }
+    if (!peek(depth).has_value() || peek(depth)->type != TokenType::str_lit)
+    {
+      return std::nullopt;
+    }
+    for (int i = 1; i <= depth; i++)
+    {
+      if (!peek(depth + i).has_value() || peek(depth + i)->type != TokenType::close_paren)
+      {
+        return std::nullopt;
+      }
+    }
+    for (int i = 0; i < depth; i++)
+    {
+      consume();
+    }
+    auto node_expr = parse_str_lit();
+    for (int i = 0; i < depth; i++)
+    {
+      consume();
+    }
+    return node_expr;
+  }
+
   std::optional<NodeTerm *> parse_term(bool allow_unary = true)
   {
+    if (peek().has_value() && peek()->type == TokenType::str_lit)
+    {
+      diagnostics() << "String literals can only be printed\n";
+      throw CompileError();
+    }
     if (auto int_lit_token = try_consume(TokenType::int_lit))
     {
       auto *node_term = allocator.alloc<NodeTerm>();
@@ -232,14 +365,14 @@ public:
     {
       if (allow_unary == false)
       {
-        std::cerr << "Expected term but got minus\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected term but got minus\n";
+        throw CompileError();
       }
       auto operand = parse_term(false);
       if (!operand.has_value())
       {
-        std::cerr << "Expected term after unary minus\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected term after unary minus\n";
+        throw CompileError();
       }
       auto *node_unary = allocator.alloc<NodeTermUnary>();
       node_unary->op = UnaryOp::Negate;
@@ -253,14 +386,14 @@ public:
     {
       if (allow_unary == false)
       {
-        std::cerr << "Expected term but got minus\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected term but got minus\n";
+        throw CompileError();
       }
       auto operand = parse_term(false);
       if (!operand.has_value())
       {
-        std::cerr << "Expected term after unary minus\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected term after unary minus\n";
+        throw CompileError();
       }
       auto *node_unary = allocator.alloc<NodeTermUnary>();
       node_unary->op = UnaryOp::Not;
@@ -273,6 +406,19 @@ public:
     else if (auto ident_token = try_consume(TokenType::ident))
     {
       auto *node_term = allocator.alloc<NodeTerm>();
+      if (try_consume(TokenType::open_paren))
+      {
+        node_term->val = parse_call(ident_token.value());
+        return node_term;
+      }
+      if (try_consume(TokenType::open_square))
+      {
+        auto *node_index = allocator.alloc<NodeTermIndex>();
+        node_index->ident = ident_token.value();
+        node_index->index = parse_index();
+        node_term->val = node_index;
+        return node_term;
+      }
       auto *node_ident = allocator.alloc<NodeTermIdent>();
       node_ident->ident = ident_token.value();
       node_term->val = node_ident;
@@ -293,8 +439,8 @@ public:
         }
         else
         {
-          std::cerr << "Expected close parenthesis\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected close parenthesis\n";
+          throw CompileError();
         }
       }
     }
@@ -327,16 +473,16 @@ public:
       }
       else
       {
-        std::cerr << "Expected semi\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected semi\n";
+        throw CompileError();
       }
       Token op = consume();
       int next_min_prec = prec + 1;
       auto expr_rhs = parse_expr(next_min_prec, false);
       if (!expr_rhs.has_value())
       {
-        std::cerr << "Unable to parse expression" << std::endl;
-        exit(EXIT_FAILURE);
+        diagnostics() << "Unable to parse expression" << std::endl;
+        throw CompileError();
       }
       auto bin_expr = allocator.alloc<NodeBinExpr>();
       if (op.type == TokenType::plus)
@@ -432,8 +578,8 @@ public:
       }
       else
       {
-        std::cerr << "Unexpected operation" << std::endl;
-        exit(EXIT_FAILURE);
+        diagnostics() << "Unexpected operation" << std::endl;
+        throw CompileError();
       }
 
       auto new_expr = allocator.alloc<NodeExpr>();
@@ -447,8 +593,8 @@ public:
   {
     if (!try_consume(TokenType::open_curly))
     {
-      std::cerr << "Expected '{'\n";
-      std::exit(EXIT_FAILURE);
+      diagnostics() << "Expected '{'\n";
+      throw CompileError();
     }
     auto node_scope = allocator.alloc<NodeStmtScope>();
     while (peek().has_value() && peek().value().type != TokenType::close_curly)
@@ -459,14 +605,14 @@ public:
       }
       else
       {
-        std::cerr << "Expected statement inside scope\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected statement inside scope\n";
+        throw CompileError();
       }
     }
     if (!try_consume(TokenType::close_curly))
     {
-      std::cerr << "Expected '}'\n";
-      std::exit(EXIT_FAILURE);
+      diagnostics() << "Expected '}'\n";
+      throw CompileError();
     }
     return node_scope;
   }
@@ -477,8 +623,8 @@ public:
     {
       if (!try_consume(TokenType::open_paren))
       {
-        std::cerr << "Expected '('\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected '('\n";
+        throw CompileError();
       }
       auto *node_elif = allocator.alloc<NodeStmtElif>();
       if (auto node_expr = parse_expr())
@@ -486,8 +632,8 @@ public:
         node_elif->expr = node_expr.value();
         if (!try_consume(TokenType::close_paren))
         {
-          std::cerr << "Expected ')'\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected ')'\n";
+          throw CompileError();
         }
 
         if (auto node_scope = parse_scope())
@@ -500,14 +646,14 @@ public:
         }
         else
         {
-          std::cerr << "Expected scope\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected scope\n";
+          throw CompileError();
         }
       }
       else
       {
-        std::cerr << "Expected expression\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected expression\n";
+        throw CompileError();
       }
     }
     if (try_consume(TokenType::else_))
@@ -522,13 +668,44 @@ public:
       }
       else
       {
-        std::cerr << "Expected scope\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected scope\n";
+        throw CompileError();
       }
     }
     return std::nullopt;
   }
 
+  // Parses `ident = expr` without the trailing semicolon.
+  NodeStmt *parse_assign()
+  {
+    if (!peek().has_value() || peek()->type != TokenType::ident)
+    {
+      diagnostics() << "Expected identifier\n";
+      throw CompileError();
+    }
+    auto *node_stmt_assign = allocator.alloc<NodeStmtAssign>();
+    node_stmt_assign->ident = consume();
+
+    if (!peek().has_value() || peek()->type != TokenType::assign)
+    {
+      diagnostics() << "Expected '=' after identifier\n";
+      throw CompileError();
+    }
+    consume();
+    if (auto node_expr = parse_expr())
+    {
+      node_stmt_assign->expr = node_expr.value();
+    }
+    else
+    {
+      diagnostics() << "Expected Expression\n";
+      throw CompileError();
+    }
+    auto *node_stmt = allocator.alloc<NodeStmt>();
+    node_stmt->stmt = node_stmt_assign;
+    return node_stmt;
+  }
+
   std::optional<NodeStmt *> parse_stmt()
   {
     if (peek().has_value() && peek()->type == TokenType::exit)
@@ -543,15 +720,15 @@ public:
         node_stmt->stmt = node_stmt_exit;
         if (!try_consume(TokenType::semi))
         {
-          std::cerr << "Expected semi\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected semi\n";
+          throw CompileError();
         }
         return node_stmt;
       }
       else
       {
-        std::cerr << "Expected Expression\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected Expression\n";
+        throw CompileError();
       }
     }
     else if (peek().has_value() && peek()->type == TokenType::print)
@@ -559,21 +736,27 @@ public:
       consume();
       auto *node_stmt_print = allocator.alloc<NodeStmtPrint>();
       auto *node_stmt = allocator.alloc<NodeStmt>();
-      if (auto node_expr = parse_expr())
+      // A string literal can only be printed, so it is not a term.
+      auto node_expr = parse_paren_str_lit();
+      if (!node_expr.has_value())
+      {
+        node_expr = parse_expr();
+      }
+      if (node_expr.has_value())
       {
         node_stmt_print->expr = node_expr.value();
         node_stmt->stmt = node_stmt_print;
         if (!try_consume(TokenType::semi))
         {
-          std::cerr << "Expected semi\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected semi\n";
+          throw CompileError();
         }
         return node_stmt;
       }
       else
       {
-        std::cerr << "Expected Expression\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected Expression\n";
+        throw CompileError();
       }
     }
     else if (peek().has_value() && peek()->type == TokenType::cnst)
@@ -582,29 +765,34 @@ public:
       auto *node_stmt_const = allocator.alloc<NodeStmtConst>();
       if (!peek().has_value())
       {
-        std::cerr << "Expected type after const\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected type after const\n";
+        throw CompileError();
       }
       auto it = typeMappings.find(peek()->type);
       if (it == typeMappings.end())
       {
-        std::cerr << "Expected valid type after const\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected valid type after const\n";
+        throw CompileError();
       }
       DataType dtype = it->second;
       node_stmt_const->dtype = dtype;
       consume();
+      if (peek().has_value() && peek()->type == TokenType::open_square)
+      {
+        diagnostics() << "Arrays must be declared with let\n";
+        throw CompileError();
+      }
       if (!peek().has_value() || peek()->type != TokenType::ident)
       {
-        std::cerr << "Expected identifier after type\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected identifier after type\n";
+        throw CompileError();
       }
       node_stmt_const->ident = consume();
       auto *node_stmt = allocator.alloc<NodeStmt>();
       if (!peek().has_value() || peek()->type != TokenType::assign)
       {
-        std::cerr << "Expected '=' after identifier\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected '=' after identifier\n";
+        throw CompileError();
       }
       consume();
       if (auto node_expr = parse_expr())
@@ -612,14 +800,14 @@ public:
         node_stmt_const->expr = node_expr.value();
         if (!try_consume(TokenType::semi))
         {
-          std::cerr << "Expected semi\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected semi\n";
+          throw CompileError();
         }
       }
       else
       {
-        std::cerr << "Expected Expression\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected Expression\n";
+        throw CompileError();
       }
 
       node_stmt->stmt = node_stmt_const;
@@ -631,27 +819,37 @@ public:
       auto *node_stmt_let = allocator.alloc<NodeStmtLet>();
       if (!peek().has_value())
       {
-        std::cerr << "Expected type after const\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected type after const\n";
+        throw CompileError();
       }
       auto it = typeMappings.find(peek()->type);
       if (it == typeMappings.end())
       {
-        std::cerr << "Expected valid type after const\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected valid type after const\n";
+        throw CompileError();
       }
       DataType dtype = it->second;
       node_stmt_let->dtype = dtype;
       consume();
+      if (try_consume(TokenType::open_square))
+      {
+        if (dtype != DataType::Int)
+        {
+          diagnostics() << "Only int arrays are supported\n";
+          throw CompileError();
+        }
+        node_stmt_let->dtype = DataType::IntArray;
+        node_stmt_let->length = parse_array_length();
+      }
       if (!peek().has_value() || peek()->type != TokenType::ident)
       {
-        std::cerr << "Expected identifier after type\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected identifier after type\n";
+        throw CompileError();
       }
       node_stmt_let->ident = consume();
       auto *node_stmt = allocator.alloc<NodeStmt>();
-      // Optional assignment
-      if (peek().has_value() && peek()->type == TokenType::assign)
+      // Optional assignment; arrays always start out zeroed
+      if (node_stmt_let->dtype != DataType::IntArray && peek().has_value() && peek()->type == TokenType::assign)
       {
         consume(); // consume '='
 
@@ -661,48 +859,107 @@ public:
         }
         else
         {
-          std::cerr << "Expected expression after '='\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected expression after '='\n";
+          throw CompileError();
         }
       }
 
       // Require semicolon in both cases
       if (!try_consume(TokenType::semi))
       {
-        std::cerr << "Expected ';' after let statement\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected ';' after let statement\n";
+        throw CompileError();
       }
 
       node_stmt->stmt = node_stmt_let;
       return node_stmt;
     }
-    else if (peek().has_value() && peek()->type == TokenType::ident)
+    else if (peek().has_value() && peek()->type == TokenType::return_)
     {
-      auto *node_stmt_assign = allocator.alloc<NodeStmtAssign>();
-      node_stmt_assign->ident = consume();
-
-      if (!peek().has_value() || peek()->type != TokenType::assign)
+      consume();
+      if (!in_function)
+      {
+        diagnostics() << "Expected return inside a function\n";
+        throw CompileError();
+      }
+      auto *node_stmt_return = allocator.alloc<NodeStmtReturn>();
+      if (auto node_expr = parse_expr())
+      {
+        node_stmt_return->expr = node_expr.value();
+      }
+      else
+      {
+        diagnostics() << "Expected Expression\n";
+        throw CompileError();
+      }
+      if (!try_consume(TokenType::semi))
       {
-        std::cerr << "Expected '=' after identifier\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected semi\n";
+        throw CompileError();
       }
+      auto *node_stmt = allocator.alloc<NodeStmt>();
+      node_stmt->stmt = node_stmt_return;
+      return node_stmt;
+    }
+    else if (peek().has_value() && peek()->type == TokenType::fn)
+    {
+      diagnostics() << "Functions must be defined at the top level\n";
+      throw CompileError();
+    }
+    else if (peek().has_value() && peek()->type == TokenType::ident && peek(1).has_value() &&
+             peek(1)->type == TokenType::open_paren)
+    {
+      Token ident = consume();
       consume();
+      auto *node_stmt_call = allocator.alloc<NodeStmtCall>();
+      node_stmt_call->call = parse_call(ident);
+      if (!try_consume(TokenType::semi))
+      {
+        diagnostics() << "Expected semi\n";
+        throw CompileError();
+      }
+      auto *node_stmt = allocator.alloc<NodeStmt>();
+      node_stmt->stmt = node_stmt_call;
+      return node_stmt;
+    }
+    else if (peek().has_value() && peek()->type == TokenType::ident && peek(1).has_value() &&
+             peek(1)->type == TokenType::open_square)
+    {
+      auto *node_stmt_assign_index = allocator.alloc<NodeStmtAssignIndex>();
+      node_stmt_assign_index->ident = consume();
+      consume();
+      node_stmt_assign_index->index = parse_index();
+      if (!try_consume(TokenType::assign))
+      {
+        diagnostics() << "Expected '=' after array element\n";
+        throw CompileError();
+      }
       if (auto node_expr = parse_expr())
       {
-        node_stmt_assign->expr = node_expr.value();
-        if (!try_consume(TokenType::semi))
-        {
-          std::cerr << "Expected semi\n";
-          std::exit(EXIT_FAILURE);
-        }
+        node_stmt_assign_index->expr = node_expr.value();
       }
       else
       {
-        std::cerr << "Expected Expression\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected Expression\n";
+        throw CompileError();
+      }
+      if (!try_consume(TokenType::semi))
+      {
+        diagnostics() << "Expected semi\n";
+        throw CompileError();
       }
       auto *node_stmt = allocator.alloc<NodeStmt>();
-      node_stmt->stmt = node_stmt_assign;
+      node_stmt->stmt = node_stmt_assign_index;
+      return node_stmt;
+    }
+    else if (peek().has_value() && peek()->type == TokenType::ident)
+    {
+      NodeStmt *node_stmt = parse_assign();
+      if (!try_consume(TokenType::semi))
+      {
+        diagnostics() << "Expected semi\n";
+        throw CompileError();
+      }
       return node_stmt;
     }
     else if (peek().has_value() && peek()->type == TokenType::open_curly)
@@ -716,8 +973,8 @@ public:
       }
       else
       {
-        std::cerr << "Expected scope\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected scope\n";
+        throw CompileError();
       }
     }
     else if (peek().has_value() && peek()->type == TokenType::if_)
@@ -725,8 +982,8 @@ public:
       consume();
       if (!try_consume(TokenType::open_paren))
       {
-        std::cerr << "Expected '('\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected '('\n";
+        throw CompileError();
       }
       auto *node_if = allocator.alloc<NodeStmtIf>();
 
@@ -736,8 +993,8 @@ public:
 
         if (!try_consume(TokenType::close_paren))
         {
-          std::cerr << "Expected ')'\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected ')'\n";
+          throw CompileError();
         }
 
         if (auto node_scope = parse_scope())
@@ -750,15 +1007,102 @@ public:
         }
         else
         {
-          std::cerr << "Expected scope\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected scope\n";
+          throw CompileError();
+        }
+      }
+      else
+      {
+        diagnostics() << "Expected expression\n";
+        throw CompileError();
+      }
+    }
+    else if (peek().has_value() && peek()->type == TokenType::while_)
+    {
+      consume();
+      if (!try_consume(TokenType::open_paren))
+      {
+        diagnostics() << "Expected '('\n";
+        throw CompileError();
+      }
+      auto *node_while = allocator.alloc<NodeStmtWhile>();
+      if (auto node_expr = parse_expr())
+      {
+        node_while->expr = node_expr.value();
+      }
+      else
+      {
+        diagnostics() << "Expected expression\n";
+        throw CompileError();
+      }
+      if (!try_consume(TokenType::close_paren))
+      {
+        diagnostics() << "Expected ')'\n";
+        throw CompileError();
+      }
+      node_while->scope = parse_scope().value();
+      auto node_stmt = allocator.alloc<NodeStmt>();
+      node_stmt->stmt = node_while;
+      return node_stmt;
+    }
+    else if (peek().has_value() && peek()->type == TokenType::for_)
+    {
+      consume();
+      if (!try_consume(TokenType::open_paren))
+      {
+        diagnostics() << "Expected '('\n";
+        throw CompileError();
+      }
+      auto *node_for = allocator.alloc<NodeStmtFor>();
+      if (!peek().has_value() ||
+          (peek()->type != TokenType::let &&
+           (peek()->type != TokenType::ident || !peek(1).has_value() || peek(1)->type != TokenType::assign)))
+      {
+        diagnostics() << "Expected let or assignment to start for loop\n";
+        throw CompileError();
+      }
+      if (peek()->type == TokenType::let)
+      {
+        node_for->init = parse_stmt().value();
+        if (std::get<NodeStmtLet *>(node_for->init->stmt)->dtype == DataType::IntArray)
+        {
+          diagnostics() << "Arrays cannot be declared in a for loop header\n";
+          throw CompileError();
+        }
+      }
+      else
+      {
+        node_for->init = parse_assign();
+        if (!try_consume(TokenType::semi))
+        {
+          diagnostics() << "Expected semi\n";
+          throw CompileError();
         }
       }
+      if (auto node_expr = parse_expr())
+      {
+        node_for->cond = node_expr.value();
+      }
       else
       {
-        std::cerr << "Expected expression\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected loop condition\n";
+        throw CompileError();
       }
+      if (!try_consume(TokenType::semi))
+      {
+        diagnostics() << "Expected semi\n";
+        throw CompileError();
+      }
+      node_for->step = parse_assign();
+      if (!try_consume(TokenType::close_paren))
+      {
+        diagnostics() << "Expected ')'\n";
+        throw CompileError();
+      }
+      node_for->scope = parse_scope().value();
+      auto node_stmt = allocator.alloc<NodeStmt>();
+      node_stmt->stmt = node_for;
+      return node_stmt;
     }
     return std::nullopt;
   }
@@ -770,21 +1114,31 @@ public:
 
     while (peek().has_value())
     {
-
+      if (peek()->type == TokenType::fn)
+      {
+        prog.funcs.push_back(parse_func());
+        continue;
+      }
       if (auto node_stmt = parse_stmt())
       {
         prog.stmts.push_back(node_stmt.value());
       }
       else
       {
-        std::cerr << "Expected statement\n";
-        std::exit(EXIT_FAILURE);
+        diagnostics() << "Expected statement\n";
+        throw CompileError();
       }
     }
 
     return prog;
   }
 
+  // Number of AST nodes parsed.
+  size_t nodes() const
+  {
+    return allocator.count();
+  }
+
   NodeProg parse()
   {
     if (auto prog = parse_prog())
@@ -793,21 +1147,165 @@ public:
     }
     else
     {
-      std::cerr << "Expected Program\n";
-      std::exit(EXIT_FAILURE);
+      diagnostics() << "Expected Program\n";
+      throw CompileError();
     }
   }
 
 private:
+  // Parses `fn type name(type param, ...) { ... }`.
+  NodeFunc *parse_func()
+  {
+    consume();
+    auto *node_func = allocator.alloc<NodeFunc>();
+    node_func->ret = parse_scalar_type("Expected return type after fn\n");
+    auto ident = try_consume(TokenType::ident);
+    if (!ident.has_value())
+    {
+      diagnostics() << "Expected function name\n";
+      throw CompileError();
+    }
+    node_func->ident = ident.value();
+    if (!try_consume(TokenType::open_paren))
+    {
+      diagnostics() << "Expected '('\n";
+      throw CompileError();
+    }
+    if (!try_consume(TokenType::close_paren))
+    {
+      do
+      {
+        DataType dtype = parse_scalar_type("Expected parameter type\n");
+        auto param = try_consume(TokenType::ident);
+        if (!param.has_value())
+        {
+          diagnostics() << "Expected parameter name\n";
+          throw CompileError();
+        }
+        node_func->params.push_back({param.value(), dtype});
+      } while (try_consume(TokenType::comma));
+      if (!try_consume(TokenType::close_paren))
+      {
+        diagnostics() << "Expected ')'\n";
+        throw CompileError();
+      }
+    }
+    in_function = true;
+    node_func->body = parse_scope().value();
+    in_function = false;
+    return node_func;
+  }
+
+  // Parses `args)` after the '(' of a call.
+  NodeTermCall *parse_call(Token ident)
+  {
+    auto *node_call = allocator.alloc<NodeTermCall>();
+    node_call->ident = std::move(ident);
+    if (try_consume(TokenType::close_paren))
+    {
+      return node_call;
+    }
+    do
+    {
+      auto node_expr = parse_expr();
+      if (!node_expr.has_value())
+      {
+        diagnostics() << "Expected argument\n";
+        throw CompileError();
+      }
+      node_call->args.push_back(node_expr.value());
+    } while (try_consume(TokenType::comma));
+    if (!try_consume(TokenType::close_paren))
+    {
+      diagnostics() << "Expected ')' after arguments\n";
+      throw CompileError();
+    }
+    return node_call;
+  }
+
+  DataType parse_scalar_type(const char *error)
+  {
+    auto it = peek().has_value() ? typeMappings.find(peek()->type) : typeMappings.end();
+    if (it == typeMappings.end())
+    {
+      diagnostics() << error;
+      throw CompileError();
+    }
+    consume();
+    return it->second;
+  }
+
+  // Parses `expr]` after the '[' of an array element.
+  NodeExpr *parse_index()
+  {
+    auto node_expr = parse_expr();
+    if (!node_expr.has_value())
+    {
+      diagnostics() << "Expected index expression\n";
+      throw CompileError();
+    }
+    if (!try_consume(TokenType::close_square))
+    {
+      diagnostics() << "Expected ']'\n";
+      throw CompileError();
+    }
+    return node_expr.value();
+  }
+
+  // Parses `N]` after the '[' of an array type.
+  size_t parse_array_length()
+  {
+    auto length_token = try_consume(TokenType::int_lit);
+    if (!length_token.has_value())
+    {
+      diagnostics() << "Expected array length\n";
+      throw CompileError();
+    }
+    const std::string &digits = length_token->val.value();
+    size_t length = digits.size() > 9 ? max_array_length + 1 : std::stoul(digits);
+    if (length == 0 || length > max_array_length)
+    {
+      diagnostics() << "Array length must be between 1 and " << max_array_length << "\n";
+      throw CompileError();
+    }
+    if (!try_consume(TokenType::close_square))
+    {
+      diagnostics() << "Expected ']'\n";
+      throw CompileError();
+    }
+    return length;
+  }
+
   std::optional<Token> peek(int offset = 0)
   {
-    if (index + offset >= tokens.size())
+    while (index + offset >= tokens.size())
     {
-      return std::nullopt;
+      if (!refill())
+      {
+        return std::nullopt;
+      }
     }
     return tokens[index + offset];
   }
 
+  // Drops the tokens already consumed and appends the lexer's next batch.
+  // Returns false once the lexer is done, or without one.
+  bool refill()
+  {
+    if (queue == nullptr)
+      return false;
+    std::optional<std::vector<Token>> batch = queue->pop();
+    if (!batch.has_value())
+    {
+      queue = nullptr;
+      return false;
+    }
+    tokens.erase(tokens.begin(), tokens.begin() + index);
+    index = 0;
+    tokens.insert(tokens.end(), std::make_move_iterator(batch->begin()), std::make_move_iterator(batch->end()));
+    return true;
+  }
+
   Token consume()
   {
     return tokens[index++];
@@ -861,5 +1359,7 @@ private:
 
   std::vector<Token> tokens;
   size_t index = 0;
+  TokenQueue *queue = nullptr; // lexer still producing tokens, if any
+  bool in_function = false;
   ArenaAllocator allocator;
 };
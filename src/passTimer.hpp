@@ -0,0 +1,151 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Wall and CPU time of the compiler's passes, for --time-passes. A pass is
+// timed on the thread that runs it, with that thread's CPU time, so passes
+// that overlap on different threads (tokenising and parsing, assembling
+// the runtime and compiling the program) are each charged their own work.
+// Sizes recorded alongside turn the times into throughput figures.
+class PassTimer
+{
+public:
+  struct Span
+  {
+    std::chrono::steady_clock::time_point wall;
+    double cpu;
+  };
+
+  struct Counts
+  {
+    size_t source_bytes = 0;
+    size_t tokens = 0;
+    size_t ast_nodes = 0;
+    size_t asm_bytes = 0;
+    size_t instructions = 0; // only known when the built-in assembler runs
+  };
+
+  PassTimer() : start_time(now()) {}
+
+  static Span now()
+  {
+    return {std::chrono::steady_clock::now(), thread_cpu_seconds()};
+  }
+
+  // Records the pass `name` as running from `start` until now on the
+  // calling thread. Safe to call from any thread.
+  void end(const char *name, const Span &start)
+  {
+    Span stop = now();
+    std::lock_guard lock(mutex);
+    passes.push_back({name, std::chrono::duration<double>(stop.wall - start.wall).count(), stop.cpu - start.cpu});
+  }
+
+  Counts counts;
+
+  void report(std::ostream &out) const
+  {
+    char line[128];
+    std::snprintf(line, sizeof(line), "%-18s %12s %12s\n", "pass", "wall ms", "cpu ms");
+    out << line;
+    for (const Pass &pass : passes)
+    {
+      std::snprintf(line, sizeof(line), "%-18s %12.3f %12.3f\n", pass.name.c_str(), pass.wall * 1e3, pass.cpu * 1e3);
+      out << line;
+    }
+    std::snprintf(line, sizeof(line), "%-18s %12.3f %12.3f\n", "total", total_wall() * 1e3, process_cpu_seconds() * 1e3);
+    out << line;
+
+    std::snprintf(line, sizeof(line), "tokenise: %zu bytes, %.2f MB/s\n", counts.source_bytes,
+                  rate(counts.source_bytes, "tokenise") / 1e6);
+    out << line;
+    std::snprintf(line, sizeof(line), "parse: %zu tokens, %.0f tokens/s\n", counts.tokens, rate(counts.tokens, "parse"));
+    out << line;
+    std::snprintf(line, sizeof(line), "generate: %zu AST nodes, %zu bytes of assembly, %.0f nodes/s\n",
+                  counts.ast_nodes, counts.asm_bytes, rate(counts.ast_nodes, "generate"));
+    out << line;
+    if (counts.instructions > 0)
+    {
+      std::snprintf(line, sizeof(line), "assemble: %zu instructions, %.0f instructions/s\n", counts.instructions,
+                    rate(counts.instructions, "assemble"));
+      out << line;
+    }
+  }
+
+  // The same figures as one JSON object, for tracking compile time over
+  // time. Times are in milliseconds and rates per CPU second.
+  void report_json(std::ostream &out) const
+  {
+    char buf[256];
+    out << "{\"passes\": [";
+    for (size_t i = 0; i < passes.size(); i++)
+    {
+      std::snprintf(buf, sizeof(buf), "%s{\"name\": \"%s\", \"wall_ms\": %.6f, \"cpu_ms\": %.6f}",
+                    i == 0 ? "" : ", ", passes[i].name.c_str(), passes[i].wall * 1e3, passes[i].cpu * 1e3);
+      out << buf;
+    }
+    std::snprintf(buf, sizeof(buf), "], \"total\": {\"wall_ms\": %.6f, \"cpu_ms\": %.6f}, ",
+                  total_wall() * 1e3, process_cpu_seconds() * 1e3);
+    out << buf;
+    std::snprintf(buf, sizeof(buf),
+                  "\"counts\": {\"source_bytes\": %zu, \"tokens\": %zu, \"ast_nodes\": %zu, \"asm_bytes\": %zu, "
+                  "\"instructions\": %zu}, ",
+                  counts.source_bytes, counts.tokens, counts.ast_nodes, counts.asm_bytes, counts.instructions);
+    out << buf;
+    std::snprintf(buf, sizeof(buf),
+                  "\"rates\": {\"tokenise_bytes_per_s\": %.1f, \"parse_tokens_per_s\": %.1f, "
+                  "\"generate_nodes_per_s\": %.1f, \"assemble_instructions_per_s\": %.1f}}\n",
+                  rate(counts.source_bytes, "tokenise"), rate(counts.tokens, "parse"),
+                  rate(counts.ast_nodes, "generate"), rate(counts.instructions, "assemble"));
+    out << buf;
+  }
+
+private:
+  struct Pass
+  {
+    std::string name;
+    double wall;
+    double cpu;
+  };
+
+  static double thread_cpu_seconds()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  static double process_cpu_seconds()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  double total_wall() const
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time.wall).count();
+  }
+
+  // `amount` per CPU second spent in `pass`, or 0 if it did not run. CPU
+  // time leaves out the parser's waits for tokens.
+  double rate(size_t amount, const char *pass) const
+  {
+    for (const Pass &p : passes)
+    {
+      if (p.name == pass && p.cpu > 0)
+        return amount / p.cpu;
+    }
+    return 0;
+  }
+
+  Span start_time;
+  std::mutex mutex;
+  std::vector<Pass> passes;
+};
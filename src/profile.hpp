@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <variant>
+#include "./parser.hpp"
+#include "./diagnostics.hpp"
+
+// Branch counts of a program, for profile-guided builds. Every if/elif
+// condition and every loop condition is a branch site, numbered in program
+// order (the program body, then each function), so an instrumented build
+// and a later build of the same source agree on the numbering whatever
+// each of them decides about layout.
+//
+// An instrumented program keeps two counters per site, how often the
+// condition was evaluated and how often it held, and writes them to
+// `default_path` when it exits normally: the magic, the source hash and
+// the site count, then the counter pairs, all as little-endian qwords.
+class BranchProfile
+{
+public:
+  struct Counts
+  {
+    uint64_t executed = 0;
+    uint64_t taken = 0;
+  };
+
+  static constexpr uint64_t magic = 0x31304f5250434d; // "MCPRO01"
+  static constexpr const char *default_path = "out.prof";
+
+  BranchProfile(const NodeProg &prog, uint64_t source_hash) : hash(source_hash)
+  {
+    number_stmts(prog.stmts);
+    for (const NodeFunc *func : prog.funcs)
+    {
+      number_stmts(func->body->stmts);
+    }
+  }
+
+  // FNV-1a, to tell whether a profile was recorded for this source.
+  static uint64_t hash_source(std::string_view source)
+  {
+    uint64_t h = 0xcbf29ce484222325;
+    for (char c : source)
+    {
+      h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+    }
+    return h;
+  }
+
+  // Reads the counts an instrumented build of the same source wrote.
+  void load(const std::string &path)
+  {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+      diagnostics() << "Error: could not open profile " << path << std::endl;
+      throw CompileError();
+    }
+    uint64_t header[3];
+    if (!file.read(reinterpret_cast<char *>(header), sizeof(header)) || header[0] != magic)
+    {
+      diagnostics() << "Error: " << path << " is not a branch profile" << std::endl;
+      throw CompileError();
+    }
+    if (header[1] != hash || header[2] != conds.size())
+    {
+      diagnostics() << "Error: profile " << path << " was recorded for a different program" << std::endl;
+      throw CompileError();
+    }
+    counts.resize(conds.size());
+    if (!file.read(reinterpret_cast<char *>(counts.data()), counts.size() * sizeof(Counts)))
+    {
+      diagnostics() << "Error: profile " << path << " is truncated" << std::endl;
+      throw CompileError();
+    }
+  }
+
+  size_t sites() const
+  {
+    return conds.size();
+  }
+
+  uint64_t source_hash() const
+  {
+    return hash;
+  }
+
+  std::optional<size_t> site_of(const NodeExpr *cond) const
+  {
+    auto site = sites_by_cond.find(cond);
+    if (site == sites_by_cond.end())
+      return std::nullopt;
+    return site->second;
+  }
+
+  // Counts recorded for the branch on `cond`, or nothing without a profile.
+  std::optional<Counts> counts_of(const NodeExpr *cond) const
+  {
+    auto site = site_of(cond);
+    if (counts.empty() || !site.has_value())
+      return std::nullopt;
+    return counts[site.value()];
+  }
+
+private:
+  void number_stmts(const std::vector<NodeStmt *> &stmts)
+  {
+    for (const NodeStmt *stmt : stmts)
+    {
+      number_stmt(stmt);
+    }
+  }
+
+  void number_stmt(const NodeStmt *stmt)
+  {
+    if (auto *stmt_if = std::get_if<NodeStmtIf *>(&stmt->stmt))
+    {
+      number((*stmt_if)->expr);
+      number_stmts((*stmt_if)->scope->stmts);
+      std::optional<NodeStmtIfCont *> cont = (*stmt_if)->cont;
+      while (cont.has_value())
+      {
+        if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+        {
+          number((*stmt_elif)->expr);
+          number_stmts((*stmt_elif)->scope->stmts);
+          cont = (*stmt_elif)->cont;
+        }
+        else
+        {
+          number_stmts(std::get<NodeStmtElse *>(cont.value()->clause)->scope->stmts);
+          cont = std::nullopt;
+        }
+      }
+    }
+    else if (auto *stmt_while = std::get_if<NodeStmtWhile *>(&stmt->stmt))
+    {
+      number((*stmt_while)->expr);
+      number_stmts((*stmt_while)->scope->stmts);
+    }
+    else if (auto *stmt_for = std::get_if<NodeStmtFor *>(&stmt->stmt))
+    {
+      number((*stmt_for)->cond);
+      number_stmts((*stmt_for)->scope->stmts);
+    }
+    else if (auto *stmt_scope = std::get_if<NodeStmtScope *>(&stmt->stmt))
+    {
+      number_stmts((*stmt_scope)->stmts);
+    }
+  }
+
+  void number(const NodeExpr *cond)
+  {
+    sites_by_cond[cond] = conds.size();
+    conds.push_back(cond);
+  }
+
+  uint64_t hash;
+  std::vector<const NodeExpr *> conds;
+  std::unordered_map<const NodeExpr *, size_t> sites_by_cond;
+  std::vector<Counts> counts; // empty without a profile
+};
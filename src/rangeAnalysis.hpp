@@ -0,0 +1,934 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <variant>
+#include "./parser.hpp"
+
+// Closed interval [lo, hi] of the values an expression can take at runtime.
+struct Range
+{
+  int64_t lo;
+  int64_t hi;
+
+  static Range full()
+  {
+    return {std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max()};
+  }
+  static Range constant(int64_t value)
+  {
+    return {value, value};
+  }
+  static Range boolean()
+  {
+    return {0, 1};
+  }
+
+  bool is_constant() const
+  {
+    return lo == hi;
+  }
+  bool contains(int64_t value) const
+  {
+    return lo <= value && value <= hi;
+  }
+  Range join(const Range &other) const
+  {
+    return {std::min(lo, other.lo), std::max(hi, other.hi)};
+  }
+  bool operator==(const Range &other) const = default;
+};
+
+// Forward interval analysis over the AST. It mirrors the scoping rules of the
+// Generator and records which arithmetic operations provably cannot overflow,
+// which divisions provably never see a zero divisor and which array accesses
+// provably stay in bounds, so the generator can drop the corresponding
+// `jo overflow_error` / `je divzero_error` / `jae bounds_error` checks.
+//
+// An array is tracked as a single range covering all of its elements; stores
+// widen it rather than replace it.
+class RangeAnalyser
+{
+public:
+  explicit RangeAnalyser(const NodeProg &program) : prog(program) {}
+
+  void analyse()
+  {
+    enter_scope();
+    for (const NodeStmt *stmt : prog.stmts)
+    {
+      if (!reachable)
+        break;
+      analyse_stmt(stmt);
+    }
+    exit_scope();
+
+    // A function body is analysed once for any arguments, so what it
+    // proves holds at every call and wherever the body is inlined.
+    for (const NodeFunc *func : prog.funcs)
+    {
+      enter_scope();
+      for (const NodeParam &param : func->params)
+      {
+        env.back()[param.ident.val.value()] = Range::full();
+      }
+      reachable = true;
+      analyse_scope(func->body);
+      exit_scope();
+    }
+  }
+
+  bool no_overflow(const void *op) const
+  {
+    auto it = overflow_proofs.find(op);
+    return it != overflow_proofs.end() && it->second;
+  }
+
+  bool nonzero_divisor(const void *op) const
+  {
+    auto it = divisor_proofs.find(op);
+    return it != divisor_proofs.end() && it->second;
+  }
+
+  // True if the index of an array access always lies within the array.
+  bool in_bounds(const void *access) const
+  {
+    auto it = bounds_proofs.find(access);
+    return it != bounds_proofs.end() && it->second;
+  }
+
+  // True if evaluating `expr` can never trap, so it may run even where the
+  // original program would not have evaluated it. Division is only allowed
+  // by a nonzero literal: idiv faults on a zero divisor and on
+  // INT64_MIN / -1, and ranges proven at one point need not hold at another.
+  // For the same reason an array is only read at a literal index: a proof
+  // that a variable index is in bounds may rest on a condition tested, or
+  // an access checked, before the read, and hoisted or selected code runs
+  // ahead of both. Arithmetic whose proof fails there only gives a value
+  // that is never used.
+  bool is_speculatable(const NodeExpr *expr) const
+  {
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      return is_speculatable(*term);
+    }
+    return std::visit(
+        [this](const auto *op)
+        {
+          using Op = std::remove_cvref_t<decltype(*op)>;
+          if constexpr (std::is_same_v<Op, NodeBinExprDiv> || std::is_same_v<Op, NodeBinExprMod>)
+          {
+            return is_nonzero_literal(op->rhs) && is_speculatable(op->lhs);
+          }
+          else
+          {
+            if constexpr (std::is_same_v<Op, NodeBinExprAdd> || std::is_same_v<Op, NodeBinExprSub> || std::is_same_v<Op, NodeBinExprMul>)
+            {
+              if (!no_overflow(op))
+              {
+                return false;
+              }
+            }
+            return is_speculatable(op->lhs) && is_speculatable(op->rhs);
+          }
+        },
+        std::get<NodeBinExpr *>(expr->var)->op);
+  }
+
+  // Range of an expression at the point it is evaluated, if it was reached.
+  std::optional<Range> range_of(const NodeExpr *expr) const
+  {
+    auto it = expr_ranges.find(expr);
+    if (it == expr_ranges.end())
+    {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+private:
+  using Env = std::vector<std::unordered_map<std::string, Range>>;
+
+  // Rounds a loop is iterated precisely before growing bounds are widened.
+  static constexpr int widen_after = 3;
+
+  bool is_speculatable(const NodeTerm *term) const
+  {
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return is_speculatable((*term_paren)->expr);
+    }
+    if (auto *term_unary = std::get_if<NodeTermUnary *>(&term->val))
+    {
+      return is_speculatable((*term_unary)->operand);
+    }
+    if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      return in_bounds(*term_index) && is_literal((*term_index)->index);
+    }
+    // A call may print, exit or never return.
+    return !std::holds_alternative<NodeTermCall *>(term->val);
+  }
+
+  static bool is_literal(const NodeExpr *expr)
+  {
+    auto *term = std::get_if<NodeTerm *>(&expr->var);
+    if (term == nullptr)
+    {
+      return false;
+    }
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&(*term)->val))
+    {
+      return is_literal((*term_paren)->expr);
+    }
+    return std::holds_alternative<NodeTermLit *>((*term)->val);
+  }
+
+  static bool is_nonzero_literal(const NodeExpr *expr)
+  {
+    auto *term = std::get_if<NodeTerm *>(&expr->var);
+    if (term == nullptr)
+    {
+      return false;
+    }
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&(*term)->val))
+    {
+      return is_nonzero_literal((*term_paren)->expr);
+    }
+    auto *term_lit = std::get_if<NodeTermLit *>(&(*term)->val);
+    return term_lit != nullptr && (*term_lit)->token.type == TokenType::int_lit &&
+           (*term_lit)->token.val.value().find_first_not_of('0') != std::string::npos;
+  }
+
+  Range analyse_lit(const NodeTermLit *term_lit) const
+  {
+    const Token &tok = term_lit->token;
+    switch (tok.type)
+    {
+    case TokenType::int_lit:
+    {
+      try
+      {
+        size_t idx;
+        int64_t value = std::stoll(tok.val.value(), &idx, 10);
+        if (idx == tok.val.value().size())
+        {
+          return Range::constant(value);
+        }
+      }
+      catch (const std::exception &)
+      {
+      }
+      return Range::full();
+    }
+    case TokenType::char_lit:
+      return Range::constant(static_cast<int64_t>(tok.val.value()[0]));
+    case TokenType::bool_lit:
+      return Range::constant(tok.val.value() == "true" ? 1 : 0);
+    default:
+      return Range::full();
+    }
+  }
+
+  Range analyse_term(const NodeTerm *term)
+  {
+    struct TermVisitor
+    {
+      RangeAnalyser *ra;
+      Range operator()(const NodeTermLit *term_lit) const
+      {
+        return ra->analyse_lit(term_lit);
+      }
+      Range operator()(const NodeTermIdent *term_ident) const
+      {
+        if (const Range *range = ra->lookup(term_ident->ident.val.value()))
+        {
+          return *range;
+        }
+        return Range::full();
+      }
+      Range operator()(const NodeTermParen *term_paren) const
+      {
+        return ra->analyse_expr(term_paren->expr);
+      }
+      Range operator()(const NodeTermUnary *term_unary) const
+      {
+        Range operand = ra->analyse_term(term_unary->operand);
+        switch (term_unary->op)
+        {
+        case UnaryOp::Negate:
+          if (operand.lo == std::numeric_limits<int64_t>::min())
+          {
+            return Range::full();
+          }
+          return {-operand.hi, -operand.lo};
+        case UnaryOp::Not:
+          if (!operand.contains(0))
+          {
+            return Range::constant(0);
+          }
+          if (operand.is_constant())
+          {
+            return Range::constant(1);
+          }
+          return Range::boolean();
+        default:
+          return Range::full();
+        }
+      }
+      Range operator()(const NodeTermIndex *term_index) const
+      {
+        const std::string &name = term_index->ident.val.value();
+        ra->check_bounds(term_index, name, term_index->index);
+        if (const Range *range = ra->lookup(name))
+        {
+          return *range;
+        }
+        return Range::full();
+      }
+      Range operator()(const NodeTermCall *term_call) const
+      {
+        ra->analyse_call(term_call);
+        return Range::full();
+      }
+    };
+    TermVisitor visitor{this};
+    return std::visit(visitor, term->val);
+  }
+
+  Range analyse_bin_expr(const NodeBinExpr *bin_expr)
+  {
+    struct BinExprVisitor
+    {
+      RangeAnalyser *ra;
+      Range operator()(const NodeBinExprAdd *add) const
+      {
+        Range lhs = ra->analyse_expr(add->lhs);
+        Range rhs = ra->analyse_expr(add->rhs);
+        Range res;
+        bool overflows = __builtin_add_overflow(lhs.lo, rhs.lo, &res.lo) || __builtin_add_overflow(lhs.hi, rhs.hi, &res.hi);
+        ra->record(ra->overflow_proofs, add, !overflows);
+        return overflows ? Range::full() : res;
+      }
+      Range operator()(const NodeBinExprSub *sub) const
+      {
+        Range lhs = ra->analyse_expr(sub->lhs);
+        Range rhs = ra->analyse_expr(sub->rhs);
+        Range res;
+        bool overflows = __builtin_sub_overflow(lhs.lo, rhs.hi, &res.lo) || __builtin_sub_overflow(lhs.hi, rhs.lo, &res.hi);
+        ra->record(ra->overflow_proofs, sub, !overflows);
+        return overflows ? Range::full() : res;
+      }
+      Range operator()(const NodeBinExprMul *mul) const
+      {
+        Range lhs = ra->analyse_expr(mul->lhs);
+        Range rhs = ra->analyse_expr(mul->rhs);
+        const int64_t a[] = {lhs.lo, lhs.hi};
+        const int64_t b[] = {rhs.lo, rhs.hi};
+        Range res{std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::min()};
+        for (int64_t x : a)
+        {
+          for (int64_t y : b)
+          {
+            int64_t p;
+            if (__builtin_mul_overflow(x, y, &p))
+            {
+              ra->record(ra->overflow_proofs, mul, false);
+              return Range::full();
+            }
+            res = {std::min(res.lo, p), std::max(res.hi, p)};
+          }
+        }
+        ra->record(ra->overflow_proofs, mul, true);
+        return res;
+      }
+      Range operator()(const NodeBinExprDiv *div) const
+      {
+        Range lhs = ra->analyse_expr(div->lhs);
+        Range rhs = ra->analyse_expr(div->rhs);
+        ra->record(ra->divisor_proofs, div, !rhs.contains(0));
+        // Execution only continues past the zero check with a nonzero divisor,
+        // so the quotient is bounded by the corners of each sign half.
+        std::optional<Range> res;
+        for (Range half : nonzero_halves(rhs))
+        {
+          if (lhs.lo == std::numeric_limits<int64_t>::min() && half.contains(-1))
+          {
+            return Range::full();
+          }
+          for (int64_t x : {lhs.lo, lhs.hi})
+          {
+            for (int64_t y : {half.lo, half.hi})
+            {
+              Range q = Range::constant(x / y);
+              res = res ? res->join(q) : q;
+            }
+          }
+        }
+        return res.value_or(Range::full());
+      }
+      Range operator()(const NodeBinExprMod *mod) const
+      {
+        Range lhs = ra->analyse_expr(mod->lhs);
+        Range rhs = ra->analyse_expr(mod->rhs);
+        ra->record(ra->divisor_proofs, mod, !rhs.contains(0));
+        // |lhs % rhs| < |rhs| and the remainder takes the sign of lhs.
+        uint64_t max_abs = std::max(magnitude(rhs.lo), magnitude(rhs.hi));
+        if (max_abs == 0)
+        {
+          return Range::full();
+        }
+        int64_t bound = static_cast<int64_t>(std::min<uint64_t>(max_abs - 1, std::numeric_limits<int64_t>::max()));
+        return {lhs.lo < 0 ? std::max(lhs.lo, -bound) : 0, lhs.hi > 0 ? std::min(lhs.hi, bound) : 0};
+      }
+      Range operator()(const NodeBinExprEq *eq) const
+      {
+        Range lhs = ra->analyse_expr(eq->lhs);
+        Range rhs = ra->analyse_expr(eq->rhs);
+        if (lhs.is_constant() && rhs.is_constant())
+        {
+          return Range::constant(lhs.lo == rhs.lo);
+        }
+        if (lhs.hi < rhs.lo || rhs.hi < lhs.lo)
+        {
+          return Range::constant(0);
+        }
+        return Range::boolean();
+      }
+      Range operator()(const NodeBinExprNeq *neq) const
+      {
+        Range lhs = ra->analyse_expr(neq->lhs);
+        Range rhs = ra->analyse_expr(neq->rhs);
+        if (lhs.is_constant() && rhs.is_constant())
+        {
+          return Range::constant(lhs.lo != rhs.lo);
+        }
+        if (lhs.hi < rhs.lo || rhs.hi < lhs.lo)
+        {
+          return Range::constant(1);
+        }
+        return Range::boolean();
+      }
+      Range operator()(const NodeBinExprLt *lt) const
+      {
+        return compare(ra->analyse_expr(lt->lhs), ra->analyse_expr(lt->rhs));
+      }
+      Range operator()(const NodeBinExprGt *gt) const
+      {
+        return compare(ra->analyse_expr(gt->rhs), ra->analyse_expr(gt->lhs));
+      }
+      Range operator()(const NodeBinExprLte *lte) const
+      {
+        return negate(compare(ra->analyse_expr(lte->rhs), ra->analyse_expr(lte->lhs)));
+      }
+      Range operator()(const NodeBinExprGte *gte) const
+      {
+        return negate(compare(ra->analyse_expr(gte->lhs), ra->analyse_expr(gte->rhs)));
+      }
+      Range operator()(const NodeBinExprAnd *and_) const
+      {
+        Range lhs = ra->analyse_expr(and_->lhs);
+        Range rhs = ra->analyse_expr(and_->rhs);
+        if (lhs == Range::constant(0) || rhs == Range::constant(0))
+        {
+          return Range::constant(0);
+        }
+        if (!lhs.contains(0) && !rhs.contains(0))
+        {
+          return Range::constant(1);
+        }
+        return Range::boolean();
+      }
+      Range operator()(const NodeBinExprOr *or_) const
+      {
+        Range lhs = ra->analyse_expr(or_->lhs);
+        Range rhs = ra->analyse_expr(or_->rhs);
+        if (!lhs.contains(0) || !rhs.contains(0))
+        {
+          return Range::constant(1);
+        }
+        if (lhs == Range::constant(0) && rhs == Range::constant(0))
+        {
+          return Range::constant(0);
+        }
+        return Range::boolean();
+      }
+
+      // Truth range of `lhs < rhs`.
+      static Range compare(Range lhs, Range rhs)
+      {
+        if (lhs.hi < rhs.lo)
+        {
+          return Range::constant(1);
+        }
+        if (lhs.lo >= rhs.hi)
+        {
+          return Range::constant(0);
+        }
+        return Range::boolean();
+      }
+      static Range negate(Range truth)
+      {
+        return {1 - truth.hi, 1 - truth.lo};
+      }
+      static uint64_t magnitude(int64_t value)
+      {
+        return value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+      }
+      static std::vector<Range> nonzero_halves(Range range)
+      {
+        std::vector<Range> halves;
+        if (range.lo < 0)
+        {
+          halves.push_back({range.lo, std::min<int64_t>(range.hi, -1)});
+        }
+        if (range.hi > 0)
+        {
+          halves.push_back({std::max<int64_t>(range.lo, 1), range.hi});
+        }
+        return halves;
+      }
+    };
+    BinExprVisitor visitor{this};
+    return std::visit(visitor, bin_expr->op);
+  }
+
+  Range analyse_expr(const NodeExpr *expr)
+  {
+    struct ExprVisitor
+    {
+      RangeAnalyser *ra;
+      Range operator()(const NodeTerm *term) const
+      {
+        return ra->analyse_term(term);
+      }
+      Range operator()(const NodeBinExpr *bin_expr) const
+      {
+        return ra->analyse_bin_expr(bin_expr);
+      }
+    };
+    ExprVisitor visitor{this};
+    Range range = std::visit(visitor, expr->var);
+    auto [it, inserted] = expr_ranges.try_emplace(expr, range);
+    if (!inserted)
+    {
+      it->second = it->second.join(range);
+    }
+    return range;
+  }
+
+  void analyse_scope(const NodeStmtScope *stmt_scope)
+  {
+    enter_scope();
+    for (const NodeStmt *stmt : stmt_scope->stmts)
+    {
+      if (!reachable)
+        break;
+      analyse_stmt(stmt);
+    }
+    exit_scope();
+  }
+
+  // Analyses one arm of a conditional starting from `entry`; returns the
+  // environment at the end of the arm, or nothing if the arm cannot complete.
+  std::optional<Env> analyse_branch(const Env &entry, const NodeStmtScope *scope)
+  {
+    env = entry;
+    reachable = true;
+    analyse_scope(scope);
+    if (!reachable)
+    {
+      return std::nullopt;
+    }
+    return env;
+  }
+
+  // Walks an if/elif/else chain. `cond` is the range of the condition that
+  // guards `scope`; `cont` the clause taken when that condition is false.
+  void analyse_if(Range cond, const NodeStmtScope *scope, const std::optional<NodeStmtIfCont *> &cont)
+  {
+    const Env entry = env;
+    std::optional<Env> merged;
+    auto merge = [&merged](std::optional<Env> arm)
+    {
+      if (!arm.has_value())
+        return;
+      if (!merged.has_value())
+      {
+        merged = std::move(arm);
+        return;
+      }
+      join_env(*merged, *arm);
+    };
+
+    if (cond != Range::constant(0))
+    {
+      merge(analyse_branch(entry, scope));
+    }
+    if (cond.contains(0))
+    {
+      if (!cont.has_value())
+      {
+        merge(entry);
+      }
+      else if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+      {
+        env = entry;
+        reachable = true;
+        Range elif_cond = analyse_expr((*stmt_elif)->expr);
+        analyse_if(elif_cond, (*stmt_elif)->scope, (*stmt_elif)->cont);
+        if (reachable)
+        {
+          merge(env);
+        }
+      }
+      else
+      {
+        merge(analyse_branch(entry, std::get<NodeStmtElse *>(cont.value()->clause)->scope));
+      }
+    }
+
+    reachable = merged.has_value();
+    env = merged.has_value() ? std::move(merged.value()) : entry;
+  }
+
+  // Joins `other`, which has the same scopes as `into`, into `into`.
+  static void join_env(Env &into, const Env &other)
+  {
+    for (size_t i = 0; i < into.size(); i++)
+    {
+      for (auto &[name, range] : into[i])
+      {
+        range = range.join(other[i].at(name));
+      }
+    }
+  }
+
+  // Pushes every bound that grew from `prev` to `next` out to the limit.
+  static void widen(Env &next, const Env &prev)
+  {
+    for (size_t i = 0; i < next.size(); i++)
+    {
+      for (auto &[name, range] : next[i])
+      {
+        const Range &old = prev[i].at(name);
+        if (range.lo < old.lo)
+          range.lo = std::numeric_limits<int64_t>::min();
+        if (range.hi > old.hi)
+          range.hi = std::numeric_limits<int64_t>::max();
+      }
+    }
+  }
+
+  // Narrows the ranges of variables compared directly in `cond` to the
+  // states in which `cond` evaluates to `truth`.
+  void refine(const NodeExpr *cond, bool truth)
+  {
+    auto *bin_expr = std::get_if<NodeBinExpr *>(&cond->var);
+    if (bin_expr == nullptr)
+    {
+      return;
+    }
+    if (auto *and_ = std::get_if<NodeBinExprAnd *>(&(*bin_expr)->op))
+    {
+      if (truth)
+      {
+        refine((*and_)->lhs, true);
+        refine((*and_)->rhs, true);
+      }
+      return;
+    }
+    // Comparisons as `lhs < rhs`, `lhs <= rhs` or `lhs == rhs` once negated.
+    enum class Cmp
+    {
+      Lt,
+      Lte,
+      Eq,
+      Other,
+    };
+    struct Comparison
+    {
+      Cmp cmp;
+      const NodeExpr *lhs;
+      const NodeExpr *rhs;
+    };
+    Comparison c = std::visit(
+        [truth](const auto *op) -> Comparison
+        {
+          using Op = std::remove_cvref_t<decltype(*op)>;
+          if constexpr (std::is_same_v<Op, NodeBinExprLt>)
+            return truth ? Comparison{Cmp::Lt, op->lhs, op->rhs} : Comparison{Cmp::Lte, op->rhs, op->lhs};
+          else if constexpr (std::is_same_v<Op, NodeBinExprLte>)
+            return truth ? Comparison{Cmp::Lte, op->lhs, op->rhs} : Comparison{Cmp::Lt, op->rhs, op->lhs};
+          else if constexpr (std::is_same_v<Op, NodeBinExprGt>)
+            return truth ? Comparison{Cmp::Lt, op->rhs, op->lhs} : Comparison{Cmp::Lte, op->lhs, op->rhs};
+          else if constexpr (std::is_same_v<Op, NodeBinExprGte>)
+            return truth ? Comparison{Cmp::Lte, op->rhs, op->lhs} : Comparison{Cmp::Lt, op->lhs, op->rhs};
+          else if constexpr (std::is_same_v<Op, NodeBinExprEq>)
+            return {truth ? Cmp::Eq : Cmp::Other, op->lhs, op->rhs};
+          else if constexpr (std::is_same_v<Op, NodeBinExprNeq>)
+            return {truth ? Cmp::Other : Cmp::Eq, op->lhs, op->rhs};
+          else
+            return {Cmp::Other, op->lhs, op->rhs};
+        },
+        (*bin_expr)->op);
+    if (c.cmp == Cmp::Other)
+    {
+      return;
+    }
+
+    std::optional<Range> lhs = range_of(c.lhs);
+    std::optional<Range> rhs = range_of(c.rhs);
+    if (!lhs.has_value() || !rhs.has_value())
+    {
+      return;
+    }
+    const int64_t slack = c.cmp == Cmp::Lt ? 1 : 0;
+    if (Range *var = variable_of(c.lhs))
+    {
+      Range narrowed = *var;
+      if (c.cmp == Cmp::Eq)
+        narrowed = {std::max(var->lo, rhs->lo), std::min(var->hi, rhs->hi)};
+      else if (rhs->hi >= std::numeric_limits<int64_t>::min() + slack)
+        narrowed.hi = std::min(var->hi, rhs->hi - slack);
+      // An empty range means the state is impossible; keep the old one.
+      if (narrowed.lo <= narrowed.hi)
+        *var = narrowed;
+    }
+    if (Range *var = variable_of(c.rhs))
+    {
+      Range narrowed = *var;
+      if (c.cmp == Cmp::Eq)
+        narrowed = {std::max(var->lo, lhs->lo), std::min(var->hi, lhs->hi)};
+      else if (lhs->lo <= std::numeric_limits<int64_t>::max() - slack)
+        narrowed.lo = std::max(var->lo, lhs->lo + slack);
+      if (narrowed.lo <= narrowed.hi)
+        *var = narrowed;
+    }
+  }
+
+  // The variable a bare identifier expression names, if it is in scope.
+  Range *variable_of(const NodeExpr *expr)
+  {
+    auto *term = std::get_if<NodeTerm *>(&expr->var);
+    if (term == nullptr)
+    {
+      return nullptr;
+    }
+    auto *term_ident = std::get_if<NodeTermIdent *>(&(*term)->val);
+    return term_ident == nullptr ? nullptr : lookup((*term_ident)->ident.val.value());
+  }
+
+  // Iterates a loop to a fixpoint. The state at the head of the loop joins
+  // the state on entry with the state after every iteration; bounds that
+  // are still growing after a few rounds are widened so this terminates.
+  // Leaves the state in which the condition fails.
+  void analyse_loop(const NodeExpr *cond, const NodeStmtScope *scope, const NodeStmt *step)
+  {
+    Env head = env;
+    for (int round = 0;; round++)
+    {
+      env = head;
+      reachable = true;
+      if (analyse_expr(cond) == Range::constant(0))
+        break;
+      refine(cond, true);
+      analyse_scope(scope);
+      if (reachable && step != nullptr)
+        analyse_stmt(step);
+      if (!reachable)
+        break;
+      Env next = head;
+      join_env(next, env);
+      if (next == head)
+        break;
+      if (round >= widen_after)
+        widen(next, head);
+      head = std::move(next);
+    }
+
+    env = std::move(head);
+    reachable = analyse_expr(cond).contains(0);
+    if (reachable)
+    {
+      refine(cond, false);
+    }
+  }
+
+  void analyse_stmt(const NodeStmt *stmt)
+  {
+    struct StmtVisitor
+    {
+      RangeAnalyser *ra;
+      void operator()(const NodeStmtExit *stmt_exit) const
+      {
+        ra->analyse_expr(stmt_exit->expr);
+        ra->reachable = false;
+      }
+      void operator()(const NodeStmtPrint *stmt_print) const
+      {
+        ra->analyse_expr(stmt_print->expr);
+      }
+      void operator()(const NodeStmtReturn *stmt_return) const
+      {
+        ra->analyse_expr(stmt_return->expr);
+        ra->reachable = false;
+      }
+      void operator()(const NodeStmtCall *stmt_call) const
+      {
+        ra->analyse_call(stmt_call->call);
+      }
+      void operator()(const NodeStmtIf *stmt_if) const
+      {
+        Range cond = ra->analyse_expr(stmt_if->expr);
+        ra->analyse_if(cond, stmt_if->scope, stmt_if->cont);
+      }
+      void operator()(const NodeStmtConst *stmt_const) const
+      {
+        Range range = ra->analyse_expr(stmt_const->expr);
+        ra->env.back()[stmt_const->ident.val.value()] = range;
+      }
+      void operator()(const NodeStmtLet *stmt_let) const
+      {
+        Range range = Range::constant(0);
+        if (stmt_let->expr.has_value())
+        {
+          range = ra->analyse_expr(stmt_let->expr.value());
+        }
+        ra->env.back()[stmt_let->ident.val.value()] = range;
+        if (stmt_let->dtype == DataType::IntArray)
+        {
+          ra->lengths.back()[stmt_let->ident.val.value()] = stmt_let->length;
+        }
+      }
+      void operator()(const NodeStmtAssign *stmt_assign) const
+      {
+        Range range = ra->analyse_expr(stmt_assign->expr);
+        if (Range *var = ra->lookup(stmt_assign->ident.val.value()))
+        {
+          *var = range;
+        }
+      }
+      void operator()(const NodeStmtAssignIndex *stmt_assign_index) const
+      {
+        const std::string &name = stmt_assign_index->ident.val.value();
+        ra->check_bounds(stmt_assign_index, name, stmt_assign_index->index);
+        Range range = ra->analyse_expr(stmt_assign_index->expr);
+        if (Range *var = ra->lookup(name))
+        {
+          *var = var->join(range);
+        }
+      }
+      void operator()(const NodeStmtScope *stmt_scope) const
+      {
+        ra->analyse_scope(stmt_scope);
+      }
+      void operator()(const NodeStmtWhile *stmt_while) const
+      {
+        ra->analyse_loop(stmt_while->expr, stmt_while->scope, nullptr);
+      }
+      void operator()(const NodeStmtFor *stmt_for) const
+      {
+        ra->enter_scope();
+        ra->analyse_stmt(stmt_for->init);
+        ra->analyse_loop(stmt_for->cond, stmt_for->scope, stmt_for->step);
+        ra->exit_scope();
+      }
+    };
+    StmtVisitor visitor{this};
+    std::visit(visitor, stmt->stmt);
+  }
+
+  // A call leaves the caller's variables alone, since a function only sees
+  // its own.
+  void analyse_call(const NodeTermCall *call)
+  {
+    for (const NodeExpr *arg : call->args)
+    {
+      analyse_expr(arg);
+    }
+  }
+
+  // An operation is only proven safe if every visit to it was proven safe.
+  static void record(std::unordered_map<const void *, bool> &proofs, const void *op, bool safe)
+  {
+    auto [it, inserted] = proofs.try_emplace(op, safe);
+    if (!inserted)
+    {
+      it->second = it->second && safe;
+    }
+  }
+
+  // Analyses the index of an access to `name` and records whether it is in
+  // bounds. Execution only continues past the check with a valid index, so
+  // a variable used directly as the index is narrowed to the array.
+  void check_bounds(const void *access, const std::string &name, const NodeExpr *index_expr)
+  {
+    Range index = analyse_expr(index_expr);
+    size_t length = array_length(name);
+    record(bounds_proofs, access, length > 0 && index.lo >= 0 && index.hi < static_cast<int64_t>(length));
+    if (length == 0)
+    {
+      return;
+    }
+    if (Range *var = variable_of(index_expr))
+    {
+      Range narrowed{std::max<int64_t>(var->lo, 0), std::min<int64_t>(var->hi, length - 1)};
+      if (narrowed.lo <= narrowed.hi)
+        *var = narrowed;
+    }
+  }
+
+  // Element count of the array `name` names, or 0 if it is not an array.
+  size_t array_length(const std::string &name) const
+  {
+    for (size_t i = env.size(); i-- > 0;)
+    {
+      if (env[i].count(name))
+      {
+        auto found = lengths[i].find(name);
+        return found == lengths[i].end() ? 0 : found->second;
+      }
+    }
+    return 0;
+  }
+
+  Range *lookup(const std::string &name)
+  {
+    for (auto it = env.rbegin(); it != env.rend(); ++it)
+    {
+      auto found = it->find(name);
+      if (found != it->end())
+      {
+        return &found->second;
+      }
+    }
+    return nullptr;
+  }
+
+  void enter_scope()
+  {
+    env.push_back({});
+    lengths.push_back({});
+  }
+
+  void exit_scope()
+  {
+    env.pop_back();
+    lengths.pop_back();
+  }
+
+  const NodeProg &prog;
+  Env env;
+  std::vector<std::unordered_map<std::string, size_t>> lengths; // scoped like env
+  bool reachable = true;
+  std::unordered_map<const void *, bool> overflow_proofs;
+  std::unordered_map<const void *, bool> divisor_proofs;
+  std::unordered_map<const void *, bool> bounds_proofs;
+  std::unordered_map<const NodeExpr *, Range> expr_ranges;
+};
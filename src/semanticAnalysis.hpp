@@ -0,0 +1,563 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <variant>
+#include "./parser.hpp"
+#include "./diagnostics.hpp"
+
+// Resolves every name and checks every type in the program before any
+// pass rewrites it. The generator only sees the statements that survive
+// dead code elimination, and stops at the first statement that ends the
+// program, so an error in code that never runs would otherwise go
+// unreported. The rules and messages are the generator's: the same scoping,
+// operands checked in the order it evaluates them, and the same errors.
+class SemanticAnalyser
+{
+public:
+  explicit SemanticAnalyser(const NodeProg &program) : prog(program) {}
+
+  void analyse()
+  {
+    for (const NodeFunc *func : prog.funcs)
+    {
+      if (!funcs.try_emplace(func->ident.val.value(), func).second)
+      {
+        diagnostics() << "Error: Function '" << func->ident.val.value() << "' already defined" << std::endl;
+        throw CompileError();
+      }
+    }
+
+    enter_scope();
+    check_stmts(prog.stmts);
+    exit_scope();
+
+    // Every function is checked, whether or not anything calls it. A body
+    // sees only its parameters, which share its outermost scope.
+    for (const NodeFunc *func : prog.funcs)
+    {
+      current_func = func;
+      enter_scope();
+      for (const NodeParam &param : func->params)
+      {
+        const std::string &name = param.ident.val.value();
+        for (const ScopeEntry &entry : scopes.back())
+        {
+          if (entry.name == name)
+          {
+            diagnostics() << "Error: Parameter '" << name << "' already declared" << std::endl;
+            throw CompileError();
+          }
+        }
+        declare_var(name, {param.dtype, true});
+      }
+      check_stmts(func->body->stmts);
+      exit_scope();
+    }
+    current_func = nullptr;
+  }
+
+private:
+  struct Var
+  {
+    DataType dtype;
+    bool mut;
+  };
+
+  struct ScopeEntry
+  {
+    std::string name;
+    std::optional<Var> old_binding;
+  };
+
+  DataType check_lit(const NodeTermLit *term_lit) const
+  {
+    const Token &tok = term_lit->token;
+    switch (tok.type)
+    {
+    case TokenType::int_lit:
+      try
+      {
+        size_t idx;
+        std::stoll(tok.val.value(), &idx, 10);
+        if (idx != tok.val.value().size())
+        {
+          throw std::invalid_argument("Invalid integer literal");
+        }
+      }
+      catch (const std::out_of_range &)
+      {
+        diagnostics() << "Integer literal out of bounds\n";
+        throw CompileError();
+      }
+      catch (const std::invalid_argument &)
+      {
+        diagnostics() << "Invalid integer literal\n";
+        throw CompileError();
+      }
+      return DataType::Int;
+    case TokenType::char_lit:
+      return DataType::Char;
+    case TokenType::bool_lit:
+      if (tok.val.value() != "true" && tok.val.value() != "false")
+      {
+        diagnostics() << "Unknown boolean literal: " << tok.val.value() << "\n";
+        throw CompileError();
+      }
+      return DataType::Bool;
+    default:
+      diagnostics() << "Unknown literal type\n";
+      throw CompileError();
+    }
+  }
+
+  DataType check_term(const NodeTerm *term)
+  {
+    if (auto *term_lit = std::get_if<NodeTermLit *>(&term->val))
+    {
+      return check_lit(*term_lit);
+    }
+    if (auto *term_ident = std::get_if<NodeTermIdent *>(&term->val))
+    {
+      const std::string &name = (*term_ident)->ident.val.value();
+      auto var = vars.find(name);
+      if (var == vars.end())
+      {
+        diagnostics() << "Variable " << name << " not declared" << std::endl;
+        throw CompileError();
+      }
+      if (var->second.dtype == DataType::IntArray)
+      {
+        diagnostics() << "Error: Array '" << name << "' must be indexed" << std::endl;
+        throw CompileError();
+      }
+      return var->second.dtype;
+    }
+    if (auto *term_index = std::get_if<NodeTermIndex *>(&term->val))
+    {
+      check_array((*term_index)->ident.val.value());
+      check_index((*term_index)->index);
+      return DataType::Int;
+    }
+    if (auto *term_paren = std::get_if<NodeTermParen *>(&term->val))
+    {
+      return check_expr((*term_paren)->expr);
+    }
+    if (auto *term_call = std::get_if<NodeTermCall *>(&term->val))
+    {
+      return check_call(*term_call);
+    }
+    const NodeTermUnary *term_unary = std::get<NodeTermUnary *>(term->val);
+    DataType dtype = check_term(term_unary->operand);
+    if (term_unary->op == UnaryOp::Negate)
+    {
+      if (dtype != DataType::Int)
+      {
+        diagnostics() << "Cannot use '-' on non integers\n";
+        throw CompileError();
+      }
+      return DataType::Int;
+    }
+    if (dtype != DataType::Int && dtype != DataType::Bool)
+    {
+      diagnostics() << "Cannot use '!' on non-integers or non-booleans\n";
+      throw CompileError();
+    }
+    return DataType::Bool;
+  }
+
+  // Checks both operands, `lhs_first` or the other way round, and returns
+  // their types.
+  std::pair<DataType, DataType> check_operands(const NodeExpr *lhs, const NodeExpr *rhs, bool lhs_first)
+  {
+    if (lhs_first)
+    {
+      DataType lhs_type = check_expr(lhs);
+      return {lhs_type, check_expr(rhs)};
+    }
+    DataType rhs_type = check_expr(rhs);
+    return {check_expr(lhs), rhs_type};
+  }
+
+  // + and * evaluate their left operand first, every other operator its
+  // right one.
+  DataType check_bin_expr(const NodeBinExpr *bin_expr)
+  {
+    return std::visit([this](auto *op)
+                      {
+                        using Op = std::remove_pointer_t<decltype(op)>;
+                        constexpr bool lhs_first = std::is_same_v<Op, NodeBinExprAdd> || std::is_same_v<Op, NodeBinExprMul>;
+                        auto [lhs, rhs] = check_operands(op->lhs, op->rhs, lhs_first);
+                        return check_operator<Op>(lhs, rhs); },
+                      bin_expr->op);
+  }
+
+  template <typename Op>
+  static DataType check_operator(DataType lhs, DataType rhs)
+  {
+    const bool ints = lhs == DataType::Int && rhs == DataType::Int;
+    const char *error = nullptr;
+    DataType result = DataType::Bool;
+    if constexpr (std::is_same_v<Op, NodeBinExprAdd>)
+    {
+      error = ints ? nullptr : "Error: Addition operator requires both operands to be integers";
+      result = DataType::Int;
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprMul>)
+    {
+      error = ints ? nullptr : "Error: Multiplication operator requires both operands to be integers";
+      result = DataType::Int;
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprSub>)
+    {
+      error = ints ? nullptr : "Error: Subtraction operator requires both operands to be integers";
+      result = DataType::Int;
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprDiv>)
+    {
+      error = ints ? nullptr : "Error: Division operator requires both operands to be integers";
+      result = DataType::Int;
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprMod>)
+    {
+      error = ints ? nullptr : "Error: Modulo operator requires both operands to be integers";
+      result = DataType::Int;
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprEq>)
+    {
+      error = lhs == rhs ? nullptr : "Error: Equality comparison requires both operands to be of the same type";
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprNeq>)
+    {
+      error = lhs == rhs ? nullptr : "Error: Non Equality comparison requires both operands to be of the same type";
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprLt>)
+    {
+      error = ints ? nullptr : "Error: Less Then operator requires both operands to be integers";
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprGt>)
+    {
+      error = ints ? nullptr : "Error: Greater Then operator requires both operands to be integers";
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprLte>)
+    {
+      error = ints ? nullptr : "Error: Less Then Equal to operator requires both operands to be integers";
+    }
+    else if constexpr (std::is_same_v<Op, NodeBinExprGte> || std::is_same_v<Op, NodeBinExprOr>)
+    {
+      error = ints ? nullptr : "Error: Greater Then Equal to operator requires both operands to be integers";
+    }
+    else
+    {
+      static_assert(std::is_same_v<Op, NodeBinExprAnd>);
+      const bool lhs_ok = lhs == DataType::Int || lhs == DataType::Bool;
+      const bool rhs_ok = rhs == DataType::Int || rhs == DataType::Bool;
+      error = lhs_ok && rhs_ok ? nullptr : "Error: Greater Then Equal to operator requires both operands to be integers";
+    }
+    if (error != nullptr)
+    {
+      diagnostics() << error << std::endl;
+      throw CompileError();
+    }
+    return result;
+  }
+
+  DataType check_expr(const NodeExpr *expr)
+  {
+    if (auto *term = std::get_if<NodeTerm *>(&expr->var))
+    {
+      return check_term(*term);
+    }
+    return check_bin_expr(std::get<NodeBinExpr *>(expr->var));
+  }
+
+  DataType check_call(const NodeTermCall *call)
+  {
+    const std::string &name = call->ident.val.value();
+    auto func = funcs.find(name);
+    if (func == funcs.end())
+    {
+      diagnostics() << "Error: Function '" << name << "' not declared" << std::endl;
+      throw CompileError();
+    }
+    const NodeFunc *callee = func->second;
+    if (callee->params.size() != call->args.size())
+    {
+      diagnostics() << "Error: Function '" << name << "' expects " << callee->params.size()
+                << " arguments but got " << call->args.size() << std::endl;
+      throw CompileError();
+    }
+    for (size_t k = 0; k < call->args.size(); k++)
+    {
+      DataType type = check_expr(call->args[k]);
+      if (type != callee->params[k].dtype)
+      {
+        diagnostics() << "Error: Type mismatch for argument " << k + 1 << " of '" << name
+                  << "'. Expected " << type_to_string(callee->params[k].dtype)
+                  << " but got " << type_to_string(type) << std::endl;
+        throw CompileError();
+      }
+    }
+    return callee->ret;
+  }
+
+  void check_array(const std::string &name) const
+  {
+    auto var = vars.find(name);
+    if (var == vars.end())
+    {
+      diagnostics() << "Variable " << name << " not declared" << std::endl;
+      throw CompileError();
+    }
+    if (var->second.dtype != DataType::IntArray)
+    {
+      diagnostics() << "Error: '" << name << "' is not an array" << std::endl;
+      throw CompileError();
+    }
+  }
+
+  void check_index(const NodeExpr *index)
+  {
+    if (check_expr(index) != DataType::Int)
+    {
+      diagnostics() << "Error: Array index must be an integer" << std::endl;
+      throw CompileError();
+    }
+  }
+
+  void check_init_type(const std::string &name, DataType expected, DataType type) const
+  {
+    if (type != expected)
+    {
+      diagnostics() << "Error: Type mismatch for variable '" << name
+                << "'. Expected " << type_to_string(expected)
+                << " but got " << type_to_string(type) << std::endl;
+      throw CompileError();
+    }
+  }
+
+  // A print of a string literal is the only place one may appear.
+  static bool is_str_lit(const NodeExpr *expr)
+  {
+    auto *term = std::get_if<NodeTerm *>(&expr->var);
+    if (term == nullptr)
+      return false;
+    auto *term_lit = std::get_if<NodeTermLit *>(&(*term)->val);
+    return term_lit != nullptr && (*term_lit)->token.type == TokenType::str_lit;
+  }
+
+  void check_scope(const NodeStmtScope *scope)
+  {
+    enter_scope();
+    check_stmts(scope->stmts);
+    exit_scope();
+  }
+
+  void check_stmts(const std::vector<NodeStmt *> &stmts)
+  {
+    for (const NodeStmt *stmt : stmts)
+    {
+      check_stmt(stmt);
+    }
+  }
+
+  void check_stmt(const NodeStmt *stmt)
+  {
+    if (auto *stmt_exit = std::get_if<NodeStmtExit *>(&stmt->stmt))
+    {
+      check_expr((*stmt_exit)->expr);
+    }
+    else if (auto *stmt_print = std::get_if<NodeStmtPrint *>(&stmt->stmt))
+    {
+      if (!is_str_lit((*stmt_print)->expr))
+      {
+        check_expr((*stmt_print)->expr);
+      }
+    }
+    else if (auto *stmt_return = std::get_if<NodeStmtReturn *>(&stmt->stmt))
+    {
+      DataType type = check_expr((*stmt_return)->expr);
+      if (current_func != nullptr && type != current_func->ret)
+      {
+        diagnostics() << "Error: Function '" << current_func->ident.val.value() << "' returns "
+                  << type_to_string(current_func->ret) << " but got " << type_to_string(type) << std::endl;
+        throw CompileError();
+      }
+    }
+    else if (auto *stmt_call = std::get_if<NodeStmtCall *>(&stmt->stmt))
+    {
+      check_call((*stmt_call)->call);
+    }
+    else if (auto *stmt_if = std::get_if<NodeStmtIf *>(&stmt->stmt))
+    {
+      check_expr((*stmt_if)->expr);
+      check_scope((*stmt_if)->scope);
+      std::optional<NodeStmtIfCont *> cont = (*stmt_if)->cont;
+      while (cont.has_value())
+      {
+        if (auto *stmt_elif = std::get_if<NodeStmtElif *>(&cont.value()->clause))
+        {
+          check_expr((*stmt_elif)->expr);
+          check_scope((*stmt_elif)->scope);
+          cont = (*stmt_elif)->cont;
+          continue;
+        }
+        check_scope(std::get<NodeStmtElse *>(cont.value()->clause)->scope);
+        break;
+      }
+    }
+    else if (auto *stmt_const = std::get_if<NodeStmtConst *>(&stmt->stmt))
+    {
+      const std::string &name = (*stmt_const)->ident.val.value();
+      check_undeclared(name);
+      check_init_type(name, (*stmt_const)->dtype, check_expr((*stmt_const)->expr));
+      declare_var(name, {(*stmt_const)->dtype, false});
+    }
+    else if (auto *stmt_let = std::get_if<NodeStmtLet *>(&stmt->stmt))
+    {
+      const std::string &name = (*stmt_let)->ident.val.value();
+      check_undeclared(name);
+      if ((*stmt_let)->dtype != DataType::IntArray && (*stmt_let)->expr.has_value())
+      {
+        check_init_type(name, (*stmt_let)->dtype, check_expr((*stmt_let)->expr.value()));
+      }
+      declare_var(name, {(*stmt_let)->dtype, true});
+    }
+    else if (auto *stmt_assign = std::get_if<NodeStmtAssign *>(&stmt->stmt))
+    {
+      const std::string &name = (*stmt_assign)->ident.val.value();
+      auto var = vars.find(name);
+      if (var == vars.end())
+      {
+        diagnostics() << "You need to declare the variable first";
+        throw CompileError();
+      }
+      if (var->second.dtype == DataType::IntArray)
+      {
+        diagnostics() << "Error: Cannot assign to array '" << name << "'; assign to its elements instead\n";
+        throw CompileError();
+      }
+      if (!var->second.mut)
+      {
+        diagnostics() << "Error: Cannot assign to immutable variable '" << name << "'\n";
+        throw CompileError();
+      }
+      const DataType dtype = var->second.dtype;
+      DataType type = check_expr((*stmt_assign)->expr);
+      if (type != dtype)
+      {
+        diagnostics() << "Error: Type mismatch in assignment to '" << name << "'. Expected "
+                  << type_to_string(dtype) << ", got " << type_to_string(type) << "\n";
+        throw CompileError();
+      }
+    }
+    else if (auto *stmt_assign_index = std::get_if<NodeStmtAssignIndex *>(&stmt->stmt))
+    {
+      const std::string &name = (*stmt_assign_index)->ident.val.value();
+      check_array(name);
+      check_index((*stmt_assign_index)->index);
+      DataType type = check_expr((*stmt_assign_index)->expr);
+      if (type != DataType::Int)
+      {
+        diagnostics() << "Error: Type mismatch in assignment to '" << name << "'. Expected int, got "
+                  << type_to_string(type) << "\n";
+        throw CompileError();
+      }
+    }
+    else if (auto *stmt_scope = std::get_if<NodeStmtScope *>(&stmt->stmt))
+    {
+      check_scope(*stmt_scope);
+    }
+    else if (auto *stmt_while = std::get_if<NodeStmtWhile *>(&stmt->stmt))
+    {
+      check_expr((*stmt_while)->expr);
+      check_scope((*stmt_while)->scope);
+    }
+    else
+    {
+      // The init is scoped to the loop, and the step runs after the body's
+      // scope has closed.
+      const NodeStmtFor *stmt_for = std::get<NodeStmtFor *>(stmt->stmt);
+      enter_scope();
+      check_stmt(stmt_for->init);
+      check_expr(stmt_for->cond);
+      check_scope(stmt_for->scope);
+      check_stmt(stmt_for->step);
+      exit_scope();
+    }
+  }
+
+  void check_undeclared(const std::string &name) const
+  {
+    for (const ScopeEntry &entry : scopes.back())
+    {
+      if (entry.name == name)
+      {
+        diagnostics() << "Variable " << name << " already declared" << std::endl;
+        throw CompileError();
+      }
+    }
+  }
+
+  void enter_scope()
+  {
+    scopes.push_back({});
+  }
+
+  void exit_scope()
+  {
+    for (const ScopeEntry &entry : scopes.back())
+    {
+      if (entry.old_binding.has_value())
+      {
+        vars[entry.name] = entry.old_binding.value();
+      }
+      else
+      {
+        vars.erase(entry.name);
+      }
+    }
+    scopes.pop_back();
+  }
+
+  void declare_var(const std::string &name, Var var)
+  {
+    std::optional<Var> old_binding;
+    if (auto existing = vars.find(name); existing != vars.end())
+    {
+      old_binding = existing->second;
+    }
+    vars[name] = var;
+    scopes.back().push_back({name, old_binding});
+  }
+
+  static std::string type_to_string(DataType type)
+  {
+    switch (type)
+    {
+    case DataType::Int:
+      return "int";
+    case DataType::Char:
+      return "char";
+    case DataType::Bool:
+      return "bool";
+    case DataType::IntArray:
+      return "int[]";
+    default:
+      return "unknown";
+    }
+  }
+
+  const NodeProg &prog;
+  const NodeFunc *current_func = nullptr;
+  std::unordered_map<std::string, const NodeFunc *> funcs;
+  std::unordered_map<std::string, Var> vars;
+  std::vector<std::vector<ScopeEntry>> scopes;
+};
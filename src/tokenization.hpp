@@ -3,6 +3,10 @@
 #include <string>
 #include <stdexcept>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+#include "./boundedQueue.hpp"
+#include "./diagnostics.hpp"
 
 enum class TokenType
 {
@@ -42,6 +46,14 @@ enum class TokenType
   and_,
   or_,
   not_,
+  while_,
+  for_,
+  open_square,
+  close_square,
+  comma,
+  fn,
+  return_,
+  str_lit,
 
 };
 
@@ -49,13 +61,19 @@ struct Token
 {
   TokenType type;
   std::optional<std::string> val;
+  // A placeholder in a syntax tree node until the parser fills it in.
+  Token() : type(TokenType::exit) {}
   Token(TokenType t, std::optional<std::string> v = std::nullopt)
       : type(t), val(std::move(v)) {}
 };
 
+using TokenQueue = BoundedQueue<std::vector<Token>>;
+
 class Tokeniser
 {
 public:
+  static constexpr size_t batch_size = 4096;
+
   explicit Tokeniser(std::string contents) : src(std::move(contents))
   {
   }
@@ -63,6 +81,26 @@ public:
   std::vector<Token> tokenise()
   {
     std::vector<Token> tokens;
+    scan(tokens, nullptr);
+    token_count = tokens.size();
+    return tokens;
+  }
+
+  // Hands the tokens to `queue` in batches of batch_size as they are
+  // scanned, so a parser on another thread can start on the first ones
+  // while the rest of the file is still being read, and closes it at the
+  // end. Scanning stops early if the parser cancels the queue.
+  void tokenise(TokenQueue &queue)
+  {
+    std::vector<Token> tokens;
+    scan(tokens, &queue);
+    token_count += tokens.size();
+    queue.push(std::move(tokens));
+    queue.close();
+  }
+
+  void scan(std::vector<Token> &tokens, TokenQueue *queue)
+  {
     std::string buf = "";
 
     // Map for single-character tokens
@@ -80,6 +118,9 @@ public:
         {')', TokenType::close_paren},
         {'{', TokenType::open_curly},
         {'}', TokenType::close_curly},
+        {'[', TokenType::open_square},
+        {']', TokenType::close_square},
+        {',', TokenType::comma},
         {'!', TokenType::not_}};
 
     const std::unordered_map<std::string, TokenType> doubleCharTokens = {
@@ -103,10 +144,20 @@ public:
         {"bool", TokenType::bool_},
         {"true", TokenType::true_},
         {"false", TokenType::false_},
-        {"let", TokenType::let}};
+        {"let", TokenType::let},
+        {"while", TokenType::while_},
+        {"for", TokenType::for_},
+        {"fn", TokenType::fn},
+        {"return", TokenType::return_}};
 
     while (peek().has_value())
     {
+      if (queue != nullptr && tokens.size() >= batch_size)
+      {
+        token_count += tokens.size();
+        if (!queue->push(std::exchange(tokens, {})))
+          return;
+      }
       char c = peek().value();
 
       if (std::isalpha(c))
@@ -156,8 +207,8 @@ public:
 
         if (!peek().has_value())
         {
-          std::cerr << "Unexpected end of input after '\''\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Unexpected end of input after '\''\n";
+          throw CompileError();
         }
 
         char charValue;
@@ -167,39 +218,18 @@ public:
         {
           if (!peek().has_value())
           {
-            std::cerr << "Unexpected end of input after escape character\n";
-            std::exit(EXIT_FAILURE);
+            diagnostics() << "Unexpected end of input after escape character\n";
+            throw CompileError();
           }
 
-          char escapeChar = consume();
-          switch (escapeChar)
-          {
-          case 'n':
-            charValue = '\n';
-            break;
-          case 't':
-            charValue = '\t';
-            break;
-          case '\\':
-            charValue = '\\';
-            break;
-          case '\'':
-            charValue = '\'';
-            break;
-          case '0':
-            charValue = '\0';
-            break;
-          default:
-            std::cerr << "Unknown escape sequence \\" << escapeChar << "\n";
-            std::exit(EXIT_FAILURE);
-          }
+          charValue = escape(consume());
         }
         else
         {
           if (nextChar == '\n')
           {
-            std::cerr << "Error: newline in character literal\n";
-            std::exit(EXIT_FAILURE);
+            diagnostics() << "Error: newline in character literal\n";
+            throw CompileError();
           }
           charValue = nextChar; // normal character
         }
@@ -207,8 +237,8 @@ public:
         // closing '
         if (!peek().has_value() || peek().value() != '\'')
         {
-          std::cerr << "Expected closing single quote for char literal\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Expected closing single quote for char literal\n";
+          throw CompileError();
         }
 
         consume(); // consume closing '
@@ -217,7 +247,37 @@ public:
         buf.clear();
         continue;
       }
-      else if (c == '/')
+      else if (c == '"')
+      {
+        consume(); // consume opening "
+        while (peek().has_value() && peek().value() != '"')
+        {
+          char nextChar = consume();
+          if (nextChar == '\n')
+          {
+            diagnostics() << "Error: newline in string literal\n";
+            throw CompileError();
+          }
+          if (nextChar == '\\')
+          {
+            if (!peek().has_value())
+            {
+              break;
+            }
+            nextChar = escape(consume());
+          }
+          buf.push_back(nextChar);
+        }
+        if (!peek().has_value())
+        {
+          diagnostics() << "Expected closing double quote for string literal\n";
+          throw CompileError();
+        }
+        consume(); // consume closing "
+        tokens.emplace_back(TokenType::str_lit, buf);
+        buf.clear();
+      }
+      else if (c == '/' && peek(1).has_value() && (peek(1).value() == '/' || peek(1).value() == '*'))
       {
         if (peek(1).has_value() && peek(1).value() == '/')
         {
@@ -263,13 +323,35 @@ public:
         }
         else
         {
-          std::cerr << "Wrong input: unknown character '" << c << "'\n";
-          std::exit(EXIT_FAILURE);
+          diagnostics() << "Wrong input: unknown character '" << c << "'\n";
+          throw CompileError();
         }
       }
     }
+  }
 
-    return tokens;
+  // The character an escape sequence stands for, given the character
+  // after the backslash.
+  static char escape(char escapeChar)
+  {
+    switch (escapeChar)
+    {
+    case 'n':
+      return '\n';
+    case 't':
+      return '\t';
+    case '\\':
+      return '\\';
+    case '\'':
+      return '\'';
+    case '"':
+      return '"';
+    case '0':
+      return '\0';
+    default:
+      diagnostics() << "Unknown escape sequence \\" << escapeChar << "\n";
+      throw CompileError();
+    }
   }
 
   std::optional<char> peek(int offset = 0)
@@ -289,6 +371,12 @@ public:
     return src[index++];
   }
 
+  size_t count() const
+  {
+    return token_count;
+  }
+
   const std::string src;
   size_t index = 0;
+  size_t token_count = 0;
 };
\ No newline at end of file
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "./asmBuffer.hpp"
+#include "./diagnostics.hpp"
+
+extern char **environ;
+
+// Runs NASM and ld for --nasm and --ld. The tools are started with
+// posix_spawnp rather than through the shell, and a tool that fails or
+// cannot be started fails the compile. The files they read are memory
+// files passed by their /proc/self/fd path, so nothing but the executable
+// is written to disk. Unlike a pipe, such a path can be opened again,
+// which NASM does for every pass over its input.
+class Toolchain
+{
+public:
+  // A file in memory. Spawned tools inherit the descriptor and open the
+  // file through path().
+  class MemFile
+  {
+  public:
+    explicit MemFile(const char *name) : fd(memfd_create(name, 0))
+    {
+      if (fd < 0)
+      {
+        diagnostics() << "Error: could not create " << name << " in memory: " << std::strerror(errno) << std::endl;
+        throw CompileError();
+      }
+    }
+
+    MemFile(const MemFile &other) = delete;
+    MemFile &operator=(const MemFile &other) = delete;
+    MemFile(MemFile &&other) noexcept : fd(std::exchange(other.fd, -1)) {}
+
+    ~MemFile()
+    {
+      if (fd >= 0)
+        close(fd);
+    }
+
+    std::string path() const
+    {
+      return "/proc/self/fd/" + std::to_string(fd);
+    }
+
+    bool write_text(std::string_view text) const
+    {
+      while (!text.empty())
+      {
+        ssize_t written = write(fd, text.data(), text.size());
+        if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+        text.remove_prefix(static_cast<size_t>(written));
+      }
+      return true;
+    }
+
+    bool write_text(const AsmBuffer &text) const
+    {
+      return text.write_to(fd);
+    }
+
+  private:
+    int fd;
+  };
+
+  // Assembles every source with NASM into the object at the same index.
+  // The assemblies run side by side.
+  static bool nasm(const std::vector<MemFile> &sources, const std::vector<MemFile> &objects)
+  {
+    std::vector<pid_t> pids;
+    bool ok = true;
+    for (size_t i = 0; i < sources.size() && ok; i++)
+    {
+      pid_t pid = spawn({"nasm", "-felf64", sources[i].path(), "-o", objects[i].path()});
+      ok = pid >= 0;
+      pids.push_back(pid);
+    }
+    for (pid_t pid : pids)
+    {
+      ok = wait(pid, "nasm") && ok;
+    }
+    return ok;
+  }
+
+  static bool ld(const std::vector<MemFile> &objects, const char *output_path)
+  {
+    std::vector<std::string> args = {"ld", "-o", output_path};
+    for (const MemFile &object : objects)
+    {
+      args.push_back(object.path());
+    }
+    return wait(spawn(args), "ld");
+  }
+
+private:
+  // Starts a tool found on PATH and returns its pid, or -1 after
+  // reporting why it could not be started.
+  static pid_t spawn(const std::vector<std::string> &args)
+  {
+    std::vector<char *> argv;
+    for (const std::string &arg : args)
+    {
+      argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ);
+    if (error != 0)
+    {
+      diagnostics() << "Error: could not run " << args[0] << ": " << std::strerror(error) << std::endl;
+      return -1;
+    }
+    return pid;
+  }
+
+  static bool wait(pid_t pid, const char *tool)
+  {
+    if (pid < 0)
+      return false;
+    int status;
+    pid_t waited;
+    do
+    {
+      waited = waitpid(pid, &status, 0);
+    } while (waited < 0 && errno == EINTR);
+    if (waited < 0)
+    {
+      diagnostics() << "Error: could not wait for " << tool << ": " << std::strerror(errno) << std::endl;
+      return false;
+    }
+    if (WIFSIGNALED(status))
+    {
+      diagnostics() << "Error: " << tool << " was killed by signal " << WTERMSIG(status) << std::endl;
+      return false;
+    }
+    if (WEXITSTATUS(status) != 0)
+    {
+      diagnostics() << "Error: " << tool << " failed with exit status " << WEXITSTATUS(status) << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs a fixed set of jobs, numbered 0 to n - 1, on a set of worker
+// threads. The jobs are dealt out round-robin up front. Each worker takes
+// its own from the back of its deque and, once that is empty, steals from
+// the front of the others', so workers that drew short jobs take over the
+// rest of a worker that drew long ones. No jobs are added while the pool
+// runs, so a worker that finds every deque empty is done.
+class WorkStealingPool
+{
+public:
+  explicit WorkStealingPool(size_t workers) : queues(workers == 0 ? 1 : workers) {}
+
+  template <typename F>
+  void run(size_t jobs, F job)
+  {
+    for (size_t i = 0; i < jobs; i++)
+    {
+      queues[i % queues.size()].jobs.push_back(i);
+    }
+    std::vector<std::thread> threads;
+    for (size_t worker = 0; worker < queues.size(); worker++)
+    {
+      threads.emplace_back([this, worker, &job]
+                           {
+                             while (std::optional<size_t> next = take(worker))
+                             {
+                               job(next.value());
+                             } });
+    }
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+  }
+
+  size_t workers() const
+  {
+    return queues.size();
+  }
+
+  // Number of jobs run by a worker other than the one they were dealt to.
+  size_t steals() const
+  {
+    return steal_count;
+  }
+
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+  };
+
+  std::optional<size_t> take(size_t worker)
+  {
+    {
+      Queue &own = queues[worker];
+      std::lock_guard lock(own.mutex);
+      if (!own.jobs.empty())
+      {
+        size_t job = own.jobs.back();
+        own.jobs.pop_back();
+        return job;
+      }
+    }
+    for (size_t k = 1; k < queues.size(); k++)
+    {
+      Queue &victim = queues[(worker + k) % queues.size()];
+      std::lock_guard lock(victim.mutex);
+      if (!victim.jobs.empty())
+      {
+        size_t job = victim.jobs.front();
+        victim.jobs.pop_front();
+        steal_count++;
+        return job;
+      }
+    }
+    return std::nullopt;
+  }
+
+  std::vector<Queue> queues;
+  std::atomic<size_t> steal_count = 0;
+};
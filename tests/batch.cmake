@@ -0,0 +1,40 @@
+# Compiles a few of the regression programs in one --batch run, from a
+# manifest and the command line, one of them a program the compiler
+# rejects. The report must name that one only, and every executable the
+# batch wrote must behave as its .expected file says.
+#
+# cmake -DCOMPILER=<mycompiler> -DPROGRAMS_DIR=<tests/programs>
+#       -DWORK_DIR=<dir> -P batch.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+set(listed functions_calls ranges_edges exit_code_wraps)
+set(good ${listed} cmov_chains)
+file(WRITE ${WORK_DIR}/manifest.txt "# regression programs\n\n")
+foreach(name ${listed})
+  file(APPEND ${WORK_DIR}/manifest.txt "${PROGRAMS_DIR}/${name}.txt\n")
+endforeach()
+
+execute_process(COMMAND ${COMPILER} --batch --jobs=3 --manifest=manifest.txt --out-dir=bin
+                        ${PROGRAMS_DIR}/cmov_chains.txt ${PROGRAMS_DIR}/for_init_array.txt
+                WORKING_DIRECTORY ${WORK_DIR}
+                OUTPUT_VARIABLE report
+                RESULT_VARIABLE result
+                TIMEOUT 120)
+if(NOT result EQUAL 1 OR NOT report MATCHES
+   "^failed: [^\n]*for_init_array.txt \\(exit 1\\): Arrays cannot be declared in a for loop header\ncompiled 4 of 5 programs")
+  message(FATAL_ERROR "unexpected batch report (exit ${result}):\n${report}")
+endif()
+
+foreach(name ${good})
+  file(READ ${PROGRAMS_DIR}/${name}.expected expected)
+  execute_process(COMMAND ${WORK_DIR}/bin/${name}
+                  WORKING_DIRECTORY ${WORK_DIR}
+                  OUTPUT_VARIABLE output
+                  RESULT_VARIABLE result
+                  TIMEOUT 60)
+  if(NOT "${output}[exit ${result}]\n" STREQUAL expected)
+    message(FATAL_ERROR "${name} built by the batch printed:\n${output}[exit ${result}]")
+  endif()
+endforeach()
@@ -0,0 +1,79 @@
+# Builds one of the regression programs through a compile cache. The entry
+# of the first build is marked by appending bytes to it, so a later build
+# that is served from the cache is one that comes out with those bytes.
+# Changing the options or the source must miss, and --run must not add an
+# entry. Eviction must leave alone a temporary file another compiler is
+# still writing, and not count it against the limit.
+#
+# cmake -DCOMPILER=<mycompiler> -DPROGRAM=<file.txt> -DWORK_DIR=<dir>
+#       -P cache.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+string(REGEX REPLACE "\\.txt$" ".expected" expected_file ${PROGRAM})
+file(READ ${expected_file} expected)
+
+function(build)
+  execute_process(COMMAND ${COMPILER} --cache=cache ${ARGN}
+                  WORKING_DIRECTORY ${WORK_DIR}
+                  ERROR_VARIABLE errors
+                  RESULT_VARIABLE result
+                  TIMEOUT 60)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${ARGN} failed:\n${errors}")
+  endif()
+endfunction()
+
+function(expect_entries count)
+  file(GLOB entries ${WORK_DIR}/cache/*)
+  list(LENGTH entries found)
+  if(NOT found EQUAL count)
+    message(FATAL_ERROR "expected ${count} cache entries, found ${found}: ${entries}")
+  endif()
+endfunction()
+
+build(--output=first ${PROGRAM})
+expect_entries(1)
+file(GLOB entry ${WORK_DIR}/cache/*)
+file(APPEND ${entry} "cached")
+
+build(--output=second ${PROGRAM})
+expect_entries(1)
+file(SIZE ${WORK_DIR}/first first_size)
+file(SIZE ${WORK_DIR}/second second_size)
+math(EXPR hit_size "${first_size} + 6")
+if(NOT second_size EQUAL hit_size)
+  message(FATAL_ERROR "the second build was not served from the cache")
+endif()
+execute_process(COMMAND ${WORK_DIR}/second
+                WORKING_DIRECTORY ${WORK_DIR}
+                OUTPUT_VARIABLE output
+                RESULT_VARIABLE result
+                TIMEOUT 60)
+if(NOT "${output}[exit ${result}]\n" STREQUAL expected)
+  message(FATAL_ERROR "the cached executable printed:\n${output}[exit ${result}]")
+endif()
+
+build(--no-cmov --output=third ${PROGRAM})
+expect_entries(2)
+
+file(READ ${PROGRAM} source)
+file(WRITE ${WORK_DIR}/changed.txt "${source}// changed\n")
+build(--output=fourth changed.txt)
+expect_entries(3)
+
+execute_process(COMMAND ${COMPILER} --cache=cache --run changed.txt
+                WORKING_DIRECTORY ${WORK_DIR}
+                OUTPUT_QUIET
+                TIMEOUT 60)
+expect_entries(3)
+
+# Far over a 1 MB limit on its own, but in flight, so nothing is evicted.
+string(REPEAT "x" 2097152 in_flight)
+file(WRITE ${WORK_DIR}/cache/0123456789abcdef.tmp4194304 "${in_flight}")
+file(WRITE ${WORK_DIR}/changed_again.txt "${source}// changed again\n")
+build(--cache-size=1 --output=fifth changed_again.txt)
+expect_entries(5)
+if(NOT EXISTS ${WORK_DIR}/cache/0123456789abcdef.tmp4194304)
+  message(FATAL_ERROR "eviction removed another compiler's temporary file")
+endif()
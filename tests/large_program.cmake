@@ -0,0 +1,53 @@
+# Writes a program of 20000 statements, over 100000 tokens and so many
+# batches more than the lexer may run ahead of the parser, and compiles it.
+# With ENDING "none" it must run and print its sum; with "lex_error" or
+# "parse_error" its last line holds a mistake, found once the parser is far
+# behind the lexer, and the compiler must report it and stop.
+#
+# cmake -DCOMPILER=<mycompiler> -DENDING=<none|lex_error|parse_error>
+#       -DWORK_DIR=<dir> -P large_program.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+set(program "let int s = 0;\n")
+foreach(i RANGE 19999)
+  math(EXPR value "${i} % 1000")
+  string(APPEND program "s = s + ${value};\n")
+endforeach()
+string(APPEND program "print s;\n")
+if(ENDING STREQUAL "lex_error")
+  string(APPEND program "let int bad_name = 1;\n")
+  set(expected "unknown character '_'")
+elseif(ENDING STREQUAL "parse_error")
+  string(APPEND program "exit 1 +;\n")
+  set(expected "Unable to parse expression")
+else()
+  set(expected "9990000\n")
+endif()
+file(WRITE ${WORK_DIR}/large.txt "${program}")
+
+execute_process(COMMAND ${COMPILER} large.txt
+                WORKING_DIRECTORY ${WORK_DIR}
+                ERROR_VARIABLE errors
+                RESULT_VARIABLE result
+                TIMEOUT 120)
+if(ENDING STREQUAL "none")
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "compiling the large program failed:\n${errors}")
+  endif()
+  execute_process(COMMAND ${WORK_DIR}/out
+                  WORKING_DIRECTORY ${WORK_DIR}
+                  OUTPUT_VARIABLE output
+                  RESULT_VARIABLE result
+                  TIMEOUT 60)
+  string(FIND "${output}" "${expected}" at)
+  if(NOT result EQUAL 0 OR NOT at EQUAL 0)
+    message(FATAL_ERROR "the large program printed:\n${output}exit ${result}")
+  endif()
+else()
+  string(FIND "${errors}" "${expected}" at)
+  if(result EQUAL 0 OR at EQUAL -1)
+    message(FATAL_ERROR "expected \"${expected}\" and a failure, got exit ${result}:\n${errors}")
+  endif()
+endif()
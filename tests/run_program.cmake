@@ -0,0 +1,87 @@
+# Compiles one test program with the options of one variant, runs it and
+# compares what it printed and its exit code with the .expected file next to
+# it: the program's output followed by "[exit <code>]". A program the
+# compiler rejects is expected to give the compiler's messages followed by
+# "[compile error]".
+#
+# cmake -DCOMPILER=<mycompiler> -DPROGRAM=<file.txt> -DVARIANT=<variant>
+#       -DWORK_DIR=<dir> -P run_program.cmake
+#
+# VARIANT is "default", "run" to run the program in memory with --run,
+# "profile" to build it with --instrument, run it and build and run it
+# again with the profile it wrote, or the name of a compiler option without
+# its dashes, such as "no-cmov".
+#
+# If a .stats file sits next to the program too, the default build is made
+# with --stats, and each of its lines must appear in what --stats reports,
+# so a test can check that an optimisation really happened.
+
+macro(run_out)
+  execute_process(COMMAND ${WORK_DIR}/out
+                  WORKING_DIRECTORY ${WORK_DIR}
+                  OUTPUT_VARIABLE output
+                  RESULT_VARIABLE result
+                  TIMEOUT 60)
+  set(actual "${output}[exit ${result}]\n")
+endmacro()
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+string(REGEX REPLACE "\\.txt$" ".expected" expected_file ${PROGRAM})
+string(REGEX REPLACE "\\.txt$" ".stats" stats_file ${PROGRAM})
+file(READ ${expected_file} expected)
+
+set(flags)
+set(check_stats FALSE)
+if(VARIANT STREQUAL "profile")
+  set(flags --instrument)
+elseif(NOT VARIANT STREQUAL "default")
+  set(flags --${VARIANT})
+elseif(EXISTS ${stats_file})
+  set(flags --stats)
+  set(check_stats TRUE)
+endif()
+
+execute_process(COMMAND ${COMPILER} ${flags} ${PROGRAM}
+                WORKING_DIRECTORY ${WORK_DIR}
+                OUTPUT_VARIABLE output
+                ERROR_VARIABLE errors
+                RESULT_VARIABLE result
+                TIMEOUT 60)
+if(check_stats AND result EQUAL 0)
+  file(STRINGS ${stats_file} wanted)
+  foreach(line ${wanted})
+    string(FIND "${errors}" "${line}" at)
+    if(at EQUAL -1)
+      message(FATAL_ERROR "${PROGRAM}: --stats did not report \"${line}\", it reported:\n${errors}")
+    endif()
+  endforeach()
+endif()
+
+# Runtime errors are printed to stdout, so anything on stderr is the
+# compiler's.
+if(NOT result EQUAL 0 AND NOT errors STREQUAL "")
+  set(actual "${errors}[compile error]\n")
+elseif(VARIANT STREQUAL "run")
+  set(actual "${output}[exit ${result}]\n")
+else()
+  run_out()
+endif()
+
+# A program that stops on a runtime error writes no profile.
+if(VARIANT STREQUAL "profile" AND actual STREQUAL expected AND EXISTS ${WORK_DIR}/out.prof)
+  execute_process(COMMAND ${COMPILER} --profile=out.prof ${PROGRAM}
+                  WORKING_DIRECTORY ${WORK_DIR}
+                  ERROR_VARIABLE errors
+                  RESULT_VARIABLE result
+                  TIMEOUT 60)
+  if(NOT result EQUAL 0)
+    set(actual "${errors}[compile error with the profile]\n")
+  else()
+    run_out()
+  endif()
+endif()
+
+if(NOT actual STREQUAL expected)
+  message(FATAL_ERROR "${PROGRAM} (${VARIANT}) expected:\n${expected}\ngot:\n${actual}")
+endif()
@@ -0,0 +1,46 @@
+# Compiles a program of one shape from the benchmarks' synthetic program
+# generator and runs it built by default, with --run, and with every code
+# generation feature turned off. Each must compile, stop without a runtime
+# error or any output, and exit with the same code.
+#
+# cmake -DCOMPILER=<mycompiler> -DCOMPILE_BENCH=<compile_bench> -DSHAPE=<shape>
+#       -DWORK_DIR=<dir> -P synthetic.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+execute_process(COMMAND ${COMPILE_BENCH} --emit ${SHAPE} 32
+                OUTPUT_FILE ${WORK_DIR}/program.txt
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "compile_bench could not generate a ${SHAPE} program")
+endif()
+
+unset(reference)
+foreach(flags "" "--run" "--no-cmov;--no-simd;--no-inline;--no-switch")
+  execute_process(COMMAND ${COMPILER} ${flags} program.txt
+                  WORKING_DIRECTORY ${WORK_DIR}
+                  OUTPUT_VARIABLE output
+                  ERROR_VARIABLE errors
+                  RESULT_VARIABLE result
+                  TIMEOUT 120)
+  if(NOT flags STREQUAL "--run")
+    if(NOT result EQUAL 0)
+      message(FATAL_ERROR "the ${SHAPE} program did not compile with '${flags}':\n${errors}")
+    endif()
+    execute_process(COMMAND ${WORK_DIR}/out
+                    WORKING_DIRECTORY ${WORK_DIR}
+                    OUTPUT_VARIABLE output
+                    RESULT_VARIABLE result
+                    TIMEOUT 60)
+  endif()
+  # The program prints nothing, so any output is a runtime error.
+  if(NOT output STREQUAL "\n")
+    message(FATAL_ERROR "the ${SHAPE} program built with '${flags}' printed:\n${output}")
+  endif()
+  if(NOT DEFINED reference)
+    set(reference ${result})
+  elseif(NOT result EQUAL reference)
+    message(FATAL_ERROR "the ${SHAPE} program exits with ${result} built with '${flags}', ${reference} by default")
+  endif()
+endforeach()